@@ -155,6 +155,23 @@ int crypto_hash_data(int, const uint8_t *, size_t, uint8_t[32]);
 int crypto_hash_data_2(int, const uint8_t *, size_t,
     const uint8_t *, size_t, uint8_t[32]);
 
+/**
+ * crypto_hash_data_multi(key, bufs, lens, n, hashes):
+ * Hash each of the ${n} buffers ${bufs}[i] of length ${lens}[i] as in
+ * crypto_hash_data, and write the results to ${hashes}[i].  On some CPUs,
+ * several buffers are hashed in parallel; see crypto_hash_multi_lanes.
+ */
+int crypto_hash_data_multi(int, const uint8_t * const[], const size_t[],
+    size_t, uint8_t[][32]);
+
+/**
+ * crypto_hash_multi_lanes(void):
+ * Return the number of buffers which crypto_hash_data_multi hashes in
+ * parallel.  If this is 1, it is no faster than hashing the buffers one at
+ * a time.
+ */
+size_t crypto_hash_multi_lanes(void);
+
 /**
  * crypto_rsa_sign(key, data, len, sig, siglen):
  * Sign the provided ${data} with the specified ${key}, writing the signature
@@ -186,6 +203,23 @@ int crypto_rsa_encrypt(int, const uint8_t *, size_t, uint8_t *, size_t);
  */
 int crypto_rsa_decrypt(int, const uint8_t *, size_t, uint8_t *, size_t *);
 
+/**
+ * crypto_file_enc_init(filebuf):
+ * Write the encryption header for a new file into ${filebuf}, reserving a
+ * nonce for the file.  This must be followed by a call to
+ * crypto_file_enc_data with the same ${filebuf}.
+ */
+int crypto_file_enc_init(uint8_t *);
+
+/**
+ * crypto_file_enc_data(buf, len, filebuf):
+ * Encrypt the buffer ${buf} of length ${len} into ${filebuf}, which must
+ * have been initialized by crypto_file_enc_init, and append the
+ * authentication trailer.  If ${buf} is ${filebuf} + CRYPTO_FILE_HLEN, the
+ * data is encrypted in place.  This function is thread-safe.
+ */
+int crypto_file_enc_data(const uint8_t *, size_t, uint8_t *);
+
 /**
  * crypto_file_enc(buf, len, filebuf):
  * Encrypt the buffer ${buf} of length ${len}, placing the result (including
@@ -219,6 +253,14 @@ CRYPTO_SESSION * crypto_session_init(uint8_t[CRYPTO_DH_PUBLEN],
 void crypto_session_encrypt(CRYPTO_SESSION *, const uint8_t *, uint8_t *,
     size_t);
 
+/**
+ * crypto_session_encrypt_sha256(CS, inbuf, outbuf, buflen, hash):
+ * Encrypt ${inbuf} as in crypto_session_encrypt, and write SHA256(${inbuf})
+ * to ${hash}, making a single pass over the data.
+ */
+void crypto_session_encrypt_sha256(CRYPTO_SESSION *, const uint8_t *,
+    uint8_t *, size_t, uint8_t[32]);
+
 /**
  * crypto_session_decrypt(CS, inbuf, outbuf, buflen):
  * Decrypt ${inbuf} with the session read key and write plaintext to ${outbuf}.
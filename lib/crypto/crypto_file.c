@@ -137,14 +137,14 @@ err0:
 }
 
 /**
- * crypto_file_enc(buf, len, filebuf):
- * Encrypt the buffer ${buf} of length ${len}, placing the result (including
- * encryption header and authentication trailer) into ${filebuf}.
+ * crypto_file_enc_init(filebuf):
+ * Write the encryption header for a new file into ${filebuf}, reserving a
+ * nonce for the file.  This must be followed by a call to
+ * crypto_file_enc_data with the same ${filebuf}.
  */
 int
-crypto_file_enc(const uint8_t * buf, size_t len, uint8_t * filebuf)
+crypto_file_enc_init(uint8_t * filebuf)
 {
-	struct crypto_aesctr * stream;
 
 	/* If we don't have a session AES key yet, generate one. */
 	if ((encr_aes == NULL) && keygen())
@@ -154,18 +154,65 @@ crypto_file_enc(const uint8_t * buf, size_t len, uint8_t * filebuf)
 	memcpy(filebuf, encr_aes->key_encrypted, 256);
 
 	/* Store nonce. */
-	be64enc(filebuf + 256, encr_aes->nonce);
+	be64enc(filebuf + 256, encr_aes->nonce++);
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
 
-	/* Encrypt the data. */
-	if ((stream =
-	    crypto_aesctr_init(encr_aes->key, encr_aes->nonce++)) == NULL)
+/**
+ * crypto_file_enc_data(buf, len, filebuf):
+ * Encrypt the buffer ${buf} of length ${len} into ${filebuf}, which must
+ * have been initialized by crypto_file_enc_init, and append the
+ * authentication trailer.  If ${buf} is ${filebuf} + CRYPTO_FILE_HLEN, the
+ * data is encrypted in place.  This function is thread-safe.
+ */
+int
+crypto_file_enc_data(const uint8_t * buf, size_t len, uint8_t * filebuf)
+{
+	struct crypto_aesctr * stream;
+
+	/*
+	 * Encrypt the data and compute the HMAC of the header and ciphertext
+	 * in a single pass over the data.
+	 */
+	if ((stream = crypto_aesctr_init(encr_aes->key,
+	    be64dec(filebuf + 256))) == NULL)
 		goto err0;
-	crypto_aesctr_stream(stream, buf, filebuf + CRYPTO_FILE_HLEN, len);
+	if (crypto_hash_aesctr(CRYPTO_KEY_HMAC_FILE_WRITE,
+	    filebuf, CRYPTO_FILE_HLEN, stream, buf,
+	    filebuf + CRYPTO_FILE_HLEN, len, 1,
+	    filebuf + CRYPTO_FILE_HLEN + len))
+		goto err1;
 	crypto_aesctr_free(stream);
 
-	/* Compute HMAC. */
-	if (crypto_hash_data(CRYPTO_KEY_HMAC_FILE_WRITE, filebuf,
-	    CRYPTO_FILE_HLEN + len, filebuf + CRYPTO_FILE_HLEN + len))
+	/* Success! */
+	return (0);
+
+err1:
+	crypto_aesctr_free(stream);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * crypto_file_enc(buf, len, filebuf):
+ * Encrypt the buffer ${buf} of length ${len}, placing the result (including
+ * encryption header and authentication trailer) into ${filebuf}.
+ */
+int
+crypto_file_enc(const uint8_t * buf, size_t len, uint8_t * filebuf)
+{
+
+	/* Write the header, then encrypt and authenticate the data. */
+	if (crypto_file_enc_init(filebuf))
+		goto err0;
+	if (crypto_file_enc_data(buf, len, filebuf))
 		goto err0;
 
 	/* Success! */
@@ -1,11 +1,20 @@
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
+#include "crypto_aesctr.h"
 #include "crypto_internal.h"
 #include "sha256.h"
 
 #include "crypto.h"
 
+/*
+ * Amount of data to encrypt before hashing it in crypto_hash_aesctr; this
+ * should be small enough that the data remains in the L1 cache between the
+ * two passes.
+ */
+#define STITCH_LEN 4096
+
 /**
  * crypto_hash_data_key(key, keylen, data, len, buf):
  * Hash the provided ${data} with the provided HMAC-SHA256 ${key}.
@@ -72,8 +81,8 @@ crypto_hash_data_2(int key, const uint8_t * data0, size_t len0,
 		if ((hkey = crypto_keys_lookup_HMAC(key)) == NULL)
 			goto err0;
 
-		/* Do the HMAC. */
-		HMAC_SHA256_Init(&hctx, hkey->key, hkey->len);
+		/* Do the HMAC, starting from the precomputed keyed state. */
+		memcpy(&hctx, &hkey->hctx, sizeof(HMAC_SHA256_CTX));
 		HMAC_SHA256_Update(&hctx, data0, len0);
 		HMAC_SHA256_Update(&hctx, data1, len1);
 		HMAC_SHA256_Final(buf, &hctx);
@@ -86,3 +95,118 @@ err0:
 	/* Failure! */
 	return (-1);
 }
+
+/**
+ * crypto_hash_data_multi(key, bufs, lens, n, hashes):
+ * Hash each of the ${n} buffers ${bufs}[i] of length ${lens}[i] as in
+ * crypto_hash_data, and write the results to ${hashes}[i].  On some CPUs,
+ * several buffers are hashed in parallel; see crypto_hash_multi_lanes.
+ */
+int
+crypto_hash_data_multi(int key, const uint8_t * const bufs[],
+    const size_t lens[], size_t n, uint8_t hashes[][32])
+{
+	struct crypto_hmac_key * hkey;
+
+	if (key == CRYPTO_KEY_HMAC_SHA256) {
+		/* Hash the data. */
+		SHA256_Buf_multi(bufs, lens, n, hashes);
+	} else {
+		if ((hkey = crypto_keys_lookup_HMAC(key)) == NULL)
+			goto err0;
+
+		/* Do the HMACs, starting from the precomputed keyed state. */
+		HMAC_SHA256_Buf_multi(&hkey->hctx, bufs, lens, n, hashes);
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * crypto_hash_multi_lanes(void):
+ * Return the number of buffers which crypto_hash_data_multi hashes in
+ * parallel.  If this is 1, it is no faster than hashing the buffers one at
+ * a time.
+ */
+size_t
+crypto_hash_multi_lanes(void)
+{
+
+	return (SHA256_Buf_multi_lanes());
+}
+
+/**
+ * crypto_hash_aesctr(key, prefix, prefixlen, stream, inbuf, outbuf, buflen,
+ *     hashout, buf):
+ * Encrypt (or decrypt) ${buflen} bytes from ${inbuf} into ${outbuf} using
+ * ${stream}, and hash ${prefix} followed by either the ciphertext (if
+ * ${hashout} is non-zero) or the plaintext (otherwise), as in
+ * crypto_hash_data_2.  The data is processed in pieces small enough to stay
+ * in cache between the encryption and the hashing.  The buffers ${inbuf}
+ * and ${outbuf} may be the same.
+ */
+int
+crypto_hash_aesctr(int key, const uint8_t * prefix, size_t prefixlen,
+    struct crypto_aesctr * stream, const uint8_t * inbuf, uint8_t * outbuf,
+    size_t buflen, int hashout, uint8_t buf[32])
+{
+	HMAC_SHA256_CTX hctx;
+	SHA256_CTX ctx;
+	struct crypto_hmac_key * hkey = NULL;
+	size_t pos, len;
+
+	/* Start the hash and feed the prefix into it. */
+	if (key == CRYPTO_KEY_HMAC_SHA256) {
+		SHA256_Init(&ctx);
+		SHA256_Update(&ctx, prefix, prefixlen);
+	} else {
+		if ((hkey = crypto_keys_lookup_HMAC(key)) == NULL)
+			goto err0;
+		memcpy(&hctx, &hkey->hctx, sizeof(HMAC_SHA256_CTX));
+		HMAC_SHA256_Update(&hctx, prefix, prefixlen);
+	}
+
+	/* Encrypt and hash one piece at a time. */
+	for (pos = 0; pos < buflen; pos += len) {
+		len = buflen - pos;
+		if (len > STITCH_LEN)
+			len = STITCH_LEN;
+
+		/* Hash the plaintext before it is (possibly) overwritten. */
+		if (!hashout) {
+			if (hkey == NULL)
+				SHA256_Update(&ctx, &inbuf[pos], len);
+			else
+				HMAC_SHA256_Update(&hctx, &inbuf[pos], len);
+		}
+
+		/* Encrypt this piece. */
+		crypto_aesctr_stream(stream, &inbuf[pos], &outbuf[pos], len);
+
+		/* Hash the ciphertext while it is still in cache. */
+		if (hashout) {
+			if (hkey == NULL)
+				SHA256_Update(&ctx, &outbuf[pos], len);
+			else
+				HMAC_SHA256_Update(&hctx, &outbuf[pos], len);
+		}
+	}
+
+	/* Finish the hash. */
+	if (hkey == NULL)
+		SHA256_Final(buf, &ctx);
+	else
+		HMAC_SHA256_Final(buf, &hctx);
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
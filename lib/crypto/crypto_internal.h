@@ -1,11 +1,17 @@
 #ifndef CRYPTO_INTERNAL_H_
 #define CRYPTO_INTERNAL_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
+struct crypto_aesctr;
+
+#include "sha256.h"
+
 struct crypto_hmac_key {
 	size_t len;
 	uint8_t * key;
+	HMAC_SHA256_CTX hctx;	/* State after keying (ipad/opad midstates). */
 };
 
 /**
@@ -97,6 +103,19 @@ int crypto_file_init_keys(void);
  */
 int crypto_keys_init_keycache(void);
 
+/**
+ * crypto_hash_aesctr(key, prefix, prefixlen, stream, inbuf, outbuf, buflen,
+ *     hashout, buf):
+ * Encrypt (or decrypt) ${buflen} bytes from ${inbuf} into ${outbuf} using
+ * ${stream}, and hash ${prefix} followed by either the ciphertext (if
+ * ${hashout} is non-zero) or the plaintext (otherwise), as in
+ * crypto_hash_data_2.  The data is processed in pieces small enough to stay
+ * in cache between the encryption and the hashing.  The buffers ${inbuf}
+ * and ${outbuf} may be the same.
+ */
+int crypto_hash_aesctr(int, const uint8_t *, size_t, struct crypto_aesctr *,
+    const uint8_t *, uint8_t *, size_t, int, uint8_t[32]);
+
 /**
  * crypto_MGF1(seed, seedlen, buf, buflen):
  * The MGF1 mask generation function, as specified in RFC 3447 section B.2.1,
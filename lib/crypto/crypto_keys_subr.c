@@ -11,6 +11,7 @@
 
 #include "crypto_compat.h"
 #include "crypto_entropy.h"
+#include "insecure_memzero.h"
 #include "sysendian.h"
 #include "warnp.h"
 
@@ -294,10 +295,7 @@ crypto_keys_subr_import_HMAC(struct crypto_hmac_key ** key,
 {
 
 	/* Free any existing key. */
-	if (*key != NULL) {
-		free((*key)->key);
-		free(*key);
-	}
+	crypto_keys_subr_free_HMAC(key);
 	*key = NULL;
 
 	/* Make sure the buffer is the right length. */
@@ -318,6 +316,9 @@ crypto_keys_subr_import_HMAC(struct crypto_hmac_key ** key,
 	(*key)->len = buflen;
 	memcpy((*key)->key, buf, buflen);
 
+	/* Precompute the keyed HMAC state. */
+	HMAC_SHA256_Init(&(*key)->hctx, (*key)->key, (*key)->len);
+
 	/* Success! */
 	return (0);
 
@@ -491,10 +492,7 @@ crypto_keys_subr_generate_HMAC(struct crypto_hmac_key ** key)
 {
 
 	/* Free any existing key. */
-	if (*key != NULL) {
-		free((*key)->key);
-		free(*key);
-	}
+	crypto_keys_subr_free_HMAC(key);
 
 	/* Allocate memory. */
 	if ((*key = malloc(sizeof(struct crypto_hmac_key))) == NULL)
@@ -511,6 +509,9 @@ crypto_keys_subr_generate_HMAC(struct crypto_hmac_key ** key)
 		goto err2;
 	}
 
+	/* Precompute the keyed HMAC state. */
+	HMAC_SHA256_Init(&(*key)->hctx, (*key)->key, (*key)->len);
+
 	/* Success! */
 	return (0);
 
@@ -533,6 +534,7 @@ crypto_keys_subr_free_HMAC(struct crypto_hmac_key ** key)
 
 	if (*key != NULL) {
 		free((*key)->key);
+		insecure_memzero(&(*key)->hctx, sizeof(HMAC_SHA256_CTX));
 		free(*key);
 	}
 	*key = NULL;
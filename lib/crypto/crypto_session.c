@@ -109,6 +109,21 @@ crypto_session_encrypt(CRYPTO_SESSION * CS, const uint8_t * inbuf,
 	crypto_aesctr_stream(CS->encr_write_stream, inbuf, outbuf, buflen);
 }
 
+/**
+ * crypto_session_encrypt_sha256(CS, inbuf, outbuf, buflen, hash):
+ * Encrypt ${inbuf} as in crypto_session_encrypt, and write SHA256(${inbuf})
+ * to ${hash}, making a single pass over the data.
+ */
+void
+crypto_session_encrypt_sha256(CRYPTO_SESSION * CS, const uint8_t * inbuf,
+    uint8_t * outbuf, size_t buflen, uint8_t hash[32])
+{
+
+	/* SHA256 never fails. */
+	(void)crypto_hash_aesctr(CRYPTO_KEY_HMAC_SHA256, NULL, 0,
+	    CS->encr_write_stream, inbuf, outbuf, buflen, 0, hash);
+}
+
 /**
  * crypto_session_decrypt(CS, inbuf, outbuf, buflen):
  * Decrypt ${inbuf} with the session read key and write plaintext to ${outbuf}.
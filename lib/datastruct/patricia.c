@@ -3,6 +3,8 @@
 #include <stdlib.h>	/* malloc, free */
 #include <string.h>	/* memcpy */
 
+#include "slab.h"
+
 #include "patricia.h"
 
 /**
@@ -56,6 +58,16 @@ struct pnode {
 #define	MAXSLEN	(256 - sizeof(struct pnode))
 #endif
 
+/*
+ * Nodes are allocated from slab allocators, one for each NODE_QUANTUM-byte
+ * size class; a tree is typically built once and freed all at once, so this
+ * avoids a malloc for each node and a recursive traversal to free them.
+ */
+#define NODE_QUANTUM	8
+#define NODE_NCLASSES	((sizeof(struct pnode) + MAXSLEN) / NODE_QUANTUM + 1)
+#define NODE_CLASS(slen)						\
+	((sizeof(struct pnode) + (slen) + NODE_QUANTUM - 1) / NODE_QUANTUM)
+
 /*
  * Structure used to store Patricia tree.  The maximum key length is stored
  * in order to simplify buffer handling in the tree traversal code.
@@ -63,27 +75,48 @@ struct pnode {
 struct patricia_internal {
 	struct pnode *	root;		/* Root node of tree. */
 	size_t		maxkey;		/* Longest key length. */
+	SLAB *		slabs[NODE_NCLASSES];	/* Node allocators. */
 };
 
-static struct pnode * node_alloc(uint8_t, const uint8_t *);
-static struct pnode * node_dup(const struct pnode *, uint8_t, const uint8_t *);
+static struct pnode * node_get(PATRICIA *, uint8_t);
+static struct pnode * node_alloc(PATRICIA *, uint8_t, const uint8_t *);
+static struct pnode * node_dup(PATRICIA *, const struct pnode *, uint8_t,
+    const uint8_t *);
+static void node_free(PATRICIA *, struct pnode *);
 static int compare(const struct pnode *, const uint8_t *, size_t, uint8_t *,
     uint8_t *);
 static int foreach_internal(struct pnode *,
     int(void *, uint8_t *, size_t, void *), void *, uint8_t *, size_t);
-static void free_internal(struct pnode *);
+
+/*
+ * Allocate memory for a node with slen bytes of key from the appropriate
+ * slab allocator, creating the allocator if necessary.
+ */
+static struct pnode *
+node_get(PATRICIA * P, uint8_t slen)
+{
+	size_t	c = NODE_CLASS(slen);
+
+	/* Create the allocator for this size class if we don't have it. */
+	if ((P->slabs[c] == NULL) &&
+	    ((P->slabs[c] = slab_init(c * NODE_QUANTUM)) == NULL))
+		return (NULL);
+
+	/* Allocate. */
+	return (slab_alloc(P->slabs[c]));
+}
 
 /*
  * Create a node with no children, mask = high = 0, and the provided slen
  * and s[].
  */
 static struct pnode *
-node_alloc(uint8_t slen, const uint8_t * s)
+node_alloc(PATRICIA * P, uint8_t slen, const uint8_t * s)
 {
 	struct pnode *	n;
 
 	/* Allocate. */
-	if ((n = malloc(sizeof(struct pnode) + slen)) == NULL)
+	if ((n = node_get(P, slen)) == NULL)
 		return (NULL);
 
 	/* No children, mask, or high bits. */
@@ -102,12 +135,13 @@ node_alloc(uint8_t slen, const uint8_t * s)
  * Create a duplicate of a node but with different slen and s[].
  */
 static struct pnode *
-node_dup(const struct pnode * n0, uint8_t slen, const uint8_t * s)
+node_dup(PATRICIA * P, const struct pnode * n0, uint8_t slen,
+    const uint8_t * s)
 {
 	struct pnode *	n;
 
 	/* Allocate. */
-	if ((n = malloc(sizeof(struct pnode) + slen)) == NULL)
+	if ((n = node_get(P, slen)) == NULL)
 		return (NULL);
 
 	/* Copy children, mask, and high bits. */
@@ -124,6 +158,16 @@ node_dup(const struct pnode * n0, uint8_t slen, const uint8_t * s)
 	return (n);
 }
 
+/*
+ * Return a node to its slab allocator for reuse.
+ */
+static void
+node_free(PATRICIA * P, struct pnode * n)
+{
+
+	slab_release(P->slabs[NODE_CLASS(n->slen)], n);
+}
+
 /*
  * Compare the given key to the given node.  If they match (i.e., the node is
  * a prefix of the key), return zero; otherwise, return non-zero and set the
@@ -238,25 +282,6 @@ foreach_internal(struct pnode * n,
 	return (rc);
 }
 
-/*
- * Recursively free the tree.
- */
-static void
-free_internal(struct pnode * n)
-{
-
-	/* Left child. */
-	if ((n->mask != 0) && (n->left != NULL))
-		free_internal(n->left);
-
-	/* Right child. */
-	if (n->right != NULL)
-		free_internal(n->right);
-
-	/* Free this node. */
-	free(n);
-}
-
 /**
  * patricia_init(void):
  * Create a Patricia tree to be used for mapping arbitrary-length keys to
@@ -266,6 +291,7 @@ PATRICIA *
 patricia_init(void)
 {
 	PATRICIA * P;
+	size_t i;
 
 	/* Allocate memory, or return failure. */
 	if ((P = malloc(sizeof(PATRICIA))) == NULL)
@@ -275,6 +301,10 @@ patricia_init(void)
 	P->root = NULL;
 	P->maxkey = 0;
 
+	/* Node allocators are created when we first need them. */
+	for (i = 0; i < NODE_NCLASSES; i++)
+		P->slabs[i] = NULL;
+
 	/* Success! */
 	return (P);
 }
@@ -320,7 +350,7 @@ patricia_insert(PATRICIA * P, const uint8_t * key, size_t keylen, void * rec)
 				slen = MAXSLEN;
 
 			/* Create the node or error out. */
-			if ((pnew = node_alloc((uint8_t)slen, key)) == NULL)
+			if ((pnew = node_alloc(P, (uint8_t)slen, key)) == NULL)
 				return (-1);
 
 			/* Add the new node into the tree. */
@@ -338,13 +368,14 @@ patricia_insert(PATRICIA * P, const uint8_t * key, size_t keylen, void * rec)
 			 */
 			/* Create the lower of the new nodes. */
 			slen = (*np)->slen - mlen;
-			pnew2 = node_dup(*np, (uint8_t)slen, (*np)->s + mlen);
+			pnew2 = node_dup(P, *np, (uint8_t)slen,
+			    (*np)->s + mlen);
 			if (pnew2 == NULL)
 				return (-1);
 
 			/* Create the upper of the new nodes. */
-			if ((pnew = node_alloc(mlen, key)) == NULL) {
-				free(pnew2);
+			if ((pnew = node_alloc(P, mlen, key)) == NULL) {
+				node_free(P, pnew2);
 				return (-1);
 			}
 			pnew->mask = mask;
@@ -370,7 +401,7 @@ patricia_insert(PATRICIA * P, const uint8_t * key, size_t keylen, void * rec)
 			}
 
 			/* Free the node which we are replacing. */
-			free(*np);
+			node_free(P, *np);
 
 			/* Reattach this branch to the tree. */
 			*np = pnew;
@@ -504,14 +535,15 @@ patricia_foreach(PATRICIA * P, int func(void *, uint8_t *, size_t, void *),
 void
 patricia_free(PATRICIA * P)
 {
+	size_t i;
 
 	/* Behave consistently with free(NULL). */
 	if (P == NULL)
 		return;
 
-	/* Call a recursive function to free all the nodes. */
-	if (P->root != NULL)
-		free_internal(P->root);
+	/* Free all the nodes at once. */
+	for (i = 0; i < NODE_NCLASSES; i++)
+		slab_free(P->slabs[i]);
 
 	/* Free the tree structure. */
 	free(P);
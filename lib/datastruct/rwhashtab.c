@@ -6,15 +6,12 @@
 #include "crypto_entropy.h"
 #include "ctassert.h"
 #include "sysendian.h"
-#include "warnp.h"
-
-#include "crypto.h"
 
 #include "rwhashtab.h"
 
 /*
- * We use le64dec to generate a size_t from an array of bytes; make sure
- * that this is enough.
+ * We use a 64-bit hash to generate a size_t table position; make sure that
+ * this is enough.
  */
 CTASSERT(sizeof(size_t) <= sizeof(uint64_t));
 
@@ -26,32 +23,85 @@ struct rwhashtab_internal {
 	size_t cursize;		/* Size of table; must be a power of 2 */
 	size_t numentries;	/* Number of entries, <= 0.75 * cursize */
 	void ** ht;		/* Table of cursize pointers to records */
+	uint16_t * tags;	/* Tags of keys in ht[], or 0 if empty */
 
 	/* Where to find keys within records */
 	size_t keyoffset;
 	size_t keylength;
 
 	/* Used for hashing */
-	uint8_t randbuf[32];	/* Prefix used for hashing */
+	uint64_t k0, k1;	/* SipHash key */
 };
 
-static int rwhashtab_enlarge(RWHASHTAB * H);
-static size_t rwhashtab_search(RWHASHTAB * H, const uint8_t * key);
+static uint64_t siphash24(uint64_t, uint64_t, const uint8_t *, size_t);
+static int rwhashtab_resize(RWHASHTAB * H, size_t newsize);
+static size_t rwhashtab_search(RWHASHTAB * H, const uint8_t * key,
+    uint16_t * tag);
+
+/* SipHash round function. */
+#define ROTL64(x, n)	(((x) << (n)) | ((x) >> (64 - (n))))
+#define SIPROUND do {						\
+	v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32);	\
+	v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2;			\
+	v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0;			\
+	v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32);	\
+} while (0)
 
-/* Enlarge the table by a factor of 2, and rehash. */
+/*
+ * Compute SipHash-2-4 of ${len} bytes from ${buf} with the key (${k0}, ${k1}).
+ * This is far cheaper than HMAC-SHA256 for short keys, while still keeping
+ * the table positions unpredictable to anyone who doesn't know the key.
+ */
+static uint64_t
+siphash24(uint64_t k0, uint64_t k1, const uint8_t * buf, size_t len)
+{
+	uint64_t v0 = k0 ^ 0x736f6d6570736575;
+	uint64_t v1 = k1 ^ 0x646f72616e646f6d;
+	uint64_t v2 = k0 ^ 0x6c7967656e657261;
+	uint64_t v3 = k1 ^ 0x7465646279746573;
+	uint64_t b = (uint64_t)len << 56;
+	uint64_t m;
+	uint8_t tail[8];
+
+	/* Process whole 8-byte words. */
+	for (; len >= 8; buf += 8, len -= 8) {
+		m = le64dec(buf);
+		v3 ^= m;
+		SIPROUND;
+		SIPROUND;
+		v0 ^= m;
+	}
+
+	/* Process the final word, which includes the total length. */
+	memset(tail, 0, 8);
+	memcpy(tail, buf, len);
+	m = le64dec(tail) | b;
+	v3 ^= m;
+	SIPROUND;
+	SIPROUND;
+	v0 ^= m;
+
+	/* Finalize. */
+	v2 ^= 0xff;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	return (v0 ^ v1 ^ v2 ^ v3);
+}
+
+/* Resize the table to ${newsize} entries (a power of 2), and rehash. */
 static int
-rwhashtab_enlarge(RWHASHTAB * H)
+rwhashtab_resize(RWHASHTAB * H, size_t newsize)
 {
 	void ** htnew, ** htold;
+	uint16_t * tagsnew, * tagsold;
 	void * rec;
-	size_t newsize, oldsize;
+	size_t oldsize;
 	size_t htposold, htposnew;
+	uint16_t tag;
 
-	/*
-	 * Compute new size, and make sure the new table size in bytes
-	 * doesn't overflow.
-	 */
-	newsize = H->cursize * 2;
+	/* Make sure the new table size in bytes doesn't overflow. */
 	if (newsize > SIZE_MAX / sizeof(void *)) {
 		errno = ENOMEM;
 		return (-1);
@@ -59,13 +109,17 @@ rwhashtab_enlarge(RWHASHTAB * H)
 
 	/* Allocate and zero the new space. */
 	if ((htnew = malloc(newsize * sizeof(void *))) == NULL)
-		return (-1);
+		goto err0;
+	if ((tagsnew = calloc(newsize, sizeof(uint16_t))) == NULL)
+		goto err1;
 	for (htposnew = 0; htposnew < newsize; htposnew++)
 		htnew[htposnew] = NULL;
 
 	/* Attach new space to hash table. */
 	htold = H->ht;
+	tagsold = H->tags;
 	H->ht = htnew;
+	H->tags = tagsnew;
 	oldsize = H->cursize;
 	H->cursize = newsize;
 
@@ -74,38 +128,47 @@ rwhashtab_enlarge(RWHASHTAB * H)
 		rec = htold[htposold];
 		if (rec != NULL) {
 			htposnew = rwhashtab_search(H,
-			    (uint8_t *)rec + H->keyoffset);
+			    (uint8_t *)rec + H->keyoffset, &tag);
 			H->ht[htposnew] = rec;
+			H->tags[htposnew] = tag;
 		}
 	}
 
 	/* Free now-unused memory. */
+	free(tagsold);
 	free(htold);
 
 	/* Success! */
 	return (0);
+
+err1:
+	free(htnew);
+err0:
+	/* Failure! */
+	return (-1);
 }
 
 /*
  * Search for a record within ht[size], using hashing parameters from H.
- * Return the position of the record or of the first NULL found.
+ * Return the position of the record or of the first NULL found, and store
+ * the tag of ${key} in ${tag}.
  */
 static size_t
-rwhashtab_search(RWHASHTAB * H, const uint8_t * key)
+rwhashtab_search(RWHASHTAB * H, const uint8_t * key, uint16_t * tag)
 {
+	uint64_t hash;
 	size_t htpos;
-	uint8_t hashbuf[32];
-
-	/* Compute the hash of the record key. */
-	if (crypto_hash_data_2(CRYPTO_KEY_HMAC_SHA256, H->randbuf, 32,
-	    key, H->keylength, hashbuf)) {
-		warn0("Programmer error: "
-		    "SHA256 should never fail");
-		abort();
-	}
+	uint16_t t;
 
-	/* Compute starting hash location. */
-	htpos = le64dec(hashbuf) & (H->cursize - 1);
+	/*
+	 * Compute the hash of the record key.  The low bits give the starting
+	 * hash location; the top bits give a (nonzero) tag, which is stored
+	 * alongside each record so that most probes don't need to look at the
+	 * record's key at all.
+	 */
+	hash = siphash24(H->k0, H->k1, key, H->keylength);
+	htpos = (size_t)hash & (H->cursize - 1);
+	t = (uint16_t)((hash >> 48) | 1);
 
 	/*
 	 * Search.  This is not an endless loop since the table isn't
@@ -113,17 +176,22 @@ rwhashtab_search(RWHASHTAB * H, const uint8_t * key)
 	 */
 	do {
 		/* Is the space empty? */
-		if (H->ht[htpos] == NULL)
-			return (htpos);
+		if (H->tags[htpos] == 0)
+			break;
 
 		/* Do we have the right key? */
-		if (memcmp((uint8_t *)(H->ht[htpos]) + H->keyoffset,
-		    key, H->keylength) == 0)
-			return (htpos);
+		if ((H->tags[htpos] == t) &&
+		    (memcmp((uint8_t *)(H->ht[htpos]) + H->keyoffset,
+		    key, H->keylength) == 0))
+			break;
 
 		/* Move to the next table entry. */
 		htpos = (htpos + 1) & (H->cursize - 1);
 	} while (1);
+
+	/* Return the position, and the tag. */
+	*tag = t;
+	return (htpos);
 }
 
 /**
@@ -136,6 +204,7 @@ RWHASHTAB *
 rwhashtab_init(size_t keyoffset, size_t keylength)
 {
 	RWHASHTAB * H;
+	uint8_t randbuf[16];
 	size_t i;
 
 	/* Sanity check. */
@@ -152,10 +221,12 @@ rwhashtab_init(size_t keyoffset, size_t keylength)
 	H->keylength = keylength;
 
 	/* Get some entropy for the keyed hash function. */
-	if (crypto_entropy_read(H->randbuf, 32)) {
+	if (crypto_entropy_read(randbuf, 16)) {
 		free(H);
 		return (NULL);
 	}
+	H->k0 = le64dec(&randbuf[0]);
+	H->k1 = le64dec(&randbuf[8]);
 
 	/* Allocate space for pointers to records. */
 	H->ht = malloc(H->cursize * sizeof(void *));
@@ -164,6 +235,14 @@ rwhashtab_init(size_t keyoffset, size_t keylength)
 		return (NULL);
 	}
 
+	/* Allocate space for tags; all zero, i.e., empty. */
+	H->tags = calloc(H->cursize, sizeof(uint16_t));
+	if (H->tags == NULL) {
+		free(H->ht);
+		free(H);
+		return (NULL);
+	}
+
 	/* All of the entries are empty. */
 	for (i = 0; i < H->cursize; i++)
 		H->ht[i] = NULL;
@@ -194,6 +273,7 @@ rwhashtab_insert(RWHASHTAB * H, void * rec)
 {
 	int rc;
 	size_t htpos;
+	uint16_t tag;
 
 	/*
 	 * Does the table need to be enlarged?  Technically we should check
@@ -204,7 +284,7 @@ rwhashtab_insert(RWHASHTAB * H, void * rec)
 	 * insert sooner than necessary.
 	 */
 	if (H->numentries >= H->cursize - (H->cursize >> 2)) {
-		rc = rwhashtab_enlarge(H);
+		rc = rwhashtab_resize(H, H->cursize * 2);
 		if (rc)
 			return (rc);
 	}
@@ -213,7 +293,7 @@ rwhashtab_insert(RWHASHTAB * H, void * rec)
 	 * Search for the record, to see if it is already present and/or
 	 * where it should be inserted.
 	 */
-	htpos = rwhashtab_search(H, (uint8_t *)rec + H->keyoffset);
+	htpos = rwhashtab_search(H, (uint8_t *)rec + H->keyoffset, &tag);
 
 	/* Already present? */
 	if (H->ht[htpos] != NULL)
@@ -221,6 +301,7 @@ rwhashtab_insert(RWHASHTAB * H, void * rec)
 
 	/* Insert the record. */
 	H->ht[htpos] = rec;
+	H->tags[htpos] = tag;
 	H->numentries += 1;
 
 	/* Success! */
@@ -236,9 +317,10 @@ void *
 rwhashtab_read(RWHASHTAB * H, const uint8_t * key)
 {
 	size_t htpos;
+	uint16_t tag;
 
 	/* Search. */
-	htpos = rwhashtab_search(H, key);
+	htpos = rwhashtab_search(H, key, &tag);
 
 	/* Return the record, or NULL if not present. */
 	return (H->ht[htpos]);
@@ -281,6 +363,7 @@ rwhashtab_free(RWHASHTAB * H)
 		return;
 
 	/* Free everything. */
+	free(H->tags);
 	free(H->ht);
 	free(H);
 }
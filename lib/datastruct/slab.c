@@ -0,0 +1,191 @@
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "slab.h"
+
+/* Objects must be aligned as strictly as any of these types. */
+struct slab_alignment {
+	char c;
+	union {
+		void * p;
+		uint64_t u;
+		double d;
+	} x;
+};
+#define SLAB_ALIGN	offsetof(struct slab_alignment, x)
+
+/* Number of objects in the first slab, and the largest size we grow to. */
+#define SLAB_MINOBJS	16
+#define SLAB_MAXLEN	(256 * 1024)
+
+/* A slab, followed (after hdrlen bytes) by the objects carved from it. */
+struct slab {
+	struct slab * next;	/* Previously allocated slab. */
+};
+
+/**
+ * Structure used to store slab allocator state.
+ */
+struct slab_internal {
+	size_t size;		/* Object size, rounded up for alignment. */
+	size_t hdrlen;		/* Space at the start of each slab. */
+	size_t nobjs;		/* Number of objects in the next slab. */
+	struct slab * slabs;	/* Most recently allocated slab. */
+	uint8_t * pos;		/* Next unused object in that slab. */
+	size_t navail;		/* Number of unused objects in that slab. */
+	void * freelist;	/* Released objects, linked via first word. */
+};
+
+static size_t roundup(size_t);
+static int slab_grow(SLAB *);
+
+/* Round ${len} up to a multiple of SLAB_ALIGN, or return 0 on overflow. */
+static size_t
+roundup(size_t len)
+{
+
+	if (len > SIZE_MAX - (SLAB_ALIGN - 1))
+		return (0);
+	return (((len + SLAB_ALIGN - 1) / SLAB_ALIGN) * SLAB_ALIGN);
+}
+
+/* Allocate a new slab, twice as large as the previous one (up to a limit). */
+static int
+slab_grow(SLAB * S)
+{
+	struct slab * sl;
+
+	/* Allocate and link in the slab. */
+	if (S->nobjs > (SIZE_MAX - S->hdrlen) / S->size) {
+		errno = ENOMEM;
+		return (-1);
+	}
+	if ((sl = malloc(S->hdrlen + S->nobjs * S->size)) == NULL)
+		return (-1);
+	sl->next = S->slabs;
+	S->slabs = sl;
+
+	/* Objects are handed out from the start of the slab. */
+	S->pos = (uint8_t *)sl + S->hdrlen;
+	S->navail = S->nobjs;
+
+	/* The next slab can be larger. */
+	if (S->nobjs <= SLAB_MAXLEN / 2 / S->size)
+		S->nobjs *= 2;
+
+	/* Success! */
+	return (0);
+}
+
+/**
+ * slab_init(size):
+ * Create a slab allocator for objects of ${size} bytes.  Return NULL on
+ * failure.
+ */
+SLAB *
+slab_init(size_t size)
+{
+	SLAB * S;
+
+	/* Allocate memory, or return failure. */
+	if ((S = malloc(sizeof(SLAB))) == NULL)
+		goto err0;
+
+	/* Released objects need to hold a pointer. */
+	if (size < sizeof(void *))
+		size = sizeof(void *);
+
+	/* Figure out how large objects and slab headers are. */
+	if (((S->size = roundup(size)) == 0) ||
+	    ((S->hdrlen = roundup(sizeof(struct slab))) == 0)) {
+		errno = ENOMEM;
+		goto err1;
+	}
+
+	/* We have no objects yet. */
+	S->nobjs = SLAB_MINOBJS;
+	S->slabs = NULL;
+	S->pos = NULL;
+	S->navail = 0;
+	S->freelist = NULL;
+
+	/* Success! */
+	return (S);
+
+err1:
+	free(S);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * slab_alloc(S):
+ * Allocate an object from the slab allocator ${S}.  The object is suitably
+ * aligned for any of the types which tarsnap stores in such objects.  Return
+ * NULL on failure.
+ */
+void *
+slab_alloc(SLAB * S)
+{
+	void * p;
+
+	/* Reuse a released object if we have one. */
+	if ((p = S->freelist) != NULL) {
+		S->freelist = *(void **)p;
+		return (p);
+	}
+
+	/* Get a new slab if the current one is used up. */
+	if ((S->navail == 0) && slab_grow(S))
+		return (NULL);
+
+	/* Take the next object from the slab. */
+	p = S->pos;
+	S->pos += S->size;
+	S->navail--;
+	return (p);
+}
+
+/**
+ * slab_release(S, p):
+ * Return the object ${p}, which was allocated from the slab allocator ${S},
+ * so that it can be reused.  Behave consistently with free(NULL).
+ */
+void
+slab_release(SLAB * S, void * p)
+{
+
+	/* Behave consistently with free(NULL). */
+	if (p == NULL)
+		return;
+
+	/* Add the object to the free list. */
+	*(void **)p = S->freelist;
+	S->freelist = p;
+}
+
+/**
+ * slab_free(S):
+ * Free the slab allocator ${S} and every object allocated from it.
+ */
+void
+slab_free(SLAB * S)
+{
+	struct slab * sl;
+
+	/* Behave consistently with free(NULL). */
+	if (S == NULL)
+		return;
+
+	/* Free the slabs. */
+	while ((sl = S->slabs) != NULL) {
+		S->slabs = sl->next;
+		free(sl);
+	}
+
+	/* Free the allocator structure. */
+	free(S);
+}
@@ -0,0 +1,43 @@
+#ifndef SLAB_H_
+#define SLAB_H_
+
+#include <stddef.h>	/* size_t */
+
+/**
+ * Structure used to store slab allocator state.  A slab allocator hands out
+ * fixed-size objects carved from large allocations, keeps objects which are
+ * returned to it for reuse, and frees everything at once when it is freed.
+ * This is intended for large numbers of small, long-lived objects which
+ * would otherwise each need a separate malloc.
+ */
+typedef struct slab_internal SLAB;
+
+/**
+ * slab_init(size):
+ * Create a slab allocator for objects of ${size} bytes.  Return NULL on
+ * failure.
+ */
+SLAB * slab_init(size_t);
+
+/**
+ * slab_alloc(S):
+ * Allocate an object from the slab allocator ${S}.  The object is suitably
+ * aligned for any of the types which tarsnap stores in such objects.  Return
+ * NULL on failure.
+ */
+void * slab_alloc(SLAB *);
+
+/**
+ * slab_release(S, p):
+ * Return the object ${p}, which was allocated from the slab allocator ${S},
+ * so that it can be reused.  Behave consistently with free(NULL).
+ */
+void slab_release(SLAB *, void *);
+
+/**
+ * slab_free(S):
+ * Free the slab allocator ${S} and every object allocated from it.
+ */
+void slab_free(SLAB *);
+
+#endif /* !SLAB_H_ */
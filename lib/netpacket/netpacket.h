@@ -50,6 +50,10 @@ typedef int handlepacket_callback(void *, NETPACKET_CONNECTION *,
 /* Maximum number of files listed in a NETPACKET_DIRECTORY_RESPONSE packet. */
 #define NETPACKET_DIRECTORY_RESPONSE_MAXFILES	8000
 
+/* Space needed around a file passed to netpacket_write_file. */
+#define NETPACKET_WRITE_FILE_HEADROOM	77
+#define NETPACKET_WRITE_FILE_TAILROOM	32
+
 /**
  * netpacket_hmac_verify(type, nonce, packetbuf, pos, key):
  * Verify that HMAC(type || nonce || packetbuf[0 .. pos - 1]) using the
@@ -160,10 +164,12 @@ int netpacket_write_fexist(NETPACKET_CONNECTION *, uint64_t, uint8_t,
  * netpacket_write_file(NPC, machinenum, class, name, buf, buflen,
  *     nonce, callback):
  * Construct and send a NETPACKET_WRITE_FILE packet asking to write the
- * specified file.
+ * specified file.  The packet is constructed in place around ${buf}, which
+ * must be preceded by NETPACKET_WRITE_FILE_HEADROOM bytes and followed by
+ * NETPACKET_WRITE_FILE_TAILROOM bytes which may be overwritten.
  */
 int netpacket_write_file(NETPACKET_CONNECTION *, uint64_t, uint8_t,
-    const uint8_t[32], const uint8_t *, size_t,
+    const uint8_t[32], uint8_t *, size_t,
     const uint8_t[32], handlepacket_callback *);
 
 /**
@@ -1,5 +1,4 @@
 #include <stdint.h>
-#include <stdlib.h>
 #include <string.h>
 
 #include "crypto.h"
@@ -53,15 +52,17 @@ err0:
  * netpacket_write_file(NPC, machinenum, class, name, buf, buflen,
  *     nonce, callback):
  * Construct and send a NETPACKET_WRITE_FILE packet asking to write the
- * specified file.
+ * specified file.  The packet is constructed in place around ${buf}, which
+ * must be preceded by NETPACKET_WRITE_FILE_HEADROOM bytes and followed by
+ * NETPACKET_WRITE_FILE_TAILROOM bytes which may be overwritten.
  */
 int
 netpacket_write_file(NETPACKET_CONNECTION * NPC,
     uint64_t machinenum, uint8_t class, const uint8_t name[32],
-    const uint8_t * buf, size_t buflen, const uint8_t nonce[32],
+    uint8_t * buf, size_t buflen, const uint8_t nonce[32],
     handlepacket_callback * callback)
 {
-	uint8_t * packetbuf;
+	uint8_t * packetbuf = buf - NETPACKET_WRITE_FILE_HEADROOM;
 
 	/* Sanity-check file size. */
 	if (buflen > 262144) {
@@ -70,39 +71,30 @@ netpacket_write_file(NETPACKET_CONNECTION * NPC,
 		goto err0;
 	}
 
-	/* Allocate space for constructing packet. */
-	if ((packetbuf = malloc(109 + buflen)) == NULL)
-		goto err0;
-
-	/* Construct packet. */
+	/* Construct packet header in the space before the file. */
 	be64enc(&packetbuf[0], machinenum);
 	packetbuf[8] = class;
 	memcpy(&packetbuf[9], name, 32);
 	memcpy(&packetbuf[41], nonce, 32);
 	be32enc(&packetbuf[73], (uint32_t)buflen);
-	memcpy(&packetbuf[77], buf, buflen);
 
 	/* Append hmac. */
 	if (netpacket_hmac_append(NETPACKET_WRITE_FILE, packetbuf,
-	    77 + buflen, CRYPTO_KEY_AUTH_PUT))
-		goto err1;
+	    NETPACKET_WRITE_FILE_HEADROOM + buflen, CRYPTO_KEY_AUTH_PUT))
+		goto err0;
 
 	/* Send packet. */
-	if (netproto_writepacket(NPC->NC, NETPACKET_WRITE_FILE,
-	    packetbuf, 109 + buflen, netpacket_op_packetsent, NPC))
-		goto err1;
+	if (netproto_writepacket(NPC->NC, NETPACKET_WRITE_FILE, packetbuf,
+	    NETPACKET_WRITE_FILE_HEADROOM + buflen +
+	    NETPACKET_WRITE_FILE_TAILROOM, netpacket_op_packetsent, NPC))
+		goto err0;
 
 	/* Set callback for handling a response. */
 	NPC->pending_current->handlepacket = callback;
 
-	/* Free packet construction buffer. */
-	free(packetbuf);
-
 	/* Success! */
 	return (0);
 
-err1:
-	free(packetbuf);
 err0:
 	/* Failure! */
 	return (-1);
@@ -3,6 +3,7 @@
 #include <errno.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "crypto_verify_bytes.h"
 #include "sysendian.h"
@@ -208,6 +209,7 @@ netproto_writepacket(NETPROTO_CONNECTION * C, uint8_t type,
 	struct writepacket_internal * WC;
 	uint8_t header[37];
 	struct timeval timeout;
+	size_t i;
 
 	/*
 	 * Print a warning if the connection is broken.  This should never
@@ -248,25 +250,26 @@ netproto_writepacket(NETPROTO_CONNECTION * C, uint8_t type,
 	if ((WC->buf = malloc(buflen + 69)) == NULL)
 		goto err1;
 
-	/* Construct header. */
+	/*
+	 * Generate the keystream for the packet header, then encrypt the
+	 * packet data while computing its SHA256 hash; this uses the
+	 * keystream in the same order as encrypting the header and then the
+	 * data would, but only reads the data once.
+	 */
+	memset(WC->buf, 0, 37);
+	crypto_session_encrypt(C->keys, WC->buf, WC->buf, 37);
+	crypto_session_encrypt_sha256(C->keys, buf, WC->buf + 69, buflen,
+	    &header[5]);
+
+	/* Construct header and encrypt it using the keystream. */
 	header[0] = type;
 	be32enc(&header[1], (uint32_t)buflen);
-	if (crypto_hash_data(CRYPTO_KEY_HMAC_SHA256, buf, buflen,
-	    &header[5])) {
-		warn0("Programmer error: "
-		    "SHA256 should never fail");
-		goto err2;
-	}
-
-	/* Encrypt packet header. */
-	crypto_session_encrypt(C->keys, header, WC->buf, 37);
+	for (i = 0; i < 37; i++)
+		WC->buf[i] ^= header[i];
 
 	/* Compute HMAC of packet header. */
 	crypto_session_sign(C->keys, WC->buf, 37, WC->buf + 37);
 
-	/* Encrypt packet data. */
-	crypto_session_encrypt(C->keys, buf, WC->buf + 69, buflen);
-
 	/*
 	 * Add packet to connection write queue.  See comments in
 	 * header_received concerning the timeout.
@@ -0,0 +1,467 @@
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "warnp.h"
+
+#include "workpool.h"
+
+/* A job in the pool. */
+struct workpool_job {
+	int (* func)(void *);		/* Function to call. */
+	void * cookie;			/* Cookie to pass to func. */
+	int rc;				/* Value returned by func. */
+	int done;			/* Non-zero once func has returned. */
+	struct workpool_job * next;	/* Next job, in order of submission. */
+};
+
+struct workpool_internal {
+	/* Worker threads. */
+	pthread_t * threads;
+	size_t nthreads;
+
+	/* Jobs, in order of submission. */
+	struct workpool_job * head;	/* Oldest job. */
+	struct workpool_job ** tailp;	/* Pointer to the last next pointer. */
+	struct workpool_job * todo;	/* Oldest job which has not started. */
+	size_t njobs;			/* Number of jobs in the list. */
+
+	/* Synchronization. */
+	pthread_mutex_t mtx;		/* Protects everything above. */
+	pthread_cond_t cv_todo;		/* A job was added, or shutdown. */
+	pthread_cond_t cv_done;		/* A job was completed. */
+	int shutdown;			/* Threads should exit. */
+};
+
+static void * workthread(void *);
+static void lockfail(const char *, int);
+
+/* Report a failure of a pthread function in a worker thread, and abort. */
+static void
+lockfail(const char * func, int rc)
+{
+
+	warn0("%s: %s", func, strerror(rc));
+	abort();
+}
+
+/* Worker thread: perform jobs until told to shut down. */
+static void *
+workthread(void * cookie)
+{
+	struct workpool_internal * P = cookie;
+	struct workpool_job * J;
+	int rc;
+
+	/* Grab the mutex. */
+	if ((rc = pthread_mutex_lock(&P->mtx)) != 0)
+		lockfail("pthread_mutex_lock", rc);
+
+	do {
+		/* Wait until we have a job or we're being told to exit. */
+		while ((P->todo == NULL) && (P->shutdown == 0)) {
+			if ((rc = pthread_cond_wait(&P->cv_todo,
+			    &P->mtx)) != 0)
+				lockfail("pthread_cond_wait", rc);
+		}
+
+		/* Exit once there is no more work to be done. */
+		if (P->todo == NULL)
+			break;
+
+		/* Take the oldest job which has not been started. */
+		J = P->todo;
+		P->todo = J->next;
+
+		/* Perform the job without holding the mutex. */
+		if ((rc = pthread_mutex_unlock(&P->mtx)) != 0)
+			lockfail("pthread_mutex_unlock", rc);
+		J->rc = (J->func)(J->cookie);
+		if ((rc = pthread_mutex_lock(&P->mtx)) != 0)
+			lockfail("pthread_mutex_lock", rc);
+
+		/* Record that the job is done and wake up the collector. */
+		J->done = 1;
+		if ((rc = pthread_cond_signal(&P->cv_done)) != 0)
+			lockfail("pthread_cond_signal", rc);
+	} while (1);
+
+	/* Release the mutex. */
+	if ((rc = pthread_mutex_unlock(&P->mtx)) != 0)
+		lockfail("pthread_mutex_unlock", rc);
+
+	/* We're done. */
+	return (NULL);
+}
+
+/**
+ * workpool_init(nthreads):
+ * Create a pool of ${nthreads} worker threads.  The threads are created with
+ * all signals blocked, so that signals continue to be delivered to the
+ * calling thread.
+ */
+WORKPOOL *
+workpool_init(size_t nthreads)
+{
+	struct workpool_internal * P;
+	sigset_t set, oset;
+	int rc;
+
+	/* Sanity check. */
+	if ((nthreads == 0) || (nthreads > SIZE_MAX / sizeof(pthread_t))) {
+		warn0("Programmer error: invalid number of threads");
+		goto err0;
+	}
+
+	/* Allocate memory. */
+	if ((P = malloc(sizeof(struct workpool_internal))) == NULL)
+		goto err0;
+	if ((P->threads = malloc(nthreads * sizeof(pthread_t))) == NULL)
+		goto err1;
+
+	/* No jobs yet. */
+	P->head = P->todo = NULL;
+	P->tailp = &P->head;
+	P->njobs = 0;
+	P->shutdown = 0;
+	P->nthreads = 0;
+
+	/* Initialize synchronization primitives. */
+	if ((rc = pthread_mutex_init(&P->mtx, NULL)) != 0) {
+		warn0("pthread_mutex_init: %s", strerror(rc));
+		goto err2;
+	}
+	if ((rc = pthread_cond_init(&P->cv_todo, NULL)) != 0) {
+		warn0("pthread_cond_init: %s", strerror(rc));
+		goto err3;
+	}
+	if ((rc = pthread_cond_init(&P->cv_done, NULL)) != 0) {
+		warn0("pthread_cond_init: %s", strerror(rc));
+		goto err4;
+	}
+
+	/* Block all signals while we create threads; they inherit this. */
+	if (sigfillset(&set)) {
+		warnp("sigfillset");
+		goto err5;
+	}
+	if ((rc = pthread_sigmask(SIG_BLOCK, &set, &oset)) != 0) {
+		warn0("pthread_sigmask: %s", strerror(rc));
+		goto err5;
+	}
+
+	/* Start the worker threads. */
+	for (; P->nthreads < nthreads; P->nthreads++) {
+		if ((rc = pthread_create(&P->threads[P->nthreads], NULL,
+		    workthread, P)) != 0) {
+			warn0("pthread_create: %s", strerror(rc));
+			goto err6;
+		}
+	}
+
+	/* Restore the signal mask. */
+	if ((rc = pthread_sigmask(SIG_SETMASK, &oset, NULL)) != 0) {
+		warn0("pthread_sigmask: %s", strerror(rc));
+		goto err7;
+	}
+
+	/* Success! */
+	return (P);
+
+err6:
+	if ((rc = pthread_sigmask(SIG_SETMASK, &oset, NULL)) != 0)
+		warn0("pthread_sigmask: %s", strerror(rc));
+err7:
+	/* Stop any threads which we started, and free everything. */
+	workpool_free(P);
+
+	/* Failure! */
+	return (NULL);
+
+err5:
+	pthread_cond_destroy(&P->cv_done);
+err4:
+	pthread_cond_destroy(&P->cv_todo);
+err3:
+	pthread_mutex_destroy(&P->mtx);
+err2:
+	free(P->threads);
+err1:
+	free(P);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * workpool_add(P, func, cookie):
+ * Add a job to the pool ${P}; a worker thread will call ${func}(${cookie}).
+ * On failure, the job is not added and ${cookie} is not used.
+ */
+int
+workpool_add(WORKPOOL * P, int (* func)(void *), void * cookie)
+{
+	struct workpool_job * J;
+	struct workpool_job ** tailp;
+	int rc;
+
+	/* Create the job. */
+	if ((J = malloc(sizeof(struct workpool_job))) == NULL)
+		goto err0;
+	J->func = func;
+	J->cookie = cookie;
+	J->rc = 0;
+	J->done = 0;
+	J->next = NULL;
+
+	/* Grab the mutex. */
+	if ((rc = pthread_mutex_lock(&P->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		goto err1;
+	}
+
+	/* Append the job to the list. */
+	tailp = P->tailp;
+	*tailp = J;
+	P->tailp = &J->next;
+	if (P->todo == NULL)
+		P->todo = J;
+	P->njobs += 1;
+
+	/* Wake up a worker. */
+	if ((rc = pthread_cond_signal(&P->cv_todo)) != 0) {
+		warn0("pthread_cond_signal: %s", strerror(rc));
+		goto err2;
+	}
+
+	/*
+	 * Release the mutex.  The job is in the list and may already be
+	 * running, so we can't report a failure to our caller here.
+	 */
+	if ((rc = pthread_mutex_unlock(&P->mtx)) != 0)
+		lockfail("pthread_mutex_unlock", rc);
+
+	/* Success! */
+	return (0);
+
+err2:
+	/*
+	 * Remove the job from the list.  We have held the mutex since adding
+	 * it, so no worker can have started it.
+	 */
+	*tailp = NULL;
+	P->tailp = tailp;
+	if (P->todo == J)
+		P->todo = NULL;
+	P->njobs -= 1;
+	pthread_mutex_unlock(&P->mtx);
+err1:
+	free(J);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * workpool_getsize(P):
+ * Return the number of jobs which have been added to the pool ${P} and have
+ * not yet been returned by workpool_wait.
+ */
+size_t
+workpool_getsize(WORKPOOL * P)
+{
+
+	/* Only the calling thread modifies njobs, so no locking is needed. */
+	return (P->njobs);
+}
+
+/**
+ * workpool_wait(P, cookie, rc):
+ * Wait until the oldest job in the pool ${P} has been completed; remove it
+ * from the pool, and store its cookie in ${cookie} and the value returned by
+ * its function in ${rc}.  Return 1 if there are no jobs in the pool, 0 on
+ * success, or -1 on error.
+ */
+int
+workpool_wait(WORKPOOL * P, void ** cookie, int * rc)
+{
+	struct workpool_job * J;
+	int prc;
+
+	/* Grab the mutex. */
+	if ((prc = pthread_mutex_lock(&P->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(prc));
+		goto err0;
+	}
+
+	/* Nothing to wait for? */
+	if ((J = P->head) == NULL)
+		goto empty;
+
+	/* Wait for the oldest job to be completed. */
+	while (J->done == 0) {
+		if ((prc = pthread_cond_wait(&P->cv_done, &P->mtx)) != 0) {
+			warn0("pthread_cond_wait: %s", strerror(prc));
+			goto err1;
+		}
+	}
+
+	/* Remove it from the list. */
+	P->head = J->next;
+	if (P->head == NULL)
+		P->tailp = &P->head;
+	P->njobs -= 1;
+
+	/* Release the mutex. */
+	if ((prc = pthread_mutex_unlock(&P->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(prc));
+		goto err2;
+	}
+
+	/* Return the job's cookie and status code. */
+	*cookie = J->cookie;
+	*rc = J->rc;
+	free(J);
+
+	/* Success! */
+	return (0);
+
+empty:
+	if ((prc = pthread_mutex_unlock(&P->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(prc));
+		goto err0;
+	}
+
+	/* No jobs. */
+	return (1);
+
+err2:
+	free(J);
+	goto err0;
+err1:
+	pthread_mutex_unlock(&P->mtx);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * workpool_waitfor(P, cookie, rc):
+ * Wait until the job in the pool ${P} with the cookie ${cookie} has been
+ * completed; remove it from the pool, and store the value returned by its
+ * function in ${rc}.  Return 0 on success, or -1 on error (including if
+ * there is no such job).
+ */
+int
+workpool_waitfor(WORKPOOL * P, void * cookie, int * rc)
+{
+	struct workpool_job ** Jp;
+	struct workpool_job * J;
+	int prc;
+
+	/* Grab the mutex. */
+	if ((prc = pthread_mutex_lock(&P->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(prc));
+		goto err0;
+	}
+
+	/* Find the job. */
+	for (Jp = &P->head; *Jp != NULL; Jp = &(*Jp)->next) {
+		if ((*Jp)->cookie == cookie)
+			break;
+	}
+	if ((J = *Jp) == NULL) {
+		warn0("Programmer error: "
+		    "workpool_waitfor called with unknown job");
+		goto err1;
+	}
+
+	/*
+	 * Wait for the job to be completed.  Worker threads don't modify the
+	 * list (apart from the todo pointer), so Jp remains valid.
+	 */
+	while (J->done == 0) {
+		if ((prc = pthread_cond_wait(&P->cv_done, &P->mtx)) != 0) {
+			warn0("pthread_cond_wait: %s", strerror(prc));
+			goto err1;
+		}
+	}
+
+	/* Remove it from the list; it has started, so it isn't P->todo. */
+	*Jp = J->next;
+	if (P->tailp == &J->next)
+		P->tailp = Jp;
+	P->njobs -= 1;
+
+	/* Release the mutex. */
+	if ((prc = pthread_mutex_unlock(&P->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(prc));
+		goto err2;
+	}
+
+	/* Return the job's status code. */
+	*rc = J->rc;
+	free(J);
+
+	/* Success! */
+	return (0);
+
+err2:
+	free(J);
+	goto err0;
+err1:
+	pthread_mutex_unlock(&P->mtx);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * workpool_free(P):
+ * Wait for any jobs in the pool ${P} to be completed, stop the worker
+ * threads, and free the pool.  The cookies of jobs which have not been
+ * returned by workpool_wait are discarded.
+ */
+void
+workpool_free(WORKPOOL * P)
+{
+	struct workpool_job * J;
+	size_t i;
+	int rc;
+
+	/* Behave consistently with free(NULL). */
+	if (P == NULL)
+		return;
+
+	/* Tell the threads to exit once they run out of work. */
+	if ((rc = pthread_mutex_lock(&P->mtx)) != 0)
+		lockfail("pthread_mutex_lock", rc);
+	P->shutdown = 1;
+	if ((rc = pthread_cond_broadcast(&P->cv_todo)) != 0)
+		lockfail("pthread_cond_broadcast", rc);
+	if ((rc = pthread_mutex_unlock(&P->mtx)) != 0)
+		lockfail("pthread_mutex_unlock", rc);
+
+	/* Wait for the threads to exit. */
+	for (i = 0; i < P->nthreads; i++) {
+		if ((rc = pthread_join(P->threads[i], NULL)) != 0)
+			lockfail("pthread_join", rc);
+	}
+
+	/* Free any jobs which were never collected. */
+	while ((J = P->head) != NULL) {
+		P->head = J->next;
+		free(J);
+	}
+
+	/* Free synchronization primitives. */
+	pthread_cond_destroy(&P->cv_done);
+	pthread_cond_destroy(&P->cv_todo);
+	pthread_mutex_destroy(&P->mtx);
+
+	/* Free memory. */
+	free(P->threads);
+	free(P);
+}
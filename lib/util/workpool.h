@@ -0,0 +1,62 @@
+#ifndef WORKPOOL_H_
+#define WORKPOOL_H_
+
+#include <stddef.h>
+
+/**
+ * A pool of worker threads which perform jobs in parallel, and return the
+ * completed jobs to the thread which submitted them, either in the order
+ * in which they were submitted or individually.  All of the functions below
+ * must be called from a single thread.
+ */
+typedef struct workpool_internal WORKPOOL;
+
+/**
+ * workpool_init(nthreads):
+ * Create a pool of ${nthreads} worker threads.  The threads are created with
+ * all signals blocked, so that signals continue to be delivered to the
+ * calling thread.
+ */
+WORKPOOL * workpool_init(size_t);
+
+/**
+ * workpool_add(P, func, cookie):
+ * Add a job to the pool ${P}; a worker thread will call ${func}(${cookie}).
+ * On failure, the job is not added and ${cookie} is not used.
+ */
+int workpool_add(WORKPOOL *, int (*)(void *), void *);
+
+/**
+ * workpool_getsize(P):
+ * Return the number of jobs which have been added to the pool ${P} and have
+ * not yet been returned by workpool_wait.
+ */
+size_t workpool_getsize(WORKPOOL *);
+
+/**
+ * workpool_wait(P, cookie, rc):
+ * Wait until the oldest job in the pool ${P} has been completed; remove it
+ * from the pool, and store its cookie in ${cookie} and the value returned by
+ * its function in ${rc}.  Return 1 if there are no jobs in the pool, 0 on
+ * success, or -1 on error.
+ */
+int workpool_wait(WORKPOOL *, void **, int *);
+
+/**
+ * workpool_waitfor(P, cookie, rc):
+ * Wait until the job in the pool ${P} with the cookie ${cookie} has been
+ * completed; remove it from the pool, and store the value returned by its
+ * function in ${rc}.  Return 0 on success, or -1 on error (including if
+ * there is no such job).
+ */
+int workpool_waitfor(WORKPOOL *, void *, int *);
+
+/**
+ * workpool_free(P):
+ * Wait for any jobs in the pool ${P} to be completed, stop the worker
+ * threads, and free the pool.  The cookies of jobs which have not been
+ * returned by workpool_wait are discarded.
+ */
+void workpool_free(WORKPOOL *);
+
+#endif /* !WORKPOOL_H_ */
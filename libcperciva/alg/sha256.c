@@ -5,6 +5,7 @@
 #include "cpusupport.h"
 #include "insecure_memzero.h"
 #include "sha256_arm.h"
+#include "sha256_avx2.h"
 #include "sha256_shani.h"
 #include "sha256_sse2.h"
 #include "sysendian.h"
@@ -32,6 +33,23 @@ static enum {
 } hwaccel = HW_UNSET;
 #endif
 
+#if defined(CPUSUPPORT_X86_SSE2)
+#define MULTI_HWACCEL
+
+/* Multi-buffer transforms, which process one block from each of N lanes. */
+static enum {
+	MULTI_NONE = 0,
+#if defined(CPUSUPPORT_X86_AVX2)
+	MULTI_X86_AVX2,
+#endif
+	MULTI_X86_SSE2,
+	MULTI_UNSET
+} multi = MULTI_UNSET;
+
+/* Largest number of lanes used by any multi-buffer transform. */
+#define MULTI_MAXLANES 8
+#endif
+
 #ifdef POSIXFAIL_ABSTRACT_DECLARATOR
 static void SHA256_Transform(uint32_t state[static restrict 8],
     const uint8_t block[static restrict 64], uint32_t W[static restrict 64],
@@ -196,6 +214,81 @@ hwaccel_init(void)
 }
 #endif /* HWACCEL */
 
+#ifdef MULTI_HWACCEL
+/*
+ * Test whether the ${lanes}-way transform ${func} produces the same results
+ * as SHA256_Transform.  Must be called after hwaccel_init.
+ */
+static int
+multitest(size_t lanes, void (* func)(uint32_t *, const uint8_t * const *,
+    uint32_t *))
+{
+	uint32_t state_sw[8];
+	uint32_t state_mb[8 * MULTI_MAXLANES];
+	uint32_t W[64 * MULTI_MAXLANES];
+	uint32_t S[8];
+	uint8_t blocks[MULTI_MAXLANES][64];
+	const uint8_t * block[MULTI_MAXLANES];
+	size_t i, j;
+
+	/* Test case: Lane j hashes j, j + 1, ... j + 63 from state + j. */
+	for (j = 0; j < lanes; j++) {
+		for (i = 0; i < 64; i++)
+			blocks[j][i] = (uint8_t)(i + j);
+		block[j] = blocks[j];
+		for (i = 0; i < 8; i++) {
+			state_mb[i * lanes + j] =
+			    initial_state[i] + (uint32_t)j;
+		}
+	}
+
+	/* Multi-buffer transform. */
+	func(state_mb, block, W);
+
+	/* Compare with transforming each lane separately. */
+	for (j = 0; j < lanes; j++) {
+		for (i = 0; i < 8; i++)
+			state_sw[i] = initial_state[i] + (uint32_t)j;
+		SHA256_Transform(state_sw, blocks[j], W, S);
+		for (i = 0; i < 8; i++) {
+			if (state_sw[i] != state_mb[i * lanes + j])
+				return (1);
+		}
+	}
+
+	/* The results match. */
+	return (0);
+}
+
+/* Which multi-buffer transform should we use, if any? */
+static void
+multi_init(void)
+{
+
+	/* If we've already set multi, we're finished. */
+	if (multi != MULTI_UNSET)
+		return;
+
+	/* Default to hashing one buffer at a time. */
+	multi = MULTI_NONE;
+
+	/*
+	 * If the CPU has SHA256 instructions, hashing one buffer at a time
+	 * is faster than hashing several in parallel with SIMD instructions.
+	 */
+	hwaccel_init();
+	if ((hwaccel != HW_SOFTWARE) && (hwaccel != HW_X86_SSE2))
+		return;
+
+#if defined(CPUSUPPORT_X86_AVX2)
+	CPUSUPPORT_VALIDATE(multi, MULTI_X86_AVX2, cpusupport_x86_avx2(),
+	    multitest(8, SHA256_Transform_8way_avx2));
+#endif
+	CPUSUPPORT_VALIDATE(multi, MULTI_X86_SSE2, cpusupport_x86_sse2(),
+	    multitest(4, SHA256_Transform_4way_sse2));
+}
+#endif /* MULTI_HWACCEL */
+
 /* Elementary functions used by SHA256 */
 #define Ch(x, y, z)	((x & (y ^ z)) ^ z)
 #define Maj(x, y, z)	((x & (y | z)) | (y & z))
@@ -626,6 +719,264 @@ HMAC_SHA256_Buf(const void * K, size_t Klen, const void * in, size_t len,
 	insecure_memzero(tmp8, 96);
 }
 
+#ifdef MULTI_HWACCEL
+/* A message being hashed in one lane of a multi-buffer transform. */
+struct multi_lane {
+	const uint8_t * in;	/* Remaining whole blocks of the message. */
+	size_t nblocks;		/* Number of whole blocks remaining. */
+	const uint8_t * tail;	/* Remaining padded final block(s). */
+	size_t ntail;		/* Number of padded final blocks remaining. */
+	size_t msg;		/* Index of the message, or SIZE_MAX if idle. */
+	uint8_t tailbuf[128];	/* Padded final block(s). */
+};
+
+/* Block hashed by lanes which have no message. */
+static const uint8_t zeroblock[64];
+
+/*
+ * Prepare lane ${L} to hash message ${msg}, consisting of ${len} bytes from
+ * ${in} following ${count} bits which have already been hashed.
+ */
+static void
+multi_lane_start(struct multi_lane * L, uint64_t count, const uint8_t * in,
+    size_t len, size_t msg)
+{
+	size_t r = len & 0x3f;
+
+	/* Hash whole blocks directly from the message. */
+	L->in = in;
+	L->nblocks = len >> 6;
+	L->msg = msg;
+
+	/* Copy the rest of the message and pad it, as in SHA256_Pad. */
+	L->ntail = (r < 56) ? 1 : 2;
+	memset(L->tailbuf, 0, L->ntail * 64);
+	if (r > 0)
+		memcpy(L->tailbuf, &in[len - r], r);
+	L->tailbuf[r] = 0x80;
+	be64enc(&L->tailbuf[L->ntail * 64 - 8], count + ((uint64_t)len << 3));
+	L->tail = L->tailbuf;
+}
+
+/*
+ * Hash the ${n} messages ${in}[i] of length ${len}[i] following the data
+ * already input to ${ctx}, using a multi-buffer transform; whenever a lane
+ * finishes its message, start the next message in that lane.
+ */
+static void
+SHA256_multi_simd(const SHA256_CTX * ctx, const uint8_t * const in[],
+    const size_t len[], size_t n, uint8_t digest[][32])
+{
+	struct multi_lane L[MULTI_MAXLANES];
+	uint32_t state[8 * MULTI_MAXLANES];
+	uint32_t W[64 * MULTI_MAXLANES];
+	const uint8_t * block[MULTI_MAXLANES];
+	void (* func)(uint32_t *, const uint8_t * const *, uint32_t *);
+	size_t lanes, next, active;
+	size_t i, j;
+
+	/* Which transform are we using? */
+	switch (multi) {
+#if defined(CPUSUPPORT_X86_AVX2)
+	case MULTI_X86_AVX2:
+		func = SHA256_Transform_8way_avx2;
+		lanes = 8;
+		break;
+#endif
+	default:
+		func = SHA256_Transform_4way_sse2;
+		lanes = 4;
+		break;
+	}
+
+	/* Lanes which never get a message hash zeros from a zero state. */
+	memset(state, 0, sizeof(state));
+
+	/* Start a message in each lane. */
+	for (next = active = j = 0; j < lanes; j++) {
+		if (next == n) {
+			L[j].msg = SIZE_MAX;
+			continue;
+		}
+		multi_lane_start(&L[j], ctx->count, in[next], len[next],
+		    next);
+		for (i = 0; i < 8; i++)
+			state[i * lanes + j] = ctx->state[i];
+		next++;
+		active++;
+	}
+
+	while (active > 0) {
+		/* Find the next block in each lane; idle lanes hash zeros. */
+		for (j = 0; j < lanes; j++) {
+			if (L[j].msg == SIZE_MAX)
+				block[j] = zeroblock;
+			else if (L[j].nblocks > 0)
+				block[j] = L[j].in;
+			else
+				block[j] = L[j].tail;
+		}
+
+		/* Mix the blocks. */
+		func(state, block, W);
+
+		/* Advance each lane. */
+		for (j = 0; j < lanes; j++) {
+			if (L[j].msg == SIZE_MAX)
+				continue;
+			if (L[j].nblocks > 0) {
+				L[j].in += 64;
+				L[j].nblocks--;
+				continue;
+			}
+			L[j].tail += 64;
+			if (--L[j].ntail > 0)
+				continue;
+
+			/* This message is finished; write the hash. */
+			for (i = 0; i < 8; i++) {
+				be32enc(&digest[L[j].msg][i * 4],
+				    state[i * lanes + j]);
+			}
+
+			/* Start the next message, if any. */
+			if (next == n) {
+				L[j].msg = SIZE_MAX;
+				active--;
+				continue;
+			}
+			multi_lane_start(&L[j], ctx->count, in[next],
+			    len[next], next);
+			for (i = 0; i < 8; i++)
+				state[i * lanes + j] = ctx->state[i];
+			next++;
+		}
+	}
+
+	/* Clean the stack. */
+	insecure_memzero(L, sizeof(L));
+	insecure_memzero(state, sizeof(state));
+	insecure_memzero(W, sizeof(W));
+}
+#endif /* MULTI_HWACCEL */
+
+/*
+ * Hash the ${n} messages ${in}[i] of length ${len}[i] following the data
+ * already input to ${ctx}, which must be a whole number of blocks, and write
+ * the hashes to ${digest}[i].  The context ${ctx} is not modified.
+ */
+static void
+SHA256_multi(const SHA256_CTX * ctx, const uint8_t * const in[],
+    const size_t len[], size_t n, uint8_t digest[][32])
+{
+	SHA256_CTX tctx;
+	uint32_t tmp32[72];
+	size_t i;
+
+	/* Sanity-check. */
+	assert((ctx->count & 0x1ff) == 0);
+
+#ifdef MULTI_HWACCEL
+	/* Hash the messages in parallel if we can. */
+	multi_init();
+	if ((multi != MULTI_NONE) && (n > 1)) {
+		SHA256_multi_simd(ctx, in, len, n, digest);
+		return;
+	}
+#endif
+
+	/* Hash the messages one at a time. */
+	for (i = 0; i < n; i++) {
+		memcpy(&tctx, ctx, sizeof(SHA256_CTX));
+		SHA256_Update_internal(&tctx, in[i], len[i], tmp32);
+		SHA256_Final_internal(digest[i], &tctx, tmp32);
+	}
+
+	/* Clean the stack. */
+	insecure_memzero(&tctx, sizeof(SHA256_CTX));
+	insecure_memzero(tmp32, sizeof(uint32_t) * 72);
+}
+
+/**
+ * SHA256_Buf_multi(in, len, n, digest):
+ * Compute the SHA256 hashes of the ${n} buffers ${in}[i] of length ${len}[i]
+ * and write them to ${digest}[i].  On CPUs without SHA256 instructions,
+ * several buffers are hashed in parallel using SIMD instructions.
+ */
+void
+SHA256_Buf_multi(const uint8_t * const in[], const size_t len[], size_t n,
+    uint8_t digest[][32])
+{
+	SHA256_CTX ctx;
+
+	SHA256_Init(&ctx);
+	SHA256_multi(&ctx, in, len, n, digest);
+}
+
+/**
+ * HMAC_SHA256_Buf_multi(ctx, in, len, n, digest):
+ * Compute the HMAC-SHA256 of each of the ${n} buffers ${in}[i] of length
+ * ${len}[i] using the context ${ctx}, which must have been initialized by
+ * HMAC_SHA256_Init and not have had any data input, and write them to
+ * ${digest}[i].  The context ${ctx} is not modified.  Buffers are hashed in
+ * parallel as in SHA256_Buf_multi.
+ */
+void
+HMAC_SHA256_Buf_multi(const HMAC_SHA256_CTX * ctx, const uint8_t * const in[],
+    const size_t len[], size_t n, uint8_t digest[][32])
+{
+	uint8_t ihash[64][32];
+	const uint8_t * iptr[64];
+	size_t ilen[64];
+	size_t i, j, m;
+
+	/* Process up to 64 buffers at once. */
+	for (i = 0; i < n; i += m) {
+		m = (n - i < 64) ? n - i : 64;
+
+		/* Inner hashes. */
+		SHA256_multi(&ctx->ictx, &in[i], &len[i], m, ihash);
+
+		/* Outer hashes. */
+		for (j = 0; j < m; j++) {
+			iptr[j] = ihash[j];
+			ilen[j] = 32;
+		}
+		SHA256_multi(&ctx->octx, iptr, ilen, m, &digest[i]);
+	}
+
+	/* Clean the stack. */
+	insecure_memzero(ihash, sizeof(ihash));
+}
+
+/**
+ * SHA256_Buf_multi_lanes(void):
+ * Return the number of buffers which SHA256_Buf_multi and
+ * HMAC_SHA256_Buf_multi hash in parallel.  If this is 1, those functions
+ * are no faster than hashing the buffers one at a time.
+ */
+size_t
+SHA256_Buf_multi_lanes(void)
+{
+
+#ifdef MULTI_HWACCEL
+	multi_init();
+	switch (multi) {
+#if defined(CPUSUPPORT_X86_AVX2)
+	case MULTI_X86_AVX2:
+		return (8);
+#endif
+	case MULTI_X86_SSE2:
+		return (4);
+	default:
+		break;
+	}
+#endif
+
+	/* One buffer at a time. */
+	return (1);
+}
+
 /**
  * PBKDF2_SHA256(passwd, passwdlen, salt, saltlen, c, buf, dkLen):
  * Compute PBKDF2(passwd, salt, c, dkLen) using HMAC-SHA256 as the PRF, and
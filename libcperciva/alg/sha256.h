@@ -18,6 +18,9 @@
 #define HMAC_SHA256_Final libcperciva_HMAC_SHA256_Final
 #define HMAC_SHA256_Buf libcperciva_HMAC_SHA256_Buf
 #define HMAC_SHA256_CTX libcperciva_HMAC_SHA256_CTX
+#define SHA256_Buf_multi libcperciva_SHA256_Buf_multi
+#define HMAC_SHA256_Buf_multi libcperciva_HMAC_SHA256_Buf_multi
+#define SHA256_Buf_multi_lanes libcperciva_SHA256_Buf_multi_lanes
 
 /* Context structure for SHA256 operations. */
 typedef struct {
@@ -84,6 +87,34 @@ void HMAC_SHA256_Final(uint8_t[32], HMAC_SHA256_CTX *);
  */
 void HMAC_SHA256_Buf(const void *, size_t, const void *, size_t, uint8_t[32]);
 
+/**
+ * SHA256_Buf_multi(in, len, n, digest):
+ * Compute the SHA256 hashes of the ${n} buffers ${in}[i] of length ${len}[i]
+ * and write them to ${digest}[i].  On CPUs without SHA256 instructions,
+ * several buffers are hashed in parallel using SIMD instructions.
+ */
+void SHA256_Buf_multi(const uint8_t * const[], const size_t[], size_t,
+    uint8_t[][32]);
+
+/**
+ * HMAC_SHA256_Buf_multi(ctx, in, len, n, digest):
+ * Compute the HMAC-SHA256 of each of the ${n} buffers ${in}[i] of length
+ * ${len}[i] using the context ${ctx}, which must have been initialized by
+ * HMAC_SHA256_Init and not have had any data input, and write them to
+ * ${digest}[i].  The context ${ctx} is not modified.  Buffers are hashed in
+ * parallel as in SHA256_Buf_multi.
+ */
+void HMAC_SHA256_Buf_multi(const HMAC_SHA256_CTX *, const uint8_t * const[],
+    const size_t[], size_t, uint8_t[][32]);
+
+/**
+ * SHA256_Buf_multi_lanes(void):
+ * Return the number of buffers which SHA256_Buf_multi and
+ * HMAC_SHA256_Buf_multi hash in parallel.  If this is 1, those functions
+ * are no faster than hashing the buffers one at a time.
+ */
+size_t SHA256_Buf_multi_lanes(void);
+
 /**
  * PBKDF2_SHA256(passwd, passwdlen, salt, saltlen, c, buf, dkLen):
  * Compute PBKDF2(passwd, salt, c, dkLen) using HMAC-SHA256 as the PRF, and
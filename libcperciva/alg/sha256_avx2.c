@@ -0,0 +1,160 @@
+#include "cpusupport.h"
+#ifdef CPUSUPPORT_X86_AVX2
+/**
+ * CPUSUPPORT CFLAGS: X86_AVX2
+ */
+
+#include <stdint.h>
+
+#include <immintrin.h>
+
+#include "sha256_avx2.h"
+
+/* SHA256 round constants. */
+static const uint32_t Krnd[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/* Elementary functions used by SHA256, operating on eight lanes at once. */
+#define VADD(x, y)	_mm256_add_epi32(x, y)
+#define SHR32(x, n)	_mm256_srli_epi32(x, n)
+#define ROTR32(x, n)	_mm256_or_si256(SHR32(x, n),			\
+	_mm256_slli_epi32(x, (32 - n)))
+#define VCh(x, y, z)	_mm256_xor_si256(				\
+	_mm256_and_si256(x, _mm256_xor_si256(y, z)), z)
+#define VMaj(x, y, z)	_mm256_or_si256(				\
+	_mm256_and_si256(x, _mm256_or_si256(y, z)), _mm256_and_si256(y, z))
+#define VS0(x)		_mm256_xor_si256(_mm256_xor_si256(		\
+	ROTR32(x, 2), ROTR32(x, 13)), ROTR32(x, 22))
+#define VS1(x)		_mm256_xor_si256(_mm256_xor_si256(		\
+	ROTR32(x, 6), ROTR32(x, 11)), ROTR32(x, 25))
+#define Vs0(x)		_mm256_xor_si256(_mm256_xor_si256(		\
+	ROTR32(x, 7), ROTR32(x, 18)), SHR32(x, 3))
+#define Vs1(x)		_mm256_xor_si256(_mm256_xor_si256(		\
+	ROTR32(x, 17), ROTR32(x, 19)), SHR32(x, 10))
+
+/* Load and store word ${i} of the message schedule for all eight lanes. */
+#define WLOAD(W, i)	_mm256_loadu_si256((const __m256i *)&W[8 * (i)])
+#define WSTORE(W, i, x)	_mm256_storeu_si256((__m256i *)&W[8 * (i)], x)
+
+/* SHA256 round function. */
+#define VRND(a, b, c, d, e, f, g, h, k)				\
+	h = VADD(h, VADD(VADD(VS1(e), VCh(e, f, g)), k));	\
+	d = VADD(d, h);						\
+	h = VADD(h, VADD(VS0(a), VMaj(a, b, c)))
+
+/* Adjusted round function for rotating state. */
+#define VRNDr(S, W, i, ii)					\
+	VRND(S[(64 - i) % 8], S[(65 - i) % 8],			\
+	    S[(66 - i) % 8], S[(67 - i) % 8],			\
+	    S[(68 - i) % 8], S[(69 - i) % 8],			\
+	    S[(70 - i) % 8], S[(71 - i) % 8],			\
+	    VADD(WLOAD(W, i + ii), _mm256_set1_epi32((int)Krnd[i + ii])))
+
+/**
+ * SHA256_Transform_8way_avx2(state, block, W):
+ * Compute the SHA256 block compression function for eight independent
+ * messages, transforming lane ${j} of ${state} (words state[8 * i + j] for
+ * i = 0 ... 7) using the data in ${block}[j].  This implementation uses x86
+ * AVX2 instructions, and should only be used if _AVX2 is defined and
+ * cpusupport_x86_avx2() returns nonzero.  The array W may be filled with
+ * sensitive data, and should be cleared by the callee.
+ */
+#ifdef POSIXFAIL_ABSTRACT_DECLARATOR
+void
+SHA256_Transform_8way_avx2(uint32_t state[64],
+    const uint8_t * const block[8], uint32_t W[512])
+#else
+void
+SHA256_Transform_8way_avx2(uint32_t state[static restrict 64],
+    const uint8_t * const block[static restrict 8],
+    uint32_t W[static restrict 512])
+#endif
+{
+	const __m256i bswap = _mm256_set_epi8(
+	    12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+	    12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+	__m256i S[8];
+	__m256i X[8];
+	__m256i T[8];
+	int i, j;
+
+	/*
+	 * 1. Prepare the first part of the message schedule W, transposing
+	 * the blocks so that each vector holds the same word of each block.
+	 */
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < 8; j++) {
+			X[j] = _mm256_loadu_si256(
+			    (const __m256i *)&block[j][32 * i]);
+		}
+
+		/* Interleave words from pairs of blocks. */
+		for (j = 0; j < 8; j += 2) {
+			T[j] = _mm256_unpacklo_epi32(X[j], X[j + 1]);
+			T[j + 1] = _mm256_unpackhi_epi32(X[j], X[j + 1]);
+		}
+
+		/* Interleave pairs of words from pairs of pairs of blocks. */
+		for (j = 0; j < 8; j += 4) {
+			X[j] = _mm256_unpacklo_epi64(T[j], T[j + 2]);
+			X[j + 1] = _mm256_unpackhi_epi64(T[j], T[j + 2]);
+			X[j + 2] = _mm256_unpacklo_epi64(T[j + 1], T[j + 3]);
+			X[j + 3] = _mm256_unpackhi_epi64(T[j + 1], T[j + 3]);
+		}
+
+		/* Combine 128-bit halves and fix the byte order. */
+		for (j = 0; j < 4; j++) {
+			WSTORE(W, 8 * i + j, _mm256_shuffle_epi8(
+			    _mm256_permute2x128_si256(X[j], X[j + 4], 0x20),
+			    bswap));
+			WSTORE(W, 8 * i + j + 4, _mm256_shuffle_epi8(
+			    _mm256_permute2x128_si256(X[j], X[j + 4], 0x31),
+			    bswap));
+		}
+	}
+
+	/* 2. Compute the rest of the message schedule. */
+	for (i = 16; i < 64; i++) {
+		WSTORE(W, i, VADD(VADD(Vs1(WLOAD(W, i - 2)), WLOAD(W, i - 7)),
+		    VADD(Vs0(WLOAD(W, i - 15)), WLOAD(W, i - 16))));
+	}
+
+	/* 3. Initialize working variables. */
+	for (i = 0; i < 8; i++)
+		S[i] = _mm256_loadu_si256((const __m256i *)&state[8 * i]);
+
+	/* 4. Mix. */
+	for (i = 0; i < 64; i += 8) {
+		VRNDr(S, W, 0, i);
+		VRNDr(S, W, 1, i);
+		VRNDr(S, W, 2, i);
+		VRNDr(S, W, 3, i);
+		VRNDr(S, W, 4, i);
+		VRNDr(S, W, 5, i);
+		VRNDr(S, W, 6, i);
+		VRNDr(S, W, 7, i);
+	}
+
+	/* 5. Mix local working variables into global state. */
+	for (i = 0; i < 8; i++) {
+		_mm256_storeu_si256((__m256i *)&state[8 * i], VADD(S[i],
+		    _mm256_loadu_si256((const __m256i *)&state[8 * i])));
+	}
+}
+#endif /* CPUSUPPORT_X86_AVX2 */
@@ -0,0 +1,23 @@
+#ifndef SHA256_AVX2_H_
+#define SHA256_AVX2_H_
+
+#include <stdint.h>
+
+/**
+ * SHA256_Transform_8way_avx2(state, block, W):
+ * Compute the SHA256 block compression function for eight independent
+ * messages, transforming lane ${j} of ${state} (words state[8 * i + j] for
+ * i = 0 ... 7) using the data in ${block}[j].  This implementation uses x86
+ * AVX2 instructions, and should only be used if _AVX2 is defined and
+ * cpusupport_x86_avx2() returns nonzero.  The array W may be filled with
+ * sensitive data, and should be cleared by the callee.
+ */
+#ifdef POSIXFAIL_ABSTRACT_DECLARATOR
+void SHA256_Transform_8way_avx2(uint32_t state[64],
+    const uint8_t * const block[8], uint32_t W[512]);
+#else
+void SHA256_Transform_8way_avx2(uint32_t[static restrict 64],
+    const uint8_t * const[static restrict 8], uint32_t[static restrict 512]);
+#endif
+
+#endif /* !SHA256_AVX2_H_ */
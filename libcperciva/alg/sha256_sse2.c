@@ -236,4 +236,112 @@ SHA256_Transform_sse2(uint32_t state[static restrict 8],
 	for (i = 0; i < 8; i++)
 		state[i] += S[i];
 }
+
+/* Elementary functions used by the four-way SHA256. */
+#define VADD(x, y)	_mm_add_epi32(x, y)
+#define VCh(x, y, z)	_mm_xor_si128(					\
+	_mm_and_si128(x, _mm_xor_si128(y, z)), z)
+#define VMaj(x, y, z)	_mm_or_si128(					\
+	_mm_and_si128(x, _mm_or_si128(y, z)), _mm_and_si128(y, z))
+#define VS0(x)		_mm_xor_si128(_mm_xor_si128(			\
+	ROTR32(x, 2), ROTR32(x, 13)), ROTR32(x, 22))
+#define VS1(x)		_mm_xor_si128(_mm_xor_si128(			\
+	ROTR32(x, 6), ROTR32(x, 11)), ROTR32(x, 25))
+#define Vs1(x)		_mm_xor_si128(_mm_xor_si128(			\
+	ROTR32(x, 17), ROTR32(x, 19)), SHR32(x, 10))
+
+/* Load and store word ${i} of the message schedule for all four lanes. */
+#define WLOAD(W, i)	_mm_loadu_si128((const __m128i *)&W[4 * (i)])
+#define WSTORE(W, i, x)	_mm_storeu_si128((__m128i *)&W[4 * (i)], x)
+
+/* Four-way SHA256 round function. */
+#define VRND(a, b, c, d, e, f, g, h, k)				\
+	h = VADD(h, VADD(VADD(VS1(e), VCh(e, f, g)), k));	\
+	d = VADD(d, h);						\
+	h = VADD(h, VADD(VS0(a), VMaj(a, b, c)))
+
+/* Adjusted four-way round function for rotating state. */
+#define VRNDr(S, W, i, ii)					\
+	VRND(S[(64 - i) % 8], S[(65 - i) % 8],			\
+	    S[(66 - i) % 8], S[(67 - i) % 8],			\
+	    S[(68 - i) % 8], S[(69 - i) % 8],			\
+	    S[(70 - i) % 8], S[(71 - i) % 8],			\
+	    VADD(WLOAD(W, i + ii), _mm_set1_epi32((int)Krnd[i + ii])))
+
+/**
+ * SHA256_Transform_4way_sse2(state, block, W):
+ * Compute the SHA256 block compression function for four independent
+ * messages, transforming lane ${j} of ${state} (words state[4 * i + j] for
+ * i = 0 ... 7) using the data in ${block}[j].  This implementation uses x86
+ * SSE2 instructions, and should only be used if _SSE2 is defined and
+ * cpusupport_x86_sse2() returns nonzero.  The array W may be filled with
+ * sensitive data, and should be cleared by the callee.
+ */
+#ifdef POSIXFAIL_ABSTRACT_DECLARATOR
+void
+SHA256_Transform_4way_sse2(uint32_t state[32],
+    const uint8_t * const block[4], uint32_t W[256])
+#else
+void
+SHA256_Transform_4way_sse2(uint32_t state[static restrict 32],
+    const uint8_t * const block[static restrict 4],
+    uint32_t W[static restrict 256])
+#endif
+{
+	__m128i S[8];
+	__m128i X0, X1, X2, X3;
+	__m128i T0, T1, T2, T3;
+	int i;
+
+	/*
+	 * 1. Prepare the first part of the message schedule W, transposing
+	 * the blocks so that each vector holds the same word of each block.
+	 */
+	for (i = 0; i < 4; i++) {
+		X0 = _mm_loadu_si128((const __m128i *)&block[0][16 * i]);
+		X1 = _mm_loadu_si128((const __m128i *)&block[1][16 * i]);
+		X2 = _mm_loadu_si128((const __m128i *)&block[2][16 * i]);
+		X3 = _mm_loadu_si128((const __m128i *)&block[3][16 * i]);
+		T0 = _mm_unpacklo_epi32(X0, X1);
+		T1 = _mm_unpacklo_epi32(X2, X3);
+		T2 = _mm_unpackhi_epi32(X0, X1);
+		T3 = _mm_unpackhi_epi32(X2, X3);
+		X0 = _mm_unpacklo_epi64(T0, T1);
+		X1 = _mm_unpackhi_epi64(T0, T1);
+		X2 = _mm_unpacklo_epi64(T2, T3);
+		X3 = _mm_unpackhi_epi64(T2, T3);
+		WSTORE(W, 4 * i + 0, mm_bswap_epi32(X0));
+		WSTORE(W, 4 * i + 1, mm_bswap_epi32(X1));
+		WSTORE(W, 4 * i + 2, mm_bswap_epi32(X2));
+		WSTORE(W, 4 * i + 3, mm_bswap_epi32(X3));
+	}
+
+	/* 2. Compute the rest of the message schedule. */
+	for (i = 16; i < 64; i++) {
+		WSTORE(W, i, VADD(VADD(Vs1(WLOAD(W, i - 2)), WLOAD(W, i - 7)),
+		    VADD(s0_128(WLOAD(W, i - 15)), WLOAD(W, i - 16))));
+	}
+
+	/* 3. Initialize working variables. */
+	for (i = 0; i < 8; i++)
+		S[i] = _mm_loadu_si128((const __m128i *)&state[4 * i]);
+
+	/* 4. Mix. */
+	for (i = 0; i < 64; i += 8) {
+		VRNDr(S, W, 0, i);
+		VRNDr(S, W, 1, i);
+		VRNDr(S, W, 2, i);
+		VRNDr(S, W, 3, i);
+		VRNDr(S, W, 4, i);
+		VRNDr(S, W, 5, i);
+		VRNDr(S, W, 6, i);
+		VRNDr(S, W, 7, i);
+	}
+
+	/* 5. Mix local working variables into global state. */
+	for (i = 0; i < 8; i++) {
+		_mm_storeu_si128((__m128i *)&state[4 * i], VADD(S[i],
+		    _mm_loadu_si128((const __m128i *)&state[4 * i])));
+	}
+}
 #endif /* CPUSUPPORT_X86_SSE2 */
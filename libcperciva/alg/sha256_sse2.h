@@ -20,4 +20,21 @@ void SHA256_Transform_sse2(uint32_t[static restrict 8],
     uint32_t S[static restrict 8]);
 #endif
 
+/**
+ * SHA256_Transform_4way_sse2(state, block, W):
+ * Compute the SHA256 block compression function for four independent
+ * messages, transforming lane ${j} of ${state} (words state[4 * i + j] for
+ * i = 0 ... 7) using the data in ${block}[j].  This implementation uses x86
+ * SSE2 instructions, and should only be used if _SSE2 is defined and
+ * cpusupport_x86_sse2() returns nonzero.  The array W may be filled with
+ * sensitive data, and should be cleared by the callee.
+ */
+#ifdef POSIXFAIL_ABSTRACT_DECLARATOR
+void SHA256_Transform_4way_sse2(uint32_t state[32],
+    const uint8_t * const block[4], uint32_t W[256]);
+#else
+void SHA256_Transform_4way_sse2(uint32_t[static restrict 32],
+    const uint8_t * const[static restrict 4], uint32_t[static restrict 256]);
+#endif
+
 #endif /* !SHA256_SSE2_H_ */
@@ -0,0 +1,29 @@
+#include <stdint.h>
+
+#include <immintrin.h>
+
+/*
+ * Use a separate function for this, because that means that the alignment of
+ * the _mm256_loadu_si256() will move to function level, which may require
+ * -Wno-cast-align.
+ */
+static __m256i
+load_256(const uint8_t * src)
+{
+	__m256i x;
+
+	x = _mm256_loadu_si256((const __m256i *)src);
+	return (x);
+}
+
+int
+main(void)
+{
+	__m256i x;
+	uint8_t a[32] = {0};
+
+	x = load_256(a);
+	x = _mm256_add_epi32(x, _mm256_shuffle_epi8(x, x));
+	_mm256_storeu_si256((__m256i *)a, x);
+	return (a[0]);
+}
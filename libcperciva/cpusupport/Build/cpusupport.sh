@@ -81,6 +81,8 @@ feature X86 AESNI "" "-maes"						\
     "-maes -Wno-missing-prototypes -Wno-cast-qual -Wno-cast-align"	\
     "-maes -Wno-missing-prototypes -Wno-cast-qual -Wno-cast-align	\
     -DBROKEN_MM_LOADU_SI64"
+feature X86 AVX2 "" "-mavx2"						\
+    "-mavx2 -Wno-cast-align"
 feature X86 RDRAND "" "-mrdrnd"
 feature X86 SHANI "" "-msse2 -msha"					\
     "-msse2 -msha -Wno-cast-align"
@@ -98,6 +100,8 @@ feature X86 SSE42_64 "" "-msse4.2"					\
     "-msse4.2 -Wno-cast-align -fno-strict-aliasing -Wno-cast-qual"
 feature X86 SSSE3 "" "-mssse3"						\
     "-mssse3 -Wno-cast-align"
+feature X86 VAES "" "-mavx2 -mvaes"					\
+    "-mavx2 -mvaes -Wno-cast-align"
 
 # Detect specific ARM features
 feature ARM AES "-march=armv8.1-a+crypto"				\
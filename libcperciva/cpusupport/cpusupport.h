@@ -131,11 +131,13 @@
  *                 that says nothing about whether it's in 64-bit mode.
  */
 CPUSUPPORT_FEATURE(x86, aesni, X86_AESNI);
+CPUSUPPORT_FEATURE(x86, avx2, X86_AVX2);
 CPUSUPPORT_FEATURE(x86, rdrand, X86_RDRAND);
 CPUSUPPORT_FEATURE(x86, shani, X86_SHANI);
 CPUSUPPORT_FEATURE(x86, sse2, X86_SSE2);
 CPUSUPPORT_FEATURE(x86, sse42, X86_SSE42);
 CPUSUPPORT_FEATURE(x86, ssse3, X86_SSSE3);
+CPUSUPPORT_FEATURE(x86, vaes, X86_VAES);
 CPUSUPPORT_FEATURE(arm, aes, ARM_AES);
 CPUSUPPORT_FEATURE(arm, crc32_64, ARM_CRC32_64);
 CPUSUPPORT_FEATURE(arm, sha256, ARM_SHA256);
@@ -0,0 +1,54 @@
+#include "cpusupport.h"
+
+#ifdef CPUSUPPORT_X86_CPUID_COUNT
+#include <cpuid.h>
+
+#define CPUID_OSXSAVE_BIT (1 << 27)
+#define CPUID_AVX2_BIT (1 << 5)
+#define CPUID_VAES_BIT (1 << 9)
+#define XCR0_SSE_AVX_BITS 0x6
+#endif
+
+CPUSUPPORT_FEATURE_DECL(x86, vaes)
+{
+#ifdef CPUSUPPORT_X86_CPUID_COUNT
+	unsigned int eax, ebx, ecx, edx;
+	unsigned int xcr0_lo, xcr0_hi;
+
+	/* Check if CPUID supports the level we need. */
+	if (!__get_cpuid(0, &eax, &ebx, &ecx, &edx))
+		goto unsupported;
+	if (eax < 7)
+		goto unsupported;
+
+	/*
+	 * The operating system must have enabled saving of the 256-bit
+	 * registers; check that OSXSAVE is set, then ask XGETBV.
+	 */
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		goto unsupported;
+	if ((ecx & CPUID_OSXSAVE_BIT) == 0)
+		goto unsupported;
+	__asm__ ("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+	(void)xcr0_hi; /* UNUSED */
+	if ((xcr0_lo & XCR0_SSE_AVX_BITS) != XCR0_SSE_AVX_BITS)
+		goto unsupported;
+
+	/*
+	 * Ask about extended CPU features.  Note that this macro violates
+	 * the principle of being "function-like" by taking the variables
+	 * used for holding output registers as named parameters rather than
+	 * as pointers (which would be necessary if __cpuid_count were a
+	 * function).
+	 */
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+
+	/* Return the relevant feature bits. */
+	return (((ebx & CPUID_AVX2_BIT) && (ecx & CPUID_VAES_BIT)) ? 1 : 0);
+
+unsupported:
+#endif
+
+	/* Not supported. */
+	return (0);
+}
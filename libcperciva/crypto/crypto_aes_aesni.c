@@ -218,6 +218,21 @@ crypto_aes_encrypt_block_aesni_m128i(__m128i in, const void * key)
 	return (aes_state);
 }
 
+/**
+ * crypto_aes_key_rkeys_aesni(key, nr):
+ * Return a pointer to the round keys of the expanded AES key ${key}, and
+ * store the number of rounds in ${nr}.  This should only be used if
+ * CPUSUPPORT_X86_AESNI is defined and cpusupport_x86_aesni() returns nonzero.
+ */
+const __m128i *
+crypto_aes_key_rkeys_aesni(const void * key, size_t * nr)
+{
+	const struct crypto_aes_key_aesni * _key = key;
+
+	*nr = _key->nr;
+	return (_key->rkeys);
+}
+
 /**
  * crypto_aes_encrypt_block_aesni(in, out, key):
  * Using the expanded AES key ${key}, encrypt the block ${in} and write the
@@ -1,6 +1,8 @@
 #ifndef CRYPTO_AES_AESNI_M128I_H_
 #define CRYPTO_AES_AESNI_M128I_H_
 
+#include <stddef.h>
+
 #include <emmintrin.h>
 
 /**
@@ -12,4 +14,12 @@
  */
 __m128i crypto_aes_encrypt_block_aesni_m128i(__m128i, const void *);
 
+/**
+ * crypto_aes_key_rkeys_aesni(key, nr):
+ * Return a pointer to the round keys of the expanded AES key ${key}, and
+ * store the number of rounds in ${nr}.  This should only be used if
+ * CPUSUPPORT_X86_AESNI is defined and cpusupport_x86_aesni() returns nonzero.
+ */
+const __m128i * crypto_aes_key_rkeys_aesni(const void *, size_t *);
+
 #endif /* !CRYPTO_AES_AESNI_M128I_H_ */
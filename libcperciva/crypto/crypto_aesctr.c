@@ -1,13 +1,16 @@
 #include <assert.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "cpusupport.h"
 #include "crypto_aes.h"
 #include "crypto_aesctr_aesni.h"
 #include "crypto_aesctr_arm.h"
+#include "crypto_aesctr_vaes.h"
 #include "insecure_memzero.h"
 #include "sysendian.h"
+#include "warnp.h"
 
 #include "crypto_aesctr.h"
 
@@ -33,6 +36,9 @@ static enum {
 #if defined(CPUSUPPORT_X86_AESNI)
 	HW_X86_AESNI,
 #endif
+#if defined(CPUSUPPORT_X86_AESNI) && defined(CPUSUPPORT_X86_VAES)
+	HW_X86_VAES,
+#endif
 #if defined(CPUSUPPORT_ARM_AES)
 	HW_ARM_AES,
 #endif
@@ -40,6 +46,95 @@ static enum {
 } hwaccel = HW_UNSET;
 #endif
 
+/* Generate and use the AES-CTR stream one block at a time. */
+static void
+crypto_aesctr_stream_generic(struct crypto_aesctr * stream,
+    const uint8_t * inbuf, uint8_t * outbuf, size_t buflen)
+{
+
+	/* Process any bytes before we can process a whole block. */
+	if (crypto_aesctr_stream_pre_wholeblock(stream, &inbuf, &outbuf,
+	    &buflen))
+		return;
+
+	/* Process whole blocks of 16 bytes. */
+	while (buflen >= 16) {
+		/* Generate a block of cipherstream. */
+		crypto_aesctr_stream_cipherblock_generate(stream);
+
+		/* Encrypt the bytes and update the positions. */
+		crypto_aesctr_stream_cipherblock_use(stream, &inbuf, &outbuf,
+		    &buflen, 16, 0);
+	}
+
+	/* Process any final bytes after finishing all whole blocks. */
+	crypto_aesctr_stream_post_wholeblock(stream, &inbuf, &outbuf, &buflen);
+}
+
+#if defined(CPUSUPPORT_X86_AESNI)
+/*
+ * Length of data used to test an accelerated function.  This must be long
+ * enough that the least significant byte of the counter wraps.
+ */
+#define FUNCTEST_LEN 5000
+
+/*
+ * Test an accelerated function against crypto_aesctr_stream_generic, using
+ * a variety of lengths to exercise the handling of partial blocks.
+ */
+static int
+functest(void (* func)(struct crypto_aesctr *, const uint8_t *, uint8_t *,
+    size_t))
+{
+	static const uint8_t key_unexpanded[32] = {
+		0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+		0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+		0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
+		0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f
+	};
+	struct crypto_aes_key * key;
+	struct crypto_aesctr stream_func, stream_generic;
+	uint8_t inbuf[FUNCTEST_LEN];
+	uint8_t outbuf_func[FUNCTEST_LEN];
+	uint8_t outbuf_generic[FUNCTEST_LEN];
+	size_t pos, len;
+	size_t i;
+
+	/* Expand the key. */
+	if ((key = crypto_aes_key_expand(key_unexpanded, 32)) == NULL)
+		goto err0;
+
+	/* Prepare the input. */
+	for (i = 0; i < FUNCTEST_LEN; i++)
+		inbuf[i] = (uint8_t)i;
+
+	/* Encrypt with both functions, in pieces of increasing length. */
+	crypto_aesctr_init2(&stream_func, key, 0x0123456789abcdef);
+	crypto_aesctr_init2(&stream_generic, key, 0x0123456789abcdef);
+	for (pos = 0, len = 1; pos < FUNCTEST_LEN; pos += len, len *= 3) {
+		if (len > FUNCTEST_LEN - pos)
+			len = FUNCTEST_LEN - pos;
+		func(&stream_func, &inbuf[pos], &outbuf_func[pos], len);
+		crypto_aesctr_stream_generic(&stream_generic, &inbuf[pos],
+		    &outbuf_generic[pos], len);
+	}
+
+	/* Clean up. */
+	crypto_aes_key_free(key);
+
+	/* Do the outputs match? */
+	if (memcmp(outbuf_func, outbuf_generic, FUNCTEST_LEN))
+		goto err0;
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+#endif /* CPUSUPPORT_X86_AESNI */
+
 #ifdef HWACCEL
 /* Which type of hardware acceleration should we use, if any? */
 static void
@@ -57,7 +152,12 @@ hwaccel_init(void)
 	switch (crypto_aes_can_use_intrinsics()) {
 #ifdef CPUSUPPORT_X86_AESNI
 	case 1:
-		hwaccel = HW_X86_AESNI;
+#ifdef CPUSUPPORT_X86_VAES
+		CPUSUPPORT_VALIDATE(hwaccel, HW_X86_VAES,
+		    cpusupport_x86_vaes(), functest(crypto_aesctr_vaes_stream));
+#endif
+		CPUSUPPORT_VALIDATE(hwaccel, HW_X86_AESNI, 1,
+		    functest(crypto_aesctr_aesni_stream));
 		break;
 #endif
 #ifdef CPUSUPPORT_ARM_AES
@@ -170,6 +270,12 @@ crypto_aesctr_stream(struct crypto_aesctr * stream, const uint8_t * inbuf,
 {
 
 #if defined(HWACCEL)
+#if defined(CPUSUPPORT_X86_AESNI) && defined(CPUSUPPORT_X86_VAES)
+	if ((buflen >= 16) && (hwaccel == HW_X86_VAES)) {
+		crypto_aesctr_vaes_stream(stream, inbuf, outbuf, buflen);
+		return;
+	}
+#endif
 #if defined(CPUSUPPORT_X86_AESNI)
 	if ((buflen >= 16) && (hwaccel == HW_X86_AESNI)) {
 		crypto_aesctr_aesni_stream(stream, inbuf, outbuf, buflen);
@@ -184,23 +290,8 @@ crypto_aesctr_stream(struct crypto_aesctr * stream, const uint8_t * inbuf,
 #endif
 #endif /* HWACCEL */
 
-	/* Process any bytes before we can process a whole block. */
-	if (crypto_aesctr_stream_pre_wholeblock(stream, &inbuf, &outbuf,
-	    &buflen))
-		return;
-
-	/* Process whole blocks of 16 bytes. */
-	while (buflen >= 16) {
-		/* Generate a block of cipherstream. */
-		crypto_aesctr_stream_cipherblock_generate(stream);
-
-		/* Encrypt the bytes and update the positions. */
-		crypto_aesctr_stream_cipherblock_use(stream, &inbuf, &outbuf,
-		    &buflen, 16, 0);
-	}
-
-	/* Process any final bytes after finishing all whole blocks. */
-	crypto_aesctr_stream_post_wholeblock(stream, &inbuf, &outbuf, &buflen);
+	/* Use the generic code. */
+	crypto_aesctr_stream_generic(stream, inbuf, outbuf, buflen);
 }
 
 /**
@@ -9,6 +9,7 @@
 #include <string.h>
 
 #include <emmintrin.h>
+#include <wmmintrin.h>
 
 #include "crypto_aes.h"
 #include "crypto_aes_aesni_m128i.h"
@@ -51,6 +52,85 @@ load_si64(const void * mem)
 #endif
 }
 
+/*
+ * Number of blocks to encrypt at once.  AESENC has a latency of several
+ * cycles but can be issued every cycle, so we keep this many independent
+ * blocks in flight.
+ */
+#define NBLOCKS 8
+
+/* Encrypt the blocks x[0 .. 7] with one round of AES using the round key k. */
+#define AESENC8(x, k) do {				\
+	x[0] = _mm_aesenc_si128(x[0], k);		\
+	x[1] = _mm_aesenc_si128(x[1], k);		\
+	x[2] = _mm_aesenc_si128(x[2], k);		\
+	x[3] = _mm_aesenc_si128(x[3], k);		\
+	x[4] = _mm_aesenc_si128(x[4], k);		\
+	x[5] = _mm_aesenc_si128(x[5], k);		\
+	x[6] = _mm_aesenc_si128(x[6], k);		\
+	x[7] = _mm_aesenc_si128(x[7], k);		\
+} while (0)
+
+/* Encrypt NBLOCKS blocks using cipherblocks generated in parallel. */
+static void
+crypto_aesctr_aesni_stream_wholeblocks_multi(struct crypto_aesctr * stream,
+    const uint8_t ** inbuf, uint8_t ** outbuf, size_t * buflen)
+{
+	const __m128i * rkeys;
+	__m128i bufsse[NBLOCKS];
+	__m128i inbufsse;
+	uint64_t nonce;
+	uint64_t block_counter_be;
+	uint64_t block_counter;
+	size_t nr;
+	size_t i, j;
+
+	/* Load local variables from stream. */
+	rkeys = crypto_aes_key_rkeys_aesni(stream->key, &nr);
+	memcpy(&nonce, stream->pblk, 8);
+	block_counter = stream->bytectr / 16;
+
+	/* Process groups of NBLOCKS blocks. */
+	for (i = 0; i < (*buflen) / (16 * NBLOCKS); i++) {
+		/*
+		 * Prepare counters and perform the initial round.  We build
+		 * the counter blocks in registers rather than in memory, in
+		 * order to avoid store-to-load forwarding stalls.
+		 */
+		for (j = 0; j < NBLOCKS; j++) {
+			be64enc(&block_counter_be, block_counter + j);
+			bufsse[j] = _mm_set_epi64x((long long)block_counter_be,
+			    (long long)nonce);
+			bufsse[j] = _mm_xor_si128(bufsse[j], rkeys[0]);
+		}
+
+		/* Encrypt the cipherblocks. */
+		for (j = 1; j < nr; j++)
+			AESENC8(bufsse, rkeys[j]);
+		for (j = 0; j < NBLOCKS; j++)
+			bufsse[j] = _mm_aesenclast_si128(bufsse[j], rkeys[nr]);
+
+		/* Encrypt the bytes. */
+		for (j = 0; j < NBLOCKS; j++) {
+			inbufsse = _mm_loadu_si128((const __m128i *)(*inbuf));
+			bufsse[j] = _mm_xor_si128(inbufsse, bufsse[j]);
+			_mm_storeu_si128((__m128i *)(*outbuf), bufsse[j]);
+			*inbuf += 16;
+			*outbuf += 16;
+		}
+
+		/* Update the counter. */
+		block_counter += NBLOCKS;
+	}
+
+	/* Update the overall buffer length. */
+	*buflen -= 16 * NBLOCKS * i;
+
+	/* Update variables in stream. */
+	memcpy(stream->pblk + 8, &block_counter_be, 8);
+	stream->bytectr += 16 * NBLOCKS * i;
+}
+
 /* Process multiple whole blocks by generating & using a cipherblock. */
 static void
 crypto_aesctr_aesni_stream_wholeblocks(struct crypto_aesctr * stream,
@@ -64,6 +144,14 @@ crypto_aesctr_aesni_stream_wholeblocks(struct crypto_aesctr * stream,
 	size_t num_blocks;
 	size_t i;
 
+	/* Process as many blocks as possible in parallel. */
+	if (*buflen >= 16 * NBLOCKS) {
+		crypto_aesctr_aesni_stream_wholeblocks_multi(stream, inbuf,
+		    outbuf, buflen);
+		if (*buflen < 16)
+			return;
+	}
+
 	/* Load local variables from stream. */
 	nonce_be = load_si64(stream->pblk);
 	block_counter = stream->bytectr / 16;
@@ -0,0 +1,175 @@
+#include "cpusupport.h"
+#if defined(CPUSUPPORT_X86_AESNI) && defined(CPUSUPPORT_X86_VAES)
+/**
+ * CPUSUPPORT CFLAGS: X86_AESNI X86_VAES
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <immintrin.h>
+
+#include "crypto_aes.h"
+#include "crypto_aes_aesni_m128i.h"
+#include "sysendian.h"
+
+#include "crypto_aesctr_vaes.h"
+
+/**
+ * In order to optimize AES-CTR, it is desirable to separate out the handling
+ * of individual bytes of data vs. the handling of complete (16 byte) blocks.
+ * The handling of blocks in turn can be optimized further using CPU
+ * intrinsics, e.g. SSE2 on x86 CPUs; however while the byte-at-once code
+ * remains the same across platforms it should be inlined into the same (CPU
+ * feature specific) routines for performance reasons.
+ *
+ * In order to allow those generic functions to be inlined into multiple
+ * functions in separate translation units, we place them into a "shared" C
+ * file which is included in each of the platform-specific variants.
+ */
+#include "crypto_aesctr_shared.c"
+
+/*
+ * Number of 256-bit vectors (each holding two blocks) to encrypt at once.
+ * VAESENC has a latency of several cycles but can be issued every cycle, so
+ * we keep this many independent vectors in flight.
+ */
+#define NVECS 8
+
+/* Encrypt the vectors x[0 .. 7] with one round of AES using round key k. */
+#define VAESENC8(x, k) do {				\
+	x[0] = _mm256_aesenc_epi128(x[0], k);		\
+	x[1] = _mm256_aesenc_epi128(x[1], k);		\
+	x[2] = _mm256_aesenc_epi128(x[2], k);		\
+	x[3] = _mm256_aesenc_epi128(x[3], k);		\
+	x[4] = _mm256_aesenc_epi128(x[4], k);		\
+	x[5] = _mm256_aesenc_epi128(x[5], k);		\
+	x[6] = _mm256_aesenc_epi128(x[6], k);		\
+	x[7] = _mm256_aesenc_epi128(x[7], k);		\
+} while (0)
+
+/* Process multiple whole blocks by generating & using cipherblocks. */
+static void
+crypto_aesctr_vaes_stream_wholeblocks(struct crypto_aesctr * stream,
+    const uint8_t ** inbuf, uint8_t ** outbuf, size_t * buflen)
+{
+	const __m128i * rkeys;
+	__m256i rkeys256[15];
+	__m256i bufavx[NVECS];
+	__m256i inbufavx;
+	__m256i ctr, ctrinc, bswapctr;
+	__m128i bufsse;
+	uint8_t ctrblk[16];
+	uint64_t nonce;
+	uint64_t block_counter;
+	size_t num_blocks;
+	size_t nr;
+	size_t i, j;
+
+	/* Load local variables from stream. */
+	rkeys = crypto_aes_key_rkeys_aesni(stream->key, &nr);
+	block_counter = stream->bytectr / 16;
+
+	/* Sanity check. */
+	assert(nr < 15);
+
+	/* Copy each round key into both halves of a vector. */
+	for (i = 0; i <= nr; i++)
+		rkeys256[i] = _mm256_broadcastsi128_si256(rkeys[i]);
+
+	/*
+	 * Each counter block is the nonce followed by the big-endian block
+	 * counter.  We hold pairs of counter blocks with the block counters
+	 * in native byte order, increment them with 64-bit additions, and
+	 * byte-swap the counter halves before encrypting.
+	 */
+	memcpy(&nonce, stream->pblk, 8);
+	ctr = _mm256_set_epi64x((long long)(block_counter + 1),
+	    (long long)nonce, (long long)block_counter, (long long)nonce);
+	ctrinc = _mm256_set_epi64x(2, 0, 2, 0);
+	bswapctr = _mm256_set_epi8(8, 9, 10, 11, 12, 13, 14, 15,
+	    7, 6, 5, 4, 3, 2, 1, 0, 8, 9, 10, 11, 12, 13, 14, 15,
+	    7, 6, 5, 4, 3, 2, 1, 0);
+
+	/* How many blocks should we process? */
+	num_blocks = (*buflen) / 16;
+
+	/* Process groups of 2 * NVECS blocks. */
+	for (i = 0; i + 2 * NVECS <= num_blocks; i += 2 * NVECS) {
+		/* Prepare counters and perform the initial round. */
+		for (j = 0; j < NVECS; j++) {
+			bufavx[j] = _mm256_shuffle_epi8(ctr, bswapctr);
+			bufavx[j] = _mm256_xor_si256(bufavx[j], rkeys256[0]);
+			ctr = _mm256_add_epi64(ctr, ctrinc);
+		}
+
+		/* Encrypt the cipherblocks. */
+		for (j = 1; j < nr; j++)
+			VAESENC8(bufavx, rkeys256[j]);
+		for (j = 0; j < NVECS; j++)
+			bufavx[j] = _mm256_aesenclast_epi128(bufavx[j],
+			    rkeys256[nr]);
+
+		/* Encrypt the bytes. */
+		for (j = 0; j < NVECS; j++) {
+			inbufavx = _mm256_loadu_si256(
+			    (const __m256i *)(*inbuf));
+			bufavx[j] = _mm256_xor_si256(inbufavx, bufavx[j]);
+			_mm256_storeu_si256((__m256i *)(*outbuf), bufavx[j]);
+			*inbuf += 32;
+			*outbuf += 32;
+		}
+	}
+
+	/* Process any remaining blocks one at a time. */
+	memcpy(ctrblk, stream->pblk, 8);
+	for (; i < num_blocks; i++) {
+		/* Encrypt the cipherblock. */
+		be64enc(&ctrblk[8], block_counter + i);
+		bufsse = _mm_loadu_si128((const __m128i *)ctrblk);
+		bufsse = crypto_aes_encrypt_block_aesni_m128i(bufsse,
+		    stream->key);
+
+		/* Encrypt the byte(s). */
+		bufsse = _mm_xor_si128(
+		    _mm_loadu_si128((const __m128i *)(*inbuf)), bufsse);
+		_mm_storeu_si128((__m128i *)(*outbuf), bufsse);
+		*inbuf += 16;
+		*outbuf += 16;
+	}
+
+	/* Update the overall buffer length. */
+	*buflen -= 16 * num_blocks;
+
+	/* Update variables in stream. */
+	be64enc(stream->pblk + 8, block_counter + num_blocks - 1);
+	stream->bytectr += 16 * num_blocks;
+}
+
+/**
+ * crypto_aesctr_vaes_stream(stream, inbuf, outbuf, buflen):
+ * Generate the next ${buflen} bytes of the AES-CTR stream ${stream} and xor
+ * them with bytes from ${inbuf}, writing the result into ${outbuf}.  If the
+ * buffers ${inbuf} and ${outbuf} overlap, they must be identical.
+ */
+void
+crypto_aesctr_vaes_stream(struct crypto_aesctr * stream, const uint8_t * inbuf,
+    uint8_t * outbuf, size_t buflen)
+{
+
+	/* Process any bytes before we can process a whole block. */
+	if (crypto_aesctr_stream_pre_wholeblock(stream, &inbuf, &outbuf,
+	    &buflen))
+		return;
+
+	/* Process whole blocks of 16 bytes. */
+	if (buflen >= 16)
+		crypto_aesctr_vaes_stream_wholeblocks(stream, &inbuf,
+		    &outbuf, &buflen);
+
+	/* Process any final bytes after finishing all whole blocks. */
+	crypto_aesctr_stream_post_wholeblock(stream, &inbuf, &outbuf, &buflen);
+}
+
+#endif /* CPUSUPPORT_X86_AESNI && CPUSUPPORT_X86_VAES */
@@ -0,0 +1,269 @@
+#include <sys/time.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "chunkify.h"
+#include "crypto.h"
+#include "monoclock.h"
+#include "parsenum.h"
+#include "warnp.h"
+
+/* Chunking parameters, as used by the multitape layer. */
+#define MEANCHUNK	65536
+#define MAXCHUNK	261120
+
+/*
+ * Amount of pseudorandom data to split into chunks; this should be large
+ * enough that the data is not in cache when each write starts.
+ */
+#define DATALEN	(64 * 1024 * 1024)
+
+/* Maximum number of chunks hashed at once by hash_multi. */
+#define HASHBATCH	64
+
+/* Maximum number of chunks in a write. */
+#define MAXCHUNKS	65536
+
+/* Sizes of the writes to test, in bytes. */
+static const size_t perfsizes[] = {65536, 4 * 1024 * 1024};
+static const size_t num_perf = sizeof(perfsizes) / sizeof(perfsizes[0]);
+
+/* Chunks found in the current write. */
+static const uint8_t * chunkbufs[MAXCHUNKS];
+static size_t chunklens[MAXCHUNKS];
+static size_t nchunks;
+
+/* Where in the data the current write starts. */
+static const uint8_t * writebuf;
+
+/* Hash each chunk as soon as the chunkifier finds it. */
+static int
+callback_hash(void * cookie, const uint8_t * buf, size_t buflen)
+{
+	uint8_t hash[32];
+
+	(void)cookie; /* UNUSED */
+
+	return (crypto_hash_data(CRYPTO_KEY_HMAC_CHUNK, buf, buflen, hash));
+}
+
+/*
+ * Record the position and length of each chunk, so that it can be hashed
+ * once the write is complete.  Each write ends with chunkify_end, so the
+ * chunks are consecutive in the data.
+ */
+static int
+callback_record(void * cookie, const uint8_t * buf, size_t buflen)
+{
+
+	(void)cookie; /* UNUSED */
+	(void)buf; /* UNUSED */
+
+	if (nchunks == MAXCHUNKS) {
+		warn0("Too many chunks");
+		return (-1);
+	}
+	chunkbufs[nchunks] = writebuf;
+	chunklens[nchunks] = buflen;
+	writebuf += buflen;
+	nchunks++;
+
+	return (0);
+}
+
+/* Hash the chunks of the current write one at a time. */
+static int
+hash_single(void)
+{
+	uint8_t hash[32];
+	size_t i;
+
+	for (i = 0; i < nchunks; i++) {
+		if (crypto_hash_data(CRYPTO_KEY_HMAC_CHUNK, chunkbufs[i],
+		    chunklens[i], hash))
+			goto err0;
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Hash the chunks of the current write up to HASHBATCH at once. */
+static int
+hash_multi(void)
+{
+	uint8_t hashes[HASHBATCH][32];
+	size_t i, n;
+
+	for (i = 0; i < nchunks; i += n) {
+		n = nchunks - i;
+		if (n > HASHBATCH)
+			n = HASHBATCH;
+		if (crypto_hash_data_multi(CRYPTO_KEY_HMAC_CHUNK,
+		    &chunkbufs[i], &chunklens[i], n, hashes))
+			goto err0;
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Fill ${buf} with ${buflen} bytes of (non-cryptographic) noise. */
+static void
+fillbuf(uint8_t * buf, size_t buflen)
+{
+	uint64_t x = 1;
+	size_t i;
+
+	for (i = 0; i < buflen; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		buf[i] = (uint8_t)(x >> 32);
+	}
+}
+
+/*
+ * Split ${total} bytes taken from ${buf} into chunks with the chunkifier
+ * ${c}, in writes of ${writelen} bytes, each ending with chunkify_end as the
+ * worker threads in multitape_write.c do.  After each write, call ${hashfunc}
+ * unless it is NULL.  Print the throughput under the name ${name}.
+ */
+static int
+perftest(CHUNKIFIER * c, const uint8_t * buf, size_t total, size_t writelen,
+    int (* hashfunc)(void), const char * name)
+{
+	struct timeval begin, end;
+	size_t done, pos;
+	double delta_s;
+
+	/* Get the start time. */
+	if (monoclock_get_cputime(&begin))
+		goto err0;
+
+	/* Chunkify and hash the data. */
+	for (done = pos = 0; done < total; done += writelen) {
+		if (pos + writelen > DATALEN)
+			pos = 0;
+		writebuf = &buf[pos];
+		nchunks = 0;
+		if (chunkify_write(c, &buf[pos], writelen))
+			goto err0;
+		if (chunkify_end(c))
+			goto err0;
+		if ((hashfunc != NULL) && (hashfunc)())
+			goto err0;
+		pos += writelen;
+	}
+
+	/* Get the end time. */
+	if (monoclock_get_cputime(&end))
+		goto err0;
+
+	/* Print the results. */
+	delta_s = timeval_diff(begin, end);
+	printf("%zu-byte writes, %s:\t%.3f s\t%.1f MB/s\n", writelen, name,
+	    delta_s, (double)total / delta_s / 1000000.0);
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+int
+main(int argc, char * argv[])
+{
+	CHUNKIFIER * c_hash;
+	CHUNKIFIER * c_record;
+	uint8_t * buf;
+	size_t total = 512;
+	size_t i;
+
+	WARNP_INIT;
+
+	/* Parse command line. */
+	if (argc > 2) {
+		fprintf(stderr, "usage: test_chunkhash [MB]\n");
+		goto err0;
+	}
+	if ((argc == 2) && PARSENUM(&total, argv[1], 1, 65536)) {
+		warnp("Invalid amount of data: %s", argv[1]);
+		goto err0;
+	}
+	total *= 1024 * 1024;
+
+	/* We need the chunkifier parameters and the chunk HMAC key. */
+	if (crypto_keys_init())
+		goto err0;
+	if (crypto_keys_generate(CRYPTO_KEYMASK_HMAC_CPARAMS |
+	    CRYPTO_KEYMASK_HMAC_CHUNK))
+		goto err0;
+
+	/* Create the data. */
+	if ((buf = malloc(DATALEN)) == NULL) {
+		warnp("malloc");
+		goto err0;
+	}
+	fillbuf(buf, DATALEN);
+
+	/* Create chunkifiers. */
+	if ((c_hash = chunkify_init(MEANCHUNK, MAXCHUNK, callback_hash,
+	    NULL)) == NULL) {
+		warnp("chunkify_init");
+		goto err1;
+	}
+	if ((c_record = chunkify_init(MEANCHUNK, MAXCHUNK, callback_record,
+	    NULL)) == NULL) {
+		warnp("chunkify_init");
+		goto err2;
+	}
+
+	/* Report how many buffers we can hash in parallel. */
+	printf("crypto_hash_multi_lanes: %zu\n", crypto_hash_multi_lanes());
+
+	/* Time each way of hashing the chunks, for each write size. */
+	for (i = 0; i < num_perf; i++) {
+		if (perftest(c_record, buf, total, perfsizes[i], NULL,
+		    "chunkify only") ||
+		    perftest(c_hash, buf, total, perfsizes[i], NULL,
+		    "hash in callback") ||
+		    perftest(c_record, buf, total, perfsizes[i], hash_single,
+		    "hash after write") ||
+		    perftest(c_record, buf, total, perfsizes[i], hash_multi,
+		    "hash after write, batched")) {
+			warnp("perftest");
+			goto err3;
+		}
+	}
+
+	/* Clean up. */
+	chunkify_free(c_record);
+	chunkify_free(c_hash);
+	free(buf);
+
+	/* Success! */
+	exit(0);
+
+err3:
+	chunkify_free(c_record);
+err2:
+	chunkify_free(c_hash);
+err1:
+	free(buf);
+err0:
+	/* Failure! */
+	exit(1);
+}
@@ -0,0 +1,158 @@
+#include <sys/time.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "chunkify.h"
+#include "crypto.h"
+#include "monoclock.h"
+#include "parsenum.h"
+#include "warnp.h"
+
+/* Chunking parameters, as used by the multitape layer. */
+#define MEANCHUNK	65536
+#define MAXCHUNK	261120
+
+/* Amount of pseudorandom data to draw the "files" from. */
+#define DATALEN	(1024 * 1024)
+
+/* Maximum file sizes to test, in bytes. */
+static const size_t perfsizes[] = {256, 1024, 4096, 16384};
+static const size_t num_perf = sizeof(perfsizes) / sizeof(perfsizes[0]);
+
+/* Do nothing with the chunks. */
+static int
+callback_nothing(void * cookie, const uint8_t * buf, size_t buflen)
+{
+
+	(void)cookie; /* UNUSED */
+	(void)buf; /* UNUSED */
+	(void)buflen; /* UNUSED */
+
+	return (0);
+}
+
+/* Fill ${buf} with ${buflen} bytes of (non-cryptographic) noise. */
+static void
+fillbuf(uint8_t * buf, size_t buflen)
+{
+	uint64_t x = 1;
+	size_t i;
+
+	for (i = 0; i < buflen; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		buf[i] = (uint8_t)(x >> 32);
+	}
+}
+
+/*
+ * Chunkify ${nfiles} files of 0 to ${maxlen} - 1 bytes taken from ${buf},
+ * ending each one with chunkify_end as multitape_write.c does at the end of
+ * an archive entry, and print the time taken.
+ */
+static int
+perftest(CHUNKIFIER * c, const uint8_t * buf, size_t maxlen, size_t nfiles)
+{
+	struct timeval begin, end;
+	uint64_t x = 1;
+	size_t i, pos, len;
+	double delta_s;
+
+	/* Get the start time. */
+	if (monoclock_get_cputime(&begin))
+		goto err0;
+
+	/* Chunkify the files. */
+	for (i = 0; i < nfiles; i++) {
+		x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+		len = (size_t)(x >> 33) % maxlen;
+		pos = (size_t)(x >> 13) % (DATALEN - len);
+		if (chunkify_write(c, &buf[pos], len))
+			goto err0;
+		if (chunkify_end(c))
+			goto err0;
+	}
+
+	/* Get the end time. */
+	if (monoclock_get_cputime(&end))
+		goto err0;
+
+	/* Print the results. */
+	delta_s = timeval_diff(begin, end);
+	printf("%zu files of 0-%zu bytes:\t%.3f s\t%.0f files/s\n", nfiles,
+	    maxlen - 1, delta_s, (double)nfiles / delta_s);
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+int
+main(int argc, char * argv[])
+{
+	CHUNKIFIER * c;
+	uint8_t * buf;
+	size_t nfiles = 1000000;
+	size_t i;
+
+	WARNP_INIT;
+
+	/* Parse command line. */
+	if (argc > 2) {
+		fprintf(stderr, "usage: test_chunkify [nfiles]\n");
+		goto err0;
+	}
+	if ((argc == 2) && PARSENUM(&nfiles, argv[1], 1, SIZE_MAX)) {
+		warnp("Invalid number of files: %s", argv[1]);
+		goto err0;
+	}
+
+	/* The chunkifier parameters are derived from this key. */
+	if (crypto_keys_init())
+		goto err0;
+	if (crypto_keys_generate(CRYPTO_KEYMASK_HMAC_CPARAMS))
+		goto err0;
+
+	/* Create the data. */
+	if ((buf = malloc(DATALEN)) == NULL) {
+		warnp("malloc");
+		goto err0;
+	}
+	fillbuf(buf, DATALEN);
+
+	/* Create a chunkifier. */
+	if ((c = chunkify_init(MEANCHUNK, MAXCHUNK, callback_nothing,
+	    NULL)) == NULL) {
+		warnp("chunkify_init");
+		goto err1;
+	}
+
+	/* Time chunkifying files of each maximum size. */
+	for (i = 0; i < num_perf; i++) {
+		if (perftest(c, buf, perfsizes[i], nfiles)) {
+			warnp("perftest");
+			goto err2;
+		}
+	}
+
+	/* Clean up. */
+	chunkify_free(c);
+	free(buf);
+
+	/* Success! */
+	exit(0);
+
+err2:
+	chunkify_free(c);
+err1:
+	free(buf);
+err0:
+	/* Failure! */
+	exit(1);
+}
@@ -0,0 +1,260 @@
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "asprintf.h"
+#include "monoclock.h"
+#include "parsenum.h"
+#include "sha256.h"
+#include "sysendian.h"
+#include "tarsnap_opt.h"
+#include "warnp.h"
+
+#include "chunks_internal.h"
+
+/* Options used by the chunk directory and statistics code. */
+int tarsnap_opt_humanize_numbers = 0;
+int tarsnap_opt_worker_threads = 1;
+uint64_t tarsnap_opt_directory_memlimit = (uint64_t)(-1);
+
+/* Number of chunks in the directory we create. */
+#define NCHUNKS	2000000
+
+/* Number of existing chunks to look up, and of new chunks to insert. */
+#define NOPS	1000000
+
+/* Compute the (fake) HMAC of chunk number ${i}. */
+static void
+chunkhash(size_t i, uint8_t hash[32])
+{
+	uint8_t buf[8];
+
+	le64enc(buf, (uint64_t)i);
+	SHA256_Buf(buf, 8, hash);
+}
+
+/* Fill in plausible metadata for a new chunk number ${i}. */
+static void
+chunkdata(size_t i, struct chunkdata * ch)
+{
+
+	ch->len = (uint32_t)(30000 + i % 60000);
+	ch->zlen_flags = (uint32_t)(20000 + i % 40000) | CHDATA_CTAPE;
+	ch->nrefs = 1;
+	ch->ncopies = 1;
+}
+
+/* Create a directory of NCHUNKS chunks in ${cachepath}. */
+static int
+create(const char * cachepath)
+{
+	struct timeval begin, end;
+	CHUNKS_DIR * D;
+	struct chunkstats stats_unique, stats_all, stats_extra;
+	struct chunkdata ch;
+	uint8_t hash[32];
+	size_t i;
+
+	/* Get the start time. */
+	if (monoclock_get(&begin))
+		goto err0;
+
+	/* Open an empty directory. */
+	if ((D = chunks_directory_open(cachepath, &stats_unique, &stats_all,
+	    &stats_extra, 0, 0)) == NULL)
+		goto err0;
+
+	/* Add the chunks. */
+	for (i = 0; i < NCHUNKS; i++) {
+		chunkhash(i, hash);
+		chunkdata(i, &ch);
+		if (chunks_directory_insert(D, hash, &ch))
+			goto err1;
+	}
+
+	/* Write out the directory and commit it. */
+	if (chunks_directory_save(D, cachepath, &stats_extra, ".tmp"))
+		goto err1;
+	chunks_directory_close(D);
+	if (chunks_directory_commit(cachepath, ".tmp", ""))
+		goto err0;
+	if (chunks_directory_prune(cachepath))
+		goto err0;
+
+	/* Get the end time. */
+	if (monoclock_get(&end))
+		goto err0;
+
+	/* Print the results. */
+	printf("created a directory of %d chunks in %.1f s\n", NCHUNKS,
+	    timeval_diff(begin, end));
+
+	/* Success! */
+	return (0);
+
+err1:
+	chunks_directory_close(D);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Look up NOPS random chunks in the directory in ${cachepath}, adding a
+ * reference to each as chunks_write does, and insert NOPS new chunks.  Save
+ * the resulting directory (without committing it), and print the time taken
+ * and the peak memory usage.
+ */
+static int
+perftest(const char * cachepath)
+{
+	struct timeval begin, mid, end;
+	struct rusage ru;
+	CHUNKS_DIR * D;
+	struct chunkstats stats_unique, stats_all, stats_extra;
+	struct chunkdata chn;
+	struct chunkdata * ch;
+	uint8_t hash[32];
+	uint64_t x = 1;
+	size_t i;
+	char * s;
+
+	/* Get the start time. */
+	if (monoclock_get(&begin))
+		goto err0;
+
+	/* Open the directory. */
+	if ((D = chunks_directory_open(cachepath, &stats_unique, &stats_all,
+	    &stats_extra, 1, 0)) == NULL)
+		goto err0;
+
+	/* Look up existing chunks and insert new ones. */
+	for (i = 0; i < NOPS; i++) {
+		x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+		chunkhash((size_t)(x >> 33) % NCHUNKS, hash);
+		if (chunks_directory_find(D, hash, &ch))
+			goto err1;
+		if (ch == NULL) {
+			warn0("chunk is missing");
+			goto err1;
+		}
+		ch->ncopies += 1;
+		if ((ch->zlen_flags & CHDATA_CTAPE) == 0) {
+			ch->nrefs += 1;
+			ch->zlen_flags |= CHDATA_CTAPE;
+		}
+
+		chunkhash(NCHUNKS + i, hash);
+		chunkdata(NCHUNKS + i, &chn);
+		if (chunks_directory_insert(D, hash, &chn))
+			goto err1;
+	}
+
+	/* Get the time before saving. */
+	if (monoclock_get(&mid))
+		goto err1;
+
+	/* Write out the directory, but don't commit it. */
+	if (chunks_directory_save(D, cachepath, &stats_extra, ".tmp"))
+		goto err1;
+	chunks_directory_close(D);
+
+	/* Get the end time and peak memory usage. */
+	if (monoclock_get(&end))
+		goto err0;
+	if (getrusage(RUSAGE_SELF, &ru)) {
+		warnp("getrusage");
+		goto err0;
+	}
+
+	/* Print the results; ru_maxrss is in kB on most systems. */
+	printf("%.0f ops/s\tsave %.1f s\tpeak RSS %ld kB\n",
+	    2.0 * NOPS / timeval_diff(begin, mid), timeval_diff(mid, end),
+	    (long)ru.ru_maxrss);
+
+	/* Remove the directory we wrote. */
+	if (asprintf(&s, "%s/directory.tmp", cachepath) == -1) {
+		warnp("asprintf");
+		goto err0;
+	}
+	if (unlink(s)) {
+		warnp("unlink(%s)", s);
+		free(s);
+		goto err0;
+	}
+	free(s);
+
+	/* Success! */
+	return (0);
+
+err1:
+	chunks_directory_close(D);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+int
+main(int argc, char * argv[])
+{
+	struct stat sb;
+	uint64_t memlimit;
+	char * s;
+
+	WARNP_INIT;
+
+	/* Parse command line. */
+	if ((argc < 2) || (argc > 3)) {
+		fprintf(stderr, "usage: test_chunks_directory cachedir [MB]\n");
+		goto err0;
+	}
+	if (argc == 3) {
+		if (PARSENUM(&memlimit, argv[2], 1, 1048576)) {
+			warnp("Invalid memory limit: %s", argv[2]);
+			goto err0;
+		}
+		tarsnap_opt_directory_memlimit = memlimit * 1024 * 1024;
+	}
+
+	/*
+	 * Create the directory if it doesn't exist yet.  This takes a lot
+	 * of memory, so we stop there; running us again measures the peak
+	 * memory usage of the transaction alone.
+	 */
+	if (asprintf(&s, "%s/directory", argv[1]) == -1) {
+		warnp("asprintf");
+		goto err0;
+	}
+	if (stat(s, &sb)) {
+		if (errno != ENOENT) {
+			warnp("stat(%s)", s);
+			goto err1;
+		}
+		tarsnap_opt_directory_memlimit = (uint64_t)(-1);
+		if (create(argv[1]))
+			goto err1;
+		free(s);
+		exit(0);
+	}
+	free(s);
+
+	/* Time a transaction. */
+	if (perftest(argv[1]))
+		goto err0;
+
+	/* Success! */
+	exit(0);
+
+err1:
+	free(s);
+err0:
+	/* Failure! */
+	exit(1);
+}
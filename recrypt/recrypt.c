@@ -43,8 +43,10 @@ static const int KEYMASK_OLD_KEYFILE = (CRYPTO_KEYMASK_SIGN_PUB
 int tarsnap_opt_aggressive_networking = 1;
 int tarsnap_opt_noisy_warnings = 0;
 int tarsnap_opt_humanize_numbers = 0;
+int tarsnap_opt_worker_threads = 1;
 uint64_t tarsnap_opt_checkpointbytes = (uint64_t)(-1);
 uint64_t tarsnap_opt_maxbytesout = (uint64_t)(-1);
+uint64_t tarsnap_opt_directory_memlimit = (uint64_t)(-1);
 
 struct block {
 	char class;
@@ -94,6 +94,10 @@ int tarsnap_opt_humanize_numbers = 0;
 int tarsnap_opt_noisy_warnings = 0;
 uint64_t tarsnap_opt_checkpointbytes = (uint64_t)(-1);
 uint64_t tarsnap_opt_maxbytesout = (uint64_t)(-1);
+int tarsnap_opt_worker_threads = 1;
+int tarsnap_opt_chunk_segments = 0;
+int tarsnap_opt_compression_level = 9;
+uint64_t tarsnap_opt_directory_memlimit = (uint64_t)(-1);
 
 /* Structure for holding a delayed option. */
 struct delayedopt {
@@ -433,6 +437,15 @@ main(int argc, char **argv)
 		case OPTION_CHROOT: /* NetBSD */
 			bsdtar->option_chroot = 1;
 			break;
+		case OPTION_CHUNK_SEGMENTS: /* tarsnap */
+			optq_push(bsdtar, "chunk-segments", bsdtar->optarg);
+			break;
+		case OPTION_COMPRESSION_LEVEL: /* tarsnap */
+			optq_push(bsdtar, "compression-level", bsdtar->optarg);
+			break;
+		case OPTION_COMPRESSION_POLICY: /* tarsnap */
+			optq_push(bsdtar, "compression-policy", bsdtar->optarg);
+			break;
 		case OPTION_CONFIGFILE:
 			bsdtar->configfiles[bsdtar->nconfigfiles++] =
 			    bsdtar->optarg;
@@ -463,6 +476,9 @@ main(int argc, char **argv)
 		case OPTION_DUMP_CONFIG: /* tarsnap */
 			/* Do nothing; already handled. */
 			break;
+		case OPTION_DIRECTORY_MEMLIMIT: /* tarsnap */
+			optq_push(bsdtar, "directory-memlimit", bsdtar->optarg);
+			break;
 		case OPTION_DISK_PAUSE: /* tarsnap */
 			optq_push(bsdtar, "disk-pause", bsdtar->optarg);
 			break;
@@ -639,6 +655,12 @@ main(int argc, char **argv)
 		case OPTION_NO_AGGRESSIVE_NETWORKING:
 			optq_push(bsdtar, "no-aggressive-networking", NULL);
 			break;
+		case OPTION_NO_CHUNK_SEGMENTS:
+			optq_push(bsdtar, "no-chunk-segments", NULL);
+			break;
+		case OPTION_NO_COMPRESSION_LEVEL:
+			optq_push(bsdtar, "no-compression-level", NULL);
+			break;
 		case OPTION_NO_CONFIG_EXCLUDE:
 			optq_push(bsdtar, "no-config-exclude", NULL);
 			break;
@@ -648,6 +670,9 @@ main(int argc, char **argv)
 		case OPTION_NO_DEFAULT_CONFIG:
 			bsdtar->option_no_default_config = 1;
 			break;
+		case OPTION_NO_DIRECTORY_MEMLIMIT:
+			optq_push(bsdtar, "no-directory-memlimit", NULL);
+			break;
 		case OPTION_NO_DISK_PAUSE:
 			optq_push(bsdtar, "no-disk-pause", NULL);
 			break;
@@ -708,6 +733,9 @@ main(int argc, char **argv)
 		case OPTION_NO_TOTALS:
 			optq_push(bsdtar, "no-totals", NULL);
 			break;
+		case OPTION_NO_WORKER_THREADS:
+			optq_push(bsdtar, "no-worker-threads", NULL);
+			break;
 		case OPTION_NUKE: /* tarsnap */
 			set_mode(bsdtar, opt, "--nuke");
 			break;
@@ -824,6 +852,9 @@ main(int argc, char **argv)
 		case OPTION_VERYLOWMEM: /* tarsnap */
 			optq_push(bsdtar, "verylowmem", NULL);
 			break;
+		case OPTION_WORKER_THREADS: /* tarsnap */
+			optq_push(bsdtar, "worker-threads", bsdtar->optarg);
+			break;
 #if 0
 		/*
 		 * The -W longopt feature is handled inside of
@@ -1667,6 +1698,7 @@ dooption(struct bsdtar *bsdtar, const char * conf_opt,
 	struct stat st;
 	const char * str;
 	char *eptr;
+	long lval;
 
 	if (strcmp(conf_opt, "aggressive-networking") == 0) {
 		if (bsdtar->mode != 'c')
@@ -1699,6 +1731,68 @@ dooption(struct bsdtar *bsdtar, const char * conf_opt,
 		if (tarsnap_opt_checkpointbytes < 1000000)
 			bsdtar_errc(bsdtar, 1, 0,
 			    "checkpoint-bytes value must be at least 1M");
+	} else if (strcmp(conf_opt, "chunk-segments") == 0) {
+		if (bsdtar->mode != 'c')
+			goto badmode;
+		if (bsdtar->option_chunk_segments_set)
+			goto optset;
+		if (conf_arg == NULL)
+			goto needarg;
+
+		lval = strtol(conf_arg, &eptr, 10);
+		if ((*conf_arg == '\0') || (*eptr != '\0') ||
+		    (lval < 1) || (lval > 64))
+			bsdtar_errc(bsdtar, 1, 0,
+			    "chunk-segments value must be between 1 and 64");
+		tarsnap_opt_chunk_segments = (int)lval;
+		bsdtar->option_chunk_segments_set = 1;
+	} else if (strcmp(conf_opt, "compression-level") == 0) {
+		if (bsdtar->mode != 'c')
+			goto badmode;
+		if (bsdtar->option_compression_level_set)
+			goto optset;
+		if (conf_arg == NULL)
+			goto needarg;
+
+		lval = strtol(conf_arg, &eptr, 10);
+		if ((*conf_arg == '\0') || (*eptr != '\0') ||
+		    (lval < 0) || (lval > 9))
+			bsdtar_errc(bsdtar, 1, 0,
+			    "compression-level value must be between 0 and 9");
+		tarsnap_opt_compression_level = (int)lval;
+		bsdtar->option_compression_level_set = 1;
+	} else if (strcmp(conf_opt, "compression-policy") == 0) {
+		if (bsdtar->mode != 'c')
+			goto badmode;
+		if (conf_arg == NULL)
+			goto needarg;
+
+		/* The argument is LEVEL:PATTERN. */
+		lval = strtol(conf_arg, &eptr, 10);
+		if ((eptr == conf_arg) || (*eptr != ':') ||
+		    (lval < 0) || (lval > 9) || (eptr[1] == '\0'))
+			bsdtar_errc(bsdtar, 1, 0,
+			    "compression-policy must be of the form"
+			    " LEVEL:PATTERN with LEVEL between 0 and 9");
+		if (compress_pattern(bsdtar, (int)lval, &eptr[1]))
+			bsdtar_errc(bsdtar, 1, 0,
+			    "Couldn't add compression policy %s", conf_arg);
+	} else if (strcmp(conf_opt, "directory-memlimit") == 0) {
+		if ((bsdtar->mode != 'c') && (bsdtar->mode != 'd'))
+			goto badmode;
+		if (bsdtar->option_directory_memlimit_set)
+			goto optset;
+		if (conf_arg == NULL)
+			goto needarg;
+
+		if (humansize_parse(conf_arg, &tarsnap_opt_directory_memlimit))
+			bsdtar_errc(bsdtar, 1, 0,
+			    "Cannot parse directory memory limit: %s",
+			    conf_arg);
+		if (tarsnap_opt_directory_memlimit < 1000000)
+			bsdtar_errc(bsdtar, 1, 0,
+			    "directory-memlimit value must be at least 1M");
+		bsdtar->option_directory_memlimit_set = 1;
 	} else if (strcmp(conf_opt, "disk-pause") == 0) {
 		if (bsdtar->mode != 'c')
 			goto badmode;
@@ -1843,6 +1937,16 @@ dooption(struct bsdtar *bsdtar, const char * conf_opt,
 			goto optset;
 
 		bsdtar->option_aggressive_networking_set = 1;
+	} else if (strcmp(conf_opt, "no-chunk-segments") == 0) {
+		if (bsdtar->option_chunk_segments_set)
+			goto optset;
+
+		bsdtar->option_chunk_segments_set = 1;
+	} else if (strcmp(conf_opt, "no-compression-level") == 0) {
+		if (bsdtar->option_compression_level_set)
+			goto optset;
+
+		bsdtar->option_compression_level_set = 1;
 	} else if (strcmp(conf_opt, "no-config-exclude") == 0) {
 		if (bsdtar->option_no_config_exclude)
 			goto optset;
@@ -1853,6 +1957,11 @@ dooption(struct bsdtar *bsdtar, const char * conf_opt,
 			goto optset;
 
 		bsdtar->option_no_config_include = 1;
+	} else if (strcmp(conf_opt, "no-directory-memlimit") == 0) {
+		if (bsdtar->option_directory_memlimit_set)
+			goto optset;
+
+		bsdtar->option_directory_memlimit_set = 1;
 	} else if (strcmp(conf_opt, "no-disk-pause") == 0) {
 		if (bsdtar->option_disk_pause_set)
 			goto optset;
@@ -1938,6 +2047,11 @@ dooption(struct bsdtar *bsdtar, const char * conf_opt,
 			goto optset;
 
 		bsdtar->option_totals_set = 1;
+	} else if (strcmp(conf_opt, "no-worker-threads") == 0) {
+		if (bsdtar->option_worker_threads_set)
+			goto optset;
+
+		bsdtar->option_worker_threads_set = 1;
 	} else if (strcmp(conf_opt, "passphrase") == 0) {
 		if (bsdtar->option_passphrase_entry != PASSPHRASE_UNSET)
 			goto optset;
@@ -2023,6 +2137,21 @@ dooption(struct bsdtar *bsdtar, const char * conf_opt,
 
 		bsdtar->cachecrunch = 2;
 		bsdtar->option_cachecrunch_set = 1;
+	} else if (strcmp(conf_opt, "worker-threads") == 0) {
+		if (bsdtar->mode != 'c')
+			goto badmode;
+		if (bsdtar->option_worker_threads_set)
+			goto optset;
+		if (conf_arg == NULL)
+			goto needarg;
+
+		lval = strtol(conf_arg, &eptr, 10);
+		if ((*conf_arg == '\0') || (*eptr != '\0') ||
+		    (lval < 1) || (lval > 256))
+			bsdtar_errc(bsdtar, 1, 0,
+			    "worker-threads value must be between 1 and 256");
+		tarsnap_opt_worker_threads = (int)lval;
+		bsdtar->option_worker_threads_set = 1;
 	} else {
 		goto badopt;
 	}
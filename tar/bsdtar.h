@@ -115,6 +115,10 @@ struct bsdtar {
 	int		  option_snaptime_set;
 	int		  option_store_atime_set;
 	int		  option_totals_set;
+	int		  option_worker_threads_set;
+	int		  option_chunk_segments_set;
+	int		  option_compression_level_set;
+	int		  option_directory_memlimit_set;
 	int		  option_no_config_exclude;
 	int		  option_no_config_include;
 	int		  option_no_config_exclude_set;
@@ -204,10 +208,14 @@ enum {
 	OPTION_CHECK_LINKS,
 	OPTION_CHECKPOINT_BYTES,
 	OPTION_CHROOT,
+	OPTION_CHUNK_SEGMENTS,
+	OPTION_COMPRESSION_LEVEL,
+	OPTION_COMPRESSION_POLICY,
 	OPTION_CONFIGFILE,
 	OPTION_CREATIONTIME,
 	OPTION_CSV_FILE,
 	OPTION_DEBUG_NETWORK_STATS,
+	OPTION_DIRECTORY_MEMLIMIT,
 	OPTION_DISK_PAUSE,
 	OPTION_DRYRUN,
 	OPTION_DRYRUN_METADATA,
@@ -241,10 +249,13 @@ enum {
 	OPTION_NOATIME,
 	OPTION_NODUMP,
 	OPTION_NO_AGGRESSIVE_NETWORKING,
+	OPTION_NO_CHUNK_SEGMENTS,
+	OPTION_NO_COMPRESSION_LEVEL,
 	OPTION_NO_NOATIME,
 	OPTION_NO_CONFIG_EXCLUDE,
 	OPTION_NO_CONFIG_INCLUDE,
 	OPTION_NO_DEFAULT_CONFIG,
+	OPTION_NO_DIRECTORY_MEMLIMIT,
 	OPTION_NO_DISK_PAUSE,
 	OPTION_NO_FORCE_RESOURCES,
 	OPTION_NO_HUMANIZE_NUMBERS,
@@ -263,6 +274,7 @@ enum {
 	OPTION_NO_SNAPTIME,
 	OPTION_NO_STORE_ATIME,
 	OPTION_NO_TOTALS,
+	OPTION_NO_WORKER_THREADS,
 	OPTION_NOISY_WARNINGS,
 	OPTION_NORMALMEM,
 	OPTION_NUKE,
@@ -287,7 +299,8 @@ enum {
 	OPTION_TOTALS,
 	OPTION_VERIFY_CONFIG,
 	OPTION_VERSION,
-	OPTION_VERYLOWMEM
+	OPTION_VERYLOWMEM,
+	OPTION_WORKER_THREADS
 };
 
 
@@ -296,6 +309,8 @@ void	bsdtar_errc(struct bsdtar *, int _eval, int _code,
 int	bsdtar_getopt(struct bsdtar *);
 void	bsdtar_warnc(struct bsdtar *, int _code, const char *fmt, ...);
 void	cleanup_exclusions(struct bsdtar *);
+int	compress_level(struct bsdtar *, const char *pathname);
+int	compress_pattern(struct bsdtar *, int level, const char *pattern);
 void	do_chdir(struct bsdtar *);
 int	edit_pathname(struct bsdtar *, struct archive_entry *);
 int	exclude(struct bsdtar *, const char *pattern);
@@ -11,7 +11,9 @@ typedef struct ccache_entry CCACHE_ENTRY;
 /**
  * ccache_read(path):
  * Read the chunkification cache (if present) from the directory ${path};
- * return a Patricia tree mapping absolute paths to cache entries.
+ * return a Patricia tree mapping absolute paths to cache entries.  A cache
+ * file in the current format is mapped, and entries are added to the tree
+ * as they are looked up.
  */
 CCACHE * ccache_read(const char *);
 
@@ -27,6 +29,15 @@ CCACHE * ccache_read(const char *);
 CCACHE_ENTRY * ccache_entry_lookup(CCACHE *, const char *,
     const struct stat *, TAPE_W *, int *);
 
+/**
+ * ccache_entry_isfresh(cache, path, sb):
+ * Return non-zero if the chunkification cache ${cache} has an entry for the
+ * file ${path} which matches the inode number, size, and modification time
+ * in the lstat data ${sb}; i.e., if ccache_entry_lookup might be able to
+ * provide the file without reading it.
+ */
+int ccache_entry_isfresh(CCACHE *, const char *, const struct stat *);
+
 /**
  * ccache_entry_write(cce, cookie):
  * Write the cached archive entry ${cce} to the multitape with write cookie
@@ -61,7 +72,9 @@ void ccache_entry_free(CCACHE_ENTRY *, TAPE_W *);
 
 /**
  * ccache_write(cache, path):
- * Write the given chunkification cache into the directory ${path}.
+ * Write the given chunkification cache into the directory ${path}.  If the
+ * cache was read from a cache file in the current format, this usually
+ * appends the changes to a log instead of writing a new cache file.
  */
 int ccache_write(CCACHE *, const char *);
 
@@ -13,9 +13,11 @@
 
 #include "ccache_internal.h"
 #include "crypto.h"
+#include "mpool.h"
 #include "multitape.h"
 #include "multitape_internal.h"
 #include "patricia.h"
+#include "slab.h"
 #include "sysendian.h"
 #include "tsnetwork.h"
 #include "warnp.h"
@@ -35,10 +37,45 @@ struct ccache_entry {
 	time_t mtime_new;		/* New modification time. */
 };
 
+MPOOL(ccache_entry, struct ccache_entry, 4);
+
+static int lookup(struct ccache_internal *, const char *,
+    struct ccache_record ***);
 static int callback_addchunk(void *, struct chunkheader *);
 static int callback_addtrailer(void *, const uint8_t *, size_t);
 static int callback_faketrailer(void *, const uint8_t *, size_t);
 
+/*
+ * Look up ${path} in the cache ${C}, adding its record to the tree from the
+ * mapped cache file if it hasn't been looked up before; set ${ccrp} to point
+ * to the pointer to the record in the tree, or to NULL if there is none.
+ */
+static int
+lookup(struct ccache_internal * C, const char * path,
+    struct ccache_record *** ccrp)
+{
+	size_t slen = strlen(path);
+
+	/* Is the record already in the tree? */
+	if ((*ccrp = (struct ccache_record **)patricia_lookup(C->tree,
+	    (const uint8_t *)path, slen)) != NULL)
+		goto done;
+
+	/* Look for it in the mapped cache file. */
+	if (ccache_read_find(C, (const uint8_t *)path, slen))
+		goto err0;
+	*ccrp = (struct ccache_record **)patricia_lookup(C->tree,
+	    (const uint8_t *)path, slen);
+
+done:
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
 /* Callback to add a chunk header to a cache entry. */
 static int
 callback_addchunk(void * cookie, struct chunkheader * ch)
@@ -215,7 +252,7 @@ ccache_entry_lookup(CCACHE * cache, const char * path, const struct stat * sb,
 	int rc;
 
 	/* Allocate memory. */
-	if ((cce = malloc(sizeof(struct ccache_entry))) == NULL)
+	if ((cce = mpool_ccache_entry_malloc()) == NULL)
 		goto err0;
 
 	/* Record the cache with which this entry is affiliated. */
@@ -236,12 +273,15 @@ ccache_entry_lookup(CCACHE * cache, const char * path, const struct stat * sb,
 	cce->mtime_new = sb->st_mtime;
 
 	/* Look up cache entry. */
-	if ((cce->ccrp = (struct ccache_record **)patricia_lookup(C->tree,
-	    (const uint8_t *)path, strlen(path))) == NULL) {
+	if (lookup(C, path, &cce->ccrp))
+		goto err1;
+	if (cce->ccrp == NULL) {
 		/* No cache entry for this path.  Create an empty record. */
-		if ((cce->ccr = malloc(sizeof(struct ccache_record))) == NULL)
+		if ((cce->ccr = slab_alloc(C->recs)) == NULL)
 			goto err1;
 		memset(cce->ccr, 0, sizeof(struct ccache_record));
+		cce->ccr->flags = CCR_DIRTY;
+		cce->ccr->ord = CCR_ORD_NONE;
 
 		/* No decompressed trailer. */
 		cce->trailer = NULL;
@@ -349,6 +389,7 @@ ccache_entry_lookup(CCACHE * cache, const char * path, const struct stat * sb,
 		/* We have no compressed trailer. */
 		cce->ccr->ztrailer = NULL;
 		cce->ccr->tlen = cce->ccr->tzlen = 0;
+		cce->ccr->flags |= CCR_DIRTY;
 	}
 
 done:
@@ -362,12 +403,35 @@ done:
 	return (cce);
 
 err1:
-	free(cce);
+	mpool_ccache_entry_free(cce);
 err0:
 	/* Failure! */
 	return (NULL);
 }
 
+/**
+ * ccache_entry_isfresh(cache, path, sb):
+ * Return non-zero if the chunkification cache ${cache} has an entry for the
+ * file ${path} which matches the inode number, size, and modification time
+ * in the lstat data ${sb}; i.e., if ccache_entry_lookup might be able to
+ * provide the file without reading it.
+ */
+int
+ccache_entry_isfresh(CCACHE * cache, const char * path, const struct stat * sb)
+{
+	struct ccache_internal * C = cache;
+	struct ccache_record ** ccrp;
+
+	/* Look up cache entry; if we can't, we can't use it. */
+	if (lookup(C, path, &ccrp) || (ccrp == NULL))
+		return (0);
+
+	/* Is the cache entry fresh? */
+	return (((*ccrp)->ino == sb->st_ino) &&
+	    ((*ccrp)->size == sb->st_size) &&
+	    ((*ccrp)->mtime == sb->st_mtime));
+}
+
 /**
  * ccache_entry_write(cce, cookie):
  * Write the cached archive entry ${cce} to the multitape with write cookie
@@ -551,6 +615,7 @@ ccache_entry_writefile(CCACHE_ENTRY * cce, TAPE_W * cookie,
 	cce->ccr->ino = cce->ino_new;
 	cce->ccr->size = cce->size_new;
 	cce->ccr->mtime = cce->mtime_new;
+	cce->ccr->flags |= CCR_DIRTY;
 
 	/*
 	 * Decide if we want to keep a trailer: We follow the policy provided
@@ -597,16 +662,20 @@ ccache_entry_end(CCACHE * cache, CCACHE_ENTRY * cce, TAPE_W * cookie,
 	 */
 	if ((cce->ino_new != cce->ccr->ino) ||
 	    (cce->size_new != cce->ccr->size) ||
-	    (cce->mtime_new != cce->ccr->mtime))
+	    (cce->mtime_new != cce->ccr->mtime)) {
 		cce->ccr->nch = 0;
+		cce->ccr->flags |= CCR_DIRTY;
+	}
 
 	/*
 	 * If the modification time is equal to or after the snapshot time,
 	 * adjust the modification time to ensure that we will consider this
 	 * file to be "modified" the next time we see it.
 	 */
-	if (cce->ccr->mtime >= snaptime)
+	if (cce->ccr->mtime >= snaptime) {
 		cce->ccr->mtime = snaptime - 1;
+		cce->ccr->flags |= CCR_DIRTY;
+	}
 
 	/* This cache entry is in use and should not be expired yet. */
 	cce->ccr->age = 0;
@@ -626,13 +695,13 @@ ccache_entry_end(CCACHE * cache, CCACHE_ENTRY * cce, TAPE_W * cookie,
 		if (cce->ccrp == NULL) {
 			if (cce->ccr->nchalloc)
 				free(cce->ccr->chp);
-			free(cce->ccr);
+			slab_release(cache->recs, cce->ccr);
 		}
 	}
 
 	/* Free the cache entry cookie. */
 	free(cce->trailer);
-	free(cce);
+	mpool_ccache_entry_free(cce);
 
 	/* Success! */
 	return (0);
@@ -642,9 +711,9 @@ err1:
 		free(cce->ccr->ztrailer);
 	if (cce->ccr->nchalloc)
 		free(cce->ccr->chp);
-	free(cce->ccr);
+	slab_release(cache->recs, cce->ccr);
 	free(cce->trailer);
-	free(cce);
+	mpool_ccache_entry_free(cce);
 
 	/* Failure! */
 	return (-1);
@@ -670,10 +739,10 @@ ccache_entry_free(CCACHE_ENTRY * cce, TAPE_W * cookie)
 			free(cce->ccr->ztrailer);
 		if (cce->ccr->nchalloc)
 			free(cce->ccr->chp);
-		free(cce->ccr);
+		slab_release(cce->cci->recs, cce->ccr);
 	}
 
 	/* Free the cache entry cookie. */
 	free(cce->trailer);
-	free(cce);
+	mpool_ccache_entry_free(cce);
 }
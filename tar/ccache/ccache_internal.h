@@ -7,8 +7,10 @@
 
 #include "ccache.h"
 #include "ctassert.h"
+#include "elasticarray.h"
 #include "multitape.h"
 #include "patricia.h"
+#include "slab.h"
 
 /*
  * Maximum number of times tarsnap can be run without accessing a cache
@@ -16,13 +18,37 @@
  */
 #define MAXAGE	10
 
+/* A segment of the log (see below). */
+struct ccache_segment {
+	size_t	recs;		/* Offset of first record in the log. */
+	size_t	nrecs;		/* Number of records. */
+	size_t	ord;		/* Index of first record. */
+	const uint8_t * bitmap;	/* Records used in that run, or NULL. */
+};
+
+ELASTICARRAY_DECL(SEGLIST, seglist, struct ccache_segment);
+
 /* Cache data structure. */
 struct ccache_internal {
 	PATRICIA *	tree;	/* Tree of ccache_record structures. */
+	SLAB *		recs;	/* Allocator for ccache_record structures. */
 	void *		data;	/* Mmapped data. */
 	size_t		datalen;	/* Size of mmapped data. */
 	size_t		chunksusage;	/* Memory used by chunks. */
 	size_t		trailerusage;	/* Memory used by trailers. */
+
+	/* Records in ${data} which are not yet in the tree, if any. */
+	const struct ccache_block_external * index;	/* Block index. */
+	size_t		nblocks;	/* Number of blocks. */
+	size_t		dataoff;	/* Offset of chunk headers. */
+	size_t		nrecs;		/* Number of records. */
+
+	/* Log of runs since ${data} was written, if any. */
+	void *		log;		/* Mmapped log. */
+	size_t		loglen;		/* Size of mmapped log. */
+	size_t		logvalid;	/* Length of complete segments. */
+	SEGLIST		segs;		/* Complete segments. */
+	size_t		nords;		/* Records in ${data} and segments. */
 };
 
 /* An entry stored in the cache. */
@@ -41,9 +67,12 @@ struct ccache_record {
 	uint8_t * ztrailer;	/* Points to deflated trailer if non-NULL. */
 
 	int	flags;	/* CCR_* flags. */
+	size_t	ord;	/* Index in cache file and log, or CCR_ORD_NONE. */
 };
 
 #define	CCR_ZTRAILER_MALLOC	1
+#define	CCR_DIRTY		2	/* Changed since it was read. */
+#define	CCR_ORD_NONE		SIZE_MAX
 
 /* On-disk data structure.  Integers are little-endian. */
 struct ccache_record_external {
@@ -67,4 +96,126 @@ struct ccache_record_external {
 /* Make sure the compiler isn't padding inappropriately. */
 CTASSERT(sizeof(struct ccache_record_external) == 52);
 
+/*
+ * A cache file in the current format starts with a struct
+ * ccache_header_external, which includes a randomly generated identifier.
+ * The records and path suffixes follow, sorted by path and grouped into
+ * blocks of CCACHE_BLOCKRECS records; the first record in each block has
+ * prefixlen == 0.  Then come the chunk headers and compressed trailers, in
+ * the same order, and finally an index holding a struct
+ * ccache_block_external for each block.  The file is mapped into memory,
+ * and a path is found by a binary search of the blocks on their first paths
+ * followed by a scan of one block; so only records which are looked up are
+ * read into the tree.  A cache file in the original format
+ * (which starts with the number of records) is read in its entirety.
+ */
+#define CCACHE_MAGIC		"tsccche2"
+#define CCACHE_BLOCKRECS	64
+
+/* On-disk header.  Integers are little-endian. */
+struct ccache_header_external {
+	uint8_t	magic[8];
+	uint8_t	id[8];		/* Identifier of cache file. */
+	uint8_t	nrecs[8];
+	uint8_t	nblocks[8];
+	uint8_t	dataoff[8];	/* Offset of chunk headers and trailers. */
+	uint8_t	indexoff[8];	/* Offset of block index. */
+	uint8_t	chunksusage[8];	/* Total size of chunk headers. */
+	uint8_t	trailerusage[8];	/* Total size of trailers. */
+};
+CTASSERT(sizeof(struct ccache_header_external) == 64);
+
+/* On-disk block index entry.  Integers are little-endian. */
+struct ccache_block_external {
+	uint8_t	recoff[8];	/* Offset of first record in block. */
+	uint8_t	dataoff[8];	/* Offset of its chunk headers. */
+};
+CTASSERT(sizeof(struct ccache_block_external) == 16);
+
+/*
+ * Rather than rewriting the cache file after every run, we append a segment
+ * to a log in "cache.log", which starts with a struct ccache_log_external
+ * carrying the identifier of the cache file.  A segment holds the records
+ * which changed in that run, in the format used in the original cache file
+ * except that each record is followed immediately by its chunk headers and
+ * compressed trailer and that a record with no chunks and no trailer is a
+ * tombstone for a record which was dropped.  A record with prefixlen ==
+ * suffixlen == 0 ends the list; then come a uint64_t count of records which
+ * were used in that run without being changed, and (if that is non-zero) a
+ * bitmap of them, with a bit for each record in the cache file and earlier
+ * segments in order; and finally a uint32_t CRC-32 of the segment.  A
+ * segment which is incomplete is ignored, and the log is truncated before
+ * the next segment is appended.  The log is read into the tree along with
+ * the records in the cache file which are looked up.  A record is as old as
+ * the number of runs since it was last written or marked as used, so ages
+ * don't need to be rewritten.  Once the log is larger than 1/CCACHE_LOGFRAC
+ * of the cache file, a new cache file is written and the log is removed.
+ */
+#define CCACHE_LOG_MAGIC	"tscclog1"
+#define CCACHE_LOGFRAC		8
+
+/* On-disk log header. */
+struct ccache_log_external {
+	uint8_t	magic[8];
+	uint8_t	id[8];		/* Identifier of cache file. */
+};
+CTASSERT(sizeof(struct ccache_log_external) == 16);
+
+/* A position in the records of a mapped cache file. */
+struct ccache_cursor {
+	size_t	block;		/* Block holding the next record. */
+	size_t	ord;		/* Index of the next record. */
+	size_t	pos;		/* Offset of the next record. */
+	size_t	end;		/* Offset of the end of the block's records. */
+	size_t	data;		/* Offset of the next record's data. */
+	size_t	dataend;	/* Offset of the end of the block's data. */
+	uint8_t * sbuf;		/* Path of the last record read. */
+	size_t	sbuflen;	/* Allocation size of sbuf. */
+	size_t	slen;		/* Length of path in sbuf. */
+};
+
+/**
+ * ccache_cursor_init(C, cur):
+ * Initialize ${cur} to point at the first record in the mapped cache file
+ * of the cache ${C}, if any.
+ */
+int ccache_cursor_init(struct ccache_internal *, struct ccache_cursor *);
+
+/**
+ * ccache_cursor_next(C, cur, ccr):
+ * Decode the record at ${cur} in the mapped cache file of the cache ${C}
+ * into ${ccr}, with its chunk headers and trailer pointing into the map,
+ * its current age, and its path in ${cur}->sbuf; and advance ${cur}.
+ * Return 1 if there are no records left, or -1 on error.
+ */
+int ccache_cursor_next(struct ccache_internal *, struct ccache_cursor *,
+    struct ccache_record *);
+
+/**
+ * ccache_cursor_free(cur):
+ * Free memory allocated by the cursor ${cur}.
+ */
+void ccache_cursor_free(struct ccache_cursor *);
+
+/**
+ * ccache_keycmp(a, alen, b, blen):
+ * Compare the paths ${a} and ${b} of lengths ${alen} and ${blen} in the
+ * order in which they appear in a Patricia tree traversal.
+ */
+int ccache_keycmp(const uint8_t *, size_t, const uint8_t *, size_t);
+
+/**
+ * ccache_crc(crc, buf, buflen):
+ * Return the CRC-32 ${crc} updated with the ${buflen} bytes in ${buf}.
+ */
+uint32_t ccache_crc(uint32_t, const uint8_t *, size_t);
+
+/**
+ * ccache_read_find(C, path, slen):
+ * If the path ${path} of length ${slen} is in the mapped cache file of the
+ * cache ${C} and has not expired, add its record to the tree.  Return 0 if
+ * the path was found or not, or -1 on error.
+ */
+int ccache_read_find(struct ccache_internal *, const uint8_t *, size_t);
+
 #endif /* !CCACHE_INTERNAL_H_ */
@@ -11,6 +11,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <zlib.h>
 
 #include "asprintf.h"
 #include "ccache_internal.h"
@@ -23,6 +24,7 @@
 
 /* Cookie structure passed to read_rec and callback_read_data. */
 struct ccache_read_internal {
+	SLAB * recs;	/* Allocator for records. */
 	size_t N;	/* Number of records. */
 	char * s;	/* File name. */
 	FILE * f;	/* File handle. */
@@ -33,12 +35,79 @@ struct ccache_read_internal {
 	uint8_t * data;	/* Mmapped data. */
 };
 
+static int rec_dec(const struct ccache_record_external *,
+    struct ccache_record *, size_t *, size_t *, int);
+static int touched(const struct ccache_segment *, size_t);
+static int age_now(struct ccache_internal *, int, size_t, size_t);
+static int cursor_seek(struct ccache_internal *, struct ccache_cursor *,
+    size_t);
+static int read_map(struct ccache_internal *, struct ccache_read_internal *,
+    const struct ccache_header_external *);
+static int log_next(struct ccache_internal *, struct ccache_cursor *,
+    struct ccache_record *);
+static int seg_scan(struct ccache_internal *, struct ccache_cursor *,
+    struct ccache_segment *);
+static int seg_read(struct ccache_internal *, struct ccache_cursor *,
+    size_t);
+static int read_log(struct ccache_internal *, const char *);
 static struct ccache_record * read_rec(void * cookie);
 static int callback_read_data(void * cookie, uint8_t * s, size_t slen,
     void * rec);
 static int callback_free(void * cookie, uint8_t * s, size_t slen,
     void * rec);
 
+/*
+ * Decode the record ${ccre} into ${ccr}, and its path prefix and suffix
+ * lengths into ${prefixlen} and ${suffixlen}.  Return -1 if the record is
+ * not sane.  If ${tombstones} is non-zero, the record may have no chunks
+ * and no trailer.
+ */
+static int
+rec_dec(const struct ccache_record_external * ccre,
+    struct ccache_record * ccr, size_t * prefixlen, size_t * suffixlen,
+    int tombstones)
+{
+
+	/* Decode record. */
+	ccr->ino = (ino_t)le64dec(ccre->ino);
+	ccr->size = (off_t)le64dec(ccre->size);
+	ccr->mtime = (time_t)le64dec(ccre->mtime);
+	ccr->nch = (size_t)le64dec(ccre->nch);
+	ccr->tlen = le32dec(ccre->tlen);
+	ccr->tzlen = le32dec(ccre->tzlen);
+	*prefixlen = le32dec(ccre->prefixlen);
+	*suffixlen = le32dec(ccre->suffixlen);
+	ccr->age = (int)le32dec(ccre->age);
+
+	/* Zero other fields. */
+	ccr->nchalloc = 0;
+	ccr->chp = NULL;
+	ccr->ztrailer = NULL;
+	ccr->flags = 0;
+	ccr->ord = CCR_ORD_NONE;
+
+	/* Sanity check some fields. */
+#if SIZE_MAX < UINT64_MAX
+	if (le64dec(ccre->nch) > (uint64_t)SIZE_MAX)
+		return (-1);
+#endif
+	if ((*prefixlen == 0 && *suffixlen == 0) ||
+	    (ccr->size < 0) ||
+	    (ccr->nch > SIZE_MAX / sizeof(struct chunkheader)) ||
+	    (ccr->nch == 0 && ccr->tlen == 0 && !tombstones) ||
+	    (ccr->tlen == 0 && ccr->tzlen != 0) ||
+	    (ccr->tlen != 0 && ccr->tzlen == 0) ||
+	    (ccr->age == INT_MAX))
+		return (-1);
+
+	/* The prefix length + suffix length must not overflow. */
+	if (*prefixlen > *prefixlen + *suffixlen)
+		return (-1);
+
+	/* Looks good. */
+	return (0);
+}
+
 /* Read a cache record. */
 static struct ccache_record *
 read_rec(void * cookie)
@@ -59,47 +128,15 @@ read_rec(void * cookie)
 	}
 
 	/* Allocate memory for a record. */
-	if ((ccr = malloc(sizeof(struct ccache_record))) == NULL)
+	if ((ccr = slab_alloc(R->recs)) == NULL)
 		goto err0;
 
-	/* Decode record. */
-	ccr->ino = (ino_t)le64dec(ccre.ino);
-	ccr->size = (off_t)le64dec(ccre.size);
-	ccr->mtime = (time_t)le64dec(ccre.mtime);
-	ccr->nch = (size_t)le64dec(ccre.nch);
-	ccr->tlen = le32dec(ccre.tlen);
-	ccr->tzlen = le32dec(ccre.tzlen);
-	prefixlen = le32dec(ccre.prefixlen);
-	suffixlen = le32dec(ccre.suffixlen);
-	ccr->age = (int)le32dec(ccre.age);
-
-	/* Zero other fields. */
-	ccr->nchalloc = 0;
-	ccr->chp = NULL;
-	ccr->ztrailer = NULL;
-	ccr->flags = 0;
-
-	/* Sanity check some fields. */
-#if SIZE_MAX < UINT64_MAX
-	if (le64dec(ccre.nch) > (uint64_t)SIZE_MAX) {
-		warn0("Cache file is corrupt or too large for this "
-		    "platform: %s", R->s);
-		goto err1;
-	}
-#endif
-	if ((prefixlen == 0 && suffixlen == 0) ||
-	    (ccr->nch > SIZE_MAX / sizeof(struct chunkheader)) ||
-	    (ccr->nch == 0 && ccr->tlen == 0) ||
-	    (ccr->tlen == 0 && ccr->tzlen != 0) ||
-	    (ccr->tlen != 0 && ccr->tzlen == 0) ||
-	    (ccr->age == INT_MAX))
+	/* Decode and sanity check the record. */
+	if (rec_dec(&ccre, ccr, &prefixlen, &suffixlen, 0))
 		goto err2;
 
-	/*
-	 * The prefix length must be <= the length of the previous path; and
-	 * the prefix length + suffix length must not overflow.
-	 */
-	if ((prefixlen > R->slen) || (prefixlen > prefixlen + suffixlen))
+	/* The prefix length must be <= the length of the previous path. */
+	if (prefixlen > R->slen)
 		goto err2;
 
 	/* Make sure we have enough space for the entry path. */
@@ -135,7 +172,7 @@ read_rec(void * cookie)
 err2:
 	warn0("Cache file is corrupt: %s", R->s);
 err1:
-	free(ccr);
+	slab_release(R->recs, ccr);
 err0:
 	/* Failure! */
 	return (NULL);
@@ -167,7 +204,10 @@ callback_read_data(void * cookie, uint8_t * s, size_t slen, void * rec)
 	return (0);
 }
 
-/* Callback to free a ccache_record structure. */
+/*
+ * Callback to free the chunk headers and trailer of a ccache_record
+ * structure; the structure itself is freed along with its slab allocator.
+ */
 static int
 callback_free(void * cookie, uint8_t * s, size_t slen, void * rec)
 {
@@ -185,30 +225,762 @@ callback_free(void * cookie, uint8_t * s, size_t slen, void * rec)
 	if (ccr->flags & CCR_ZTRAILER_MALLOC)
 		free(ccr->ztrailer);
 
-	/* Free cache record. */
-	free(ccr);
+	/* Success! */
+	return (0);
+}
+
+/* Was record ${ord} used, without being changed, in the run of ${seg}? */
+static int
+touched(const struct ccache_segment * seg, size_t ord)
+{
+
+	/* The bitmap covers the records which precede the segment. */
+	if ((seg->bitmap == NULL) || (ord >= seg->ord))
+		return (0);
+	return ((seg->bitmap[ord / 8] >> (ord % 8)) & 1);
+}
+
+/*
+ * Return the current age of record ${ord}, which was written with age ${age}
+ * in segment ${gen} of the log, counting from 1, or in the cache file if
+ * ${gen} is 0.  Any age above MAXAGE + 1 is returned as MAXAGE + 2.
+ */
+static int
+age_now(struct ccache_internal * C, int age, size_t gen, size_t ord)
+{
+	size_t nsegs = seglist_getsize(C->segs);
+	size_t j;
+
+	/* A record which was used in a recent run is that many runs old. */
+	for (j = nsegs; (j > gen) && (nsegs - j <= MAXAGE); j--) {
+		if (touched(seglist_get(C->segs, j - 1), ord))
+			return ((int)(nsegs - j + 1));
+	}
+
+	/* Otherwise, it has aged by one in every run since it was written. */
+	if ((age > MAXAGE + 1) || (nsegs - gen > (size_t)(MAXAGE + 1 - age)))
+		return (MAXAGE + 2);
+	return (age + (int)(nsegs - gen));
+}
+
+/*
+ * Point ${cur} at the first record in block ${b} of the mapped cache file of
+ * the cache ${C}, after checking that the block lies within the file.
+ */
+static int
+cursor_seek(struct ccache_internal * C, struct ccache_cursor * cur, size_t b)
+{
+	const uint8_t * map = C->data;
+	size_t indexoff = (size_t)((const uint8_t *)C->index - map);
+	uint64_t pos, end, data, dataend;
+
+	/* Find where this block and the next one start. */
+	pos = le64dec(C->index[b].recoff);
+	data = le64dec(C->index[b].dataoff);
+	if (b + 1 < C->nblocks) {
+		end = le64dec(C->index[b + 1].recoff);
+		dataend = le64dec(C->index[b + 1].dataoff);
+	} else {
+		end = C->dataoff;
+		dataend = indexoff;
+	}
+
+	/* Blocks are non-empty, and lie within the records and data. */
+	if ((pos < sizeof(struct ccache_header_external)) || (pos >= end) ||
+	    (end > C->dataoff) || (data < C->dataoff) || (data > dataend) ||
+	    (dataend > indexoff)) {
+		warn0("Cache file is corrupt");
+		goto err0;
+	}
+
+	/* Point the cursor at the start of the block. */
+	cur->block = b;
+	cur->ord = b * CCACHE_BLOCKRECS;
+	cur->pos = (size_t)pos;
+	cur->end = (size_t)end;
+	cur->data = (size_t)data;
+	cur->dataend = (size_t)dataend;
+
+	/* The first record in a block has no prefix. */
+	cur->slen = 0;
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * ccache_cursor_init(C, cur):
+ * Initialize ${cur} to point at the first record in the mapped cache file
+ * of the cache ${C}, if any.
+ */
+int
+ccache_cursor_init(struct ccache_internal * C, struct ccache_cursor * cur)
+{
+
+	/* No path yet. */
+	cur->sbuf = NULL;
+	cur->sbuflen = cur->slen = 0;
+
+	/* Without any blocks, there is nothing to read. */
+	if (C->nblocks == 0) {
+		cur->block = cur->ord = 0;
+		cur->pos = cur->end = cur->data = cur->dataend = 0;
+		return (0);
+	}
+
+	/* Start at the first block. */
+	return (cursor_seek(C, cur, 0));
+}
+
+/**
+ * ccache_cursor_next(C, cur, ccr):
+ * Decode the record at ${cur} in the mapped cache file of the cache ${C}
+ * into ${ccr}, with its chunk headers and trailer pointing into the map,
+ * and its path in ${cur}->sbuf; and advance ${cur}.  Return 1 if there are
+ * no records left, or -1 on error.
+ */
+int
+ccache_cursor_next(struct ccache_internal * C, struct ccache_cursor * cur,
+    struct ccache_record * ccr)
+{
+	struct ccache_record_external ccre;
+	uint8_t * map = C->data;
+	size_t prefixlen, suffixlen;
+	size_t chlen;
+	uint8_t * sbuf_new;
+
+	/* Move on to the next block if we've finished this one. */
+	while (cur->pos == cur->end) {
+		/* All of the block's data should belong to its records. */
+		if (cur->data != cur->dataend)
+			goto err1;
+
+		/* Are there any more blocks? */
+		if (cur->block + 1 >= C->nblocks)
+			return (1);
+		if (cursor_seek(C, cur, cur->block + 1))
+			goto err0;
+	}
+
+	/* Decode and sanity check a record. */
+	if (cur->end - cur->pos < sizeof(ccre))
+		goto err1;
+	memcpy(&ccre, map + cur->pos, sizeof(ccre));
+	cur->pos += sizeof(ccre);
+	if (rec_dec(&ccre, ccr, &prefixlen, &suffixlen, 0))
+		goto err1;
+
+	/* The path must fit within the previous path and the block. */
+	if ((prefixlen > cur->slen) || (suffixlen > cur->end - cur->pos))
+		goto err1;
+
+	/* Make sure we have enough space for the entry path. */
+	if (prefixlen + suffixlen > cur->sbuflen) {
+		sbuf_new = realloc(cur->sbuf, prefixlen + suffixlen);
+		if (sbuf_new == NULL)
+			goto err0;
+		cur->sbuf = sbuf_new;
+		cur->sbuflen = prefixlen + suffixlen;
+	}
+
+	/* Copy the entry path suffix. */
+	memcpy(cur->sbuf + prefixlen, map + cur->pos, suffixlen);
+	cur->slen = prefixlen + suffixlen;
+	cur->pos += suffixlen;
+
+	/* The chunk headers and trailer must fit within the block. */
+	chlen = ccr->nch * sizeof(struct chunkheader);
+	if ((chlen > cur->dataend - cur->data) ||
+	    (ccr->tzlen > cur->dataend - cur->data - chlen))
+		goto err1;
+
+	/* Point at chunk headers and compressed trailer, if present. */
+	if (ccr->nch)
+		ccr->chp = (struct chunkheader *)(map + cur->data);
+	cur->data += chlen;
+	if (ccr->tzlen)
+		ccr->ztrailer = map + cur->data;
+	cur->data += ccr->tzlen;
+
+	/* Figure out how old the record is now. */
+	ccr->ord = cur->ord++;
+	ccr->age = age_now(C, ccr->age, 0, ccr->ord);
+
+	/* Success! */
+	return (0);
+
+err1:
+	warn0("Cache file is corrupt");
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * ccache_cursor_free(cur):
+ * Free memory allocated by the cursor ${cur}.
+ */
+void
+ccache_cursor_free(struct ccache_cursor * cur)
+{
+
+	/* Free the path buffer. */
+	free(cur->sbuf);
+}
+
+/**
+ * ccache_keycmp(a, alen, b, blen):
+ * Compare the paths ${a} and ${b} of lengths ${alen} and ${blen} in the
+ * order in which they appear in a Patricia tree traversal.
+ */
+int
+ccache_keycmp(const uint8_t * a, size_t alen, const uint8_t * b, size_t blen)
+{
+	int rc;
+
+	/* Compare the common part; a shorter path sorts first. */
+	if ((rc = memcmp(a, b, (alen < blen) ? alen : blen)) != 0)
+		return (rc);
+	return ((alen > blen) - (alen < blen));
+}
+
+/**
+ * ccache_crc(crc, buf, buflen):
+ * Return the CRC-32 ${crc} updated with the ${buflen} bytes in ${buf}.
+ */
+uint32_t
+ccache_crc(uint32_t crc, const uint8_t * buf, size_t buflen)
+{
+	uInt len;
+
+	/* Feed zlib as much as it can take at once. */
+	while (buflen > 0) {
+		len = (buflen > (1 << 30)) ? (1 << 30) : (uInt)buflen;
+		crc = (uint32_t)crc32(crc, buf, len);
+		buf += len;
+		buflen -= len;
+	}
+
+	return (crc);
+}
+
+/**
+ * ccache_read_find(C, path, slen):
+ * If the path ${path} of length ${slen} is in the mapped cache file of the
+ * cache ${C} and has not expired, add its record to the tree.  Return 0 if
+ * the path was found or not, or -1 on error.
+ */
+int
+ccache_read_find(struct ccache_internal * C, const uint8_t * path,
+    size_t slen)
+{
+	struct ccache_cursor cur;
+	struct ccache_record rec;
+	struct ccache_record * ccr;
+	size_t lo, hi, mid;
+	int rc;
+
+	/* Is there a mapped cache file? */
+	if (C->nblocks == 0)
+		goto done;
+	cur.sbuf = NULL;
+	cur.sbuflen = 0;
+
+	/* Find the first block which starts after ${path}. */
+	for (lo = 0, hi = C->nblocks; lo < hi; ) {
+		mid = lo + (hi - lo) / 2;
+		if (cursor_seek(C, &cur, mid) ||
+		    (ccache_cursor_next(C, &cur, &rec) != 0))
+			goto err1;
+		if (ccache_keycmp(cur.sbuf, cur.slen, path, slen) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	/* If that's the first block, ${path} isn't present. */
+	if (lo == 0)
+		goto notfound;
+
+	/* Scan the previous block. */
+	if (cursor_seek(C, &cur, lo - 1))
+		goto err1;
+	do {
+		if (ccache_cursor_next(C, &cur, &rec) != 0)
+			goto err1;
+		rc = ccache_keycmp(cur.sbuf, cur.slen, path, slen);
+	} while ((rc < 0) && (cur.pos < cur.end));
+
+	/* Is this the right record, and would it have been kept? */
+	if ((rc != 0) || (rec.age > MAXAGE + 1))
+		goto notfound;
+
+	/* Add a copy of the record to the tree. */
+	if ((ccr = slab_alloc(C->recs)) == NULL)
+		goto err1;
+	memcpy(ccr, &rec, sizeof(struct ccache_record));
+	if (patricia_insert(C->tree, path, slen, ccr))
+		goto err2;
+
+notfound:
+	/* Free the path buffer. */
+	ccache_cursor_free(&cur);
+
+done:
+	/* Success! */
+	return (0);
+
+err2:
+	slab_release(C->recs, ccr);
+err1:
+	ccache_cursor_free(&cur);
+
+	/* Failure! */
+	return (-1);
+}
+
+/* Map the cache file ${R}->f in the current format, with header ${hdr}. */
+static int
+read_map(struct ccache_internal * C, struct ccache_read_internal * R,
+    const struct ccache_header_external * hdr)
+{
+	struct stat sb;
+	uint64_t nrecs, nblocks, dataoff, indexoff;
+	uint64_t chunksusage, trailerusage;
+
+	/* Decode the header. */
+	nrecs = le64dec(hdr->nrecs);
+	nblocks = le64dec(hdr->nblocks);
+	dataoff = le64dec(hdr->dataoff);
+	indexoff = le64dec(hdr->indexoff);
+	chunksusage = le64dec(hdr->chunksusage);
+	trailerusage = le64dec(hdr->trailerusage);
+
+	/* How large is the file? */
+	if (fstat(fileno(R->f), &sb)) {
+		warnp("fstat(%s)", R->s);
+		goto err0;
+	}
+
+	/*
+	 * Make sure the header is consistent with itself and the file: the
+	 * records are grouped into blocks, the records, data, and index fit
+	 * into the file in that order, and the data is what the header says.
+	 */
+	if ((nblocks != nrecs / CCACHE_BLOCKRECS +
+	    (nrecs % CCACHE_BLOCKRECS != 0)) ||
+	    (dataoff < sizeof(struct ccache_header_external)) ||
+	    (nrecs > (dataoff - sizeof(struct ccache_header_external)) /
+		sizeof(struct ccache_record_external)) ||
+	    (indexoff < dataoff) ||
+	    ((uint64_t)sb.st_size < indexoff) ||
+	    (nblocks != ((uint64_t)sb.st_size - indexoff) /
+		sizeof(struct ccache_block_external)) ||
+	    (((uint64_t)sb.st_size - indexoff) %
+		sizeof(struct ccache_block_external) != 0) ||
+	    (chunksusage > indexoff - dataoff) ||
+	    (trailerusage != indexoff - dataoff - chunksusage)) {
+		warn0("Cache file is corrupt: %s", R->s);
+		goto err0;
+	}
+#if SIZE_MAX < UINT64_MAX
+	if ((uint64_t)sb.st_size > (uint64_t)SIZE_MAX) {
+		warn0("Cache file is too large for this platform: %s", R->s);
+		goto err0;
+	}
+#endif
+
+	/* Map the entire file into memory. */
+	C->datalen = (size_t)sb.st_size;
+#ifdef HAVE_MMAP
+	if ((C->data = mmap(NULL, C->datalen, PROT_READ,
+#ifdef MAP_NOCORE
+	    MAP_PRIVATE | MAP_NOCORE,
+#else
+	    MAP_PRIVATE,
+#endif
+	    fileno(R->f), 0)) == MAP_FAILED) {
+		warnp("mmap(%s)", R->s);
+		goto err0;
+	}
+#else
+	if ((C->data = malloc(C->datalen)) == NULL)
+		goto err0;
+	if (fseeko(R->f, 0, SEEK_SET)) {
+		warnp("fseeko(%s)", R->s);
+		goto err1;
+	}
+	if (fread(C->data, C->datalen, 1, R->f) != 1) {
+		warnp("fread(%s)", R->s);
+		goto err1;
+	}
+#endif
+
+	/* Records will be read from the map as they are looked up. */
+	C->index = (const struct ccache_block_external *)
+	    ((uint8_t *)C->data + indexoff);
+	C->nblocks = (size_t)nblocks;
+	C->dataoff = (size_t)dataoff;
+	C->nrecs = (size_t)nrecs;
+	C->chunksusage = (size_t)chunksusage;
+	C->trailerusage = (size_t)trailerusage;
+
+	/* Success! */
+	return (0);
+
+#ifndef HAVE_MMAP
+err1:
+	free(C->data);
+#endif
+err0:
+	/* Failure! */
+	C->data = NULL;
+	C->datalen = 0;
+	return (-1);
+}
+
+/*
+ * Decode the record at ${cur} in the log of the cache ${C} into ${ccr}, with
+ * its chunk headers and trailer pointing into the log, and its path in
+ * ${cur}->sbuf; and advance ${cur}.  Return 1 if the record is incomplete
+ * or not sane, or -1 on error.
+ */
+static int
+log_next(struct ccache_internal * C, struct ccache_cursor * cur,
+    struct ccache_record * ccr)
+{
+	struct ccache_record_external ccre;
+	uint8_t * log = C->log;
+	size_t prefixlen, suffixlen;
+	size_t chlen;
+	uint8_t * sbuf_new;
+
+	/* Decode and sanity check a record. */
+	if (cur->end - cur->pos < sizeof(ccre))
+		return (1);
+	memcpy(&ccre, log + cur->pos, sizeof(ccre));
+	cur->pos += sizeof(ccre);
+	if (rec_dec(&ccre, ccr, &prefixlen, &suffixlen, 1))
+		return (1);
+
+	/* The path must fit within the previous path and the log. */
+	if ((prefixlen > cur->slen) || (suffixlen > cur->end - cur->pos))
+		return (1);
+
+	/* Make sure we have enough space for the entry path. */
+	if (prefixlen + suffixlen > cur->sbuflen) {
+		sbuf_new = realloc(cur->sbuf, prefixlen + suffixlen);
+		if (sbuf_new == NULL)
+			return (-1);
+		cur->sbuf = sbuf_new;
+		cur->sbuflen = prefixlen + suffixlen;
+	}
+
+	/* Copy the entry path suffix. */
+	memcpy(cur->sbuf + prefixlen, log + cur->pos, suffixlen);
+	cur->slen = prefixlen + suffixlen;
+	cur->pos += suffixlen;
+
+	/* The chunk headers and trailer follow the path. */
+	chlen = ccr->nch * sizeof(struct chunkheader);
+	if ((chlen > cur->end - cur->pos) ||
+	    (ccr->tzlen > cur->end - cur->pos - chlen))
+		return (1);
+	if (ccr->nch)
+		ccr->chp = (struct chunkheader *)(log + cur->pos);
+	cur->pos += chlen;
+	if (ccr->tzlen)
+		ccr->ztrailer = log + cur->pos;
+	cur->pos += ccr->tzlen;
+
+	/* Success! */
+	return (0);
+}
+
+/*
+ * Check the segment at ${cur} in the log of the cache ${C}, and fill in the
+ * rest of ${seg}, whose first record has index ${seg}->ord; and advance
+ * ${cur} past it.  Return 1 if the segment is incomplete or not sane, or -1
+ * on error.
+ */
+static int
+seg_scan(struct ccache_internal * C, struct ccache_cursor * cur,
+    struct ccache_segment * seg)
+{
+	struct ccache_record_external ccre;
+	struct ccache_record ccr;
+	const uint8_t * log = C->log;
+	size_t start = cur->pos;
+	size_t blen;
+	int rc = 0;
+
+	/* Read records until we reach the end of the list. */
+	seg->recs = start;
+	seg->nrecs = 0;
+	seg->bitmap = NULL;
+	cur->slen = 0;
+	do {
+		if (cur->end - cur->pos < sizeof(ccre))
+			return (1);
+		memcpy(&ccre, log + cur->pos, sizeof(ccre));
+		if ((le32dec(ccre.prefixlen) == 0) &&
+		    (le32dec(ccre.suffixlen) == 0)) {
+			cur->pos += sizeof(ccre);
+			break;
+		}
+		seg->nrecs++;
+	} while ((rc = log_next(C, cur, &ccr)) == 0);
+	if (rc != 0)
+		return (rc);
+
+	/* Find the bitmap of records used in this run, if any. */
+	if (cur->end - cur->pos < 8)
+		return (1);
+	if (le64dec(log + cur->pos) != 0) {
+		blen = seg->ord / 8 + (seg->ord % 8 != 0);
+		if (blen > cur->end - cur->pos - 8)
+			return (1);
+		seg->bitmap = log + cur->pos + 8;
+		cur->pos += blen;
+	}
+	cur->pos += 8;
+
+	/* Check the CRC. */
+	if ((cur->end - cur->pos < 4) || (le32dec(log + cur->pos) !=
+	    ccache_crc(0, log + start, cur->pos - start)))
+		return (1);
+	cur->pos += 4;
 
 	/* Success! */
 	return (0);
 }
 
+/*
+ * Add the records in segment ${i} of the log of the cache ${C} to the tree,
+ * replacing any records for the same paths, using the cursor ${cur}.
+ */
+static int
+seg_read(struct ccache_internal * C, struct ccache_cursor * cur, size_t i)
+{
+	struct ccache_segment * seg = seglist_get(C->segs, i);
+	struct ccache_record rec;
+	struct ccache_record * ccr;
+	struct ccache_record ** ccrp;
+	size_t k;
+
+	/* Go back to the start of the segment. */
+	cur->pos = seg->recs;
+	cur->slen = 0;
+
+	for (k = 0; k < seg->nrecs; k++) {
+		/* Decode a record; we checked it in seg_scan. */
+		if (log_next(C, cur, &rec))
+			goto err0;
+		rec.ord = seg->ord + k;
+		rec.age = age_now(C, rec.age, i + 1, rec.ord);
+
+		/*
+		 * A record which would have been dropped is kept as a
+		 * tombstone, since it replaces any older record.
+		 */
+		if (rec.age > MAXAGE + 1) {
+			rec.ino = 0;
+			rec.size = 0;
+			rec.mtime = 0;
+			rec.nch = rec.tlen = rec.tzlen = 0;
+			rec.chp = NULL;
+			rec.ztrailer = NULL;
+		}
+
+		/* Add the record to the tree, or replace an older record. */
+		if ((ccr = slab_alloc(C->recs)) == NULL)
+			goto err0;
+		memcpy(ccr, &rec, sizeof(struct ccache_record));
+		if ((ccrp = (struct ccache_record **)patricia_lookup(C->tree,
+		    cur->sbuf, cur->slen)) != NULL) {
+			slab_release(C->recs, *ccrp);
+			*ccrp = ccr;
+		} else if (patricia_insert(C->tree, cur->sbuf, cur->slen,
+		    ccr)) {
+			slab_release(C->recs, ccr);
+			goto err0;
+		}
+		C->chunksusage += ccr->nch * sizeof(struct chunkheader);
+		C->trailerusage += ccr->tzlen;
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Read the log of runs since the mapped cache file of ${C} in the directory
+ * ${path} was written, if there is one, and add its records to the tree.
+ */
+static int
+read_log(struct ccache_internal * C, const char * path)
+{
+	const struct ccache_header_external * hdr = C->data;
+	struct ccache_log_external cle;
+	struct ccache_cursor cur;
+	struct ccache_segment seg;
+	struct stat sb;
+	char * s;
+	FILE * f;
+	size_t i;
+	int rc;
+
+	/* No segments yet. */
+	if ((C->segs = seglist_init(0)) == NULL)
+		goto err0;
+	C->nords = C->nrecs;
+
+	/* Construct the name of the log file. */
+	if (asprintf(&s, "%s/cache.log", path) == -1) {
+		warnp("asprintf");
+		goto err0;
+	}
+
+	/* Open the log file. */
+	if ((f = fopen(s, "r")) == NULL) {
+		/* ENOENT isn't an error. */
+		if (errno != ENOENT) {
+			warnp("fopen(%s)", s);
+			goto err1;
+		}
+
+		/* No runs have been logged. */
+		goto done;
+	}
+
+	/* Ignore the log if it doesn't belong to this cache file. */
+	if (fstat(fileno(f), &sb)) {
+		warnp("fstat(%s)", s);
+		goto err2;
+	}
+	if (fread(&cle, sizeof(cle), 1, f) != 1) {
+		if (ferror(f)) {
+			warnp("Error reading cache log: %s", s);
+			goto err2;
+		}
+		goto nolog;
+	}
+	if (memcmp(cle.magic, CCACHE_LOG_MAGIC, sizeof(cle.magic)) ||
+	    memcmp(cle.id, hdr->id, sizeof(cle.id)))
+		goto nolog;
+#if SIZE_MAX < UINT64_MAX
+	if ((uint64_t)sb.st_size > (uint64_t)SIZE_MAX) {
+		warn0("Cache log is too large for this platform: %s", s);
+		goto err2;
+	}
+#endif
+
+	/* Map the log into memory. */
+	C->loglen = (size_t)sb.st_size;
+#ifdef HAVE_MMAP
+	if ((C->log = mmap(NULL, C->loglen, PROT_READ,
+#ifdef MAP_NOCORE
+	    MAP_PRIVATE | MAP_NOCORE,
+#else
+	    MAP_PRIVATE,
+#endif
+	    fileno(f), 0)) == MAP_FAILED) {
+		warnp("mmap(%s)", s);
+		C->log = NULL;
+		goto err2;
+	}
+#else
+	if ((C->log = malloc(C->loglen)) == NULL)
+		goto err2;
+	if (fseeko(f, 0, SEEK_SET)) {
+		warnp("fseeko(%s)", s);
+		goto err2;
+	}
+	if (fread(C->log, C->loglen, 1, f) != 1) {
+		warnp("fread(%s)", s);
+		goto err2;
+	}
+#endif
+
+	/* Find the complete segments. */
+	cur.sbuf = NULL;
+	cur.sbuflen = 0;
+	cur.pos = C->logvalid = sizeof(cle);
+	cur.end = C->loglen;
+	while (cur.pos < cur.end) {
+		seg.ord = C->nords;
+		if ((rc = seg_scan(C, &cur, &seg)) == -1)
+			goto err3;
+		if (rc == 1)
+			break;
+		if (seglist_append(C->segs, &seg, 1))
+			goto err3;
+		C->nords += seg.nrecs;
+		C->logvalid = cur.pos;
+	}
+
+	/* Add their records to the tree. */
+	cur.end = C->logvalid;
+	for (i = 0; i < seglist_getsize(C->segs); i++) {
+		if (seg_read(C, &cur, i))
+			goto err3;
+	}
+
+	/* Free the path buffer. */
+	ccache_cursor_free(&cur);
+
+nolog:
+	/* Close the log file. */
+	if (fclose(f))
+		warnp("fclose");
+
+done:
+	/* Free string allocated by asprintf. */
+	free(s);
+
+	/* Success! */
+	return (0);
+
+err3:
+	ccache_cursor_free(&cur);
+err2:
+	if (fclose(f))
+		warnp("fclose");
+err1:
+	free(s);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
 /**
  * ccache_read(path):
  * Read the chunkification cache (if present) from the directory ${path};
- * return a Patricia tree mapping absolute paths to cache entries.
+ * return a Patricia tree mapping absolute paths to cache entries.  A cache
+ * file in the current format is mapped, and entries are added to the tree
+ * as they are looked up.
  */
 CCACHE *
 ccache_read(const char * path)
 {
 	struct ccache_internal * C;
 	struct ccache_read_internal R;
+	struct ccache_header_external hdr;
 	struct ccache_record * ccr;
 #ifdef HAVE_MMAP
 	struct stat sb;
 	off_t fpos;
 	long int pagesize;
 #endif
-	size_t i;
+	size_t i, hlen;
 	uint8_t N[4];
 
 	/* The caller must pass a file name to be read. */
@@ -223,10 +995,15 @@ ccache_read(const char * path)
 	if ((C->tree = patricia_init()) == NULL)
 		goto err1;
 
+	/* Create an allocator for cache entries. */
+	if ((C->recs = slab_init(sizeof(struct ccache_record))) == NULL)
+		goto err2;
+	R.recs = C->recs;
+
 	/* Construct the name of cache file. */
 	if (asprintf(&R.s, "%s/cache", path) == -1) {
 		warnp("asprintf");
-		goto err2;
+		goto err3;
 	}
 
 	/* Open the cache file. */
@@ -234,15 +1011,36 @@ ccache_read(const char * path)
 		/* ENOENT isn't an error. */
 		if (errno != ENOENT) {
 			warnp("fopen(%s)", R.s);
-			goto err3;
+			goto err4;
 		}
 
 		/* No cache exists on disk; return an empty cache. */
 		goto emptycache;
 	}
 
+	/* Read the header, if the file has one. */
+	hlen = fread(&hdr, 1, sizeof(hdr), R.f);
+	if (ferror(R.f)) {
+		warnp("Error reading cache: %s", R.s);
+		goto err5;
+	}
+
+	/* If the file is in the current format, map it. */
+	if ((hlen == sizeof(hdr)) &&
+	    (memcmp(hdr.magic, CCACHE_MAGIC, sizeof(hdr.magic)) == 0)) {
+		if (read_map(C, &R, &hdr))
+			goto err5;
+		goto done;
+	}
+
+	/* Otherwise, go back to the start of the file. */
+	if (fseeko(R.f, 0, SEEK_SET)) {
+		warnp("fseeko(%s)", R.s);
+		goto err5;
+	}
+
 	/*-
-	 * We read the cache file in three steps:
+	 * We read a cache file in the original format in three steps:
 	 * 1. Read a little-endian uint32_t which indicates the number of
 	 *    records in the cache file.
 	 * 2. Read N (record, path suffix) pairs and insert them into a
@@ -257,7 +1055,7 @@ ccache_read(const char * path)
 			warnp("Error reading cache: %s", R.s);
 		else
 			warn0("Error reading cache: %s", R.s);
-		goto err4;
+		goto err5;
 	}
 	R.N = le32dec(N);
 
@@ -266,9 +1064,9 @@ ccache_read(const char * path)
 	R.sbuflen = R.slen = R.datalen = 0;
 	for (i = 0; i < R.N; i++) {
 		if ((ccr = read_rec(&R)) == NULL)
-			goto err5;
+			goto err6;
 		if (patricia_insert(C->tree, R.sbuf, R.slen, ccr))
-			goto err5;
+			goto err6;
 		C->chunksusage += ccr->nch * sizeof(struct chunkheader);
 		C->trailerusage += ccr->tzlen;
 	}
@@ -277,24 +1075,24 @@ ccache_read(const char * path)
 	/* Obtain page size, since mmapped regions must be page-aligned. */
 	if ((pagesize = sysconf(_SC_PAGESIZE)) == -1) {
 		warnp("sysconf(_SC_PAGESIZE)");
-		goto err5;
+		goto err6;
 	}
 
 	/* Map the remainder of the cache into memory. */
 	fpos = ftello(R.f);
 	if (fpos == -1) {
 		warnp("ftello(%s)", R.s);
-		goto err5;
+		goto err6;
 	}
 	if (fstat(fileno(R.f), &sb)) {
 		warnp("fstat(%s)", R.s);
-		goto err5;
+		goto err6;
 	}
 	if (sb.st_size != fpos + (off_t)R.datalen) {
 		warn0("Cache has incorrect size (%jd, expected %jd)",
 		    (intmax_t)(sb.st_size),
 		    (intmax_t)(fpos + (off_t)R.datalen));
-		goto err5;
+		goto err6;
 	}
 	C->datalen = R.datalen + (size_t)(fpos % pagesize);
 	if ((C->data = mmap(NULL, C->datalen, PROT_READ,
@@ -305,17 +1103,17 @@ ccache_read(const char * path)
 #endif
 	    fileno(R.f), fpos - (fpos % pagesize))) == MAP_FAILED) {
 		warnp("mmap(%s)", R.s);
-		goto err5;
+		goto err6;
 	}
 	R.data = (uint8_t *)C->data + (fpos % pagesize);
 #else
 	/* Allocate space. */
 	C->datalen = R.datalen;
 	if (((C->data = malloc(C->datalen)) == NULL) && (C->datalen > 0))
-		goto err5;
+		goto err6;
 	if (fread(C->data, C->datalen, 1, R.f) != 1) {
 		warnp("fread(%s)", R.s);
-		goto err6;
+		goto err7;
 	}
 	R.data = (uint8_t *)C->data;
 #endif
@@ -323,12 +1121,13 @@ ccache_read(const char * path)
 	/* Iterate through the tree reading chunk headers and trailers. */
 	if (patricia_foreach(C->tree, callback_read_data, &R)) {
 		warnp("Error reading cache: %s", R.s);
-		goto err6;
+		goto err7;
 	}
 
 	/* Free buffer used for storing paths. */
 	free(R.sbuf);
 
+done:
 	/* Close the cache file. */
 	if (fclose(R.f))
 		warnp("fclose");
@@ -336,6 +1135,12 @@ ccache_read(const char * path)
 	/* Free string allocated by asprintf. */
 	free(R.s);
 
+	/* Read the log of runs since a mapped cache file was written. */
+	if ((C->index != NULL) && read_log(C, path)) {
+		ccache_free(C);
+		goto err0;
+	}
+
 	/* Success! */
 	return (C);
 
@@ -344,21 +1149,23 @@ emptycache:
 	free(R.s);
 	return (C);
 
-err6:
+err7:
 #ifdef HAVE_MMAP
 	if (C->datalen > 0)
 		munmap(C->data, C->datalen);
 #else
 	free(C->data);
 #endif
-err5:
+err6:
 	free(R.sbuf);
 	patricia_foreach(C->tree, callback_free, NULL);
-err4:
+err5:
 	if (fclose(R.f))
 		warnp("fclose");
-err3:
+err4:
 	free(R.s);
+err3:
+	slab_free(C->recs);
 err2:
 	patricia_free(C->tree);
 err1:
@@ -383,16 +1190,21 @@ ccache_free(CCACHE * cache)
 	/* Free all of the records in the patricia tree. */
 	patricia_foreach(C->tree, callback_free, NULL);
 
-	/* Free the patricia tree itself. */
+	/* Free the patricia tree itself, and the records. */
 	patricia_free(C->tree);
+	slab_free(C->recs);
 
 	/* Unmap memory. */
 #ifdef HAVE_MMAP
 	if (C->datalen > 0 && munmap(C->data, C->datalen))
 		warnp("munmap failed on cache data");
+	if ((C->log != NULL) && munmap(C->log, C->loglen))
+		warnp("munmap failed on cache log");
 #else
 	free(C->data);
+	free(C->log);
 #endif
+	seglist_free(C->segs);
 
 	/* Free the cache. */
 	free(C);
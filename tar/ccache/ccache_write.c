@@ -12,6 +12,8 @@
 
 #include "asprintf.h"
 #include "ccache_internal.h"
+#include "crypto_entropy.h"
+#include "elasticarray.h"
 #include "fileutil.h"
 #include "multitape_internal.h"
 #include "patricia.h"
@@ -20,21 +22,54 @@
 
 #include "ccache.h"
 
-/* Cookie structure passed to callback_count and callback_write_*. */
+/* Index entries for the blocks of records written so far. */
+ELASTICARRAY_DECL(BLOCKLIST, blocklist, struct ccache_block_external);
+
+/* Cookie structure passed to callback_write, callback_log, and write_*. */
 struct ccache_write_internal {
+	struct ccache_internal * C;	/* Cache being written. */
+	int (* write)(struct ccache_write_internal *, const uint8_t *,
+	    size_t, struct ccache_record *);	/* Function for this pass. */
 	size_t N;	/* Number of records. */
 	char * s;	/* File name. */
 	FILE * f;	/* File handle. */
-	char * sbuf;	/* Contains a NUL-terminated entry path. */
+	uint8_t * sbuf;	/* Contains the previous entry path in this block. */
 	size_t sbuflen;	/* Allocation size of sbuf. */
+	size_t slen;	/* Length of path currently stored in sbuf. */
+	uint64_t recoff;	/* Offset of the next record. */
+	uint64_t datalen;	/* Length of data for records so far. */
+	uint64_t chunksusage;	/* Length of chunk headers so far. */
+	uint64_t trailerusage;	/* Length of trailers so far. */
+	BLOCKLIST blocks;	/* Block index, with data offsets relative */
+				/* to the start of the data. */
+	struct ccache_cursor M;	/* Next record in the mapped cache file. */
+	struct ccache_record mccr;	/* That record, if !mdone. */
+	int mdone;	/* Non-zero if there are no more mapped records. */
+	uint32_t crc;	/* CRC-32 of the log segment so far. */
+	uint8_t * bitmap;	/* Records used in this run. */
+	uint64_t ntouched;	/* Number of bits set in bitmap. */
 };
 
-static int callback_count(void * cookie, uint8_t * s, size_t slen,
-    void * rec);
-static int callback_write_rec(void * cookie, uint8_t * s, size_t slen,
+static void rec_enc(const struct ccache_record *, size_t, size_t,
+    struct ccache_record_external *);
+static size_t prefix(struct ccache_write_internal *, const uint8_t *, size_t);
+static int remember(struct ccache_write_internal *, const uint8_t *, size_t,
+    size_t);
+static int write_rec(struct ccache_write_internal *, const uint8_t *, size_t,
+    struct ccache_record *);
+static int write_data(struct ccache_write_internal *, const uint8_t *,
+    size_t, struct ccache_record *);
+static int merge_upto(struct ccache_write_internal *, const uint8_t *,
+    size_t);
+static int callback_write(void * cookie, uint8_t * s, size_t slen,
     void * rec);
-static int callback_write_data(void * cookie, uint8_t * s, size_t slen,
+static int write_pass(struct ccache_write_internal *);
+static int write_cache(struct ccache_internal *, const char *);
+static int logwrite(struct ccache_write_internal *, const void *, size_t);
+static int callback_log(void * cookie, uint8_t * s, size_t slen,
     void * rec);
+static int append_log(struct ccache_internal *, const char *);
+static int log_remove(const char *);
 
 /* Should we skip this record? */
 static int
@@ -74,59 +109,96 @@ skiprecord(struct ccache_record * ccr)
 	return (0);
 }
 
-/* Callback to count the number of records which will be written. */
-static int
-callback_count(void * cookie, uint8_t * s, size_t slen, void * rec)
+/*
+ * Encode the record ${ccr} for a path of length ${slen} which shares a
+ * prefix of length ${plen} with the previous path into ${ccre}.
+ */
+static void
+rec_enc(const struct ccache_record * ccr, size_t plen, size_t slen,
+    struct ccache_record_external * ccre)
 {
-	struct ccache_write_internal * W = cookie;
-	struct ccache_record * ccr = rec;
 
-	(void)s; /* UNUSED */
-	(void)slen; /* UNUSED */
+	/* Sanity checks. */
+	assert(slen <= UINT32_MAX);
+	assert((ccr->size >= 0) && ((uintmax_t)ccr->size <= UINT64_MAX));
+	assert((uintmax_t)ccr->mtime <= UINT64_MAX);
+	assert((uintmax_t)ccr->ino <= UINT64_MAX);
 
-	/* Count records we're not skipping. */
-	if (!skiprecord(ccr))
-		W->N += 1;
+	/* Convert integers to portable format. */
+	le64enc(ccre->ino, (uint64_t)ccr->ino);
+	le64enc(ccre->size, (uint64_t)ccr->size);
+	le64enc(ccre->mtime, (uint64_t)ccr->mtime);
+	le64enc(ccre->nch, (uint64_t)ccr->nch);
+	le32enc(ccre->tlen, (uint32_t)ccr->tlen);
+	le32enc(ccre->tzlen, (uint32_t)ccr->tzlen);
+	le32enc(ccre->prefixlen, (uint32_t)plen);
+	le32enc(ccre->suffixlen, (uint32_t)(slen - plen));
+	le32enc(ccre->age, (uint32_t)(ccr->age + 1));
+}
+
+/* How much of the path ${s} of length ${slen} is shared with the last? */
+static size_t
+prefix(struct ccache_write_internal * W, const uint8_t * s, size_t slen)
+{
+	size_t plen;
+
+	for (plen = 0; plen < slen && plen < W->slen; plen++) {
+		if (s[plen] != W->sbuf[plen])
+			break;
+	}
+
+	return (plen);
+}
+
+/*
+ * Record the path ${s} of length ${slen}, which shares a prefix of length
+ * ${plen} with the last path, as the last path.
+ */
+static int
+remember(struct ccache_write_internal * W, const uint8_t * s, size_t slen,
+    size_t plen)
+{
+	uint8_t * sbuf_new;
+
+	/* Enlarge last-path buffer if needed. */
+	if (W->sbuflen < slen) {
+		if ((sbuf_new = realloc(W->sbuf, slen)) == NULL)
+			return (-1);
+		W->sbuf = sbuf_new;
+		W->sbuflen = slen;
+	}
+	memcpy(W->sbuf + plen, s + plen, slen - plen);
+	W->slen = slen;
 
 	/* Success! */
 	return (0);
 }
 
-/* Callback to write a record and path suffix to disk. */
+/* Write a record and path suffix to disk. */
 static int
-callback_write_rec(void * cookie, uint8_t * s, size_t slen, void * rec)
+write_rec(struct ccache_write_internal * W, const uint8_t * s, size_t slen,
+    struct ccache_record * ccr)
 {
 	struct ccache_record_external ccre;
-	struct ccache_write_internal * W = cookie;
-	struct ccache_record * ccr = rec;
+	struct ccache_block_external cbe;
 	size_t plen;
 
 	/* Skip records which we don't want stored. */
 	if (skiprecord(ccr))
 		goto done;
 
-	/* Sanity checks. */
-	assert(slen <= UINT32_MAX);
-	assert((ccr->size >= 0) && ((uintmax_t)ccr->size <= UINT64_MAX));
-	assert((uintmax_t)ccr->mtime <= UINT64_MAX);
-	assert((uintmax_t)ccr->ino <= UINT64_MAX);
-
-	/* Figure out how much prefix is shared. */
-	for (plen = 0; plen < slen && plen < W->sbuflen; plen++) {
-		if (s[plen] != (uint8_t)W->sbuf[plen])
-			break;
+	/* Start a new block if necessary; its first path has no prefix. */
+	if (W->N % CCACHE_BLOCKRECS == 0) {
+		le64enc(cbe.recoff, W->recoff);
+		le64enc(cbe.dataoff, W->datalen);
+		if (blocklist_append(W->blocks, &cbe, 1))
+			goto err0;
+		W->slen = 0;
 	}
 
-	/* Convert integers to portable format. */
-	le64enc(ccre.ino, (uint64_t)ccr->ino);
-	le64enc(ccre.size, (uint64_t)ccr->size);
-	le64enc(ccre.mtime, (uint64_t)ccr->mtime);
-	le64enc(ccre.nch, (uint64_t)ccr->nch);
-	le32enc(ccre.tlen, (uint32_t)ccr->tlen);
-	le32enc(ccre.tzlen, (uint32_t)ccr->tzlen);
-	le32enc(ccre.prefixlen, (uint32_t)plen);
-	le32enc(ccre.suffixlen, (uint32_t)(slen - plen));
-	le32enc(ccre.age, (uint32_t)(ccr->age + 1));
+	/* Figure out how much prefix is shared, and encode the record. */
+	plen = prefix(W, s, slen);
+	rec_enc(ccr, plen, slen, &ccre);
 
 	/* Write cache entry header to disk. */
 	if (fwrite(&ccre, sizeof(ccre), 1, W->f) != 1)
@@ -136,18 +208,17 @@ callback_write_rec(void * cookie, uint8_t * s, size_t slen, void * rec)
 	if (fwrite(s + plen, slen - plen, 1, W->f) != 1)
 		goto err0;
 
-	/* Enlarge last-path buffer if needed. */
-	if (W->sbuflen < slen + 1) {
-		free(W->sbuf);
-		W->sbuflen = slen + 1;
-		if ((W->sbuf = malloc(W->sbuflen)) == NULL) {
-			W->sbuflen = 0;
-			goto err0;
-		}
-		memcpy(W->sbuf, s, slen);
-	} else
-		memcpy(W->sbuf + plen, s + plen, slen - plen);
-	W->sbuf[slen] = 0;
+	/* Remember the path for prefix compression. */
+	if (remember(W, s, slen, plen))
+		goto err0;
+
+	/* Account for the record and its data. */
+	W->N += 1;
+	W->recoff += sizeof(ccre) + (slen - plen);
+	W->chunksusage += (uint64_t)ccr->nch * sizeof(struct chunkheader);
+	W->trailerusage += ccr->tzlen;
+	W->datalen += (uint64_t)ccr->nch * sizeof(struct chunkheader) +
+	    ccr->tzlen;
 
 done:
 	/* Success! */
@@ -158,12 +229,11 @@ err0:
 	return (-1);
 }
 
-/* Callback to write chunk headers and compressed entry trailers to disk. */
+/* Write chunk headers and compressed entry trailers to disk. */
 static int
-callback_write_data(void * cookie, uint8_t * s, size_t slen, void * rec)
+write_data(struct ccache_write_internal * W, const uint8_t * s, size_t slen,
+    struct ccache_record * ccr)
 {
-	struct ccache_write_internal * W = cookie;
-	struct ccache_record * ccr = rec;
 
 	(void)s; /* UNUSED */
 	(void)slen; /* UNUSED */
@@ -194,21 +264,101 @@ err0:
 	return (-1);
 }
 
-/**
- * ccache_write(cache, path):
- * Write the given chunkification cache into the directory ${path}.
+/*
+ * Write the records from the mapped cache file which come before the path
+ * ${s} of length ${slen}, or all of them if ${s} is NULL; and skip the
+ * record for ${s} itself, if any, since the record in the tree replaces it.
  */
-int
-ccache_write(CCACHE * cache, const char * path)
+static int
+merge_upto(struct ccache_write_internal * W, const uint8_t * s, size_t slen)
+{
+	int rc, next;
+
+	while (!W->mdone) {
+		/* Stop at the first mapped record after ${s}. */
+		if (s == NULL)
+			rc = -1;
+		else if ((rc = ccache_keycmp(W->M.sbuf, W->M.slen,
+		    s, slen)) > 0)
+			break;
+
+		/* Write the record, unless the tree has replaced it. */
+		if ((rc < 0) && W->write(W, W->M.sbuf, W->M.slen, &W->mccr))
+			goto err0;
+
+		/* Move on to the next mapped record. */
+		if ((next = ccache_cursor_next(W->C, &W->M, &W->mccr)) == -1)
+			goto err0;
+		W->mdone = next;
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Callback to write a record from the tree, after any which precede it. */
+static int
+callback_write(void * cookie, uint8_t * s, size_t slen, void * rec)
+{
+	struct ccache_write_internal * W = cookie;
+
+	/* Write mapped records which come first. */
+	if (merge_upto(W, s, slen))
+		return (-1);
+
+	/* Write this record. */
+	return (W->write(W, s, slen, rec));
+}
+
+/* Pass through the records in the tree and the mapped cache file in order. */
+static int
+write_pass(struct ccache_write_internal * W)
+{
+	int rc;
+
+	/* Start at the first mapped record, if any. */
+	if (ccache_cursor_init(W->C, &W->M))
+		goto err0;
+	if ((rc = ccache_cursor_next(W->C, &W->M, &W->mccr)) == -1)
+		goto err1;
+	W->mdone = rc;
+
+	/* Handle the records in the tree and the mapped records between. */
+	if (patricia_foreach(W->C->tree, callback_write, W))
+		goto err1;
+
+	/* Handle the mapped records after the last record in the tree. */
+	if (merge_upto(W, NULL, 0))
+		goto err1;
+
+	/* Free the cursor. */
+	ccache_cursor_free(&W->M);
+
+	/* Success! */
+	return (0);
+
+err1:
+	ccache_cursor_free(&W->M);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Write a new cache file for the cache ${C} into the directory ${path}. */
+static int
+write_cache(struct ccache_internal * C, const char * path)
 {
-	struct ccache_internal * C = cache;
 	struct ccache_write_internal W;
-	uint8_t N[4];
+	struct ccache_header_external hdr;
+	struct ccache_block_external * cbe;
+	uint64_t dataoff;
+	size_t nblocks, i;
 	char * s_old;
 
-	/* The caller must pass a file name to be written. */
-	assert(path != NULL);
-
 	/* Construct name of temporary cache file. */
 	if (asprintf(&W.s, "%s/cache.new", path) == -1) {
 		warnp("asprintf");
@@ -221,52 +371,86 @@ ccache_write(CCACHE * cache, const char * path)
 		goto err1;
 	}
 
-	/*-
-	 * We make three passes through the cache tree:
-	 * 1. Counting the number of records which will be written to disk.
-	 *    This is necessary since records in the cache which are too old
-	 *    will not be written, but the on-disk cache format starts with
-	 *    the number of records.
-	 * 2. Writing the records and suffixes.
-	 * 3. Writing the cached chunk headers and compressed entry trailers.
-	 */
-
-	/* Count the number of records which need to be written. */
-	W.N = 0;
-	if (patricia_foreach(C->tree, callback_count, &W)) {
-		warnp("patricia_foreach");
+	/* Create an empty block index. */
+	if ((W.blocks = blocklist_init(0)) == NULL)
 		goto err2;
-	}
 
-	/* Check that we don't have too many cache records. */
-	if (W.N > UINT32_MAX) {
-		warn0("Programmer error: "
-		    "The cache cannot contain more than 2^32-1 entries");
-		goto err2;
-	}
+	/*-
+	 * We write the file in four steps:
+	 * 1. Writing a placeholder for the header, since we don't yet know
+	 *    how many records will be written; records which are too old
+	 *    are dropped.
+	 * 2. Writing the records and suffixes, in order; records in the tree
+	 *    are merged with (and replace) records in the mapped cache file
+	 *    which were never looked up.
+	 * 3. Writing the chunk headers and compressed entry trailers, in the
+	 *    same order.
+	 * 4. Writing the block index and filling in the header.
+	 */
 
-	/* Write the number of records to the file. */
-	le32enc(N, (uint32_t)W.N);
-	if (fwrite(N, 4, 1, W.f) != 1) {
+	/* Write a placeholder header. */
+	memset(&hdr, 0, sizeof(hdr));
+	if (fwrite(&hdr, sizeof(hdr), 1, W.f) != 1) {
 		warnp("fwrite(%s)", W.s);
-		goto err2;
+		goto err3;
 	}
 
 	/* Write the records and suffixes. */
+	W.C = C;
+	W.write = write_rec;
+	W.N = 0;
 	W.sbuf = NULL;
-	W.sbuflen = 0;
-	if (patricia_foreach(C->tree, callback_write_rec, &W)) {
+	W.sbuflen = W.slen = 0;
+	W.recoff = sizeof(hdr);
+	W.datalen = W.chunksusage = W.trailerusage = 0;
+	if (write_pass(&W)) {
 		warnp("Error writing cache to %s", W.s);
-		goto err2;
+		goto err4;
 	}
-	free(W.sbuf);
 
 	/* Write the chunk headers and compressed entry trailers. */
-	if (patricia_foreach(C->tree, callback_write_data, &W)) {
+	W.write = write_data;
+	if (write_pass(&W)) {
 		warnp("Error writing cache to %s", W.s);
-		goto err2;
+		goto err4;
 	}
 
+	/* Write the block index, with data offsets relative to the file. */
+	dataoff = W.recoff;
+	nblocks = blocklist_getsize(W.blocks);
+	for (i = 0; i < nblocks; i++) {
+		cbe = blocklist_get(W.blocks, i);
+		le64enc(cbe->dataoff, le64dec(cbe->dataoff) + dataoff);
+	}
+	if ((nblocks > 0) && (fwrite(blocklist_get(W.blocks, 0),
+	    sizeof(struct ccache_block_external), nblocks, W.f) != nblocks)) {
+		warnp("fwrite(%s)", W.s);
+		goto err4;
+	}
+
+	/* Fill in the header, with a new identifier. */
+	memcpy(hdr.magic, CCACHE_MAGIC, sizeof(hdr.magic));
+	if (crypto_entropy_read(hdr.id, sizeof(hdr.id)))
+		goto err4;
+	le64enc(hdr.nrecs, (uint64_t)W.N);
+	le64enc(hdr.nblocks, (uint64_t)nblocks);
+	le64enc(hdr.dataoff, dataoff);
+	le64enc(hdr.indexoff, dataoff + W.datalen);
+	le64enc(hdr.chunksusage, W.chunksusage);
+	le64enc(hdr.trailerusage, W.trailerusage);
+	if (fseeko(W.f, 0, SEEK_SET)) {
+		warnp("fseeko(%s)", W.s);
+		goto err4;
+	}
+	if (fwrite(&hdr, sizeof(hdr), 1, W.f) != 1) {
+		warnp("fwrite(%s)", W.s);
+		goto err4;
+	}
+
+	/* Free the path buffer and block index. */
+	free(W.sbuf);
+	blocklist_free(W.blocks);
+
 	/* Finish writing the file. */
 	if (fileutil_fsync(W.f, W.s))
 		goto err2;
@@ -275,6 +459,10 @@ ccache_write(CCACHE * cache, const char * path)
 	if (fclose(W.f))
 		warnp("fclose");
 
+	/* The log belongs to the old cache file; delete it first. */
+	if (log_remove(path))
+		goto err1;
+
 	/* Construct the name of the old cache file. */
 	if (asprintf(&s_old, "%s/cache", path) == -1) {
 		warnp("asprintf");
@@ -303,6 +491,10 @@ ccache_write(CCACHE * cache, const char * path)
 	/* Success! */
 	return (0);
 
+err4:
+	free(W.sbuf);
+err3:
+	blocklist_free(W.blocks);
 err2:
 	if (fclose(W.f))
 		warnp("fclose");
@@ -313,6 +505,253 @@ err0:
 	return (-1);
 }
 
+/* Write ${len} bytes from ${buf} to the log, updating the CRC. */
+static int
+logwrite(struct ccache_write_internal * W, const void * buf, size_t len)
+{
+
+	/* Nothing to write? */
+	if (len == 0)
+		return (0);
+
+	/* Write the data. */
+	if (fwrite(buf, len, 1, W->f) != 1)
+		return (-1);
+	W->crc = ccache_crc(W->crc, buf, len);
+
+	/* Success! */
+	return (0);
+}
+
+/* Callback to log a record from the tree if it changed or was used. */
+static int
+callback_log(void * cookie, uint8_t * s, size_t slen, void * rec)
+{
+	struct ccache_write_internal * W = cookie;
+	struct ccache_record * ccr = rec;
+	struct ccache_record tombstone;
+	struct ccache_record_external ccre;
+	size_t plen;
+
+	/* An unchanged record only needs to be marked as used, if it was. */
+	if ((ccr->flags & CCR_DIRTY) == 0) {
+		if ((ccr->age == 0) && (ccr->ord != CCR_ORD_NONE)) {
+			W->bitmap[ccr->ord / 8] |=
+			    (uint8_t)(1 << (ccr->ord % 8));
+			W->ntouched += 1;
+		}
+		goto done;
+	}
+
+	/*
+	 * A record which we don't want stored must hide any older record
+	 * for the same path.
+	 */
+	if (skiprecord(ccr)) {
+		if (ccr->ord == CCR_ORD_NONE)
+			goto done;
+		memset(&tombstone, 0, sizeof(struct ccache_record));
+		ccr = &tombstone;
+	}
+
+	/* Write the record and path suffix. */
+	plen = prefix(W, s, slen);
+	rec_enc(ccr, plen, slen, &ccre);
+	if (logwrite(W, &ccre, sizeof(ccre)) ||
+	    logwrite(W, s + plen, slen - plen))
+		goto err0;
+	if (remember(W, s, slen, plen))
+		goto err0;
+
+	/* Write chunkheader records and compressed trailer, if any. */
+	if ((ccr->chp != NULL) && logwrite(W, ccr->chp,
+	    ccr->nch * sizeof(struct chunkheader)))
+		goto err0;
+	if ((ccr->ztrailer != NULL) && logwrite(W, ccr->ztrailer, ccr->tzlen))
+		goto err0;
+
+done:
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Append a segment with the changes to the cache ${C} in this run to the log
+ * in the directory ${path}.
+ */
+static int
+append_log(struct ccache_internal * C, const char * path)
+{
+	const struct ccache_header_external * hdr = C->data;
+	struct ccache_write_internal W;
+	struct ccache_log_external cle;
+	struct ccache_record_external ccre;
+	uint8_t buf[8];
+	size_t blen;
+
+	/* Create an empty bitmap of the records which were used. */
+	blen = C->nords / 8 + (C->nords % 8 != 0);
+	if (((W.bitmap = calloc(blen, 1)) == NULL) && (blen > 0))
+		goto err0;
+	W.ntouched = 0;
+
+	/* Construct the name of the log file. */
+	if (asprintf(&W.s, "%s/cache.log", path) == -1) {
+		warnp("asprintf");
+		goto err1;
+	}
+
+	/*
+	 * Start a new log if we don't have one for this cache file;
+	 * otherwise, drop any incomplete segment from the end of the log.
+	 */
+	if (C->log == NULL) {
+		if ((W.f = fopen(W.s, "w")) == NULL) {
+			warnp("fopen(%s)", W.s);
+			goto err2;
+		}
+		memcpy(cle.magic, CCACHE_LOG_MAGIC, sizeof(cle.magic));
+		memcpy(cle.id, hdr->id, sizeof(cle.id));
+		if (fwrite(&cle, sizeof(cle), 1, W.f) != 1) {
+			warnp("fwrite(%s)", W.s);
+			goto err3;
+		}
+	} else {
+		if ((W.f = fopen(W.s, "a")) == NULL) {
+			warnp("fopen(%s)", W.s);
+			goto err2;
+		}
+		if (ftruncate(fileno(W.f), (off_t)C->logvalid)) {
+			warnp("ftruncate(%s)", W.s);
+			goto err3;
+		}
+	}
+
+	/* Write the records which changed, and mark those which were used. */
+	W.C = C;
+	W.sbuf = NULL;
+	W.sbuflen = W.slen = 0;
+	W.crc = 0;
+	if (patricia_foreach(C->tree, callback_log, &W)) {
+		warnp("Error writing cache log to %s", W.s);
+		goto err4;
+	}
+
+	/* End the list of records. */
+	memset(&ccre, 0, sizeof(ccre));
+	if (logwrite(&W, &ccre, sizeof(ccre)))
+		goto err5;
+
+	/* Write the bitmap of records which were used, if any were. */
+	le64enc(buf, W.ntouched);
+	if (logwrite(&W, buf, 8))
+		goto err5;
+	if ((W.ntouched > 0) && logwrite(&W, W.bitmap, blen))
+		goto err5;
+
+	/* Write the CRC. */
+	le32enc(buf, W.crc);
+	if (fwrite(buf, 4, 1, W.f) != 1)
+		goto err5;
+
+	/* Free the path buffer and bitmap. */
+	free(W.sbuf);
+	free(W.bitmap);
+
+	/* Finish writing the file. */
+	if (fileutil_fsync(W.f, W.s)) {
+		if (fclose(W.f))
+			warnp("fclose");
+		free(W.s);
+		goto err0;
+	}
+
+	/* Close the file. */
+	if (fclose(W.f))
+		warnp("fclose");
+
+	/* Free string allocated by asprintf. */
+	free(W.s);
+
+	/* Success! */
+	return (0);
+
+err5:
+	warnp("fwrite(%s)", W.s);
+err4:
+	free(W.sbuf);
+err3:
+	if (fclose(W.f))
+		warnp("fclose");
+err2:
+	free(W.s);
+err1:
+	free(W.bitmap);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * ccache_write(cache, path):
+ * Write the given chunkification cache into the directory ${path}.  If the
+ * cache was read from a cache file in the current format, this usually
+ * appends the changes to a log instead of writing a new cache file.
+ */
+int
+ccache_write(CCACHE * cache, const char * path)
+{
+	struct ccache_internal * C = cache;
+
+	/* The caller must pass a file name to be written. */
+	assert(path != NULL);
+
+	/* Append to the log, unless it has grown too large. */
+	if ((C->index != NULL) &&
+	    (C->logvalid <= C->datalen / CCACHE_LOGFRAC))
+		return (append_log(C, path));
+
+	/* Write a new cache file. */
+	return (write_cache(C, path));
+}
+
+/* Delete the cache log from the directory ${path}, if it exists. */
+static int
+log_remove(const char * path)
+{
+	char * s;
+
+	/* Construct the name of the log file. */
+	if (asprintf(&s, "%s/cache.log", path) == -1) {
+		warnp("asprintf");
+		goto err0;
+	}
+
+	/* Delete the file if it exists. */
+	if (unlink(s)) {
+		if (errno != ENOENT) {
+			warnp("unlink(%s)", s);
+			goto err1;
+		}
+	}
+
+	/* Free string allocated by asprintf. */
+	free(s);
+
+	/* Success! */
+	return (0);
+
+err1:
+	free(s);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
 /**
  * ccache_remove(path):
  * Delete the chunkification cache from the directory ${path}.
@@ -325,6 +764,10 @@ ccache_remove(const char * path)
 	/* The caller must pass a file name to be deleted. */
 	assert(path != NULL);
 
+	/* Delete the log of runs since the cache file was written. */
+	if (log_remove(path))
+		return (-1);
+
 	/* Construct the name of the cache file. */
 	if (asprintf(&s, "%s/cache", path) == -1) {
 		warnp("asprintf");
@@ -50,17 +50,55 @@ void chunks_read_free(CHUNKS_R *);
 CHUNKS_W * chunks_write_start(const char *, STORAGE_W *, size_t);
 
 /**
- * chunks_write_chunk(C, hash, buf, buflen):
+ * chunks_write_chunk(C, hash, buf, buflen, level):
  * Write the chunk ${buf} of length ${buflen}, which has HMAC ${hash},
- * as part of the write transaction associated with the cookie ${C}.
- * Return the compressed size.
+ * as part of the write transaction associated with the cookie ${C}.  If the
+ * chunk is not already stored, compress it using zlib compression level
+ * ${level}.  Return the compressed size.
  */
 ssize_t chunks_write_chunk(CHUNKS_W *, const uint8_t *, const uint8_t *,
-    size_t);
+    size_t, int);
+
+/**
+ * chunks_write_chunk_start(C, hash, buf, buflen, level):
+ * Prepare to write the chunk ${buf} of length ${buflen}, which has HMAC
+ * ${hash}, as part of the write transaction associated with the cookie
+ * ${C}, compressing it using zlib compression level ${level}.  The chunk
+ * data is copied, so ${buf} may be reused as soon as this function returns.
+ * The returned cookie must be passed to chunks_write_chunk_compress and then
+ * to chunks_write_chunk_finish.
+ */
+struct chunks_write_pending * chunks_write_chunk_start(CHUNKS_W *,
+    const uint8_t *, const uint8_t *, size_t, int);
+
+/**
+ * chunks_write_chunk_compress(P):
+ * Compress and encrypt the chunk associated with the cookie ${P}.  This
+ * function is thread-safe, and does not access the write transaction except
+ * to read its parameters.
+ */
+int chunks_write_chunk_compress(struct chunks_write_pending *);
+
+/**
+ * chunks_write_chunk_finish(P):
+ * Finish writing the chunk associated with the cookie ${P}, which has been
+ * passed to chunks_write_chunk_compress, and free the cookie.  Cookies must
+ * be finished in the order in which they were started.  Return the
+ * compressed size.
+ */
+ssize_t chunks_write_chunk_finish(struct chunks_write_pending *);
+
+/**
+ * chunks_write_pending_free(P):
+ * Free the cookie ${P} returned by chunks_write_chunk_start without writing
+ * the chunk.
+ */
+void chunks_write_pending_free(struct chunks_write_pending *);
 
 /**
  * chunks_write_ispresent(C, hash):
  * If a chunk with hash ${hash} exists, return 0; otherwise, return 1.
+ * Return -1 on error.
  */
 int chunks_write_ispresent(CHUNKS_W *, const uint8_t *);
 
@@ -68,7 +106,7 @@ int chunks_write_ispresent(CHUNKS_W *, const uint8_t *);
  * chunks_write_chunkref(C, hash):
  * If a chunk with hash ${hash} exists, mark it as being part of the write
  * transaction associated with the cookie ${C} and return 0.  If it
- * does not exist, return 1.
+ * does not exist, return 1.  Return -1 on error.
  */
 int chunks_write_chunkref(CHUNKS_W *, const uint8_t *);
 
@@ -250,7 +288,7 @@ void chunks_stats_zeroarchive(CHUNKS_S *);
 /**
  * chunks_stats_addchunk(C, hash, len, zlen):
  * Add the given chunk to the per-archive statistics.  If the chunk does not
- * exist, return 1.
+ * exist, return 1; on error, return -1.
  */
 int chunks_stats_addchunk(CHUNKS_S *, const uint8_t *, size_t, size_t);
 
@@ -6,15 +6,13 @@
 #include <string.h>
 
 #include "chunks_internal.h"
-#include "rwhashtab.h"
 #include "storage.h"
 #include "warnp.h"
 
 #include "chunks.h"
 
 struct chunks_delete_internal {
-	RWHASHTAB * HT;			/* Hash table of struct chunkdata. */
-	void * dir;			/* On-disk directory entries. */
+	CHUNKS_DIR * dir;		/* Chunk directory. */
 	char * path;			/* Path to cache directory. */
 	STORAGE_D * S;			/* Storage layer cookie. */
 	struct chunkstats stats_total;	/* All archives, w/ multiplicity. */
@@ -47,8 +45,8 @@ chunks_delete_start(const char * cachepath, STORAGE_D * S)
 		goto err1;
 
 	/* Read the existing chunk directory. */
-	if ((C->HT = chunks_directory_read(cachepath, &C->dir,
-	    &C->stats_unique, &C->stats_total, &C->stats_extra, 0, 0)) == NULL)
+	if ((C->dir = chunks_directory_open(cachepath, &C->stats_unique,
+	    &C->stats_total, &C->stats_extra, 0, 0)) == NULL)
 		goto err2;
 
 	/* Zero "new chunks" and "this tape" statistics. */
@@ -76,8 +74,8 @@ size_t
 chunks_delete_getdirsz(CHUNKS_D * C)
 {
 
-	/* Get the value from the hash table. */
-	return (rwhashtab_getsize(C->HT));
+	/* Get the value from the chunk directory. */
+	return (chunks_directory_getsize(C->dir));
 }
 
 /**
@@ -92,8 +90,10 @@ chunks_delete_chunk(CHUNKS_D * C, const uint8_t * hash)
 {
 	struct chunkdata * ch;
 
-	/* If the chunk is not in ${C}->HT, error out. */
-	if ((ch = rwhashtab_read(C->HT, hash)) == NULL) {
+	/* If the chunk is not in the directory, error out. */
+	if (chunks_directory_find(C->dir, hash, &ch))
+		goto err0;
+	if (ch == NULL) {
 		warn0("Chunk is missing or directory is corrupt");
 		goto err0;
 	}
@@ -197,11 +197,11 @@ chunks_delete_end(CHUNKS_D * C)
 {
 
 	/* Write the new chunk directory. */
-	if (chunks_directory_write(C->path, C->HT, &C->stats_extra, ".tmp"))
+	if (chunks_directory_save(C->dir, C->path, &C->stats_extra, ".tmp"))
 		goto err1;
 
-	/* Free the chunk hash table. */
-	chunks_directory_free(C->HT, C->dir);
+	/* Free the chunk directory. */
+	chunks_directory_close(C->dir);
 
 	/* Free memory. */
 	free(C->path);
@@ -211,7 +211,7 @@ chunks_delete_end(CHUNKS_D * C)
 	return (0);
 
 err1:
-	chunks_directory_free(C->HT, C->dir);
+	chunks_directory_close(C->dir);
 	free(C->path);
 	free(C);
 
@@ -232,8 +232,8 @@ chunks_delete_free(CHUNKS_D * C)
 	if (C == NULL)
 		return;
 
-	/* Free the chunk hash table. */
-	chunks_directory_free(C->HT, C->dir);
+	/* Free the chunk directory. */
+	chunks_directory_close(C->dir);
 
 	/* Free memory. */
 	free(C->path);
@@ -1,6 +1,7 @@
 #include "platform.h"
 
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #include <assert.h>
@@ -15,17 +16,19 @@
 #include <unistd.h>
 
 #include "asprintf.h"
+#include "crypto_entropy.h"
 #include "ctassert.h"
 #include "dirutil.h"
+#include "elasticarray.h"
 #include "fileutil.h"
-#include "rwhashtab.h"
 #include "sysendian.h"
+#include "tarsnap_opt.h"
 #include "warnp.h"
+#include "workpool.h"
 
 #include "chunks.h"
 #include "chunks_internal.h"
 
-/* On-disk extra data statistics structure; integers are little-endian. */
 struct chunkstats_external {
 	uint8_t nchunks[8];	/* Number of files. */
 	uint8_t s_len[8];	/* Sum of file lengths. */
@@ -43,316 +46,1854 @@ struct chunkdata_external {
 };
 CTASSERT(sizeof(struct chunkdata_external) == 48);
 
-static int callback_write(void * rec, void * cookie);
-static int callback_free(void * rec, void * cookie);
+/*
+ * The chunk directory was originally a struct chunkstats_external followed
+ * by struct chunkdata_external records in no particular order.  It is now
+ * written as a struct chunkdir_external followed by records sorted by hash,
+ * so that it can be mapped into memory and searched in place; only chunks
+ * which are used by a transaction need to be copied into core.
+ *
+ * Rather than rewriting every record each time a transaction commits, we
+ * can instead write a delta: a sorted list of the records which have been
+ * added, changed, or deleted (these have nrefs == 0) relative to a base
+ * directory, which is kept as ${cachepath}/directory.base.  The delta and
+ * its base carry the same randomly generated identifier, and the header of
+ * a delta holds the statistics for the combined directory.  Once a delta
+ * grows to more than 1/DELTA_MAXFRAC of the size of its base, we compact
+ * the two by writing out a complete directory instead.
+ */
+#define CHDIR_MAGIC		"tschdir2"
+#define CHDIR_MAGIC_DELTA	"tschdlt2"
+#define DELTA_MAXFRAC		8
+
+/* On-disk sorted directory header; integers are little-endian. */
+struct chunkdir_external {
+	uint8_t magic[8];		/* CHDIR_MAGIC or CHDIR_MAGIC_DELTA. */
+	uint8_t numchunks[8];		/* Number of chunks. */
+	uint8_t id[8];			/* Identifier of base directory. */
+	struct chunkstats_external extra;	/* Extra (non-chunked) data. */
+	struct chunkstats_external unique;	/* Chunks w/o multiplicity. */
+	struct chunkstats_external all;		/* Chunks w/ multiplicity. */
+};
+CTASSERT(sizeof(struct chunkdir_external) == 96);
+
+/*
+ * Most lookups of new chunks would otherwise end with a search of the base
+ * directory for a chunk which isn't there.  To avoid this, we keep a blocked
+ * Bloom filter of the chunks in the most recently written complete directory
+ * in ${cachepath}/directory.filter: each chunk sets FILTER_K bits within one
+ * FILTER_BLOCK-byte block, so a lookup of a chunk which is not present
+ * usually touches a single cache line.  The filter carries the identifier of
+ * the directory which it describes; if it is missing or describes a
+ * different directory, we build it when we first need it and write it out
+ * when the directory is next saved.
+ *
+ * Blocks are selected by the leading bits of chunk hashes, so the records
+ * of a sorted directory map to blocks in order.  This lets us build a filter
+ * by splitting the records into ranges which start on block boundaries and
+ * handing them to worker threads, which can then set bits without locking.
+ */
+#define CHFLT_MAGIC		"tschflt1"
+#define FILTER_BITS		10	/* Bits per chunk. */
+#define FILTER_K		7	/* Bits set per chunk. */
+#define FILTER_BLOCK		64	/* Bytes per block. */
+#define FILTER_MINJOB		65536	/* Minimum records per thread. */
+
+/* On-disk filter header; integers are little-endian. */
+struct chunkfilter_external {
+	uint8_t magic[8];	/* CHFLT_MAGIC. */
+	uint8_t id[8];		/* Identifier of directory. */
+	uint8_t nblocks[8];	/* Number of FILTER_BLOCK-byte blocks. */
+	uint8_t zero[40];	/* Padding, so blocks are aligned. */
+};
+CTASSERT(sizeof(struct chunkfilter_external) == FILTER_BLOCK);
+
+/*
+ * If tarsnap_opt_directory_memlimit is set, the number of records kept in
+ * core is limited: whenever it would be exceeded, the in-core records are
+ * sorted and written out (tombstones and flags included) as a "spill run"
+ * in the delta format, which is mapped and searched in place like the base
+ * and delta, and which is unlinked as soon as it has been mapped so that
+ * it vanishes when we exit.  A record found in a spill run is copied back
+ * into core, since the caller may modify it.  In order to keep the number
+ * of runs which a lookup must search logarithmic, each spill merges the
+ * newest runs which are no more than twice the size of what is being
+ * written; and when the directory is saved, the runs are merged along with
+ * everything else.  The bulk of the directory thus stays on disk, and the
+ * OS can evict the mapped pages as it sees fit.  SPILL_RECSZ is the number
+ * of bytes of memory which we assume an in-core record uses, including the
+ * hash table and the hash of a new chunk.
+ */
+#define SPILL_MAXRUNS		32
+#define SPILL_RECSZ		128
+#define SPILL_MINRECS		1024
+
+/*
+ * The records which a transaction uses are kept in core in a compact table
+ * rather than in individually allocated structures.  A record copied from
+ * the on-disk directory doesn't need a copy of its hash, since the hash can
+ * be found in the mapped directory; we only store where to find it.  The
+ * hashes of new chunks are kept in a separate array.  Records are located
+ * via an open addressing hash table of 64-bit slots, each holding the
+ * leading 32 bits of a chunk hash and the record number (plus one; a zero
+ * slot is empty).  Since chunk hashes are HMAC outputs, their leading bits
+ * are uniformly distributed and serve as a hash table index, and a slot only
+ * needs its record's full hash to be looked up if the leading bits match.
+ */
+#define SRC_BASE	((uint32_t)(0) << 30)	/* Hash is in base. */
+#define SRC_DELTA	((uint32_t)(1) << 30)	/* Hash is in delta. */
+#define SRC_CORE	((uint32_t)(2) << 30)	/* Hash is in hashes array. */
+#define SRC_MASK	((uint32_t)(3) << 30)
+#define SRC_IDX		(~SRC_MASK)
+
+/* Hash of a chunk which is not in the on-disk directory. */
+struct chunkhash {
+	uint8_t hash[32];
+};
+
+ELASTICARRAY_DECL(HASHLIST, hashlist, struct chunkhash);
+ELASTICARRAY_DECL(SRCLIST, srclist, uint32_t);
+
+/* A sorted directory, mapped (or read) into memory. */
+struct chunkdir_map {
+	void * map;		/* Mapped directory file, or NULL. */
+	size_t maplen;		/* Size of ${map}. */
+	const struct chunkdata_external * recs;	/* Sorted records in map. */
+	size_t nrecs;		/* Number of records in ${recs}. */
+};
+
+/* A chunk filter, mapped or built in memory. */
+struct chunkfilter {
+	void * map;		/* Mapped filter file, or NULL. */
+	size_t maplen;		/* Size of ${map}. */
+	uint8_t * blocks;	/* Filter blocks, or NULL. */
+	size_t nblocks;		/* Number of blocks. */
+	int dirty;		/* Built in memory and not yet written out. */
+};
+
+/* A range of sorted records to add to a filter. */
+struct filterjob {
+	struct chunkfilter * F;			/* Filter to add to. */
+	const struct chunkdata_external * recs;	/* First record. */
+	size_t nrecs;				/* Number of records. */
+};
+
+/* An in-core record, for sorting. */
+struct corerec {
+	const uint8_t * hash;		/* HMAC of chunk. */
+	const struct chunkdata * ch;	/* Chunk metadata. */
+};
+
+/* A position in a sorted array of on-disk or in-core chunk records. */
+struct cursor {
+	const struct chunkdata_external * recs;	/* On-disk records... */
+	const struct corerec * chs;		/* ... or in-core records. */
+	size_t n;				/* Number of records. */
+	size_t i;				/* Current position. */
+	int tombstones;				/* Records may be deletions. */
+};
+
+/* Chunk directory: sorted on-disk records, plus records in core. */
+struct chunks_directory_internal {
+	uint64_t * slots;	/* Hash table of in-core records. */
+	size_t nslots;		/* Size of ${slots}; a power of two. */
+	struct elasticarray * recs;	/* In-core chunk metadata records. */
+	size_t recsz;		/* Size of a struct chunkdata{,_statstape}. */
+	SRCLIST srcs;		/* SRC_* | index of each record's hash. */
+	HASHLIST hashes;	/* Hashes of SRC_CORE records. */
+	struct chunkdir_map base;	/* Base directory. */
+	struct chunkdir_map delta;	/* Changes to the base directory. */
+	struct chunkdir_external cdb;	/* Header of the base directory. */
+	struct chunkfilter filter;	/* Filter of chunks in base. */
+	struct chunkdir_map runs[SPILL_MAXRUNS];	/* Spill runs. */
+	size_t nruns;		/* Number of runs, oldest first. */
+	size_t maxcore;		/* Maximum number of in-core records. */
+	char * spillpath;	/* Path for writing spill runs, or NULL. */
+	int baseisdir;		/* Base is ${cachepath}/directory itself. */
+	size_t nchunks;		/* Number of chunks on disk. */
+	size_t nnew;		/* Number of chunks inserted. */
+};
+
+static void stats_dec(const struct chunkstats_external *,
+    struct chunkstats *);
+static void stats_enc(const struct chunkstats *,
+    struct chunkstats_external *);
+static int rec_dec(const struct chunkdata_external *, struct chunkdata *,
+    int);
+static void rec_enc(const uint8_t *, const struct chunkdata *,
+    struct chunkdata_external *);
+static const uint8_t * rec_hash(CHUNKS_DIR *, size_t);
+static size_t table_lookup(CHUNKS_DIR *, const uint8_t *);
+static int table_resize(CHUNKS_DIR *, size_t);
+static int table_reserve(CHUNKS_DIR *, size_t);
+static struct chunkdata * table_add(CHUNKS_DIR *, const uint8_t *, uint32_t,
+    const struct chunkdata *);
+static struct chunkdata * core_add(CHUNKS_DIR *, const uint8_t *,
+    const struct chunkdata *);
+static int hashcmp(const void *, const void *);
+static struct corerec * core_sort(CHUNKS_DIR *);
+static const struct chunkdata_external * search(
+    const struct chunkdata_external *, size_t, const uint8_t *);
+static void cursor_init(struct cursor *, const struct chunkdata_external *,
+    const struct corerec *, size_t, int);
+static const uint8_t * cursor_hash(struct cursor *);
+static int merge_next(struct cursor *, size_t, const uint8_t **,
+    struct chunkdata *);
+static void map_init(struct chunkdir_map *);
+static int map_open(const char *, struct chunkdir_map *,
+    struct chunkdir_external *);
+static void map_close(struct chunkdir_map *);
+static int maps_open(const char *, struct chunkdir_map *,
+    struct chunkdir_map *, struct chunkdir_external *,
+    struct chunkdir_external *);
+static int base_link(const char *);
+static void filter_init(struct chunkfilter *);
+static int filter_alloc(struct chunkfilter *, size_t);
+static size_t filter_blockno(const struct chunkfilter *, const uint8_t *);
+static uint8_t * filter_block(const struct chunkfilter *, const uint8_t *);
+static void filter_add(struct chunkfilter *, const uint8_t *);
+static int filter_check(const struct chunkfilter *, const uint8_t *);
+static int filter_addrecs(void *);
+static int filter_build(struct chunkfilter *, const struct chunkdir_map *);
+static int filter_open(const char *, struct chunkfilter *, const uint8_t *);
+static int filter_write(const char *, struct chunkfilter *,
+    const uint8_t *);
+static void filter_free(struct chunkfilter *);
+static int spill(CHUNKS_DIR *);
+static int directory_write(const char *, CHUNKS_DIR *,
+    const struct chunkdir_external *, struct chunkstats *, const char *);
+static int read_old(CHUNKS_DIR *, const char *, struct chunkstats *,
+    struct chunkstats *, struct chunkstats *, int);
+
+static void
+stats_dec(const struct chunkstats_external * cse, struct chunkstats * stats)
+{
+
+	stats->nchunks = le64dec(cse->nchunks);
+	stats->s_len = le64dec(cse->s_len);
+	stats->s_zlen = le64dec(cse->s_zlen);
+}
+
+/* Encode the statistics ${stats} into ${cse}. */
+static void
+stats_enc(const struct chunkstats * stats, struct chunkstats_external * cse)
+{
+
+	le64enc(cse->nchunks, stats->nchunks);
+	le64enc(cse->s_len, stats->s_len);
+	le64enc(cse->s_zlen, stats->s_zlen);
+}
+
+/**
+ * rec_dec(che, ch, tombstone):
+ * Convert the metadata in the on-disk record ${che} into the struct
+ * chunkdata ${ch}.  Return -1 if the record is not sane; a record with
+ * nrefs == 0 is only sane if ${tombstone} is non-zero.
+ */
+static int
+rec_dec(const struct chunkdata_external * che, struct chunkdata * ch,
+    int tombstone)
+{
+
+	/* Decode the record. */
+	ch->len = le32dec(che->len);
+	ch->zlen_flags = le32dec(che->zlen);
+	ch->nrefs = le32dec(che->nrefs);
+	ch->ncopies = le32dec(che->ncopies);
+
+#if UINT32_MAX > SSIZE_MAX
+	/* Paranoid check for number of copies. */
+	if (ch->ncopies > SSIZE_MAX)
+		warn0("More than %zd copies of a chunk; "
+		    "data is ok but stats may be inaccurate",
+		    SSIZE_MAX);
+#endif
+
+	/* Sanity check. */
+	if ((ch->len == 0) || (ch->zlen_flags == 0) ||
+	    ((ch->nrefs == 0) && !tombstone))
+		return (-1);
+
+	/* Success! */
+	return (0);
+}
+
+/* Convert ${hash} and the struct chunkdata ${ch} into the record ${che}. */
+static void
+rec_enc(const uint8_t * hash, const struct chunkdata * ch,
+    struct chunkdata_external * che)
+{
+
+	memcpy(che->hash, hash, 32);
+	le32enc(che->len, ch->len);
+	le32enc(che->zlen, ch->zlen_flags & CHDATA_ZLEN);
+	le32enc(che->nrefs, ch->nrefs);
+	le32enc(che->ncopies, ch->ncopies);
+}
+
+/* Return the hash of in-core record number ${i} in ${D}. */
+static const uint8_t *
+rec_hash(CHUNKS_DIR * D, size_t i)
+{
+	uint32_t src = *srclist_get(D->srcs, i);
+
+	switch (src & SRC_MASK) {
+	case SRC_BASE:
+		return (D->base.recs[src & SRC_IDX].hash);
+	case SRC_DELTA:
+		return (D->delta.recs[src & SRC_IDX].hash);
+	default:
+		return (hashlist_get(D->hashes, src & SRC_IDX)->hash);
+	}
+}
+
+/**
+ * table_lookup(D, hash):
+ * Return the number of the in-core record in ${D} with hash ${hash}, or
+ * SIZE_MAX if there is no such record.
+ */
+static size_t
+table_lookup(CHUNKS_DIR * D, const uint8_t * hash)
+{
+	uint64_t prefix = be32dec(hash);
+	uint64_t slot;
+	size_t pos;
+
+	for (pos = (size_t)prefix & (D->nslots - 1);
+	    (slot = D->slots[pos]) != 0;
+	    pos = (pos + 1) & (D->nslots - 1)) {
+		/* Only look at the full hash if the prefix matches. */
+		if ((slot >> 32) != prefix)
+			continue;
+		if (memcmp(rec_hash(D, (size_t)(slot & UINT32_MAX) - 1),
+		    hash, 32) == 0)
+			return ((size_t)(slot & UINT32_MAX) - 1);
+	}
+
+	/* Not found. */
+	return (SIZE_MAX);
+}
+
+/**
+ * table_resize(D, nslots):
+ * Replace the hash table of in-core records in ${D} with one having
+ * ${nslots} slots, where ${nslots} is a power of two.
+ */
+static int
+table_resize(CHUNKS_DIR * D, size_t nslots)
+{
+	uint64_t * slots;
+	size_t i, pos;
+
+	/* Allocate a new table. */
+	if (nslots > SIZE_MAX / sizeof(uint64_t)) {
+		errno = ENOMEM;
+		goto err0;
+	}
+	if ((slots = calloc(nslots, sizeof(uint64_t))) == NULL)
+		goto err0;
+
+	/* Move the slots over; the prefix tells us where they belong. */
+	for (i = 0; i < D->nslots; i++) {
+		if (D->slots[i] == 0)
+			continue;
+		for (pos = (size_t)(D->slots[i] >> 32) & (nslots - 1);
+		    slots[pos] != 0; pos = (pos + 1) & (nslots - 1))
+			continue;
+		slots[pos] = D->slots[i];
+	}
+
+	/* Replace the old table. */
+	free(D->slots);
+	D->slots = slots;
+	D->nslots = nslots;
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * table_reserve(D, n):
+ * Make sure that the hash table in ${D} can hold ${n} in-core records while
+ * remaining no more than 3/4 full.
+ */
+static int
+table_reserve(CHUNKS_DIR * D, size_t n)
+{
+	size_t nslots = D->nslots;
+
+	/* Record numbers must fit into a slot. */
+	if (n >= UINT32_MAX) {
+		warn0("Too many chunks in chunk directory");
+		goto err0;
+	}
+
+	/* Figure out how large the table needs to be. */
+	while (n > nslots - (nslots >> 2)) {
+		/* The prefix can't index more than 2^32 slots. */
+		if ((nslots > SIZE_MAX / 2) ||
+		    ((uint64_t)nslots >= ((uint64_t)(1) << 32)))
+			break;
+		nslots <<= 1;
+	}
+
+	/* Resize if necessary. */
+	if ((nslots != D->nslots) && table_resize(D, nslots))
+		goto err0;
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * table_add(D, hash, src, ch):
+ * Add an in-core record with hash ${hash}, which can be found as described
+ * by ${src}, and metadata ${ch} to ${D}.  Return a pointer to the metadata
+ * of the new record, or NULL on error.
+ */
+static struct chunkdata *
+table_add(CHUNKS_DIR * D, const uint8_t * hash, uint32_t src,
+    const struct chunkdata * ch)
+{
+	struct chunkdata_statstape rec;
+	uint64_t prefix = be32dec(hash);
+	size_t i = srclist_getsize(D->srcs);
+	size_t pos;
+
+	/* Make sure the hash table has room for this record. */
+	if (table_reserve(D, i + 1))
+		goto err0;
+
+	/* Add the metadata, with ncopies_ctape = 0 if we have it. */
+	memset(&rec, 0, sizeof(rec));
+	memcpy(&rec.d, ch, sizeof(struct chunkdata));
+	if (elasticarray_append(D->recs, &rec, 1, D->recsz))
+		goto err0;
+
+	/* Record where to find the hash. */
+	if (srclist_append(D->srcs, &src, 1))
+		goto err1;
+
+	/* Add the record to the hash table. */
+	for (pos = (size_t)prefix & (D->nslots - 1); D->slots[pos] != 0;
+	    pos = (pos + 1) & (D->nslots - 1))
+		continue;
+	D->slots[pos] = (prefix << 32) | (uint64_t)(i + 1);
+
+	/* Success! */
+	return (elasticarray_get(D->recs, i, D->recsz));
+
+err1:
+	elasticarray_shrink(D->recs, 1, D->recsz);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * core_add(D, hash, ch):
+ * Add an in-core record with hash ${hash}, which is stored in the array of
+ * hashes, and metadata ${ch} to ${D}.  Return a pointer to the metadata of
+ * the new record, or NULL on error.
+ */
+static struct chunkdata *
+core_add(CHUNKS_DIR * D, const uint8_t * hash, const struct chunkdata * ch)
+{
+	struct chunkhash h;
+	struct chunkdata * chn;
+	size_t nhashes = hashlist_getsize(D->hashes);
+
+	/* Make sure we can find the hash via a SRC_CORE index. */
+	if (nhashes > SRC_IDX) {
+		warn0("Too many chunks in chunk directory");
+		goto err0;
+	}
+
+	/* Store the hash... */
+	memcpy(h.hash, hash, 32);
+	if (hashlist_append(D->hashes, &h, 1))
+		goto err0;
+
+	/* ... and add the record. */
+	if ((chn = table_add(D, hash, SRC_CORE | (uint32_t)nhashes,
+	    ch)) == NULL)
+		goto err1;
+
+	/* Success! */
+	return (chn);
+
+err1:
+	hashlist_shrink(D->hashes, 1);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/* Compare the hashes of the struct corerec records ${a} and ${b}. */
+static int
+hashcmp(const void * a, const void * b)
+{
+	const struct corerec * cra = a;
+	const struct corerec * crb = b;
+
+	return (memcmp(cra->hash, crb->hash, 32));
+}
+
+/**
+ * core_sort(D):
+ * Return an array of the in-core records of ${D}, sorted by hash, or NULL on
+ * error.
+ */
+static struct corerec *
+core_sort(CHUNKS_DIR * D)
+{
+	struct corerec * CR;
+	size_t ncore = srclist_getsize(D->srcs);
+	size_t i;
+
+	/* Allocate an array. */
+	if (ncore > SIZE_MAX / sizeof(struct corerec) - 1) {
+		errno = ENOMEM;
+		return (NULL);
+	}
+	if ((CR = malloc((ncore + 1) * sizeof(struct corerec))) == NULL)
+		return (NULL);
+
+	/* Collect the records and sort them by hash. */
+	for (i = 0; i < ncore; i++) {
+		CR[i].hash = rec_hash(D, i);
+		CR[i].ch = elasticarray_get(D->recs, i, D->recsz);
+	}
+	qsort(CR, ncore, sizeof(struct corerec), hashcmp);
+
+	/* Success! */
+	return (CR);
+}
+
+/**
+ * search(recs, nrecs, hash):
+ * Return a pointer to the record with hash ${hash} in the array ${recs} of
+ * ${nrecs} records sorted by hash, or NULL if there is no such record.
+ */
+static const struct chunkdata_external *
+search(const struct chunkdata_external * recs, size_t nrecs,
+    const uint8_t * hash)
+{
+	const struct chunkdata_external * che;
+	uint64_t k, klo, khi;
+	size_t lo, hi, pos;
+	int bisect = 0;
+	int rc;
+
+	/*
+	 * Chunk hashes are HMAC outputs and thus uniformly distributed, so
+	 * interpolating on their leading 64 bits will usually find a chunk
+	 * within two or three probes; but we alternate with bisection steps
+	 * in order to keep the worst case logarithmic.
+	 */
+	k = be64dec(hash);
+	klo = 0;
+	khi = UINT64_MAX;
+	lo = 0;
+	hi = nrecs;
+	while (lo < hi) {
+		/* Pick a record in [lo, hi) to look at. */
+		if (bisect || (khi <= klo) || (k < klo) || (k > khi))
+			pos = lo + (hi - lo) / 2;
+		else
+			pos = lo + (size_t)((double)(k - klo) /
+			    (double)(khi - klo) * (double)(hi - lo));
+		if (pos >= hi)
+			pos = hi - 1;
+		bisect = !bisect;
+
+		/* Compare, and narrow the range. */
+		che = &recs[pos];
+		if ((rc = memcmp(hash, che->hash, 32)) == 0)
+			return (che);
+		if (rc < 0) {
+			hi = pos;
+			khi = be64dec(che->hash);
+		} else {
+			lo = pos + 1;
+			klo = be64dec(che->hash);
+		}
+	}
+
+	/* Not found. */
+	return (NULL);
+}
+
+/**
+ * cursor_init(C, recs, chs, n, tombstones):
+ * Point ${C} at the start of the ${n} sorted on-disk records ${recs}, or if
+ * ${recs} is NULL, the ${n} sorted in-core records ${chs}.  On-disk records
+ * may have nrefs == 0 if ${tombstones} is non-zero.
+ */
+static void
+cursor_init(struct cursor * C, const struct chunkdata_external * recs,
+    const struct corerec * chs, size_t n, int tombstones)
+{
+
+	C->recs = recs;
+	C->chs = chs;
+	C->n = n;
+	C->i = 0;
+	C->tombstones = tombstones;
+}
+
+/* Return the hash of the record at ${C}, or NULL if there are none left. */
+static const uint8_t *
+cursor_hash(struct cursor * C)
+{
+
+	if (C->i == C->n)
+		return (NULL);
+	if (C->recs != NULL)
+		return (C->recs[C->i].hash);
+	else
+		return (C->chs[C->i].hash);
+}
+
+/**
+ * merge_next(C, n, hash, ch):
+ * Read the record with the smallest hash from the cursors ${C}[0 .. n - 1],
+ * pointing ${hash} at its hash and reading its metadata into ${ch}, and
+ * advance all of the cursors which are at a record with that hash; if more
+ * than one is, the last such cursor takes precedence.  Return 1 if there are
+ * no records left, or -1 if a record is not sane.
+ */
+static int
+merge_next(struct cursor * C, size_t n, const uint8_t ** hash,
+    struct chunkdata * ch)
+{
+	struct cursor * best = NULL;
+	const uint8_t * h;
+	size_t k;
+
+	/* Find the smallest hash. */
+	*hash = NULL;
+	for (k = 0; k < n; k++) {
+		if ((h = cursor_hash(&C[k])) == NULL)
+			continue;
+		if ((*hash == NULL) || (memcmp(h, *hash, 32) <= 0)) {
+			*hash = h;
+			best = &C[k];
+		}
+	}
+
+	/* Are we done? */
+	if (best == NULL)
+		return (1);
+
+	/* Read the record. */
+	if (best->recs != NULL) {
+		if (rec_dec(&best->recs[best->i], ch, best->tombstones))
+			return (-1);
+	} else {
+		memcpy(ch, best->chs[best->i].ch, sizeof(struct chunkdata));
+	}
+
+	/* Move past this hash. */
+	for (k = 0; k < n; k++) {
+		if (((h = cursor_hash(&C[k])) != NULL) &&
+		    (memcmp(h, *hash, 32) == 0))
+			C[k].i++;
+	}
+
+	/* Success! */
+	return (0);
+}
+
+/* Initialize ${M} as an empty directory. */
+static void
+map_init(struct chunkdir_map * M)
+{
+
+	M->map = NULL;
+	M->maplen = 0;
+	M->recs = NULL;
+	M->nrecs = 0;
+}
+
+/**
+ * map_open(s, M, cde):
+ * If ${s} is a sorted chunk directory, read its header into ${cde} and map
+ * it into memory as ${M}.  Return 1 if ${s} does not exist or is not in a
+ * sorted format, 0 on success, or -1 on error.
+ */
+static int
+map_open(const char * s, struct chunkdir_map * M,
+    struct chunkdir_external * cde)
+{
+	struct stat sb;
+	FILE * f;
+	size_t nrecs;
+
+	/* We don't have anything yet. */
+	map_init(M);
+
+	/* Open the file, if it exists. */
+	if ((f = fopen(s, "r")) == NULL) {
+		if (errno == ENOENT)
+			return (1);
+		warnp("fopen(%s)", s);
+		goto err0;
+	}
+	if (fstat(fileno(f), &sb)) {
+		warnp("fstat(%s)", s);
+		goto err1;
+	}
+
+	/*
+	 * Make sure the directory file isn't too large, in order to avoid
+	 * any possibility of integer overflows.
+	 */
+	if ((sb.st_size < 0) ||
+	    ((sizeof(off_t) > sizeof(size_t)) && (sb.st_size > SIZE_MAX))) {
+		warn0("on-disk directory has insane size (%jd bytes): %s",
+		    (intmax_t)(sb.st_size), s);
+		goto err1;
+	}
+
+	/* Read the header, if this might be a sorted directory. */
+	if ((size_t)sb.st_size < sizeof(struct chunkdir_external))
+		goto notsorted;
+	if (fread(cde, sizeof(struct chunkdir_external), 1, f) != 1) {
+		warnp("fread(%s)", s);
+		goto err1;
+	}
+	if (memcmp(cde->magic, CHDIR_MAGIC, 8) &&
+	    memcmp(cde->magic, CHDIR_MAGIC_DELTA, 8))
+		goto notsorted;
+
+	/* Make sure the number of records is an integer. */
+	if (((size_t)sb.st_size - sizeof(struct chunkdir_external)) %
+	    sizeof(struct chunkdata_external)) {
+		warn0("on-disk directory is corrupt: %s", s);
+		goto err1;
+	}
+	nrecs = ((size_t)sb.st_size - sizeof(struct chunkdir_external)) /
+	    sizeof(struct chunkdata_external);
+
+	/* A complete directory has one record per chunk. */
+	if ((memcmp(cde->magic, CHDIR_MAGIC, 8) == 0) &&
+	    (le64dec(cde->numchunks) != nrecs)) {
+		warn0("on-disk directory is corrupt: %s", s);
+		goto err1;
+	}
+
+	/* Map the directory into memory. */
+	M->maplen = (size_t)sb.st_size;
+#ifdef HAVE_MMAP
+	if ((M->map = mmap(NULL, M->maplen, PROT_READ,
+#ifdef MAP_NOCORE
+	    MAP_SHARED | MAP_NOCORE,
+#else
+	    MAP_SHARED,
+#endif
+	    fileno(f), 0)) == MAP_FAILED) {
+		warnp("mmap(%s)", s);
+		goto err1;
+	}
+#else
+	/* Read the directory into memory instead. */
+	if ((M->map = malloc(M->maplen)) == NULL)
+		goto err1;
+	rewind(f);
+	if (fread(M->map, M->maplen, 1, f) != 1) {
+		warnp("fread(%s)", s);
+		free(M->map);
+		goto err1;
+	}
+#endif
+	M->recs = (const struct chunkdata_external *)
+	    ((uint8_t *)M->map + sizeof(struct chunkdir_external));
+	M->nrecs = nrecs;
+
+	/* We don't need the file handle any more. */
+	if (fclose(f)) {
+		warnp("fclose(%s)", s);
+		map_close(M);
+		goto err0;
+	}
+
+	/* Success! */
+	return (0);
+
+notsorted:
+	/* This isn't a sorted directory. */
+	if (fclose(f)) {
+		warnp("fclose(%s)", s);
+		goto err0;
+	}
+	return (1);
+
+err1:
+	if (fclose(f))
+		warnp("fclose");
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Unmap (or free, if we don't have mmap) the directory ${M}. */
+static void
+map_close(struct chunkdir_map * M)
+{
+
+	/* Nothing to do if we don't have anything. */
+	if (M->map == NULL)
+		return;
+
+#ifdef HAVE_MMAP
+	if (munmap(M->map, M->maplen))
+		warnp("munmap failed on chunk directory");
+#else
+	free(M->map);
+#endif
+	map_init(M);
+}
+
+/**
+ * maps_open(cachepath, base, delta, cde, cdb):
+ * Map the sorted chunk directory "${cachepath}/directory" as ${base} and
+ * read its header into ${cde} and ${cdb}; or if it is a delta, map it as
+ * ${delta} and read its header into ${cde}, and map the directory which it
+ * applies to as ${base} and read that header into ${cdb}.  Return 1 if
+ * there is no sorted chunk directory, 0 on success, or -1 on error.
+ */
+static int
+maps_open(const char * cachepath, struct chunkdir_map * base,
+    struct chunkdir_map * delta, struct chunkdir_external * cde,
+    struct chunkdir_external * cdb)
+{
+	char * s;
+	int rc;
+
+	/* We don't have a delta yet. */
+	map_init(delta);
+
+	/* Map ${cachepath}/directory. */
+	if (asprintf(&s, "%s/directory", cachepath) == -1) {
+		warnp("asprintf");
+		goto err0;
+	}
+	if ((rc = map_open(s, base, cde)) != 0)
+		goto done;
+
+	/* If this is a complete directory, we're done. */
+	if (memcmp(cde->magic, CHDIR_MAGIC, 8) == 0) {
+		memcpy(cdb, cde, sizeof(struct chunkdir_external));
+		goto done;
+	}
+
+	/* This is a delta; map its base. */
+	memcpy(delta, base, sizeof(struct chunkdir_map));
+	free(s);
+	if (asprintf(&s, "%s/directory.base", cachepath) == -1) {
+		warnp("asprintf");
+		goto err1;
+	}
+	if ((rc = map_open(s, base, cdb)) == -1)
+		goto err2;
+
+	/* Make sure this is the right base. */
+	if ((rc == 1) || memcmp(cdb->magic, CHDIR_MAGIC, 8) ||
+	    memcmp(cdb->id, cde->id, 8)) {
+		warn0("on-disk directory is corrupt: %s", s);
+		map_close(base);
+		goto err2;
+	}
+
+done:
+	free(s);
+
+	/* Success, or no sorted directory. */
+	return (rc);
+
+err2:
+	free(s);
+err1:
+	map_close(delta);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * base_link(cachepath):
+ * Make "${cachepath}/directory.base" a hard link to the complete chunk
+ * directory "${cachepath}/directory", so that it will stay around when the
+ * latter is replaced by a delta.  Return 1 if the filesystem doesn't
+ * support hard links, 0 on success, or -1 on error.
+ */
+static int
+base_link(const char * cachepath)
+{
+	char * s;
+	char * t;
+	int rc = 0;
+
+	/* Construct file names. */
+	if (asprintf(&s, "%s/directory", cachepath) == -1) {
+		warnp("asprintf");
+		goto err0;
+	}
+	if (asprintf(&t, "%s/directory.base", cachepath) == -1) {
+		warnp("asprintf");
+		goto err1;
+	}
+
+	/*
+	 * Remove any old base.  Transactions which were using it have
+	 * already been committed or discarded, since the current directory
+	 * is complete.
+	 */
+	if (unlink(t)) {
+		/* ENOENT isn't a problem. */
+		if (errno != ENOENT) {
+			warnp("unlink(%s)", t);
+			goto err2;
+		}
+	}
+
+	/* Create the link. */
+	if (link(s, t)) {
+		if ((errno != ENOSYS) && (errno != EPERM)) {
+			warnp("link(%s, %s)", s, t);
+			goto err2;
+		}
+
+		/* We'll have to write complete directories instead. */
+		rc = 1;
+	}
+
+	/* Make sure ${cachepath} is flushed to disk. */
+	if (dirutil_fsyncdir(cachepath))
+		goto err2;
+
+	/* Free file names. */
+	free(t);
+	free(s);
+
+	/* Success! */
+	return (rc);
+
+err2:
+	free(t);
+err1:
+	free(s);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Initialize ${F} as an empty filter. */
+static void
+filter_init(struct chunkfilter * F)
+{
+
+	F->map = NULL;
+	F->maplen = 0;
+	F->blocks = NULL;
+	F->nblocks = 0;
+	F->dirty = 0;
+}
+
+/**
+ * filter_alloc(F, n):
+ * Initialize ${F} as an empty in-core filter which is large enough to hold
+ * ${n} chunks.
+ */
+static int
+filter_alloc(struct chunkfilter * F, size_t n)
+{
+	size_t nblocks;
+
+	/* Figure out how many blocks we need; always have at least one. */
+	if (n > SIZE_MAX / FILTER_BITS) {
+		errno = ENOMEM;
+		goto err0;
+	}
+	nblocks = (n * FILTER_BITS + FILTER_BLOCK * 8 - 1) / (FILTER_BLOCK * 8);
+	if (nblocks == 0)
+		nblocks = 1;
+
+	/* Block numbers are computed using 32-bit arithmetic. */
+	if ((uint64_t)nblocks > UINT32_MAX) {
+		warn0("Too many chunks in chunk directory");
+		goto err0;
+	}
+
+	/* Allocate zeroed blocks. */
+	filter_init(F);
+	if ((F->blocks = calloc(nblocks, FILTER_BLOCK)) == NULL)
+		goto err0;
+	F->nblocks = nblocks;
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Return the number of the block of ${F} which holds the bits for ${hash}. */
+static size_t
+filter_blockno(const struct chunkfilter * F, const uint8_t * hash)
+{
+	uint64_t x = be32dec(hash);
+
+	/* Scale the (uniformly distributed) hash bits to a block number. */
+	return ((size_t)((x * F->nblocks) >> 32));
+}
+
+/* Return a pointer to the block of ${F} which holds the bits for ${hash}. */
+static uint8_t *
+filter_block(const struct chunkfilter * F, const uint8_t * hash)
+{
+
+	return (&F->blocks[filter_blockno(F, hash) * FILTER_BLOCK]);
+}
+
+/* Add the chunk with HMAC ${hash} to the in-core filter ${F}. */
+static void
+filter_add(struct chunkfilter * F, const uint8_t * hash)
+{
+	uint8_t * block = filter_block(F, hash);
+	uint64_t x = le64dec(&hash[16]);
+	unsigned int bit;
+	int k;
+
+	/* Each 9-bit piece of ${x} picks a bit within the block. */
+	for (k = 0; k < FILTER_K; k++, x >>= 9) {
+		bit = (unsigned int)(x & (FILTER_BLOCK * 8 - 1));
+		block[bit >> 3] |= (uint8_t)(1 << (bit & 7));
+	}
+}
+
+/**
+ * filter_check(F, hash):
+ * Return zero if the chunk with HMAC ${hash} is definitely not in the
+ * filter ${F}, or non-zero if it might be.
+ */
+static int
+filter_check(const struct chunkfilter * F, const uint8_t * hash)
+{
+	const uint8_t * block = filter_block(F, hash);
+	uint64_t x = le64dec(&hash[16]);
+	unsigned int bit;
+	int k;
+
+	/* Check the same bits as filter_add sets. */
+	for (k = 0; k < FILTER_K; k++, x >>= 9) {
+		bit = (unsigned int)(x & (FILTER_BLOCK * 8 - 1));
+		if ((block[bit >> 3] & (1 << (bit & 7))) == 0)
+			return (0);
+	}
+
+	/* The chunk might be present. */
+	return (1);
+}
+
+/* Add the records described by the struct filterjob ${cookie}. */
+static int
+filter_addrecs(void * cookie)
+{
+	struct filterjob * J = cookie;
+	size_t i;
+
+	for (i = 0; i < J->nrecs; i++)
+		filter_add(J->F, J->recs[i].hash);
+
+	/* Success! */
+	return (0);
+}
+
+/**
+ * filter_build(F, M):
+ * Initialize ${F} as an in-core filter of the chunks in the sorted
+ * directory ${M}, using up to tarsnap_opt_worker_threads threads.
+ */
+static int
+filter_build(struct chunkfilter * F, const struct chunkdir_map * M)
+{
+	struct filterjob J1;
+	struct filterjob * J;
+	WORKPOOL * P;
+	void * cookie;
+	size_t njobs, k, start, end;
+	int rc, jobrc;
+
+	/* Allocate an empty filter. */
+	if (filter_alloc(F, M->nrecs))
+		goto err0;
+
+	/* Figure out how many threads are worth using. */
+	njobs = M->nrecs / FILTER_MINJOB;
+	if (njobs > (size_t)tarsnap_opt_worker_threads)
+		njobs = (size_t)tarsnap_opt_worker_threads;
+
+	/* Add the chunks ourselves if we're not using worker threads. */
+	if (njobs < 2) {
+		J1.F = F;
+		J1.recs = M->recs;
+		J1.nrecs = M->nrecs;
+		(void)filter_addrecs(&J1);
+		goto done;
+	}
+
+	/* Split the records into ranges which start on block boundaries. */
+	if ((J = malloc(njobs * sizeof(struct filterjob))) == NULL)
+		goto err1;
+	for (start = k = 0; k < njobs; k++, start = end) {
+		if (k == njobs - 1)
+			end = M->nrecs;
+		else if ((end = (M->nrecs / njobs) * (k + 1)) < start)
+			end = start;
+		while ((end > 0) && (end < M->nrecs) &&
+		    (filter_blockno(F, M->recs[end].hash) ==
+		    filter_blockno(F, M->recs[end - 1].hash)))
+			end++;
+		J[k].F = F;
+		J[k].recs = &M->recs[start];
+		J[k].nrecs = end - start;
+	}
+
+	/* Add the ranges in worker threads and wait for them to finish. */
+	if ((P = workpool_init(njobs)) == NULL)
+		goto err2;
+	for (k = 0; k < njobs; k++) {
+		if (workpool_add(P, filter_addrecs, &J[k]))
+			goto err3;
+	}
+	while ((rc = workpool_wait(P, &cookie, &jobrc)) == 0)
+		continue;
+	if (rc == -1)
+		goto err3;
+
+	/* Shut down the threads. */
+	workpool_free(P);
+	free(J);
+
+done:
+	/* This needs to be written out. */
+	F->dirty = 1;
+
+	/* Success! */
+	return (0);
+
+err3:
+	workpool_free(P);
+err2:
+	free(J);
+err1:
+	filter_free(F);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * filter_open(cachepath, F, id):
+ * If "${cachepath}/directory.filter" is a filter of the complete directory
+ * with identifier ${id}, map it into memory as ${F}.  Return 1 if the filter
+ * does not exist or is for a different directory, 0 on success, or -1 on
+ * error.
+ */
+static int
+filter_open(const char * cachepath, struct chunkfilter * F,
+    const uint8_t * id)
+{
+	struct chunkfilter_external cfe;
+	struct stat sb;
+	FILE * f;
+	char * s;
+	uint64_t nblocks;
+	int rc = 1;
+
+	/* We don't have anything yet. */
+	filter_init(F);
+
+	/* Open the file, if it exists. */
+	if (asprintf(&s, "%s/directory.filter", cachepath) == -1) {
+		warnp("asprintf");
+		goto err0;
+	}
+	if ((f = fopen(s, "r")) == NULL) {
+		if (errno == ENOENT)
+			goto done;
+		warnp("fopen(%s)", s);
+		goto err1;
+	}
+	if (fstat(fileno(f), &sb)) {
+		warnp("fstat(%s)", s);
+		goto err2;
+	}
+
+	/* Read the header, and check that this is the filter we want. */
+	if ((sb.st_size < 0) ||
+	    ((uintmax_t)sb.st_size < sizeof(struct chunkfilter_external)))
+		goto notours;
+	if (fread(&cfe, sizeof(cfe), 1, f) != 1) {
+		warnp("fread(%s)", s);
+		goto err2;
+	}
+	if (memcmp(cfe.magic, CHFLT_MAGIC, 8) || memcmp(cfe.id, id, 8))
+		goto notours;
+
+	/* Make sure the size is right; if not, we'll build a new filter. */
+	nblocks = le64dec(cfe.nblocks);
+	if ((nblocks == 0) || (nblocks > UINT32_MAX) ||
+	    ((uintmax_t)sb.st_size != (nblocks + 1) * FILTER_BLOCK) ||
+	    ((uintmax_t)sb.st_size > SIZE_MAX))
+		goto notours;
+
+	/* Map the filter into memory. */
+	F->maplen = (size_t)sb.st_size;
+#ifdef HAVE_MMAP
+	if ((F->map = mmap(NULL, F->maplen, PROT_READ,
+#ifdef MAP_NOCORE
+	    MAP_SHARED | MAP_NOCORE,
+#else
+	    MAP_SHARED,
+#endif
+	    fileno(f), 0)) == MAP_FAILED) {
+		warnp("mmap(%s)", s);
+		F->map = NULL;
+		goto err2;
+	}
+#else
+	/* Read the filter into memory instead. */
+	if ((F->map = malloc(F->maplen)) == NULL)
+		goto err2;
+	rewind(f);
+	if (fread(F->map, F->maplen, 1, f) != 1) {
+		warnp("fread(%s)", s);
+		free(F->map);
+		F->map = NULL;
+		goto err2;
+	}
+#endif
+	F->blocks = (uint8_t *)F->map + sizeof(struct chunkfilter_external);
+	F->nblocks = (size_t)nblocks;
+	rc = 0;
+
+notours:
+	/* We don't need the file handle any more. */
+	if (fclose(f)) {
+		warnp("fclose(%s)", s);
+		filter_free(F);
+		goto err1;
+	}
+
+done:
+	free(s);
+
+	/* Success, or no usable filter. */
+	return (rc);
+
+err2:
+	if (fclose(f))
+		warnp("fclose");
+err1:
+	free(s);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * filter_write(cachepath, F, id):
+ * Write the in-core filter ${F} of the complete directory with identifier
+ * ${id} to "${cachepath}/directory.filter".
+ */
+static int
+filter_write(const char * cachepath, struct chunkfilter * F,
+    const uint8_t * id)
+{
+	struct chunkfilter_external cfe;
+	FILE * f;
+	char * s;
+	char * t;
+
+	/* Construct file names. */
+	if (asprintf(&s, "%s/directory.filter", cachepath) == -1) {
+		warnp("asprintf");
+		goto err0;
+	}
+	if (asprintf(&t, "%s/directory.filter.tmp", cachepath) == -1) {
+		warnp("asprintf");
+		goto err1;
+	}
 
-/**
- * callback_write(rec, cookie):
- * Convert chunkdata record ${rec} into a struct chunkdata_external and
- * write it to the FILE * ${cookie}; but don't write entries with nrefs == 0.
- */
-static int
-callback_write(void * rec, void * cookie)
-{
-	struct chunkdata_external che;
-	struct chunkdata * ch = rec;
-	FILE * f = cookie;
+	/* Write the filter to a temporary file. */
+	if ((f = fopen(t, "w")) == NULL) {
+		warnp("fopen(%s)", t);
+		goto err2;
+	}
+	memset(&cfe, 0, sizeof(cfe));
+	memcpy(cfe.magic, CHFLT_MAGIC, 8);
+	memcpy(cfe.id, id, 8);
+	le64enc(cfe.nblocks, F->nblocks);
+	if ((fwrite(&cfe, sizeof(cfe), 1, f) != 1) ||
+	    (fwrite(F->blocks, FILTER_BLOCK, F->nblocks, f) != F->nblocks)) {
+		warnp("Error writing to chunk filter");
+		goto err3;
+	}
+	if (fileutil_fsync(f, t))
+		goto err3;
+	if (fclose(f)) {
+		warnp("fclose(%s)", t);
+		goto err2;
+	}
 
-	/* If nrefs == 0, return without writing anything. */
-	if (ch->nrefs == 0)
-		return (0);
+	/*
+	 * Move it into place.  A filter which is lost in a crash will simply
+	 * be rebuilt, so we don't need to be as careful here as we are with
+	 * the directory itself.
+	 */
+	if (rename(t, s)) {
+		warnp("rename(%s, %s)", t, s);
+		goto err2;
+	}
 
-	/* Convert to on-disk format. */
-	memcpy(che.hash, ch->hash, 32);
-	le32enc(che.len, ch->len);
-	le32enc(che.zlen, ch->zlen_flags & CHDATA_ZLEN);
-	le32enc(che.nrefs, ch->nrefs);
-	le32enc(che.ncopies, ch->ncopies);
+	/* The filter is now on disk. */
+	F->dirty = 0;
 
-	/* Write. */
-	if (fwrite(&che, sizeof(che), 1, f) != 1) {
-		warnp("Error writing to chunk directory");
-		return (-1);
-	}
+	/* Free file names. */
+	free(t);
+	free(s);
 
 	/* Success! */
 	return (0);
+
+err3:
+	if (fclose(f))
+		warnp("fclose");
+err2:
+	free(t);
+err1:
+	free(s);
+err0:
+	/* Failure! */
+	return (-1);
 }
 
-/**
- * callback_free(rec, cookie):
- * If the chunkdata record ${rec} was allocated via malloc(3), free it.
- */
-static int
-callback_free(void * rec, void * cookie)
+/* Unmap or free the filter ${F}. */
+static void
+filter_free(struct chunkfilter * F)
 {
-	struct chunkdata * ch = rec;
 
-	(void)cookie;	/* UNUSED */
-
-	if (ch->zlen_flags & CHDATA_MALLOC)
-		free(rec);
+	/* A filter which we built in memory has no map. */
+	if (F->map == NULL) {
+		free(F->blocks);
+		filter_init(F);
+		return;
+	}
 
-	/* Success! */
-	return (0);
+#ifdef HAVE_MMAP
+	if (munmap(F->map, F->maplen))
+		warnp("munmap failed on chunk filter");
+#else
+	free(F->map);
+#endif
+	filter_init(F);
 }
 
 /**
- * chunks_directory_read(cachepath, dir, stats_unique, stats_all, stats_extra,
- *     mustexist, statstape):
- * Read stats_extra statistics (statistics on non-chunks which are stored)
- * and the chunk directory (if present) from "${cachepath}/directory" into
- * memory allocated and assigned to ${*dir}; and return a hash table
- * populated with struct chunkdata records.  Populate stats_all with
- * statistics for all the chunks listed in the directory (counting
- * multiplicity) and populate stats_unique with statistics reflecting the
- * unique chunks.  If ${mustexist}, error out if the directory does not exist.
- * If ${statstape}, allocate struct chunkdata_statstape records instead.
- */
-RWHASHTAB *
-chunks_directory_read(const char * cachepath, void ** dir,
-    struct chunkstats * stats_unique, struct chunkstats * stats_all,
-    struct chunkstats * stats_extra, int mustexist, int statstape)
+ * spill(D):
+ * Write the in-core records of ${D}, merged with the newest spill runs which
+ * are not much larger, to a new spill run; and empty the in-core records.
+ */
+static int
+spill(CHUNKS_DIR * D)
 {
+	struct chunkdir_external cde;
 	struct chunkdata_external che;
-	struct chunkstats_external cse;
-	struct stat sb;
-	RWHASHTAB * HT;
-	char * s;
-	struct chunkdata * p = NULL;
-	struct chunkdata_statstape * ps = NULL;
+	struct chunkdir_map M;
+	struct cursor C[SPILL_MAXRUNS + 1];
+	struct corerec * CR;
+	struct chunkdata ch;
+	const uint8_t * hash;
 	FILE * f;
-	size_t numchunks;
-
-	/* Zero statistics. */
-	chunks_stats_zero(stats_unique);
-	chunks_stats_zero(stats_all);
-	chunks_stats_zero(stats_extra);
+	size_t ncore = srclist_getsize(D->srcs);
+	size_t nmerged, k, i;
+	int rc;
 
-	/* Create a hash table to hold the chunkdata structures. */
-	HT = rwhashtab_init(offsetof(struct chunkdata, hash), 32);
-	if (HT == NULL)
+	/* Sort the in-core records. */
+	if ((CR = core_sort(D)) == NULL)
 		goto err0;
 
-	/* Bail if we're not using a cache directory. */
-	if (cachepath == NULL) {
-		*dir = NULL;
-		return (HT);
+	/*
+	 * Pick the runs to merge: the newest ones which are no more than
+	 * twice the size of what we're writing, and at least one if we
+	 * don't have room for another run.
+	 */
+	nmerged = ncore;
+	for (k = D->nruns; k > 0; k--) {
+		if (D->runs[k - 1].nrecs > nmerged * 2)
+			break;
+		nmerged += D->runs[k - 1].nrecs;
 	}
-
-	/* Construct the string "${cachepath}/directory". */
-	if (asprintf(&s, "%s/directory", cachepath) == -1) {
-		warnp("asprintf");
+	if (k == SPILL_MAXRUNS)
+		k--;
+
+	/* Set up cursors for those runs and the in-core records. */
+	for (i = k; i < D->nruns; i++)
+		cursor_init(&C[i - k], D->runs[i].recs, NULL,
+		    D->runs[i].nrecs, 1);
+	cursor_init(&C[i - k], NULL, CR, ncore, 1);
+
+	/* Create the new run. */
+	if ((f = fopen(D->spillpath, "w")) == NULL) {
+		warnp("fopen(%s)", D->spillpath);
 		goto err1;
 	}
-	if (stat(s, &sb)) {
-		/* Could not stat ${cachepath}/directory.  Error? */
-		if (errno != ENOENT) {
-			warnp("stat(%s)", s);
+
+	/* Runs have a header so that we can map them like a delta. */
+	memset(&cde, 0, sizeof(cde));
+	memcpy(cde.magic, CHDIR_MAGIC_DELTA, 8);
+	if (fwrite(&cde, sizeof(cde), 1, f) != 1) {
+		warnp("Error writing to chunk directory");
+		goto err2;
+	}
+
+	/* Write the merged records, keeping their flags. */
+	while ((rc = merge_next(C, D->nruns - k + 1, &hash, &ch)) != 1) {
+		if (rc == -1) {
+			warn0("on-disk directory is corrupt");
 			goto err2;
 		}
-
-		/* The directory doesn't exist; complain if mustexist != 0. */
-		if (mustexist) {
-			warn0("Error reading cache directory from %s",
-			    cachepath);
+		rec_enc(hash, &ch, &che);
+		le32enc(che.zlen, ch.zlen_flags);
+		if (fwrite(&che, sizeof(che), 1, f) != 1) {
+			warnp("Error writing to chunk directory");
 			goto err2;
 		}
-
-		/*
-		 * ${cachepath}/directory does not exist; set ${*dir} to NULL
-		 * and return the empty hash table.
-		 */
-		free(s);
-		*dir = NULL;
-		return (HT);
 	}
-
-	/*
-	 * Make sure the directory file isn't too large or too small, in
-	 * order to avoid any possibility of integer overflows.
-	 */
-	if ((sb.st_size < 0) ||
-	    ((sizeof(off_t) > sizeof(size_t)) && (sb.st_size > SIZE_MAX))) {
-		warn0("on-disk directory has insane size (%jd bytes): %s",
-		    (intmax_t)(sb.st_size), s);
-		goto err2;
+	if (fclose(f)) {
+		warnp("fclose(%s)", D->spillpath);
+		goto err1;
 	}
 
-	/* Make sure the directory file isn't too small (different message). */
-	if ((size_t)sb.st_size < sizeof(struct chunkstats_external)) {
-		warn0("on-disk directory is too small (%jd bytes): %s",
-		    (intmax_t)(sb.st_size), s);
-		goto err2;
+	/* Map the new run; we don't need its name after that. */
+	if (map_open(D->spillpath, &M, &cde)) {
+		warn0("Cannot map spilled chunk directory: %s", D->spillpath);
+		goto err1;
 	}
-
-	/* Make sure the number of chunks is an integer. */
-	if (((size_t)sb.st_size - sizeof(struct chunkstats_external)) %
-	    (sizeof(struct chunkdata_external))) {
-		warn0("on-disk directory is corrupt: %s", s);
-		goto err2;
+	if (unlink(D->spillpath)) {
+		warnp("unlink(%s)", D->spillpath);
+		map_close(&M);
+		goto err1;
 	}
 
-	/* Compute the number of on-disk chunks. */
-	numchunks =
-	    ((size_t)sb.st_size - sizeof(struct chunkstats_external)) /
-	    sizeof(struct chunkdata_external);
+	/* Replace the runs which we merged. */
+	for (i = k; i < D->nruns; i++)
+		map_close(&D->runs[i]);
+	memcpy(&D->runs[k], &M, sizeof(struct chunkdir_map));
+	D->nruns = k + 1;
 
-	/* Make sure we don't get an integer overflow. */
-	if (numchunks >= SIZE_MAX / sizeof(struct chunkdata_statstape)) {
-		warn0("on-disk directory is too large: %s", s);
-		goto err2;
-	}
+	/* Empty the in-core records. */
+	elasticarray_shrink(D->recs, ncore, D->recsz);
+	srclist_shrink(D->srcs, ncore);
+	hashlist_shrink(D->hashes, hashlist_getsize(D->hashes));
+	memset(D->slots, 0, D->nslots * sizeof(uint64_t));
 
-	/*
-	 * Allocate memory to ${*dir} large enough to store a struct
-	 * chunkdata or struct chunkdata_statstape for each struct
-	 * chunkdata_external in ${cachepath}/directory.
-	 */
-	if (statstape) {
-		ps = malloc(numchunks * sizeof(struct chunkdata_statstape));
-		*dir = ps;
-	} else {
-		p = malloc(numchunks * sizeof(struct chunkdata));
-		*dir = p;
-	}
-	if (*dir == NULL)
+	/* Free the sorted array. */
+	free(CR);
+
+	/* Success! */
+	return (0);
+
+err2:
+	if (fclose(f))
+		warnp("fclose");
+err1:
+	free(CR);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * directory_write(cachepath, D, cdb, stats_extra, suff):
+ * Write stats_extra statistics and the union of the base directory of ${D},
+ * its delta, its spill runs, and its in-core records (with precedence in
+ * that order) to
+ * "${cachepath}/directory${suff}".  If ${cdb} is non-NULL, it is the header
+ * of the base directory, and only a new delta relative to the base is
+ * written; otherwise a complete directory is written.  Return 1 (after
+ * writing a partial file) if the delta would have more than 1/DELTA_MAXFRAC
+ * as many records as the base.
+ */
+static int
+directory_write(const char * cachepath, CHUNKS_DIR * D,
+    const struct chunkdir_external * cdb, struct chunkstats * stats_extra,
+    const char * suff)
+{
+	struct chunkdir_external cde;
+	struct chunkdata_external che;
+	const struct chunkdata_external * cheb;
+	struct chunkstats stats_unique, stats_all;
+	struct chunkfilter F;
+	struct cursor C[SPILL_MAXRUNS + 3];
+	struct corerec * CR;
+	struct chunkdata ch, chb;
+	const uint8_t * hash;
+	FILE * f;
+	char * s;
+	uint64_t numchunks;
+	size_t nwritten = 0;
+	size_t k;
+	int rc;
+
+	/* The caller must pass the cachepath, and a suffix to use. */
+	assert(cachepath != NULL);
+	assert(suff != NULL);
+
+	/* Collect the in-core records and sort them by hash. */
+	if ((CR = core_sort(D)) == NULL)
+		goto err0;
+
+	/* Set up cursors for the base, delta, runs, and in-core records. */
+	cursor_init(&C[0], D->base.recs, NULL, D->base.nrecs, 0);
+	cursor_init(&C[1], D->delta.recs, NULL, D->delta.nrecs, 1);
+	for (k = 0; k < D->nruns; k++)
+		cursor_init(&C[k + 2], D->runs[k].recs, NULL,
+		    D->runs[k].nrecs, 1);
+	cursor_init(&C[k + 2], NULL, CR, srclist_getsize(D->srcs), 1);
+
+	/* A complete directory gets a filter; we can't write more chunks. */
+	filter_init(&F);
+	if ((cdb == NULL) && filter_alloc(&F, chunks_directory_getsize(D)))
+		goto err1;
+
+	/* Construct the path to the new chunk directory. */
+	if (asprintf(&s, "%s/directory%s", cachepath, suff) == -1) {
+		warnp("asprintf");
 		goto err2;
+	}
 
-	/* Open the directory file. */
-	if ((f = fopen(s, "r")) == NULL) {
+	/* Create the new chunk directory. */
+	if ((f = fopen(s, "w")) == NULL) {
 		warnp("fopen(%s)", s);
 		goto err3;
 	}
 
-	/* Read the extra files statistics. */
-	if (fread(&cse, sizeof(cse), 1, f) != 1) {
-		warnp("fread(%s)", s);
+	/* Leave space for the header; we fill it in at the end. */
+	memset(&cde, 0, sizeof(cde));
+	if (fwrite(&cde, sizeof(cde), 1, f) != 1) {
+		warnp("Error writing to chunk directory");
 		goto err4;
 	}
-	stats_extra->nchunks = le64dec(cse.nchunks);
-	stats_extra->s_len = le64dec(cse.s_len);
-	stats_extra->s_zlen = le64dec(cse.s_zlen);
 
-	/* Read the chunk structures. */
-	for (; numchunks != 0; numchunks--) {
-		/* Set p to point at the struct chunkdata. */
-		if (statstape)
-			p = &ps->d;
+	/*
+	 * If we're writing a delta, start with the statistics for the base
+	 * and adjust them for each record which we write out; otherwise we
+	 * add up the statistics for all the records.
+	 */
+	if (cdb != NULL) {
+		numchunks = le64dec(cdb->numchunks);
+		stats_dec(&cdb->unique, &stats_unique);
+		stats_dec(&cdb->all, &stats_all);
+	} else {
+		numchunks = 0;
+		chunks_stats_zero(&stats_unique);
+		chunks_stats_zero(&stats_all);
+	}
 
-		/* Read the file one record at a time... */
-		if (fread(&che, sizeof(che), 1, f) != 1) {
-			warnp("fread(%s)", s);
+	/* Merge records from the cursors. */
+	do {
+		/* Get the next record. */
+		if (cdb != NULL)
+			rc = merge_next(&C[1], D->nruns + 2, &hash, &ch);
+		else
+			rc = merge_next(C, D->nruns + 3, &hash, &ch);
+		if (rc == 1)
+			break;
+		if (rc == -1) {
+			warn0("on-disk directory is corrupt");
 			goto err4;
 		}
 
-		/* ... creating struct chunkdata records... */
-		memcpy(p->hash, che.hash, 32);
-		p->len = le32dec(che.len);
-		p->zlen_flags = le32dec(che.zlen);
-		p->nrefs = le32dec(che.nrefs);
-		p->ncopies = le32dec(che.ncopies);
-
-		/* ... inserting them into the hash table... */
-		if (rwhashtab_insert(HT, p))
-			goto err4;
-
-#if UINT32_MAX > SSIZE_MAX
-		/* ... paranoid check for number of copies... */
-		if (p->ncopies > SSIZE_MAX)
-			warn0("More than %zd copies of a chunk; "
-			    "data is ok but stats may be inaccurate",
-			    SSIZE_MAX);
-#endif
-
-		/* ... and updating the statistics. */
-		chunks_stats_add(stats_unique, p->len, p->zlen_flags, 1);
-		chunks_stats_add(stats_all, p->len, p->zlen_flags,
-		    (ssize_t)p->ncopies);
+		/* If we're writing a delta, look for a base record. */
+		cheb = NULL;
+		if (cdb != NULL) {
+			cheb = search(D->base.recs, D->base.nrecs, hash);
+			if ((cheb != NULL) && rec_dec(cheb, &chb, 0)) {
+				warn0("on-disk directory is corrupt");
+				goto err4;
+			}
+		}
 
-		/* Sanity check. */
-		if ((p->len == 0) || (p->zlen_flags == 0) || (p->nrefs == 0)) {
-			warn0("on-disk directory is corrupt: %s", s);
+		/*
+		 * A complete directory doesn't have records with nrefs == 0,
+		 * and a delta only needs them if they remove a base record.
+		 */
+		if ((ch.nrefs == 0) && (cheb == NULL))
+			continue;
+
+		/* A delta doesn't need records which match the base. */
+		if ((cheb != NULL) && (ch.nrefs != 0) &&
+		    (ch.len == chb.len) && (ch.nrefs == chb.nrefs) &&
+		    (ch.ncopies == chb.ncopies) &&
+		    ((ch.zlen_flags & CHDATA_ZLEN) == chb.zlen_flags))
+			continue;
+
+		/* Give up on a delta if it's getting too large. */
+		if ((cdb != NULL) &&
+		    (++nwritten > D->base.nrecs / DELTA_MAXFRAC))
+			goto toolarge;
+
+		/* Write. */
+		rec_enc(hash, &ch, &che);
+		if (fwrite(&che, sizeof(che), 1, f) != 1) {
+			warnp("Error writing to chunk directory");
 			goto err4;
 		}
+		if (cdb == NULL)
+			filter_add(&F, hash);
+
+		/* Update statistics. */
+		if (cheb != NULL) {
+			chunks_stats_add(&stats_unique, chb.len,
+			    chb.zlen_flags, -1);
+			chunks_stats_add(&stats_all, chb.len,
+			    chb.zlen_flags, -(ssize_t)chb.ncopies);
+			numchunks--;
+		}
+		if (ch.nrefs != 0) {
+			chunks_stats_add(&stats_unique, ch.len,
+			    ch.zlen_flags & CHDATA_ZLEN, 1);
+			chunks_stats_add(&stats_all, ch.len,
+			    ch.zlen_flags & CHDATA_ZLEN, (ssize_t)ch.ncopies);
+			numchunks++;
+		}
+	} while (1);
 
-		/* Move to next record. */
-		if (statstape)
-			ps++;
-		else
-			p++;
+	/* Fill in the header; a new complete directory gets a new ID. */
+	if (cdb != NULL) {
+		memcpy(cde.magic, CHDIR_MAGIC_DELTA, 8);
+		memcpy(cde.id, cdb->id, 8);
+	} else {
+		memcpy(cde.magic, CHDIR_MAGIC, 8);
+		if (crypto_entropy_read(cde.id, 8))
+			goto err4;
+	}
+	le64enc(cde.numchunks, numchunks);
+	stats_enc(stats_extra, &cde.extra);
+	stats_enc(&stats_unique, &cde.unique);
+	stats_enc(&stats_all, &cde.all);
+
+	/* Go back and write the header. */
+	if (fseeko(f, 0, SEEK_SET)) {
+		warnp("fseeko(%s)", s);
+		goto err4;
 	}
+	if (fwrite(&cde, sizeof(cde), 1, f) != 1) {
+		warnp("Error writing to chunk directory");
+		goto err4;
+	}
+
+	/* Call fsync on the new chunk directory and close it. */
+	if (fileutil_fsync(f, s))
+		goto err4;
 	if (fclose(f)) {
 		warnp("fclose(%s)", s);
 		goto err3;
 	}
 
+	/* Write the filter of a new complete directory. */
+	if ((cdb == NULL) && filter_write(cachepath, &F, cde.id))
+		goto err3;
+
 	/* Free string allocated by asprintf. */
 	free(s);
 
+	/* Free the filter and the array of in-core records. */
+	filter_free(&F);
+	free(CR);
+
 	/* Success! */
-	return (HT);
+	return (0);
+
+toolarge:
+	/* The caller will overwrite this file with a complete directory. */
+	if (fclose(f)) {
+		warnp("fclose(%s)", s);
+		goto err3;
+	}
+	free(s);
+	free(CR);
+
+	/* We didn't write a delta. */
+	return (1);
 
 err4:
 	if (fclose(f))
 		warnp("fclose");
 err3:
-	free(*dir);
-err2:
 	free(s);
+err2:
+	filter_free(&F);
 err1:
-	rwhashtab_free(HT);
+	free(CR);
 err0:
 	/* Failure! */
-	return (NULL);
+	return (-1);
 }
 
-/**
- * chunks_directory_write(cachepath, HT, stats_extra, suff):
- * Write stats_extra statistics and the contents of the hash table ${HT} of
- * struct chunkdata records to a new chunk directory in
- * "${cachepath}/directory${suff}".
- */
-int
-chunks_directory_write(const char * cachepath, RWHASHTAB * HT,
-    struct chunkstats * stats_extra, const char * suff)
-{
-	struct chunkstats_external cse;
-	FILE * f;
-	char * s;
+/**
+ * read_old(D, cachepath, stats_unique, stats_all, stats_extra, mustexist):
+ * Read stats_extra statistics (statistics on non-chunks which are stored)
+ * and the chunk directory (if present) in the original unsorted format from
+ * "${cachepath}/directory" into the in-core records of ${D}.  Populate
+ * stats_all with statistics for all the chunks listed in the directory
+ * (counting multiplicity) and populate stats_unique with statistics
+ * reflecting the unique chunks.  If ${mustexist}, error out if the
+ * directory does not exist.
+ */
+static int
+read_old(CHUNKS_DIR * D, const char * cachepath,
+    struct chunkstats * stats_unique, struct chunkstats * stats_all,
+    struct chunkstats * stats_extra, int mustexist)
+{
+	struct chunkdata_external che;
+	struct chunkstats_external cse;
+	struct chunkdata ch;
+	struct chunkhash h;
+	struct stat sb;
+	char * s;
+	FILE * f;
+	size_t numchunks, i;
+	uint32_t src;
+
+	/* Zero statistics. */
+	chunks_stats_zero(stats_unique);
+	chunks_stats_zero(stats_all);
+	chunks_stats_zero(stats_extra);
+
+	/* Bail if we're not using a cache directory. */
+	if (cachepath == NULL)
+		return (0);
+
+	/* Construct the string "${cachepath}/directory". */
+	if (asprintf(&s, "%s/directory", cachepath) == -1) {
+		warnp("asprintf");
+		goto err0;
+	}
+	if (stat(s, &sb)) {
+		/* Could not stat ${cachepath}/directory.  Error? */
+		if (errno != ENOENT) {
+			warnp("stat(%s)", s);
+			goto err1;
+		}
+
+		/* The directory doesn't exist; complain if mustexist != 0. */
+		if (mustexist) {
+			warn0("Error reading cache directory from %s",
+			    cachepath);
+			goto err1;
+		}
+
+		/* ${cachepath}/directory does not exist; we're done. */
+		free(s);
+		return (0);
+	}
+
+	/*
+	 * Make sure the directory file isn't too large or too small, in
+	 * order to avoid any possibility of integer overflows.
+	 */
+	if ((sb.st_size < 0) ||
+	    ((sizeof(off_t) > sizeof(size_t)) && (sb.st_size > SIZE_MAX))) {
+		warn0("on-disk directory has insane size (%jd bytes): %s",
+		    (intmax_t)(sb.st_size), s);
+		goto err1;
+	}
+
+	/* Make sure the directory file isn't too small (different message). */
+	if ((size_t)sb.st_size < sizeof(struct chunkstats_external)) {
+		warn0("on-disk directory is too small (%jd bytes): %s",
+		    (intmax_t)(sb.st_size), s);
+		goto err1;
+	}
 
-	/* The caller must pass the cachepath, and a suffix to use. */
-	assert(cachepath != NULL);
-	assert(suff != NULL);
+	/* Make sure the number of chunks is an integer. */
+	if (((size_t)sb.st_size - sizeof(struct chunkstats_external)) %
+	    (sizeof(struct chunkdata_external))) {
+		warn0("on-disk directory is corrupt: %s", s);
+		goto err1;
+	}
 
-	/* Construct the path to the new chunk directory. */
-	if (asprintf(&s, "%s/directory%s", cachepath, suff) == -1) {
-		warnp("asprintf");
-		goto err0;
+	/* Compute the number of on-disk chunks. */
+	numchunks =
+	    ((size_t)sb.st_size - sizeof(struct chunkstats_external)) /
+	    sizeof(struct chunkdata_external);
+
+	/* Make sure every hash can be found via a SRC_CORE index. */
+	if (numchunks > SRC_IDX) {
+		warn0("on-disk directory is too large: %s", s);
+		goto err1;
 	}
 
-	/* Create the new chunk directory. */
-	if ((f = fopen(s, "w")) == NULL) {
+	/* Size the hash table up front so it never needs to be rehashed. */
+	if (table_reserve(D, numchunks))
+		goto err1;
+
+	/* Open the directory file. */
+	if ((f = fopen(s, "r")) == NULL) {
 		warnp("fopen(%s)", s);
 		goto err1;
 	}
 
-	/* Write the extra files statistics. */
-	le64enc(cse.nchunks, stats_extra->nchunks);
-	le64enc(cse.s_len, stats_extra->s_len);
-	le64enc(cse.s_zlen, stats_extra->s_zlen);
-	if (fwrite(&cse, sizeof(cse), 1, f) != 1) {
-		warnp("Error writing to chunk directory");
+	/* Read the extra files statistics. */
+	if (fread(&cse, sizeof(cse), 1, f) != 1) {
+		warnp("fread(%s)", s);
 		goto err2;
 	}
+	stats_dec(&cse, stats_extra);
 
-	/* Write the hash table entries to the new chunk directory. */
-	if (rwhashtab_foreach(HT, callback_write, f))
-		goto err2;
+	/* Read the chunk structures. */
+	for (i = 0; i < numchunks; i++) {
+		/* Read the file one record at a time... */
+		if (fread(&che, sizeof(che), 1, f) != 1) {
+			warnp("fread(%s)", s);
+			goto err2;
+		}
 
-	/* Call fsync on the new chunk directory and close it. */
-	if (fileutil_fsync(f, s))
-		goto err2;
+		/* ... decoding them... */
+		if (rec_dec(&che, &ch, 0) ||
+		    (table_lookup(D, che.hash) != SIZE_MAX)) {
+			warn0("on-disk directory is corrupt: %s", s);
+			goto err2;
+		}
+
+		/* ... and adding them to the in-core records. */
+		src = SRC_CORE | (uint32_t)hashlist_getsize(D->hashes);
+		memcpy(h.hash, che.hash, 32);
+		if (hashlist_append(D->hashes, &h, 1))
+			goto err2;
+		if (table_add(D, che.hash, src, &ch) == NULL)
+			goto err2;
+
+		/* Update the statistics. */
+		chunks_stats_add(stats_unique, ch.len, ch.zlen_flags, 1);
+		chunks_stats_add(stats_all, ch.len, ch.zlen_flags,
+		    (ssize_t)ch.ncopies);
+	}
+	D->nchunks = numchunks;
 	if (fclose(f)) {
 		warnp("fclose(%s)", s);
 		goto err1;
@@ -416,22 +1957,384 @@ done:
 }
 
 /**
- * chunks_directory_free(HT, dir):
- * Free the hash table ${HT} of struct chunkdata records, all of its
- * elements, and ${dir}.
+ * chunks_directory_open(cachepath, stats_unique, stats_all, stats_extra,
+ *     mustexist, statstape):
+ * Open the chunk directory (if present) in "${cachepath}/directory", and
+ * read the stats_extra statistics and statistics for all the chunks listed
+ * in the directory both counting multiplicity (stats_all) and counting unique
+ * chunks (stats_unique).  A directory in the sorted format is mapped into
+ * memory and records are read from it as needed; a directory in the old
+ * format is read into memory in its entirety.  If ${cachepath} is NULL,
+ * return an empty directory.  If ${mustexist}, error out if the directory
+ * does not exist.  If ${statstape}, in-core records are struct
+ * chunkdata_statstape instead of struct chunkdata; otherwise, if
+ * tarsnap_opt_directory_memlimit is set, in-core records beyond that budget
+ * are spilled to temporary files in ${cachepath}.
  */
-void
-chunks_directory_free(RWHASHTAB * HT, void * dir)
+CHUNKS_DIR *
+chunks_directory_open(const char * cachepath,
+    struct chunkstats * stats_unique, struct chunkstats * stats_all,
+    struct chunkstats * stats_extra, int mustexist, int statstape)
+{
+	CHUNKS_DIR * D;
+	struct chunkdir_external cde;
+
+	/* Allocate memory. */
+	if ((D = malloc(sizeof(CHUNKS_DIR))) == NULL)
+		goto err0;
+	D->slots = NULL;
+	D->nslots = 0;
+	map_init(&D->base);
+	map_init(&D->delta);
+	filter_init(&D->filter);
+	D->nruns = 0;
+	D->maxcore = SIZE_MAX;
+	D->spillpath = NULL;
+	D->baseisdir = 0;
+	D->nchunks = 0;
+	D->nnew = 0;
+
+	/* Create empty arrays for in-core records. */
+	if (statstape)
+		D->recsz = sizeof(struct chunkdata_statstape);
+	else
+		D->recsz = sizeof(struct chunkdata);
+	if ((D->recs = elasticarray_init(0, D->recsz)) == NULL)
+		goto err1;
+	if ((D->srcs = srclist_init(0)) == NULL)
+		goto err2;
+	if ((D->hashes = hashlist_init(0)) == NULL)
+		goto err3;
+	if (table_resize(D, 16))
+		goto err4;
+
+	/* Without a cache directory, we just need an empty directory. */
+	if (cachepath == NULL)
+		goto oldformat;
+
+	/* Map the directory, if it is in the sorted format. */
+	switch (maps_open(cachepath, &D->base, &D->delta, &cde, &D->cdb)) {
+	case -1:
+		goto err5;
+	case 1:
+		goto oldformat;
+	}
+	D->baseisdir = (D->delta.map == NULL);
+
+	/* Make sure every hash can be found via a SRC_* index. */
+	if ((D->base.nrecs > SRC_IDX) || (D->delta.nrecs > SRC_IDX)) {
+		warn0("on-disk directory is too large");
+		goto err6;
+	}
+
+	/* Map the filter of the base, if we have an up-to-date one. */
+	if (filter_open(cachepath, &D->filter, D->cdb.id) == -1)
+		goto err6;
+
+	/*
+	 * Limit the number of in-core records if asked to; but not if we're
+	 * collecting per-tape statistics, since that needs every record.
+	 */
+	if ((tarsnap_opt_directory_memlimit != (uint64_t)(-1)) &&
+	    !statstape) {
+		if (tarsnap_opt_directory_memlimit / SPILL_RECSZ < SIZE_MAX)
+			D->maxcore = (size_t)(tarsnap_opt_directory_memlimit /
+			    SPILL_RECSZ);
+		if (D->maxcore < SPILL_MINRECS)
+			D->maxcore = SPILL_MINRECS;
+		if (asprintf(&D->spillpath, "%s/directory.spill",
+		    cachepath) == -1) {
+			warnp("asprintf");
+			goto err7;
+		}
+	}
+
+	/* Extract statistics from the header. */
+	D->nchunks = le64dec(cde.numchunks);
+	stats_dec(&cde.extra, stats_extra);
+	stats_dec(&cde.unique, stats_unique);
+	stats_dec(&cde.all, stats_all);
+
+	/* Success! */
+	return (D);
+
+oldformat:
+	/* Read the entire directory into core. */
+	if (read_old(D, cachepath, stats_unique, stats_all, stats_extra,
+	    mustexist))
+		goto err5;
+
+	/* Success! */
+	return (D);
+
+err7:
+	filter_free(&D->filter);
+err6:
+	map_close(&D->delta);
+	map_close(&D->base);
+err5:
+	free(D->slots);
+err4:
+	hashlist_free(D->hashes);
+err3:
+	srclist_free(D->srcs);
+err2:
+	elasticarray_free(D->recs);
+err1:
+	free(D);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * chunks_directory_find(D, hash, ch):
+ * Look for the chunk with HMAC ${hash} in the chunk directory ${D}.  If it
+ * is present, set ${ch} to point to an in-core record which the caller may
+ * modify until the next chunks_directory_find or chunks_directory_insert
+ * call; otherwise, set ${ch} to NULL.
+ */
+int
+chunks_directory_find(CHUNKS_DIR * D, const uint8_t * hash,
+    struct chunkdata ** ch)
+{
+	const struct chunkdata_external * che;
+	struct chunkdata chd;
+	uint32_t src;
+	size_t i, k;
+
+	/* Do we already have an in-core record? */
+	if ((i = table_lookup(D, hash)) != SIZE_MAX) {
+		*ch = elasticarray_get(D->recs, i, D->recsz);
+		goto done;
+	}
+	*ch = NULL;
+
+	/* Make room for another in-core record if necessary. */
+	if ((srclist_getsize(D->srcs) >= D->maxcore) && spill(D))
+		goto err0;
+
+	/* Look for a record which we spilled, newest first. */
+	for (k = D->nruns; k > 0; k--) {
+		if ((che = search(D->runs[k - 1].recs, D->runs[k - 1].nrecs,
+		    hash)) == NULL)
+			continue;
+
+		/* It was an in-core record, so deletions are returned too. */
+		if (rec_dec(che, &chd, 1)) {
+			warn0("on-disk directory is corrupt");
+			goto err0;
+		}
+		if ((*ch = core_add(D, hash, &chd)) == NULL)
+			goto err0;
+		goto done;
+	}
+
+	/* Look for an on-disk record in the delta. */
+	if ((che = search(D->delta.recs, D->delta.nrecs, hash)) != NULL) {
+		src = SRC_DELTA | (uint32_t)(che - D->delta.recs);
+		goto found;
+	}
+
+	/* Nothing else to search if the base is empty. */
+	if (D->base.nrecs == 0)
+		goto done;
+
+	/* Build a filter of the base if we didn't have one on disk. */
+	if ((D->filter.blocks == NULL) && filter_build(&D->filter, &D->base))
+		goto err0;
+
+	/* Most new chunks can be ruled out without searching the base. */
+	if (!filter_check(&D->filter, hash))
+		goto done;
+	if ((che = search(D->base.recs, D->base.nrecs, hash)) == NULL)
+		goto done;
+	src = SRC_BASE | (uint32_t)(che - D->base.recs);
+
+found:
+	/* Decode it. */
+	if (rec_dec(che, &chd, (src & SRC_MASK) == SRC_DELTA)) {
+		warn0("on-disk directory is corrupt");
+		goto err0;
+	}
+
+	/* A record with nrefs == 0 in the delta has been deleted. */
+	if (chd.nrefs == 0)
+		goto done;
+
+	/* Add it to the in-core records. */
+	if ((*ch = table_add(D, hash, src, &chd)) == NULL)
+		goto err0;
+
+done:
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * chunks_directory_insert(D, hash, ch):
+ * Add a record with HMAC ${hash} and the metadata ${ch} to the chunk
+ * directory ${D}.  The chunk must not already be present.
+ */
+int
+chunks_directory_insert(CHUNKS_DIR * D, const uint8_t * hash,
+    const struct chunkdata * ch)
+{
+
+	/* Make room for another in-core record if necessary. */
+	if ((srclist_getsize(D->srcs) >= D->maxcore) && spill(D))
+		goto err0;
+
+	/* Add the record. */
+	if (core_add(D, hash, ch) == NULL)
+		goto err0;
+	D->nnew++;
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * chunks_directory_reserve(D, n):
+ * Make room for ${n} in-core records in the chunk directory ${D}.
+ */
+int
+chunks_directory_reserve(CHUNKS_DIR * D, size_t n)
+{
+
+	/* We never keep more than ${D}->maxcore records in core. */
+	if (n > D->maxcore)
+		n = D->maxcore;
+
+	/* Size the hash table; the record arrays grow as needed. */
+	return (table_reserve(D, n));
+}
+
+/**
+ * chunks_directory_foreach(D, func, cookie):
+ * Call ${func}(hash, ch, cookie) for each in-core record ${ch} in the chunk
+ * directory ${D}, i.e., each record which was inserted or returned by
+ * chunks_directory_find and has not been spilled; if it returns non-zero,
+ * stop and return that value.
+ * The function ${func} must not call chunks_directory_find or
+ * chunks_directory_insert.
+ */
+int
+chunks_directory_foreach(CHUNKS_DIR * D,
+    int func(const uint8_t *, struct chunkdata *, void *), void * cookie)
+{
+	size_t i;
+	int rc;
+
+	for (i = 0; i < srclist_getsize(D->srcs); i++) {
+		if ((rc = func(rec_hash(D, i),
+		    elasticarray_get(D->recs, i, D->recsz), cookie)) != 0)
+			return (rc);
+	}
+
+	/* Success! */
+	return (0);
+}
+
+/**
+ * chunks_directory_getsize(D):
+ * Return the number of chunks in the chunk directory ${D}.
+ */
+size_t
+chunks_directory_getsize(CHUNKS_DIR * D)
+{
+
+	/* Records copied from disk aren't new chunks. */
+	return (D->nchunks + D->nnew);
+}
+
+/**
+ * chunks_directory_save(D, cachepath, stats_extra, suff):
+ * Write stats_extra statistics and the contents of the chunk directory ${D}
+ * to a new chunk directory in "${cachepath}/directory${suff}".  If only a
+ * small fraction of the chunks have changed, this writes a delta relative
+ * to the existing directory instead of rewriting every record.  A filter
+ * of the chunks in the underlying complete directory is also written to
+ * "${cachepath}/directory.filter" if it is not already there.
+ */
+int
+chunks_directory_save(CHUNKS_DIR * D, const char * cachepath,
+    struct chunkstats * stats_extra, const char * suff)
 {
 
-	/* Free records in the hash table. */
-	rwhashtab_foreach(HT, callback_free, NULL);
+	/* We need a sorted base, and a delta which isn't too large already. */
+	if ((D->base.map == NULL) ||
+	    (D->delta.nrecs > D->base.nrecs / DELTA_MAXFRAC))
+		goto complete;
+
+	/* The base needs to stay around after the directory is replaced. */
+	if (D->baseisdir) {
+		switch (base_link(cachepath)) {
+		case -1:
+			goto err0;
+		case 1:
+			goto complete;
+		}
+		D->baseisdir = 0;
+	}
+
+	/* Try to write a delta. */
+	switch (directory_write(cachepath, D, &D->cdb, stats_extra, suff)) {
+	case -1:
+		goto err0;
+	case 0:
+		/* Write out the base filter if we built it. */
+		if (D->filter.dirty &&
+		    filter_write(cachepath, &D->filter, D->cdb.id))
+			goto err0;
+		return (0);
+	}
+
+complete:
+	/* Write a complete directory, compacting any existing delta. */
+	return (directory_write(cachepath, D, NULL, stats_extra, suff));
+
+err0:
+	/* Failure! */
+	return (-1);
+}
 
-	/* Free the hash table itself. */
-	rwhashtab_free(HT);
+/**
+ * chunks_directory_close(D):
+ * Free the chunk directory ${D}.
+ */
+void
+chunks_directory_close(CHUNKS_DIR * D)
+{
 
-	/* Free the records which were allocated en masse. */
-	free(dir);
+	/* Behave consistently with free(NULL). */
+	if (D == NULL)
+		return;
+
+	/* Free the in-core records. */
+	free(D->slots);
+	hashlist_free(D->hashes);
+	srclist_free(D->srcs);
+	elasticarray_free(D->recs);
+
+	/* Unmap the spill runs, the sorted directory, and its filter. */
+	while (D->nruns > 0)
+		map_close(&D->runs[--D->nruns]);
+	free(D->spillpath);
+	filter_free(&D->filter);
+	map_close(&D->delta);
+	map_close(&D->base);
+
+	/* Free the directory structure. */
+	free(D);
 }
 
 /**
@@ -564,3 +2467,69 @@ err0:
 	/* Failure! */
 	return (-1);
 }
+
+/**
+ * chunks_directory_prune(cachepath):
+ * If ${cachepath}/directory is not a delta, remove the base directory
+ * ${cachepath}/directory.base (if it exists), since nothing refers to it.
+ */
+int
+chunks_directory_prune(const char * cachepath)
+{
+	struct chunkdir_external cde;
+	FILE * f;
+	char * s;
+	char * t;
+	int isdelta;
+
+	/* Construct file names. */
+	if (asprintf(&s, "%s/directory", cachepath) == -1) {
+		warnp("asprintf");
+		goto err0;
+	}
+	if (asprintf(&t, "%s/directory.base", cachepath) == -1) {
+		warnp("asprintf");
+		goto err1;
+	}
+
+	/* If the directory is a delta, we still need the base. */
+	if ((f = fopen(s, "r")) == NULL) {
+		if (errno != ENOENT) {
+			warnp("fopen(%s)", s);
+			goto err2;
+		}
+	} else {
+		isdelta = (fread(&cde, sizeof(cde), 1, f) == 1) &&
+		    (memcmp(cde.magic, CHDIR_MAGIC_DELTA, 8) == 0);
+		if (fclose(f)) {
+			warnp("fclose(%s)", s);
+			goto err2;
+		}
+		if (isdelta)
+			goto done;
+	}
+
+	/* Remove the base. */
+	if (unlink(t)) {
+		/* ENOENT isn't a problem. */
+		if (errno != ENOENT) {
+			warnp("unlink(%s)", t);
+			goto err2;
+		}
+	}
+
+done:
+	free(t);
+	free(s);
+
+	/* Success! */
+	return (0);
+
+err2:
+	free(t);
+err1:
+	free(s);
+err0:
+	/* Failure! */
+	return (-1);
+}
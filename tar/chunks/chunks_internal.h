@@ -6,18 +6,13 @@
 #include <stdlib.h>
 #include <unistd.h>
 
-#include "rwhashtab.h"
-
-/* Chunk metadata structure was allocated by malloc(3). */
-#define	CHDATA_MALLOC	((uint32_t)(1) << 30)
 /* Chunk belongs to the current tape. */
 #define CHDATA_CTAPE	((uint32_t)(1) << 31)
 #define CHDATA_FLAGS	(0xc0000000)
 #define CHDATA_ZLEN	(~CHDATA_FLAGS)
 
-/* In-core chunk metadata structure. */
+/* In-core chunk metadata structure; the HMAC is kept by the directory. */
 struct chunkdata {
-	uint8_t hash[32];	/* HMAC of chunk. */
 	uint32_t len;		/* Length of chunk. */
 	uint32_t zlen_flags;	/* Compressed length of chunk | flags. */
 	uint32_t nrefs;		/* Number of existing tapes using this. */
@@ -30,6 +25,9 @@ struct chunkdata_statstape {
 	uint32_t ncopies_ctape;	/* Used by chunks_stats only. */
 };
 
+/* Chunk directory, with on-disk records read as needed. */
+typedef struct chunks_directory_internal CHUNKS_DIR;
+
 /* Chunk statistics structure. */
 struct chunkstats {
 	uint64_t nchunks;	/* Number of chunks. */
@@ -38,35 +36,81 @@ struct chunkstats {
 };
 
 /**
- * chunks_directory_read(cachepath, dir, stats_unique, stats_all, stats_extra,
+ * chunks_directory_open(cachepath, stats_unique, stats_all, stats_extra,
  *     mustexist, statstape):
- * Read stats_extra statistics (statistics on non-chunks which are stored)
- * and the chunk directory (if present) from "${cachepath}/directory" into
- * memory allocated and assigned to ${*dir}; and return a hash table
- * populated with struct chunkdata records.  Populate stats_all with
- * statistics for all the chunks listed in the directory (counting
- * multiplicity) and populate stats_unique with statistics reflecting the
- * unique chunks.  If ${mustexist}, error out if the directory does not exist.
- * If ${statstape}, allocate struct chunkdata_statstape records instead.
+ * Open the chunk directory (if present) in "${cachepath}/directory", and
+ * read the stats_extra statistics and statistics for all the chunks listed
+ * in the directory both counting multiplicity (stats_all) and counting unique
+ * chunks (stats_unique).  A directory in the sorted format is mapped into
+ * memory and records are read from it as needed; a directory in the old
+ * format is read into memory in its entirety.  If ${cachepath} is NULL,
+ * return an empty directory.  If ${mustexist}, error out if the directory
+ * does not exist.  If ${statstape}, in-core records are struct
+ * chunkdata_statstape instead of struct chunkdata; otherwise, if
+ * tarsnap_opt_directory_memlimit is set, in-core records beyond that budget
+ * are spilled to temporary files in ${cachepath}.
+ */
+CHUNKS_DIR * chunks_directory_open(const char *, struct chunkstats *,
+    struct chunkstats *, struct chunkstats *, int, int);
+
+/**
+ * chunks_directory_find(D, hash, ch):
+ * Look for the chunk with HMAC ${hash} in the chunk directory ${D}.  If it
+ * is present, set ${ch} to point to an in-core record which the caller may
+ * modify until the next chunks_directory_find or chunks_directory_insert
+ * call; otherwise, set ${ch} to NULL.
+ */
+int chunks_directory_find(CHUNKS_DIR *, const uint8_t *, struct chunkdata **);
+
+/**
+ * chunks_directory_insert(D, hash, ch):
+ * Add a record with HMAC ${hash} and the metadata ${ch} to the chunk
+ * directory ${D}.  The chunk must not already be present.
+ */
+int chunks_directory_insert(CHUNKS_DIR *, const uint8_t *,
+    const struct chunkdata *);
+
+/**
+ * chunks_directory_reserve(D, n):
+ * Make room for ${n} in-core records in the chunk directory ${D}.
+ */
+int chunks_directory_reserve(CHUNKS_DIR *, size_t);
+
+/**
+ * chunks_directory_foreach(D, func, cookie):
+ * Call ${func}(hash, ch, cookie) for each in-core record ${ch} in the chunk
+ * directory ${D}, i.e., each record which was inserted or returned by
+ * chunks_directory_find and has not been spilled; if it returns non-zero,
+ * stop and return that value.
+ * The function ${func} must not call chunks_directory_find or
+ * chunks_directory_insert.
+ */
+int chunks_directory_foreach(CHUNKS_DIR *,
+    int(const uint8_t *, struct chunkdata *, void *), void *);
+
+/**
+ * chunks_directory_getsize(D):
+ * Return the number of chunks in the chunk directory ${D}.
  */
-RWHASHTAB * chunks_directory_read(const char *, void **,
-    struct chunkstats *, struct chunkstats *, struct chunkstats *, int, int);
+size_t chunks_directory_getsize(CHUNKS_DIR *);
 
 /**
- * chunks_directory_write(cachepath, HT, stats_extra, suff):
- * Write stats_extra statistics and the contents of the hash table ${HT} of
- * struct chunkdata records to a new chunk directory in
- * "${cachepath}/directory${suff}".
+ * chunks_directory_save(D, cachepath, stats_extra, suff):
+ * Write stats_extra statistics and the contents of the chunk directory ${D}
+ * to a new chunk directory in "${cachepath}/directory${suff}".  If only a
+ * small fraction of the chunks have changed, this writes a delta relative
+ * to the existing directory instead of rewriting every record.  A filter
+ * of the chunks in the underlying complete directory is also written to
+ * "${cachepath}/directory.filter" if it is not already there.
  */
-int chunks_directory_write(const char *, RWHASHTAB *, struct chunkstats *,
+int chunks_directory_save(CHUNKS_DIR *, const char *, struct chunkstats *,
     const char *);
 
 /**
- * chunks_directory_free(HT, dir):
- * Free the hash table ${HT} of struct chunkdata records, all of its
- * elements, and ${dir}.
+ * chunks_directory_close(D):
+ * Free the chunk directory ${D}.
  */
-void chunks_directory_free(RWHASHTAB *, void *);
+void chunks_directory_close(CHUNKS_DIR *);
 
 /**
  * chunks_directory_commit(cachepath, osuff, nsuff):
@@ -75,6 +119,13 @@ void chunks_directory_free(RWHASHTAB *, void *);
  */
 int chunks_directory_commit(const char *, const char *, const char *);
 
+/**
+ * chunks_directory_prune(cachepath):
+ * If ${cachepath}/directory is not a delta, remove the base directory
+ * ${cachepath}/directory.base (if it exists), since nothing refers to it.
+ */
+int chunks_directory_prune(const char *);
+
 /**
  * chunks_stats_zero(stats):
  * Zero the provided set of statistics.
@@ -24,6 +24,7 @@ struct chunks_read_internal {
 	size_t maxlen;		/* Maximum chunk size. */
 	uint8_t * zbuf;		/* Buffer for compression. */
 	size_t zbuflen;		/* Length of zbuf. */
+	z_stream zs;		/* Inflate stream, reset for each chunk. */
 	STORAGE_R * S;		/* Cookie for file read operations. */
 };
 
@@ -36,6 +37,7 @@ CHUNKS_R *
 chunks_read_init(STORAGE_R * S, size_t maxchunksize)
 {
 	CHUNKS_R * C;
+	int rc;
 
 	/* Sanity check. */
 	if ((maxchunksize == 0) || (maxchunksize > SIZE_MAX / 2)) {
@@ -55,12 +57,37 @@ chunks_read_init(STORAGE_R * S, size_t maxchunksize)
 	if ((C->zbuf = malloc(C->zbuflen)) == NULL)
 		goto err1;
 
+	/*
+	 * Create an inflate stream which we reuse for every chunk, rather
+	 * than having zlib allocate and free its state each time.
+	 */
+	C->zs.zalloc = Z_NULL;
+	C->zs.zfree = Z_NULL;
+	C->zs.opaque = Z_NULL;
+	C->zs.next_in = Z_NULL;
+	C->zs.avail_in = 0;
+	if ((rc = inflateInit(&C->zs)) != Z_OK) {
+		switch (rc) {
+		case Z_MEM_ERROR:
+			errno = ENOMEM;
+			warnp("Error initializing zlib");
+			break;
+		default:
+			warn0("Programmer error: "
+			    "Unexpected error code from inflateInit: %d", rc);
+			break;
+		}
+		goto err2;
+	}
+
 	/* Record the storage cookie that we're using. */
 	C->S = S;
 
 	/* Success! */
 	return (C);
 
+err2:
+	free(C->zbuf);
 err1:
 	free(C);
 err0:
@@ -96,7 +123,7 @@ chunks_read_chunk(CHUNKS_R * C, const uint8_t * hash, size_t len,
 	uint8_t hash_actual[32];
 	char hashbuf_actual[65];
 	int rc;
-	uLongf buflen;
+	size_t buflen;
 
 	/* Sanity check ${len} and ${zlen} against parameters in ${C}. */
 	if ((len > C->maxlen) || (zlen > C->zbuflen)) {
@@ -127,8 +154,16 @@ chunks_read_chunk(CHUNKS_R * C, const uint8_t * hash, size_t len,
 	}
 
 	/* Decompress the chunk into ${buf}. */
-	buflen = len;
-	if ((rc = uncompress(buf, &buflen, C->zbuf, zlen)) != Z_OK) {
+	if ((rc = inflateReset(&C->zs)) != Z_OK) {
+		warn0("Programmer error: "
+		    "Unexpected error code from inflateReset: %d", rc);
+		goto err0;
+	}
+	C->zs.next_in = C->zbuf;
+	C->zs.avail_in = (uInt)zlen;
+	C->zs.next_out = buf;
+	C->zs.avail_out = (uInt)len;
+	if ((rc = inflate(&C->zs, Z_FINISH)) != Z_STREAM_END) {
 		if (quiet == 0) {
 			switch (rc) {
 			case Z_MEM_ERROR:
@@ -136,27 +171,30 @@ chunks_read_chunk(CHUNKS_R * C, const uint8_t * hash, size_t len,
 				warnp("Error decompressing chunk %s",
 				    hashbuf);
 				break;
+			case Z_OK:
 			case Z_BUF_ERROR:
 			case Z_DATA_ERROR:
+			case Z_NEED_DICT:
 				warn0("Error decompressing chunk %s: "
 				    "chunk is corrupt", hashbuf);
 				break;
 			default:
 				warn0("Programmer error: "
 				    "Unexpected error code from "
-				    "uncompress: %d", rc);
+				    "inflate: %d", rc);
 				break;
 			}
 		}
 		goto corrupt;
 	}
+	buflen = len - C->zs.avail_out;
 
 	/* Make sure the decompressed chunk length is correct. */
 	if (buflen != len) {
 		if (quiet == 0)
 			warn0("Chunk %s has incorrect length"
 			    " (%zd, expected %zd)",
-			    hashbuf, (size_t)buflen, len);
+			    hashbuf, buflen, len);
 		goto corrupt;
 	}
 
@@ -199,6 +237,9 @@ chunks_read_free(CHUNKS_R * C)
 	if (C == NULL)
 		return;
 
+	/* Free the inflate stream. */
+	inflateEnd(&C->zs);
+
 	/* Free memory. */
 	free(C->zbuf);
 	free(C);
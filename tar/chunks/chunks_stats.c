@@ -1,6 +1,5 @@
 #include "platform.h"
 
-#include <errno.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -9,14 +8,12 @@
 
 #include "chunks_internal.h"
 #include "hexify.h"
-#include "rwhashtab.h"
 #include "storage.h"
 
 #include "chunks.h"
 
 struct chunks_stats_internal {
-	RWHASHTAB * HT;		/* Hash table of struct chunkdata_statstape. */
-	struct chunkdata_statstape * dir;	/* On-disk directory entries. */
+	CHUNKS_DIR * dir;	/* Chunk directory (of chunkdata_statstape). */
 	char * cachepath;	/* Path to cache directory. */
 	struct chunkstats stats_total;	/* All archives, w/ multiplicity. */
 	struct chunkstats stats_unique;	/* All archives, w/o multiplicity. */
@@ -26,20 +23,21 @@ struct chunks_stats_internal {
 	struct chunkstats stats_tapee;	/* Extra data in this archive. */
 };
 
-static int callback_zero(void *, void *);
-static int callback_add(void *, void *);
-static int callback_delete(void *, void *);
+static int callback_zero(const uint8_t *, struct chunkdata *, void *);
+static int callback_add(const uint8_t *, struct chunkdata *, void *);
+static int callback_delete(const uint8_t *, struct chunkdata *, void *);
 
 /**
- * callback_zero(rec, cookie):
+ * callback_zero(hash, rec, cookie):
  * Mark the struct chunkdata_statstape ${rec} as being not used in the current
  * archive.
  */
 static int
-callback_zero(void * rec, void * cookie)
+callback_zero(const uint8_t * hash, struct chunkdata * rec, void * cookie)
 {
-	struct chunkdata_statstape * ch = rec;
+	struct chunkdata_statstape * ch = (struct chunkdata_statstape *)rec;
 
+	(void)hash;	/* UNUSED */
 	(void)cookie;	/* UNUSED */
 
 	ch->d.zlen_flags &= ~CHDATA_CTAPE;
@@ -50,14 +48,15 @@ callback_zero(void * rec, void * cookie)
 }
 
 /**
- * callback_add(rec, cookie):
+ * callback_add(hash, rec, cookie):
  * Add the "current archive" statistics to the total chunk statistics.
  */
 static int
-callback_add(void * rec, void * cookie)
+callback_add(const uint8_t * hash, struct chunkdata * rec, void * cookie)
 {
-	struct chunkdata_statstape * ch = rec;
+	struct chunkdata_statstape * ch = (struct chunkdata_statstape *)rec;
 
+	(void)hash;	/* UNUSED */
 	(void)cookie;	/* UNUSED */
 
 	ch->d.ncopies += ch->ncopies_ctape;
@@ -69,23 +68,23 @@ callback_add(void * rec, void * cookie)
 }
 
 /**
- * callback_delete(rec, cookie):
- * If the reference count of the struct chunkdata_statstape ${rec} is zero,
- * delete the chunk using the storage layer delete cookie ${cookie}.
+ * callback_delete(hash, rec, cookie):
+ * If the reference count of the struct chunkdata_statstape ${rec} with HMAC
+ * ${hash} is zero, delete the chunk using the storage layer delete cookie
+ * ${cookie}.
  */
 static int
-callback_delete(void * rec, void * cookie)
+callback_delete(const uint8_t * hash, struct chunkdata * rec, void * cookie)
 {
-	struct chunkdata_statstape * ch = rec;
 	STORAGE_D * S = cookie;
 	char hashbuf[65];
 
-	if (ch->d.nrefs)
+	if (rec->nrefs)
 		goto done;
 
-	hexify(ch->d.hash, hashbuf, 32);
+	hexify(hash, hashbuf, 32);
 	fprintf(stdout, "  Removing unreferenced chunk file: %s\n", hashbuf);
-	if (storage_delete_file(S, 'c', ch->d.hash))
+	if (storage_delete_file(S, 'c', hash))
 		goto err0;
 
 done:
@@ -107,6 +106,7 @@ CHUNKS_S *
 chunks_fsck_start(uint64_t machinenum, const char * cachepath)
 {
 	struct chunks_stats_internal * C;
+	struct chunkdata ch;
 	uint8_t * flist;
 	size_t nfiles;
 	size_t file;
@@ -123,47 +123,33 @@ chunks_fsck_start(uint64_t machinenum, const char * cachepath)
 	if (storage_directory_read(machinenum, 'c', 0, &flist, &nfiles))
 		goto err2;
 
-	/* Construct a chunkdata_statstape structure for each file. */
-	if (nfiles > SIZE_MAX / sizeof(struct chunkdata_statstape)) {
-		errno = ENOMEM;
+	/* Create an empty chunk directory, with zeroed statistics. */
+	if ((C->dir = chunks_directory_open(NULL, &C->stats_unique,
+	    &C->stats_total, &C->stats_extra, 0, 1)) == NULL) {
 		free(flist);
 		goto err2;
 	}
-	if ((C->dir =
-	    malloc(nfiles * sizeof(struct chunkdata_statstape))) == NULL) {
-		free(flist);
-		goto err2;
-	}
-	for (file = 0; file < nfiles; file++) {
-		memcpy(C->dir[file].d.hash, &flist[file * 32], 32);
-		C->dir[file].d.len = C->dir[file].d.zlen_flags = 0;
-		C->dir[file].d.nrefs = C->dir[file].d.ncopies = 0;
-	}
 
-	/* Free the file list. */
-	free(flist);
-
-	/* Create an empty chunk directory. */
-	C->HT = rwhashtab_init(offsetof(struct chunkdata, hash), 32);
-	if (C->HT == NULL)
-		goto err2;
+	/* Size the directory for the records we're about to insert. */
+	if (chunks_directory_reserve(C->dir, nfiles))
+		goto err3;
 
-	/* Insert the chunkdata structures we constructed above. */
+	/* Insert a zeroed record for each file. */
+	memset(&ch, 0, sizeof(ch));
 	for (file = 0; file < nfiles; file++) {
-		if (rwhashtab_insert(C->HT, &C->dir[file]))
+		if (chunks_directory_insert(C->dir, &flist[file * 32], &ch))
 			goto err3;
 	}
 
-	/* Zero statistics. */
-	chunks_stats_zero(&C->stats_total);
-	chunks_stats_zero(&C->stats_extra);
-	chunks_stats_zero(&C->stats_unique);
+	/* Free the file list. */
+	free(flist);
 
 	/* Success! */
 	return (C);
 
 err3:
-	rwhashtab_free(C->HT);
+	chunks_directory_close(C->dir);
+	free(flist);
 err2:
 	free(C->cachepath);
 err1:
@@ -187,7 +173,7 @@ chunks_fsck_archive_add(CHUNKS_S * C)
 	chunks_stats_addstats(&C->stats_extra, &C->stats_tapee);
 
 	/* Add per-chunk "this archive" stats to per-chunk "total" stats. */
-	return (rwhashtab_foreach(C->HT, callback_add, NULL));
+	return (chunks_directory_foreach(C->dir, callback_add, NULL));
 }
 
 /**
@@ -200,7 +186,7 @@ chunks_fsck_deletechunks(CHUNKS_S * C, STORAGE_D * S)
 {
 
 	/* Delete each chunk iff it has zero references. */
-	return (rwhashtab_foreach(C->HT, callback_delete, S));
+	return (chunks_directory_foreach(C->dir, callback_delete, S));
 }
 
 /**
@@ -213,12 +199,12 @@ chunks_fsck_end(CHUNKS_S * C)
 	int rc = 0;
 
 	/* Write out the new chunk directory. */
-	if (chunks_directory_write(C->cachepath, C->HT, &C->stats_extra,
+	if (chunks_directory_save(C->dir, C->cachepath, &C->stats_extra,
 	    ".tmp"))
 		rc = -1;
 
-	/* Free the chunk hash table. */
-	chunks_directory_free(C->HT, C->dir);
+	/* Free the chunk directory. */
+	chunks_directory_close(C->dir);
 
 	/* Free memory. */
 	free(C->cachepath);
@@ -236,7 +222,6 @@ CHUNKS_S *
 chunks_stats_init(const char * cachepath)
 {
 	struct chunks_stats_internal * C;
-	void * dir;
 
 	/* Allocate memory. */
 	if ((C = malloc(sizeof(struct chunks_stats_internal))) == NULL)
@@ -246,11 +231,10 @@ chunks_stats_init(const char * cachepath)
 	if ((C->cachepath = strdup(cachepath)) == NULL)
 		goto err1;
 
-	/* Read directory. */
-	if ((C->HT = chunks_directory_read(cachepath, &dir,
-	    &C->stats_unique, &C->stats_total, &C->stats_extra, 1, 1)) == NULL)
+	/* Open directory. */
+	if ((C->dir = chunks_directory_open(cachepath, &C->stats_unique,
+	    &C->stats_total, &C->stats_extra, 1, 1)) == NULL)
 		goto err2;
-	C->dir = dir;
 
 	/* Success! */
 	return (C);
@@ -272,8 +256,8 @@ size_t
 chunks_stats_getdirsz(CHUNKS_S * C)
 {
 
-	/* Get the value from the hash table. */
-	return (rwhashtab_getsize(C->HT));
+	/* Get the value from the chunk directory. */
+	return (chunks_directory_getsize(C->dir));
 }
 
 /**
@@ -319,23 +303,27 @@ chunks_stats_zeroarchive(CHUNKS_S * C)
 	chunks_stats_zero(&C->stats_tapee);
 
 	/* Zero per-chunk statistics. */
-	rwhashtab_foreach(C->HT, callback_zero, NULL);
+	chunks_directory_foreach(C->dir, callback_zero, NULL);
 }
 
 /**
  * chunks_stats_addchunk(C, hash, len, zlen):
  * Add the given chunk to the per-archive statistics.  If the chunk does not
- * exist, return 1.
+ * exist, return 1; on error, return -1.
  */
 int
 chunks_stats_addchunk(CHUNKS_S * C, const uint8_t * hash,
     size_t len, size_t zlen)
 {
 	struct chunkdata_statstape * ch;
+	struct chunkdata * rec;
 
-	/* If the chunk is not in ${S}->HT, error out. */
-	if ((ch = rwhashtab_read(C->HT, hash)) == NULL)
+	/* If the chunk is not in ${C}->dir, error out. */
+	if (chunks_directory_find(C->dir, hash, &rec))
+		goto err0;
+	if (rec == NULL)
 		goto notpresent;
+	ch = (struct chunkdata_statstape *)rec;
 
 	/* Record the lengths if necessary. */
 	if (ch->d.nrefs == 0 && ch->ncopies_ctape == 0) {
@@ -360,6 +348,10 @@ chunks_stats_addchunk(CHUNKS_S * C, const uint8_t * hash,
 notpresent:
 	/* No such chunk exists. */
 	return (1);
+
+err0:
+	/* Failure! */
+	return (-1);
 }
 
 /**
@@ -412,8 +404,8 @@ chunks_stats_free(CHUNKS_S * C)
 	if (C == NULL)
 		return;
 
-	/* Free the chunk hash table. */
-	chunks_directory_free(C->HT, C->dir);
+	/* Free the chunk directory. */
+	chunks_directory_close(C->dir);
 
 	/* Free memory. */
 	free(C->cachepath);
@@ -428,8 +420,8 @@ chunks_stats_free(CHUNKS_S * C)
 int
 chunks_initialize(const char * cachepath)
 {
-	RWHASHTAB * HT;
-	struct chunkstats stats_extra;
+	CHUNKS_DIR * D;
+	struct chunkstats stats_unique, stats_all, stats_extra;
 
 	/* Bail if ${chunkpath}/directory already exists. */
 	switch (chunks_directory_exists(cachepath)) {
@@ -441,23 +433,23 @@ chunks_initialize(const char * cachepath)
 		goto err0;
 	}
 
-	/* Allocate empty hash table, and zero stats. */
-	if ((HT = rwhashtab_init(0, 1)) == NULL)
+	/* Create an empty chunk directory, with zeroed stats. */
+	if ((D = chunks_directory_open(NULL, &stats_unique, &stats_all,
+	    &stats_extra, 0, 0)) == NULL)
 		goto err0;
-	chunks_stats_zero(&stats_extra);
 
 	/* Write empty directory file. */
-	if (chunks_directory_write(cachepath, HT, &stats_extra, ""))
+	if (chunks_directory_save(D, cachepath, &stats_extra, ""))
 		goto err1;
 
 	/* Free memory. */
-	rwhashtab_free(HT);
+	chunks_directory_close(D);
 
 	/* Success! */
 	return (0);
 
 err1:
-	rwhashtab_free(HT);
+	chunks_directory_close(D);
 err0:
 	/* Failure! */
 	return (-1);
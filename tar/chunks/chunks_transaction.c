@@ -41,6 +41,10 @@ chunks_transaction_commit(const char * cachepath)
 	if (chunks_directory_commit(cachepath, ".tmp", ""))
 		goto err0;
 
+	/* Remove the old base directory if the new directory is complete. */
+	if (chunks_directory_prune(cachepath))
+		goto err0;
+
 	/* Success! */
 	return (0);
 
@@ -13,18 +13,37 @@
 
 #include "chunks_internal.h"
 #include "hexify.h"
-#include "rwhashtab.h"
 #include "storage.h"
 #include "warnp.h"
 
 #include "chunks.h"
 
+/* Chunks shorter than this are always passed to deflate. */
+#define INCOMPRESSIBLE_MINLEN	4096
+
+/* Size of the table used to look for repeated strings in chunks. */
+#define INCOMPRESSIBLE_HTBITS	15
+#define INCOMPRESSIBLE_HTLEN	(1 << INCOMPRESSIBLE_HTBITS)
+
+/* Maximum length of a zlib stored block. */
+#define STOREDBLOCK_MAXLEN	65535
+
+/*
+ * A deflate stream which is kept around and reset between chunks, so that
+ * we don't need to allocate and free zlib's window and hash tables for
+ * every chunk we compress.
+ */
+struct chunks_deflate {
+	z_stream zs;			/* Deflate stream. */
+	int level;			/* Compression level of zs. */
+	struct chunks_deflate * next;	/* Next unused stream. */
+};
+
 struct chunks_write_internal {
 	size_t maxlen;			/* Maximum chunk size. */
-	uint8_t * zbuf;			/* Buffer for compression. */
-	size_t zbuflen;			/* Length of zbuf. */
-	RWHASHTAB * HT;			/* Hash table of struct chunkdata. */
-	void * dir;			/* On-disk directory entries. */
+	size_t zbuflen;			/* Maximum compressed chunk size. */
+	struct chunks_deflate * D[Z_BEST_COMPRESSION + 1];	/* Unused. */
+	CHUNKS_DIR * dir;		/* Chunk directory. */
 	char * path;			/* Path to cache directory. */
 	STORAGE_W * S;			/* Storage layer cookie; NULL=dryrun. */
 	struct chunkstats stats_total;	/* All archives, w/ multiplicity. */
@@ -46,6 +65,7 @@ CHUNKS_W *
 chunks_write_start(const char * cachepath, STORAGE_W * S, size_t maxchunksize)
 {
 	struct chunks_write_internal * C;
+	int i;
 
 	/* Sanity check. */
 	if ((maxchunksize == 0) || (maxchunksize > SIZE_MAX / 2)) {
@@ -61,9 +81,9 @@ chunks_write_start(const char * cachepath, STORAGE_W * S, size_t maxchunksize)
 	C->maxlen = maxchunksize;
 	C->zbuflen = C->maxlen + (C->maxlen / 1000) + 13;
 
-	/* Allocate buffer for holding a compressed chunk. */
-	if ((C->zbuf = malloc(C->zbuflen)) == NULL)
-		goto err1;
+	/* We don't have any deflate streams yet. */
+	for (i = 0; i <= Z_BEST_COMPRESSION; i++)
+		C->D[i] = NULL;
 
 	/* Record the storage cookie that we're using. */
 	C->S = S;
@@ -73,13 +93,13 @@ chunks_write_start(const char * cachepath, STORAGE_W * S, size_t maxchunksize)
 		C->path = NULL;
 	} else {
 		if ((C->path = strdup(cachepath)) == NULL)
-			goto err2;
+			goto err1;
 	}
 
 	/* Read the existing chunk directory (if one exists). */
-	if ((C->HT = chunks_directory_read(cachepath, &C->dir,
-	    &C->stats_unique, &C->stats_total, &C->stats_extra, 0, 0)) == NULL)
-		goto err3;
+	if ((C->dir = chunks_directory_open(cachepath, &C->stats_unique,
+	    &C->stats_total, &C->stats_extra, 0, 0)) == NULL)
+		goto err2;
 
 	/* Zero "new chunks" and "this tape" statistics. */
 	chunks_stats_zero(&C->stats_tape);
@@ -89,10 +109,8 @@ chunks_write_start(const char * cachepath, STORAGE_W * S, size_t maxchunksize)
 	/* Success! */
 	return (C);
 
-err3:
-	free(C->path);
 err2:
-	free(C->zbuf);
+	free(C->path);
 err1:
 	free(C);
 err0:
@@ -149,118 +167,616 @@ padme(size_t len, size_t maxlen)
 	return (plen - len);
 }
 
-/**
- * chunks_write_chunk(C, hash, buf, buflen):
- * Write the chunk ${buf} of length ${buflen}, which has HMAC ${hash},
- * as part of the write transaction associated with the cookie ${C}.
- * Return the compressed size.
+/* A chunk being compressed and encrypted by a worker thread. */
+struct chunks_write_pending {
+	CHUNKS_W * C;			/* Write transaction. */
+	uint8_t hash[32];		/* HMAC of the chunk. */
+	uint8_t * buf;			/* Data to compress, or NULL. */
+	size_t buflen;			/* Length of chunk. */
+	struct chunks_deflate * D;	/* Deflate stream; NULL=store. */
+	uint8_t * zbuf;			/* Compressed (and encrypted) chunk. */
+	size_t zlen;			/* Padded compressed length. */
+};
+
+/* Record a reference to the existing chunk ${ch}. */
+static void
+chunk_ref(CHUNKS_W * C, struct chunkdata * ch)
+{
+
+	chunks_stats_add(&C->stats_total, ch->len,
+	    ch->zlen_flags & CHDATA_ZLEN, 1);
+	chunks_stats_add(&C->stats_tape, ch->len,
+	    ch->zlen_flags & CHDATA_ZLEN, 1);
+	ch->ncopies += 1;
+	if ((ch->zlen_flags & CHDATA_CTAPE) == 0) {
+		ch->nrefs += 1;
+		ch->zlen_flags |= CHDATA_CTAPE;
+	}
+}
+
+/*
+ * Return non-zero if the ${buflen} bytes in ${buf} look like they have
+ * already been compressed (or encrypted), i.e., if zlib would not be able to
+ * make them noticeably smaller.  Deflate gains from skewed byte frequencies
+ * and from repeated strings, so we check for both: first we compare the
+ * number of pairs of equal bytes against what we would expect to see in
+ * uniformly random data, and then we look for 4-byte strings which recur
+ * within deflate's 32 kB window.  This is cheap compared to deflate, and data
+ * which passes both tests would only compress by a fraction of a percent,
+ * which is less than the padding we add afterwards.
  */
-ssize_t
-chunks_write_chunk(CHUNKS_W * C, const uint8_t * hash,
-    const uint8_t * buf, size_t buflen)
+static int
+chunk_incompressible(const uint8_t * buf, size_t buflen)
 {
-	struct chunkdata * ch;
-	uLongf zlen;
-	size_t padlen;
-	char hashbuf[65];
-	int rc;
+	uint32_t counts[256];
+	uint16_t lastpos[INCOMPRESSIBLE_HTLEN];
+	uint64_t pairs, randpairs;
+	uint32_t x, h;
+	size_t i, dist;
+	size_t nmatches;
+
+	/* Small chunks are cheap to compress, and too short to judge. */
+	if (buflen < INCOMPRESSIBLE_MINLEN)
+		return (0);
 
-	/* Sanity checks. */
-	assert(buflen <= UINT32_MAX);
-	assert(C->zbuflen < CHDATA_MALLOC);
-
-	/* If the chunk is in ${C}->HT, return the compressed length. */
-	if ((ch = rwhashtab_read(C->HT, hash)) != NULL) {
-		chunks_stats_add(&C->stats_total, ch->len,
-		    ch->zlen_flags & CHDATA_ZLEN, 1);
-		chunks_stats_add(&C->stats_tape, ch->len,
-		    ch->zlen_flags & CHDATA_ZLEN, 1);
-		ch->ncopies += 1;
-		if ((ch->zlen_flags & CHDATA_CTAPE) == 0) {
-			ch->nrefs += 1;
-			ch->zlen_flags |= CHDATA_CTAPE;
+	/* Count how many times each byte value appears. */
+	memset(counts, 0, sizeof(counts));
+	for (i = 0; i < buflen; i++)
+		counts[buf[i]]++;
+
+	/* Count (ordered) pairs of equal bytes, times 256. */
+	for (pairs = 0, i = 0; i < 256; i++)
+		pairs += (uint64_t)counts[i] * counts[i];
+	pairs = (pairs - buflen) * 256;
+
+	/* Expected number of such pairs in random data, times 256. */
+	randpairs = (uint64_t)buflen * (buflen - 1);
+
+	/* Allow random data a 2% margin. */
+	if (pairs > randpairs + randpairs / 50)
+		return (0);
+
+	/*
+	 * Remember where we last saw each (hashed) 4-byte string, and count
+	 * the positions where the string was seen within the past 32 kB.  We
+	 * only need to record positions modulo 2^16 since we're only looking
+	 * at short distances, and we compare the strings themselves to weed
+	 * out hash collisions and stale entries.
+	 */
+	memset(lastpos, 0, sizeof(lastpos));
+	for (nmatches = 0, i = 0; i + 4 <= buflen; i++) {
+		x = ((uint32_t)buf[i] << 24) + ((uint32_t)buf[i + 1] << 16) +
+		    ((uint32_t)buf[i + 2] << 8) + (uint32_t)buf[i + 3];
+		h = (x * 2654435761U) >> (32 - INCOMPRESSIBLE_HTBITS);
+		dist = (uint16_t)(i - lastpos[h]);
+		if ((dist > 0) && (dist <= 32768) && (dist <= i) &&
+		    (memcmp(&buf[i - dist], &buf[i], 4) == 0)) {
+			/* Random data should have (almost) no matches. */
+			if (++nmatches > buflen / 256)
+				return (0);
 		}
-		return (ch->zlen_flags & CHDATA_ZLEN);
+		lastpos[h] = (uint16_t)i;
 	}
 
-	/* Compress the chunk. */
-	zlen = C->zbuflen;
-	if ((rc = compress2(C->zbuf, &zlen, buf, buflen, 9)) != Z_OK) {
+	/* This looks like random data. */
+	return (1);
+}
+
+/*
+ * Set ${Dp} to an unused deflate stream with compression level ${level}
+ * from ${C}, creating a new one if necessary; or to NULL if ${level} is
+ * zero, since we don't need deflate to store data.  This must only be called
+ * from the thread which owns ${C}.
+ */
+static int
+deflate_get(CHUNKS_W * C, int level, struct chunks_deflate ** Dp)
+{
+	struct chunks_deflate * D;
+	int rc;
+
+	/* Sanity check. */
+	assert((level >= 0) && (level <= Z_BEST_COMPRESSION));
+
+	/* Storing data doesn't need a stream. */
+	if (level == Z_NO_COMPRESSION) {
+		*Dp = NULL;
+		goto done;
+	}
+
+	/* Use an unused stream if we have one. */
+	if ((D = C->D[level]) != NULL) {
+		C->D[level] = D->next;
+		*Dp = D;
+		goto done;
+	}
+
+	/* Create a new stream. */
+	if ((D = malloc(sizeof(struct chunks_deflate))) == NULL)
+		goto err0;
+	D->zs.zalloc = Z_NULL;
+	D->zs.zfree = Z_NULL;
+	D->zs.opaque = Z_NULL;
+	D->level = level;
+	if ((rc = deflateInit(&D->zs, level)) != Z_OK) {
 		switch (rc) {
 		case Z_MEM_ERROR:
 			errno = ENOMEM;
-			warnp("Error compressing data");
+			warnp("Error initializing zlib");
+			break;
+		default:
+			warn0("Programmer error: "
+			    "Unexpected error code from deflateInit: %d", rc);
 			break;
+		}
+		goto err1;
+	}
+	*Dp = D;
+
+done:
+	/* Success! */
+	return (0);
+
+err1:
+	free(D);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Return the deflate stream ${D} (which may be NULL) to ${C} for reuse.
+ * This must only be called from the thread which owns ${C}.
+ */
+static void
+deflate_put(CHUNKS_W * C, struct chunks_deflate * D)
+{
+
+	/* Nothing to do if we didn't have a stream. */
+	if (D == NULL)
+		return;
+
+	D->next = C->D[D->level];
+	C->D[D->level] = D;
+}
+
+/*
+ * Write ${buflen} bytes from ${buf} into ${zbuf} of length ${zbuflen} as a
+ * zlib stream made up of "stored" (i.e., uncompressed) blocks, and store the
+ * length of the stream in ${len}.  This is what deflate produces at
+ * compression level 0, but we don't need any of deflate's state to do it.
+ */
+static int
+chunk_store(uint8_t * zbuf, size_t zbuflen, const uint8_t * buf,
+    size_t buflen, size_t * len)
+{
+	size_t pos, blen;
+	uLong adler;
+	uint8_t * p = zbuf;
+
+	/* Make sure we have room for the header, blocks, and checksum. */
+	if (buflen + 6 + 5 * (buflen / STOREDBLOCK_MAXLEN + 1) > zbuflen) {
+		warn0("Programmer error: "
+		    "Buffer too small to hold zlib-compressed data");
+		goto err0;
+	}
+
+	/* zlib header: deflate, 32 kB window, no dictionary, level 0. */
+	*p++ = 0x78;
+	*p++ = 0x01;
+
+	/* Stored blocks; the last block has BFINAL set. */
+	pos = 0;
+	do {
+		blen = buflen - pos;
+		if (blen > STOREDBLOCK_MAXLEN)
+			blen = STOREDBLOCK_MAXLEN;
+		*p++ = (pos + blen == buflen) ? 1 : 0;
+		*p++ = blen & 0xff;
+		*p++ = (blen >> 8) & 0xff;
+		*p++ = ~blen & 0xff;
+		*p++ = (~blen >> 8) & 0xff;
+		memcpy(p, &buf[pos], blen);
+		p += blen;
+		pos += blen;
+	} while (pos < buflen);
+
+	/* Adler-32 checksum of the data, big-endian. */
+	adler = adler32(adler32(0, Z_NULL, 0), buf, (uInt)buflen);
+	*p++ = (adler >> 24) & 0xff;
+	*p++ = (adler >> 16) & 0xff;
+	*p++ = (adler >> 8) & 0xff;
+	*p++ = adler & 0xff;
+
+	/* Record the length of the stream. */
+	*len = (size_t)(p - zbuf);
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Compress ${buflen} bytes from ${buf} into ${zbuf} of length ${zbuflen}
+ * using the deflate stream ${D}, and store the length of the zlib stream in
+ * ${len}.
+ */
+static int
+chunk_deflate(struct chunks_deflate * D, uint8_t * zbuf, size_t zbuflen,
+    const uint8_t * buf, size_t buflen, size_t * len)
+{
+	int rc;
+
+	/* Start a new zlib stream. */
+	if ((rc = deflateReset(&D->zs)) != Z_OK) {
+		warn0("Programmer error: "
+		    "Unexpected error code from deflateReset: %d", rc);
+		goto err0;
+	}
+
+	/* Compress the chunk. */
+	D->zs.next_in = (Bytef *)(uintptr_t)buf;
+	D->zs.avail_in = (uInt)buflen;
+	D->zs.next_out = zbuf;
+	D->zs.avail_out = (uInt)zbuflen;
+	if ((rc = deflate(&D->zs, Z_FINISH)) != Z_STREAM_END) {
+		switch (rc) {
+		case Z_OK:
 		case Z_BUF_ERROR:
 			warn0("Programmer error: "
 			    "Buffer too small to hold zlib-compressed data");
 			break;
 		default:
 			warn0("Programmer error: "
-			    "Unexpected error code from compress2: %d", rc);
+			    "Unexpected error code from deflate: %d", rc);
 			break;
 		}
 		goto err0;
 	}
 
+	/* Record the length of the stream. */
+	*len = zbuflen - D->zs.avail_out;
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Compress ${buflen} bytes from ${buf} into ${zbuf} of length ${zbuflen}
+ * using the deflate stream ${D}, add padding, and store the padded length in
+ * ${zlen}.  If ${D} is NULL, or if the data appears to be incompressible, it
+ * is stored in zlib's uncompressed format rather than being passed through
+ * deflate.  This function is thread-safe, provided that ${D} is not being
+ * used by any other thread.
+ */
+static int
+chunk_compress(struct chunks_deflate * D, uint8_t * zbuf, size_t zbuflen,
+    const uint8_t * buf, size_t buflen, size_t * zlen)
+{
+	size_t len;
+	size_t padlen;
+
+	/* Compress the chunk, or store it if compressing would be futile. */
+	if ((D == NULL) || chunk_incompressible(buf, buflen)) {
+		if (chunk_store(zbuf, zbuflen, buf, buflen, &len))
+			goto err0;
+	} else {
+		if (chunk_deflate(D, zbuf, zbuflen, buf, buflen, &len))
+			goto err0;
+	}
+
 	/* Sanity check the compressed size. */
-	if (zlen > SSIZE_MAX) {
+	if (len > SSIZE_MAX) {
 		warnp("Error compressing chunk");
 		goto err0;
 	}
 
 	/* Add padding. */
-	padlen = padme((size_t)zlen, C->zbuflen);
-	memset(&C->zbuf[zlen], 0, padlen);
-	zlen += padlen;
+	padlen = padme(len, zbuflen);
+	memset(&zbuf[len], 0, padlen);
+	*zlen = len + padlen;
 
-	/* Ask the storage layer to write the file for us. */
-	if (storage_write_file(C->S, C->zbuf, zlen, 'c', hash)) {
-		hexify(hash, hashbuf, 32);
-		warnp("Error storing chunk %s", hashbuf);
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Add a new chunk to ${C}->dir and update statistics. */
+static int
+chunk_insert(CHUNKS_W * C, const uint8_t * hash, size_t buflen, size_t zlen)
+{
+	struct chunkdata ch;
+
+	/* Fill in the chunk parameters... */
+	ch.len = (uint32_t)buflen;
+	ch.zlen_flags = (uint32_t)(zlen | CHDATA_CTAPE);
+	ch.nrefs = 1;
+	ch.ncopies = 1;
+
+	/* ... and insert it into the chunk directory. */
+	if (chunks_directory_insert(C->dir, hash, &ch))
+		goto err0;
+
+	/* Update statistics. */
+	chunks_stats_add(&C->stats_total, ch.len, zlen, 1);
+	chunks_stats_add(&C->stats_unique, ch.len, zlen, 1);
+	chunks_stats_add(&C->stats_tape, ch.len, zlen, 1);
+	chunks_stats_add(&C->stats_new, ch.len, zlen, 1);
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * chunks_write_chunk(C, hash, buf, buflen, level):
+ * Write the chunk ${buf} of length ${buflen}, which has HMAC ${hash},
+ * as part of the write transaction associated with the cookie ${C}.  If the
+ * chunk is not already stored, compress it using zlib compression level
+ * ${level}.  Return the compressed size.
+ */
+ssize_t
+chunks_write_chunk(CHUNKS_W * C, const uint8_t * hash,
+    const uint8_t * buf, size_t buflen, int level)
+{
+	struct chunkdata * ch;
+	struct chunks_deflate * D;
+	uint8_t * zbuf;
+	size_t zlen;
+	char hashbuf[65];
+	int rc;
+
+	/* Sanity checks. */
+	assert(buflen <= UINT32_MAX);
+	assert(C->zbuflen <= CHDATA_ZLEN);
+
+	/* If the chunk is in ${C}->dir, return the compressed length. */
+	if (chunks_directory_find(C->dir, hash, &ch))
 		goto err0;
+	if (ch != NULL) {
+		chunk_ref(C, ch);
+		return (ch->zlen_flags & CHDATA_ZLEN);
 	}
 
-	/* Allocate a new struct chunkdata... */
-	if ((ch = malloc(sizeof(struct chunkdata))) == NULL)
+	/* Compress the chunk straight into a buffer for the storage layer. */
+	if ((zbuf = storage_write_file_alloc(C->S, C->zbuflen)) == NULL)
 		goto err0;
+	if (deflate_get(C, level, &D))
+		goto err1;
+	rc = chunk_compress(D, zbuf, C->zbuflen, buf, buflen, &zlen);
+	deflate_put(C, D);
+	if (rc)
+		goto err1;
+
+	/* Encrypt the chunk and ask the storage layer to write it for us. */
+	if (C->S == NULL) {
+		storage_write_file_free(zbuf);
+	} else {
+		if (storage_write_file_seal(zbuf, zlen))
+			goto err1;
+		if (storage_write_file_sealed(C->S, zbuf, zlen, 'c', hash)) {
+			hexify(hash, hashbuf, 32);
+			warnp("Error storing chunk %s", hashbuf);
+			goto err0;
+		}
+	}
 
-	/* ... fill in the chunk parameters... */
-	memcpy(ch->hash, hash, 32);
-	ch->len = (uint32_t)buflen;
-	ch->zlen_flags = (uint32_t)(zlen | CHDATA_MALLOC | CHDATA_CTAPE);
-	ch->nrefs = 1;
-	ch->ncopies = 1;
+	/* Record the new chunk. */
+	if (chunk_insert(C, hash, buflen, zlen))
+		goto err0;
 
-	/* ... and insert it into the hash table. */
-	if (rwhashtab_insert(C->HT, ch))
+	/* Success! */
+	return ((ssize_t)zlen);
+
+err1:
+	storage_write_file_free(zbuf);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * chunks_write_chunk_start(C, hash, buf, buflen, level):
+ * Prepare to write the chunk ${buf} of length ${buflen}, which has HMAC
+ * ${hash}, as part of the write transaction associated with the cookie
+ * ${C}, compressing it using zlib compression level ${level}.  The chunk
+ * data is copied, so ${buf} may be reused as soon as this function returns.
+ * The returned cookie must be passed to chunks_write_chunk_compress and then
+ * to chunks_write_chunk_finish.
+ */
+struct chunks_write_pending *
+chunks_write_chunk_start(CHUNKS_W * C, const uint8_t * hash,
+    const uint8_t * buf, size_t buflen, int level)
+{
+	struct chunks_write_pending * P;
+	struct chunkdata * ch;
+
+	/* Sanity checks. */
+	assert(buflen <= UINT32_MAX);
+	assert(C->zbuflen <= CHDATA_ZLEN);
+
+	/* Allocate memory. */
+	if ((P = malloc(sizeof(struct chunks_write_pending))) == NULL)
+		goto err0;
+	P->C = C;
+	memcpy(P->hash, hash, 32);
+	P->buf = NULL;
+	P->buflen = buflen;
+	P->D = NULL;
+	P->zbuf = NULL;
+	P->zlen = 0;
+
+	/* If we already have this chunk, there is no work to be done. */
+	if (chunks_directory_find(C->dir, hash, &ch))
 		goto err1;
+	if (ch != NULL)
+		goto done;
 
-	/* Update statistics. */
-	chunks_stats_add(&C->stats_total, ch->len, zlen, 1);
-	chunks_stats_add(&C->stats_unique, ch->len, zlen, 1);
-	chunks_stats_add(&C->stats_tape, ch->len, zlen, 1);
-	chunks_stats_add(&C->stats_new, ch->len, zlen, 1);
+	/* Copy the chunk data. */
+	if ((P->buf = malloc(buflen)) == NULL)
+		goto err1;
+	memcpy(P->buf, buf, buflen);
+
+	/* Get a deflate stream for the worker thread to use. */
+	if (deflate_get(C, level, &P->D))
+		goto err1;
 
+	/* Allocate space for the compressed and encrypted chunk. */
+	if ((P->zbuf = storage_write_file_alloc(C->S, C->zbuflen)) == NULL)
+		goto err1;
+
+done:
 	/* Success! */
-	return ((ssize_t)zlen);
+	return (P);
 
 err1:
-	free(ch);
+	chunks_write_pending_free(P);
 err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * chunks_write_chunk_compress(P):
+ * Compress and encrypt the chunk associated with the cookie ${P}.  This
+ * function is thread-safe, and does not access the write transaction except
+ * to read its parameters.
+ */
+int
+chunks_write_chunk_compress(struct chunks_write_pending * P)
+{
+
+	/* Nothing to do if we already have this chunk. */
+	if (P->buf == NULL)
+		return (0);
+
+	/* Compress the chunk. */
+	if (chunk_compress(P->D, P->zbuf, P->C->zbuflen, P->buf, P->buflen,
+	    &P->zlen))
+		goto err0;
+
+	/* We don't need the uncompressed data any more. */
+	free(P->buf);
+	P->buf = NULL;
+
+	/* Encrypt the chunk in place, unless this is a dry run. */
+	if ((P->C->S != NULL) && storage_write_file_seal(P->zbuf, P->zlen))
+		goto err0;
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * chunks_write_chunk_finish(P):
+ * Finish writing the chunk associated with the cookie ${P}, which has been
+ * passed to chunks_write_chunk_compress, and free the cookie.  Cookies must
+ * be finished in the order in which they were started.  Return the
+ * compressed size.
+ */
+ssize_t
+chunks_write_chunk_finish(struct chunks_write_pending * P)
+{
+	CHUNKS_W * C = P->C;
+	struct chunkdata * ch;
+	uint8_t * zbuf;
+	char hashbuf[65];
+	ssize_t zlen;
+
+	/*
+	 * If the chunk is in ${C}->dir, return the compressed length; it may
+	 * have been added by an earlier chunk since this one was started.
+	 */
+	if (chunks_directory_find(C->dir, P->hash, &ch))
+		goto err0;
+	if (ch != NULL) {
+		chunk_ref(C, ch);
+		zlen = ch->zlen_flags & CHDATA_ZLEN;
+		goto done;
+	}
+
+	/* Ask the storage layer to write the file for us. */
+	if (C->S != NULL) {
+		zbuf = P->zbuf;
+		P->zbuf = NULL;
+		if (storage_write_file_sealed(C->S, zbuf, P->zlen, 'c',
+		    P->hash)) {
+			hexify(P->hash, hashbuf, 32);
+			warnp("Error storing chunk %s", hashbuf);
+			goto err0;
+		}
+	}
+
+	/* Record the new chunk. */
+	if (chunk_insert(C, P->hash, P->buflen, P->zlen))
+		goto err0;
+	zlen = (ssize_t)P->zlen;
+
+done:
+	chunks_write_pending_free(P);
+
+	/* Success! */
+	return (zlen);
+
+err0:
+	chunks_write_pending_free(P);
+
 	/* Failure! */
 	return (-1);
 }
 
+/**
+ * chunks_write_pending_free(P):
+ * Free the cookie ${P} returned by chunks_write_chunk_start without writing
+ * the chunk.
+ */
+void
+chunks_write_pending_free(struct chunks_write_pending * P)
+{
+
+	/* Behave consistently with free(NULL). */
+	if (P == NULL)
+		return;
+
+	/* Return the deflate stream for reuse. */
+	deflate_put(P->C, P->D);
+
+	/* Free memory. */
+	storage_write_file_free(P->zbuf);
+	free(P->buf);
+	free(P);
+}
+
 /**
  * chunks_write_ispresent(C, hash):
  * If a chunk with hash ${hash} exists, return 0; otherwise, return 1.
+ * Return -1 on error.
  */
 int
 chunks_write_ispresent(CHUNKS_W * C, const uint8_t * hash)
 {
 
-	if (rwhashtab_read(C->HT, hash) != NULL)
+	struct chunkdata * ch;
+
+	if (chunks_directory_find(C->dir, hash, &ch))
+		return (-1);
+	if (ch != NULL)
 		return (0);
 	else
 		return (1);
@@ -270,7 +786,7 @@ chunks_write_ispresent(CHUNKS_W * C, const uint8_t * hash)
  * chunks_write_chunkref(C, hash):
  * If a chunk with hash ${hash} exists, mark it as being part of the write
  * transaction associated with the cookie ${C} and return 0.  If it
- * does not exist, return 1.
+ * does not exist, return 1.  Return -1 on error.
  */
 int
 chunks_write_chunkref(CHUNKS_W * C, const uint8_t * hash)
@@ -278,20 +794,13 @@ chunks_write_chunkref(CHUNKS_W * C, const uint8_t * hash)
 	struct chunkdata * ch;
 
 	/*
-	 * If the chunk is in ${C}->HT, mark it as being part of the
+	 * If the chunk is in ${C}->dir, mark it as being part of the
 	 * transaction and return 0.
 	 */
-	if ((ch = rwhashtab_read(C->HT, hash)) != NULL) {
-		chunks_stats_add(&C->stats_total, ch->len,
-		    ch->zlen_flags & CHDATA_ZLEN, 1);
-		chunks_stats_add(&C->stats_tape, ch->len,
-		    ch->zlen_flags & CHDATA_ZLEN, 1);
-		ch->ncopies += 1;
-		if ((ch->zlen_flags & CHDATA_CTAPE) == 0) {
-			ch->nrefs += 1;
-			ch->zlen_flags |= CHDATA_CTAPE;
-		}
-
+	if (chunks_directory_find(C->dir, hash, &ch))
+		return (-1);
+	if (ch != NULL) {
+		chunk_ref(C, ch);
 		return (0);
 	}
 
@@ -374,7 +883,7 @@ chunks_write_checkpoint(CHUNKS_W * C)
 
 	/* If this isn't a dry run, write the new chunk directory. */
 	if ((C->S != NULL) &&
-	    chunks_directory_write(C->path, C->HT, &C->stats_extra, ".ckpt"))
+	    chunks_directory_save(C->dir, C->path, &C->stats_extra, ".ckpt"))
 		goto err0;
 
 	/* Success! */
@@ -392,16 +901,26 @@ err0:
 void
 chunks_write_free(CHUNKS_W * C)
 {
+	struct chunks_deflate * D;
+	int i;
 
 	/* Behave consistently with free(NULL). */
 	if (C == NULL)
 		return;
 
-	/* Free the chunk hash table. */
-	chunks_directory_free(C->HT, C->dir);
+	/* Free the chunk directory. */
+	chunks_directory_close(C->dir);
+
+	/* Free the deflate streams. */
+	for (i = 0; i <= Z_BEST_COMPRESSION; i++) {
+		while ((D = C->D[i]) != NULL) {
+			C->D[i] = D->next;
+			deflateEnd(&D->zs);
+			free(D);
+		}
+	}
 
 	/* Free memory. */
-	free(C->zbuf);
 	free(C->path);
 	free(C);
 }
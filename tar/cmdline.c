@@ -75,6 +75,9 @@ static struct option {
 	{ "check-links",          0, OPTION_CHECK_LINKS },
 	{ "checkpoint-bytes",	  1, OPTION_CHECKPOINT_BYTES },
 	{ "chroot",               0, OPTION_CHROOT },
+	{ "chunk-segments",	  1, OPTION_CHUNK_SEGMENTS },
+	{ "compression-level",	  1, OPTION_COMPRESSION_LEVEL },
+	{ "compression-policy",	  1, OPTION_COMPRESSION_POLICY },
 	{ "configfile",		  1, OPTION_CONFIGFILE },
 	{ "confirmation",         0, 'w' },
 	{ "create",               0, 'c' },
@@ -83,6 +86,7 @@ static struct option {
 	{ "debug-network-stats",  0, OPTION_DEBUG_NETWORK_STATS },
 	{ "dereference",	  0, 'L' },
 	{ "directory",            1, 'C' },
+	{ "directory-memlimit",	  1, OPTION_DIRECTORY_MEMLIMIT },
 	{ "disk-pause",		  1, OPTION_DISK_PAUSE },
 	{ "dry-run",		  0, OPTION_DRYRUN },
 	{ "dry-run-metadata",	  0, OPTION_DRYRUN_METADATA },
@@ -129,9 +133,12 @@ static struct option {
 	{ "norecurse",            0, 'n' },
 	{ "normalmem",		  0, OPTION_NORMALMEM },
 	{ "no-aggressive-networking", 0, OPTION_NO_AGGRESSIVE_NETWORKING },
+	{ "no-chunk-segments",	  0, OPTION_NO_CHUNK_SEGMENTS },
+	{ "no-compression-level", 0, OPTION_NO_COMPRESSION_LEVEL },
 	{ "no-config-exclude",	  0, OPTION_NO_CONFIG_EXCLUDE },
 	{ "no-config-include",	  0, OPTION_NO_CONFIG_INCLUDE },
 	{ "no-default-config",	  0, OPTION_NO_DEFAULT_CONFIG },
+	{ "no-directory-memlimit", 0, OPTION_NO_DIRECTORY_MEMLIMIT },
 	{ "no-disk-pause",	  0, OPTION_NO_DISK_PAUSE },
 	{ "no-force-resources",	  0, OPTION_NO_FORCE_RESOURCES },
 	{ "no-humanize-numbers",  0, OPTION_NO_HUMANIZE_NUMBERS },
@@ -152,6 +159,7 @@ static struct option {
 	{ "no-snaptime",	  0, OPTION_NO_SNAPTIME },
 	{ "no-store-atime",	  0, OPTION_NO_STORE_ATIME },
 	{ "no-totals",		  0, OPTION_NO_TOTALS },
+	{ "no-worker-threads",	  0, OPTION_NO_WORKER_THREADS },
 	{ "nuke",		  0, OPTION_NUKE },
 	{ "null",		  0, OPTION_NULL },
 	{ "null-input",		  0, OPTION_NULL_INPUT },
@@ -180,6 +188,7 @@ static struct option {
 	{ "verbose",              0, 'v' },
 	{ "version",              0, OPTION_VERSION },
 	{ "verylowmem",		  0, OPTION_VERYLOWMEM },
+	{ "worker-threads",	  1, OPTION_WORKER_THREADS },
 	{ NULL, 0, 0 }
 };
 
@@ -46,6 +46,7 @@ __FBSDID("$FreeBSD: src/usr.bin/tar/matching.c,v 1.16 2008/08/18 18:13:40 kientz
 struct match {
 	struct match	 *next;
 	int		  matches;
+	int		  level;
 	char		  pattern[1];
 };
 
@@ -55,6 +56,7 @@ struct matching {
 	struct match	 *inclusions;
 	int		  inclusions_count;
 	int		  inclusions_unmatched_count;
+	struct match	 *compressions;
 };
 
 
@@ -137,6 +139,45 @@ add_pattern(struct bsdtar *bsdtar, struct match **list, const char *pattern)
 	match->matches = 0;
 }
 
+/*
+ * Compression levels are kept in the order they were specified, so that
+ * the first pattern which matches wins; this lets command-line options
+ * override patterns from the configuration file.
+ */
+int
+compress_pattern(struct bsdtar *bsdtar, int level, const char *pattern)
+{
+	struct match **list;
+
+	if (bsdtar->matching == NULL)
+		initialize_matching(bsdtar);
+	for (list = &(bsdtar->matching->compressions); *list != NULL;
+	    list = &((*list)->next))
+		continue;
+	add_pattern(bsdtar, list, pattern);
+	(*list)->level = level;
+	return (0);
+}
+
+int
+compress_level(struct bsdtar *bsdtar, const char *pathname)
+{
+	struct match *match;
+
+	if (bsdtar->matching == NULL)
+		return (-1);
+
+	/* Compression patterns match the same way as exclusions. */
+	for (match = bsdtar->matching->compressions; match != NULL;
+	    match = match->next) {
+		if (match_exclusion(match, pathname))
+			return (match->level);
+	}
+
+	/* No pattern matched. */
+	return (-1);
+}
+
 int
 excluded(struct bsdtar *bsdtar, const char *pathname)
 {
@@ -241,6 +282,12 @@ cleanup_exclusions(struct bsdtar *bsdtar)
 			p = p->next;
 			free(q);
 		}
+		p = bsdtar->matching->compressions;
+		while (p != NULL) {
+			q = p;
+			p = p->next;
+			free(q);
+		}
 		free(bsdtar->matching);
 	}
 }
@@ -254,6 +301,7 @@ initialize_matching(struct bsdtar *bsdtar)
 	memset(bsdtar->matching, 0, sizeof(*bsdtar->matching));
 	bsdtar->matching->exclusions = NULL;
 	bsdtar->matching->inclusions = NULL;
+	bsdtar->matching->compressions = NULL;
 }
 
 int
@@ -29,6 +29,9 @@ struct chunkifier_internal {
 	void * cookie;		/* Cookie passed to callback */
 
 	/* Current state */
+	uint32_t kbase;		/* Position of start of chunk in input */
+				/* since the hash table was last cleared, */
+				/* plus htlen for each previous chunk. */
 	uint32_t k;		/* Number of bytes in chunk so far */
 	uint32_t r;		/* floor(sqrt(4 * k - mu)) */
 	uint32_t rs;		/* (r + 1)^2 - (4 * k - mu) */
@@ -37,8 +40,10 @@ struct chunkifier_internal {
 				/* evaluated at a mod p */
 	uint32_t * b;		/* Circular buffer of values waiting to */
 				/* be added to the hash table. */
-	uint32_t * ht;		/* Hash table; pairs of the form (yka, k). */
-	uint8_t * buf;		/* Buffer of bytes processed */
+	uint32_t * ht;		/* Hash table; pairs of the form */
+				/* (kbase + k, yka). */
+	uint8_t * buf;		/* Bytes of the chunk which were provided */
+				/* by earlier calls to chunkify_write. */
 };
 
 static int isprime(uint32_t n);
@@ -46,6 +51,7 @@ static uint32_t nextprime(uint32_t n);
 static uint32_t mmul(uint32_t a, uint32_t b, uint32_t p, uint32_t pp);
 static int minorder(uint32_t ar, uint32_t ord, uint32_t p, uint32_t pp);
 static uint32_t isqrt(uint32_t x);
+static void chunkify_clear(CHUNKIFIER * c);
 static void chunkify_start(CHUNKIFIER * c);
 
 /* Return nonzero iff n is prime. */
@@ -129,17 +135,41 @@ isqrt(uint32_t x)
 }
 
 /*
- * Prepare the CHUNKIFIER for input.
+ * Remove all entries from the hash table, and count positions from zero.
  */
 static void
-chunkify_start(CHUNKIFIER * c)
+chunkify_clear(CHUNKIFIER * c)
 {
 	uint32_t i;
 
-	/* No entries in the hash table. */
+	/* Mark every entry as being htlen bytes before position zero. */
 	for (i = 0; i < 2 * c->htlen; i++)
 		c->ht[i] = - c->htlen;
 
+	/* The next chunk starts at position zero. */
+	c->kbase = 0;
+}
+
+/*
+ * Prepare the CHUNKIFIER for input.
+ */
+static void
+chunkify_start(CHUNKIFIER * c)
+{
+	uint32_t i;
+
+	/*
+	 * Start the new chunk htlen bytes after the end of the previous one.
+	 * Entries in the hash table are ignored unless they are less than
+	 * 2 * r <= htlen bytes old, so this has the same effect as removing
+	 * all the entries from the table, without touching it.  Once the
+	 * positions get large enough that they might wrap around, we clear
+	 * the table instead.
+	 */
+	c->kbase += c->k + c->htlen;
+	if (c->kbase > UINT32_MAX / 2)
+		chunkify_clear(c);
+
 	/* Nothing in the queue waiting to be added to the table, either. */
 	for (i = 0; i < c->w; i++)
 		c->b[i] = c->p;
@@ -173,7 +203,11 @@ chunkify_init(uint32_t meanlen, uint32_t maxlen,
 {
 	CHUNKIFIER * c;
 	uint8_t hbuf[32];	/* HMAC of something */
-	uint8_t pbuf[2];	/* 'p\0', 'a\0', or 'x' . i */
+	uint8_t pbuf[2];	/* 'p\0' or 'a\0' */
+	uint8_t xbuf[256][2];	/* 'x' . i */
+	const uint8_t * xptr[256];
+	size_t xlen[256];
+	uint8_t xhash[256][32];	/* HMAC('x' . i) */
 	uint32_t pmin;
 	uint32_t i;
 
@@ -246,14 +280,18 @@ chunkify_init(uint32_t meanlen, uint32_t maxlen,
 		goto err;
 	memcpy(&c->ar, hbuf, sizeof(c->ar));
 
-	/* cm[i] is generated from HMAC('x' . i). */
+	/* cm[i] is generated from HMAC('x' . i); compute these together. */
 	for (i = 0; i < 256; i++) {
-		pbuf[0] = 'x';
-		pbuf[1] = i & 0xff;
-		if (crypto_hash_data(CRYPTO_KEY_HMAC_CPARAMS, pbuf, 2, hbuf))
-			goto err;
-		memcpy(&c->cm[i], hbuf, sizeof(c->cm[i]));
+		xbuf[i][0] = 'x';
+		xbuf[i][1] = i & 0xff;
+		xptr[i] = xbuf[i];
+		xlen[i] = 2;
 	}
+	if (crypto_hash_data_multi(CRYPTO_KEY_HMAC_CPARAMS, xptr, xlen, 256,
+	    xhash))
+		goto err;
+	for (i = 0; i < 256; i++)
+		memcpy(&c->cm[i], xhash[i], sizeof(c->cm[i]));
 
 	/*
 	 * Using the generated pseudorandom values, actually generate
@@ -290,6 +328,8 @@ chunkify_init(uint32_t meanlen, uint32_t maxlen,
 	/*
 	 * Prepare for incoming data.
 	 */
+	chunkify_clear(c);
+	c->k = 0;
 	chunkify_start(c);
 
 	/*
@@ -308,25 +348,29 @@ err:
 }
 
 /**
- * validcycle(buf, start, end):
- * Check if the cycle in ${buf} from ${start} to ${end} contains enough
- * distinct byte values; a chosen-plaintext attack may be feasible under some
- * circumstances if only two distinct byte values are used, so we require
- * eight.
+ * validcycle(buf, buflen, buf2, start, end):
+ * Check if the cycle from ${start} to ${end} in a chunk, the first ${buflen}
+ * bytes of which are in ${buf} and the rest of which are in ${buf2},
+ * contains enough distinct byte values; a chosen-plaintext attack may be
+ * feasible under some circumstances if only two distinct byte values are
+ * used, so we require eight.
  */
 static int
-validcycle(uint8_t * buf, size_t start, size_t end)
+validcycle(const uint8_t * buf, size_t buflen, const uint8_t * buf2,
+    size_t start, size_t end)
 {
 	uint8_t seen[256];
 	size_t nzcount = 0;
 	size_t i;
+	uint8_t x;
 
 	/* Count how many byte values occur a nonzero number of times. */
 	for (i = 0; i < 256; i++)
 		seen[i] = 0;
 	for (i = start; i < end; i++) {
-		nzcount += 1 - seen[buf[i]];
-		seen[buf[i]] = 1;
+		x = (i < buflen) ? buf[i] : buf2[i - buflen];
+		nzcount += 1 - seen[x];
+		seen[x] = 1;
 	}
 
 	/* A valid cycle uses at least 8 distinct byte values. */
@@ -346,102 +390,158 @@ validcycle(uint8_t * buf, size_t start, size_t end)
 int
 chunkify_write(CHUNKIFIER * c, const uint8_t * buf, size_t buflen)
 {
+	const uint8_t * chunk;	/* Start of chunk data in buf. */
+	uint32_t kbuf;		/* Number of bytes of chunk in c->buf. */
+	uint32_t kbase, k, r, rs, akr, yka;
+	uint32_t kpos;
+	const uint32_t * cm;
+	uint32_t * ht;
+	uint32_t * b;
+	uint32_t p, pp, ar, htmask, blen, w;
 	uint32_t htpos;
 	uint32_t yka_tmp;
 	size_t i;
+	size_t n;
 	int rc;
 
 	/* Bail if we don't have a chunkifier. */
 	if (c == NULL)
 		return (0);
 
+	/*
+	 * The bytes of the current chunk which were provided by earlier
+	 * calls are in c->buf; the rest of the chunk is in buf, and is only
+	 * copied into c->buf if the chunk doesn't end in this call.
+	 */
+	kbuf = c->k;
+	chunk = buf;
+
+	/*
+	 * Load the parameters; the compiler can't keep them in registers
+	 * itself, since writes to ht[] and b[] might alias them.
+	 */
+	cm = c->cm;
+	ht = c->ht;
+	b = c->b;
+	p = c->p;
+	pp = c->pp;
+	ar = c->ar;
+	htmask = c->htlen - 1;
+	blen = c->blen;
+	w = c->w;
+
+	/* Load the current state. */
+	kbase = c->kbase;
+	k = c->k;
+	r = c->r;
+	rs = c->rs;
+	akr = c->akr;
+	yka = c->yka;
+
 	for (i = 0; i < buflen; i++) {
-		/* Add byte to buffer. */
-		c->buf[c->k] = buf[i];
+		/*
+		 * While r = 0, bytes don't affect anything but k, r, and rs;
+		 * so skip over as many bytes as we can until r becomes
+		 * nonzero or k reaches blen - 1.
+		 */
+		if (r == 0) {
+			n = (rs - 1) / 4;
+			if (n > buflen - i)
+				n = buflen - i;
+			if (n > blen - 1 - k)
+				n = blen - 1 - k;
+			k += (uint32_t)n;
+			rs -= 4 * (uint32_t)n;
+			if ((i += n) == buflen)
+				break;
+		}
 
 		/* k := k + 1 */
-		c->k++;
-		while (c->rs <= 4) {
-			c->rs += 2 * c->r + 1;
-			c->r += 1;
+		k++;
+		while (rs <= 4) {
+			rs += 2 * r + 1;
+			r += 1;
 		}
-		c->rs -= 4;
+		rs -= 4;
 
 		/*
 		 * If k = blen, then we've filled the buffer and we
 		 * automatically have the end of the chunk.
 		 */
-		if (c->k == c->blen)
+		if (k == blen)
 			goto endofchunk;
 
 		/*
 		 * Don't waste time on arithmetic if we don't have enough
 		 * data yet for a permitted loop to ever occur.
 		 */
-		if (c->r == 0)
+		if (r == 0)
 			continue;
 
+		/* Position used to tag entries in the hash table. */
+		kpos = kbase + k;
+
 		/*
 		 * Update state to add new character.
 		 */
 
 		/* y_k(a) := y_k(a) + a^k * x_k mod p */
 		/* yka <= p * (2 + p / (2^32 - p)) <= p * 2.5 < 2^31 + p */
-		c->yka += mmul(c->akr, c->cm[buf[i]], c->p, c->pp);
+		yka += mmul(akr, cm[buf[i]], p, pp);
 
 		/* Each step reduces yka by p iff yka >= p. */
-		c->yka -= c->p & (((c->yka - c->p) >> 31) - 1);
-		c->yka -= c->p & (((c->yka - c->p) >> 31) - 1);
+		yka -= p & (((yka - p) >> 31) - 1);
+		yka -= p & (((yka - p) >> 31) - 1);
 
 		/* a^k := a^k * alpha mod p */
 		/* akr <= p * 2^32 / (2^32 - p) */
-		c->akr = mmul(c->akr, c->ar, c->p, c->pp);
+		akr = mmul(akr, ar, p, pp);
 
 		/*
 		 * Check if yka is in the hash table.
 		 */
-		htpos = c->yka & (c->htlen - 1);
+		htpos = yka & htmask;
 		do {
 			/* Have we found yka? */
-			if (c->ht[2 * htpos + 1] == c->yka) {
+			if (ht[2 * htpos + 1] == yka) {
 				/* Recent enough to be a valid entry? */
-				if (c->k - c->ht[2 * htpos] - 1 < c->r) {
+				if (kpos - ht[2 * htpos] - 1 < r) {
 					/* Has enough unique characters? */
-					if (validcycle(c->buf,
-					    c->ht[2 * htpos] - c->w, c->k))
+					if (validcycle(c->buf, kbuf, chunk,
+					    ht[2 * htpos] - kbase - w, k))
 						goto endofchunk;
 				}
 			}
 
 			/* Have we found an empty space? */
-			if (c->k - c->ht[2 * htpos] - 1 >= 2 * c->r)
+			if (kpos - ht[2 * htpos] - 1 >= 2 * r)
 				break;
 
 			/* Move to the next position in the table. */
-			htpos = (htpos + 1) & (c->htlen - 1);
+			htpos = (htpos + 1) & htmask;
 		} while (1);
 
 		/*
 		 * Insert queued value into table.
 		 */
-		yka_tmp = c->b[c->k & (c->w - 1)];
-		htpos = yka_tmp & (c->htlen - 1);
+		yka_tmp = b[k & (w - 1)];
+		htpos = yka_tmp & htmask;
 		do {
 			/* Have we found an empty space or tombstone? */
-			if (c->k - c->ht[2 * htpos] - 1 >= c->r) {
-				c->ht[2 * htpos] = c->k;
-				c->ht[2 * htpos + 1] = yka_tmp;
+			if (kpos - ht[2 * htpos] - 1 >= r) {
+				ht[2 * htpos] = kpos;
+				ht[2 * htpos + 1] = yka_tmp;
 				break;
 			}
 
 			/* Move to the next position in the table. */
-			htpos = (htpos + 1) & (c->htlen - 1);
+			htpos = (htpos + 1) & htmask;
 		} while (1);
 
 		/*
 		 * Add current value into queue.
 		 */
-		c->b[c->k & (c->w - 1)] = c->yka;
+		b[k & (w - 1)] = yka;
 
 		/*
 		 * Move on to next byte.
@@ -450,13 +550,44 @@ chunkify_write(CHUNKIFIER * c, const uint8_t * buf, size_t buflen)
 
 endofchunk:
 		/*
-		 * We've reached the end of a chunk.
+		 * We've reached the end of a chunk.  If it started in this
+		 * call, pass it to the callback directly from buf; otherwise
+		 * append the rest of it to c->buf.
 		 */
-		rc = chunkify_end(c);
-		if (rc)
-			return (rc);
+		c->k = k;
+		if (kbuf == 0) {
+			rc = (c->chunkdone)(c->cookie, chunk, k);
+			if (rc)
+				return (rc);
+			chunkify_start(c);
+		} else {
+			memcpy(&c->buf[kbuf], chunk, k - kbuf);
+			rc = chunkify_end(c);
+			if (rc)
+				return (rc);
+		}
+
+		/* The next chunk starts with the next byte. */
+		kbuf = 0;
+		chunk = &buf[i + 1];
+		kbase = c->kbase;
+		k = c->k;
+		r = c->r;
+		rs = c->rs;
+		akr = c->akr;
+		yka = c->yka;
 	}
 
+	/* Keep the bytes of the unfinished chunk for later calls. */
+	memcpy(&c->buf[kbuf], chunk, k - kbuf);
+
+	/* Store the current state. */
+	c->k = k;
+	c->r = r;
+	c->rs = rs;
+	c->akr = akr;
+	c->yka = yka;
+
 	/* Success! */
 	return (0);
 }
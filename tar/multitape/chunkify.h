@@ -12,13 +12,15 @@ typedef struct chunkifier_internal CHUNKIFIER;
 /**
  * Callback when the end of a chunk is reached.  The parameters passed are
  * the cookie provided to chunkify_init, a pointer to a buffer containing
- * the chunk, and the length of the chunk in bytes.
+ * the chunk, and the length of the chunk in bytes.  The buffer may be part
+ * of a buffer passed to chunkify_write, and is only valid until the
+ * callback returns.
  *
  * Upon success, the callback should return 0.  Upon failure, a nonzero
  * value should be returned, and will be passed upstream to the caller of
  * chunkify_write or chunkify_end.
  */
-typedef int chunkify_callback(void *, uint8_t *, size_t);
+typedef int chunkify_callback(void *, const uint8_t *, size_t);
 
 /**
  * chunkify_init(meanlen, maxlen, callback, cookie):
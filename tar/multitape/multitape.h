@@ -12,6 +12,7 @@ typedef struct multitape_delete_internal TAPE_D;
 typedef struct multitape_stats_internal TAPE_S;
 
 struct chunkheader;
+struct writetape_prechunk;
 
 /**
  * readtape_open(machinenum, tapename):
@@ -83,6 +84,7 @@ ssize_t writetape_write(TAPE_W *, const void *, size_t);
 /**
  * writetape_ischunkpresent(d, ch):
  * If the specified chunk exists, return its length; otherwise, return 0.
+ * Return -1 on error.
  */
 ssize_t writetape_ischunkpresent(TAPE_W *, struct chunkheader *);
 
@@ -97,12 +99,67 @@ ssize_t writetape_ischunkpresent(TAPE_W *, struct chunkheader *);
  */
 ssize_t writetape_writechunk(TAPE_W *, struct chunkheader *);
 
+/**
+ * writetape_canprechunk(d):
+ * Return non-zero if archive entry data can be read and chunkified by the
+ * worker threads of the tape ${d} via writetape_prechunk_start.
+ */
+int writetape_canprechunk(TAPE_W *);
+
+/**
+ * writetape_prechunk_start(d, len, readfunc, cookie):
+ * Ask a worker thread of the tape ${d} to call ${readfunc}(${cookie}, buf,
+ * ${len}) to read ${len} > 0 bytes of archive entry data into a buffer, and
+ * then to split the data into chunks in the same way as writetape_write
+ * would if the data was the entire contents of an archive entry.  The
+ * function ${readfunc} must be thread-safe, and must return 0 on success or
+ * non-zero on failure.  This may only be called if writetape_canprechunk
+ * returned non-zero.
+ */
+struct writetape_prechunk * writetape_prechunk_start(TAPE_W *, size_t,
+    int (*)(void *, uint8_t *, size_t), void *);
+
+/**
+ * writetape_prechunk_wait(d, J):
+ * Wait until the worker threads of the tape ${d} have finished reading and
+ * chunkifying the archive entry data ${J}.  Return 0 if the data can be
+ * written via writetape_prechunk_write; 1 if reading or chunkifying the data
+ * failed; or -1 on error.
+ */
+int writetape_prechunk_wait(TAPE_W *, struct writetape_prechunk *);
+
+/**
+ * writetape_prechunk_write(d, J):
+ * Write the next chunk of the archive entry data ${J}, for which
+ * writetape_prechunk_wait returned 0, to the tape ${d} in the same way as
+ * writetape_write would have.  The tape must be in DATA mode, with no data
+ * having been passed to writetape_write since the mode was set.  Return the
+ * length of the chunk; 0 if all of the data has been written or the archive
+ * is being truncated; or -1 on error.
+ */
+ssize_t writetape_prechunk_write(TAPE_W *, struct writetape_prechunk *);
+
+/**
+ * writetape_prechunk_free(J):
+ * Free the archive entry data ${J}, which must not be pending in the worker
+ * threads (i.e., writetape_prechunk_wait must have been called).
+ */
+void writetape_prechunk_free(struct writetape_prechunk *);
+
 /**
  * writetape_setmode(d, mode):
  * Set the tape mode to 0 (HEADER), 1 (DATA), or 2 (finished archive entry).
  */
 int writetape_setmode(TAPE_W *, int);
 
+/**
+ * writetape_setlevel(d, level):
+ * Compress any new chunks of archive entry data written after this point
+ * using zlib compression level ${level}.  This must not be called in DATA
+ * mode, since chunks of the current entry might not have been written yet.
+ */
+void writetape_setlevel(TAPE_W *, int);
+
 /**
  * writetape_truncate(d):
  * Record that the archive is being truncated at the current position.
@@ -17,7 +17,9 @@
 #include "elasticarray.h"
 #include "storage.h"
 #include "sysendian.h"
+#include "tarsnap_opt.h"
 #include "warnp.h"
+#include "workpool.h"
 
 #include "multitape_internal.h"
 
@@ -38,6 +40,39 @@ CTASSERT(MAXCHUNK <= SSIZE_MAX);
  */
 #define	MINCHUNK	4096
 
+/*
+ * The file chunkifier can't end a chunk (other than via chunkify_end)
+ * within the first MEANCHUNK / 4 bytes, so a file with at most this much
+ * data becomes a single chunk (or a trailer) without needing to be passed
+ * through it.
+ */
+#define	SMALLBUFLEN	(MEANCHUNK / 4)
+CTASSERT(MINCHUNK <= SMALLBUFLEN);
+
+/*
+ * Maximum number of chunks per worker thread which are allowed to be
+ * waiting to be compressed and encrypted, or waiting to be collected after
+ * having been compressed and encrypted, before callback_file will block.
+ */
+#define	MAXPENDING_PERTHREAD	2
+
+/*
+ * If tarsnap_opt_chunk_segments is non-zero and we're using worker threads,
+ * file data written via writetape_write is divided into segments of
+ * SEGMENTLEN bytes, which worker threads split into chunks speculatively
+ * (i.e., as if a chunk started at the start of each segment); up to
+ * tarsnap_opt_chunk_segments segments can be held by the worker threads at
+ * once, regardless of how many threads there are.
+ */
+#define	SEGMENTLEN	(4 * 1024 * 1024)
+
+/*
+ * If the CPU can hash several buffers in parallel faster than it can hash
+ * them one at a time, worker threads compute the HMACs of the chunks in a
+ * segment after splitting it, up to PRECHUNK_HASHBATCH chunks at once.
+ */
+#define	PRECHUNK_HASHBATCH	64
+
 /* Elastic array of chunk headers. */
 ELASTICARRAY_DECL(CHUNKLIST, chunklist, struct chunkheader);
 
@@ -50,6 +85,39 @@ struct stream {
 	CHUNKIFIER * c;		/* Chunkifier for stream. */
 };
 
+/* A chunk which has been handed to the worker threads. */
+struct pendingchunk {
+	struct chunks_write_pending * P;	/* Chunk layer cookie. */
+	struct chunkheader ch;	/* Chunk header; zlen is not yet known. */
+	struct stream * S;	/* Stream, or NULL for file data. */
+};
+
+/* A chunkifier used by worker threads for chunkifying archive entry data. */
+struct prechunker {
+	CHUNKIFIER * c;		/* Chunkifier. */
+	struct writetape_prechunk * J;	/* Job using the chunkifier. */
+	struct prechunker * next;	/* Next unused chunkifier. */
+	int hashlater;		/* Chunks are hashed by prechunk_hash. */
+};
+
+/*
+ * Archive entry data which is chunkified (and possibly read) by a worker
+ * thread: Either an entire archive entry, via writetape_prechunk_start; or
+ * a segment of file data written via writetape_write.
+ */
+struct writetape_prechunk {
+	int (* readfunc)(void *, uint8_t *, size_t);	/* Reads the data. */
+	void * cookie;		/* Cookie passed to readfunc. */
+	uint8_t * buf;		/* Archive entry data. */
+	size_t buflen;		/* Length of archive entry data. */
+	int partial;		/* Data continues past the end of buf. */
+	struct prechunker * pcr;	/* Chunkifier; NULL once collected. */
+	CHUNKLIST chunks;	/* Lengths and hashes of chunks. */
+	size_t chunknum;	/* Next chunk to be written. */
+	size_t bufpos;		/* Position of next chunk in buf. */
+	struct writetape_prechunk * next;	/* Next segment. */
+};
+
 /*
  * "Cookie" structure created by writetape_open and passed to other functions.
  */
@@ -68,9 +136,20 @@ struct multitape_write_internal {
 	/* Lower level cookies. */
 	STORAGE_W * S;		/* Storage layer write cookie; NULL=dryrun. */
 	CHUNKS_W * C;		/* Chunk layer write cookie. */
+	WORKPOOL * P;		/* Worker threads; NULL=serial. */
+	size_t maxpending;	/* Maximum number of pending chunks. */
+	WORKPOOL * P_prechunk;	/* Worker threads for entry data, or NULL. */
+	struct prechunker * prechunkers;	/* Unused chunkifiers. */
 	int lockfd;		/* Lock on cache directory. */
 	uint8_t seqnum[32];	/* Transaction sequence number. */
 
+	/* Segments of file data being chunkified by worker threads. */
+	struct writetape_prechunk * seg;	/* Segment being filled. */
+	struct writetape_prechunk * seghead;	/* Oldest segment in use. */
+	struct writetape_prechunk ** segtailp;	/* Last next pointer. */
+	size_t nsegs;		/* Number of segments in use. */
+	size_t maxsegs;		/* Maximum number of segments; 0=none. */
+
 	/* Chunkification state. */
 	struct stream h;	/* Header stream. */
 	struct stream c;	/* Chunk index stream. */
@@ -78,7 +157,10 @@ struct multitape_write_internal {
 	CHUNKIFIER * c_file;	/* Used for chunkifying individual files. */
 	off_t c_file_in;	/* Bytes written into c_file. */
 	off_t c_file_out;	/* Bytes passed out by c_file. */
+	uint8_t smallbuf[SMALLBUFLEN];	/* File data held back from c_file. */
+	size_t smallbuflen;	/* Length of data in smallbuf. */
 	int mode;		/* Tape mode (header, data, end of entry). */
+	int level;		/* Compression level for file data. */
 
 	/* Header buffering. */
 	BYTEBUF	hbuf;		/* Pending archive header. */
@@ -95,12 +177,32 @@ struct multitape_write_internal {
 };
 
 static int tapepresent(STORAGE_W *, const char *, const char *);
-static int store_chunk(uint8_t *, size_t, struct chunkheader *, CHUNKS_W *);
-static int handle_chunk(uint8_t *, size_t, struct stream *, CHUNKS_W *);
+static int store_chunk(const uint8_t *, size_t, const uint8_t *, int,
+    struct chunkheader *, CHUNKS_W *);
+static int handle_chunk(const uint8_t *, size_t, struct stream *,
+    CHUNKS_W *);
+static int queue_chunk(TAPE_W *, const uint8_t *, size_t, const uint8_t *,
+    struct stream *);
+static int drain_chunk(TAPE_W *);
+static int drain_chunks(TAPE_W *);
+static void cancel_chunks(TAPE_W *);
+static int prechunk_work(void *);
+static int prechunk_hash(struct writetape_prechunk *);
+static struct writetape_prechunk * prechunk_alloc(size_t);
+static int prechunk_queue(TAPE_W *, struct writetape_prechunk *);
+static int segment_write(TAPE_W *, const uint8_t *, size_t);
+static int segment_start(TAPE_W *);
+static int segment_finish(TAPE_W *);
+static int segment_flush(TAPE_W *);
+static int file_isempty(TAPE_W *);
+static int file_flush(TAPE_W *);
+static int file_end(TAPE_W *);
 static chunkify_callback callback_h;
 static chunkify_callback callback_t;
 static chunkify_callback callback_c;
 static chunkify_callback callback_file;
+static chunkify_callback callback_prechunk;
+static int file_chunk(TAPE_W *, const uint8_t *, size_t, const uint8_t *);
 static int endentry(TAPE_W *);
 static int flushtape(TAPE_W *, int);
 
@@ -190,25 +292,30 @@ err0:
 }
 
 /**
- * store_chunk(buf, buflen, ch, C):
+ * store_chunk(buf, buflen, hash, level, ch, C):
  * Write the chunk ${buf} of length ${buflen} using the chunk layer cookie
- * ${C}, and populate the chunkheader structure ${ch}.
+ * ${C} and compression level ${level}, and populate the chunkheader
+ * structure ${ch}.  If ${hash} is not NULL, it is the (already computed)
+ * hash of the chunk.
  */
 static int
-store_chunk(uint8_t * buf, size_t buflen, struct chunkheader * ch,
-    CHUNKS_W * C)
+store_chunk(const uint8_t * buf, size_t buflen, const uint8_t * hash,
+    int level, struct chunkheader * ch, CHUNKS_W * C)
 {
 	ssize_t zlen;
 
 	/* Hash of chunk. */
-	if (crypto_hash_data(CRYPTO_KEY_HMAC_CHUNK, buf, buflen, ch->hash))
+	if (hash != NULL)
+		memcpy(ch->hash, hash, 32);
+	else if (crypto_hash_data(CRYPTO_KEY_HMAC_CHUNK, buf, buflen,
+	    ch->hash))
 		goto err0;
 
 	/* Length of chunk. */
 	le32enc(ch->len, (uint32_t)(buflen));
 
 	/* Ask chunk layer to store the chunk. */
-	zlen = chunks_write_chunk(C, ch->hash, buf, buflen);
+	zlen = chunks_write_chunk(C, ch->hash, buf, buflen, level);
 	if (zlen == -1) {
 		warnp("Error in chunk storage layer");
 		goto err0;
@@ -232,11 +339,13 @@ err0:
  * the stream index.
  */
 static int
-handle_chunk(uint8_t * buf, size_t buflen, struct stream * S, CHUNKS_W * C)
+handle_chunk(const uint8_t * buf, size_t buflen, struct stream * S,
+    CHUNKS_W * C)
 {
 	struct chunkheader ch;
 
-	if (store_chunk(buf, buflen, &ch, C))
+	if (store_chunk(buf, buflen, NULL, tarsnap_opt_compression_level,
+	    &ch, C))
 		goto err0;
 
 	/* Add chunk header to elastic array. */
@@ -251,16 +360,234 @@ err0:
 	return (-1);
 }
 
+/* Compress and encrypt a chunk; called in a worker thread. */
+static int
+workfunc(void * cookie)
+{
+	struct pendingchunk * PC = cookie;
+
+	return (chunks_write_chunk_compress(PC->P));
+}
+
+/**
+ * queue_chunk(d, buf, buflen, hash, S):
+ * Compute the hash of the chunk ${buf} of length ${buflen} belonging to the
+ * stream ${S} (or to file data, if ${S} is NULL) and hand it to the worker
+ * threads of the tape ${d}.  If ${hash} is not NULL, it is the (already
+ * computed) hash of the chunk.  The chunk header will be appended to the
+ * stream index, or written to the chunk index stream, by drain_chunk.
+ */
+static int
+queue_chunk(TAPE_W * d, const uint8_t * buf, size_t buflen,
+    const uint8_t * hash, struct stream * S)
+{
+	struct pendingchunk * PC;
+	int level;
+
+	/* Allocate memory. */
+	if ((PC = malloc(sizeof(struct pendingchunk))) == NULL)
+		goto err0;
+	PC->S = S;
+
+	/* File data may have its own compression level. */
+	level = (S == NULL) ? d->level : tarsnap_opt_compression_level;
+
+	/* Hash of chunk. */
+	if (hash != NULL)
+		memcpy(PC->ch.hash, hash, 32);
+	else if (crypto_hash_data(CRYPTO_KEY_HMAC_CHUNK, buf, buflen,
+	    PC->ch.hash))
+		goto err1;
+
+	/* Length of chunk. */
+	le32enc(PC->ch.len, (uint32_t)(buflen));
+
+	/* Ask the chunk layer to prepare to store the chunk. */
+	if ((PC->P = chunks_write_chunk_start(d->C, PC->ch.hash,
+	    buf, buflen, level)) == NULL) {
+		warnp("Error in chunk storage layer");
+		goto err1;
+	}
+
+	/* Hand the chunk to the worker threads. */
+	if (workpool_add(d->P, workfunc, PC))
+		goto err2;
+
+	/* Success! */
+	return (0);
+
+err2:
+	chunks_write_pending_free(PC->P);
+err1:
+	free(PC);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * drain_chunk(d):
+ * Wait for the oldest chunk handed to the worker threads of the tape ${d}
+ * to be compressed and encrypted, write it using the chunk layer, and record
+ * its chunk header.  Return 1 if there are no pending chunks.
+ */
+static int
+drain_chunk(TAPE_W * d)
+{
+	struct pendingchunk * PC;
+	void * cookie;
+	ssize_t zlen;
+	int rc;
+
+	/* Wait for the oldest chunk. */
+	switch (workpool_wait(d->P, &cookie, &rc)) {
+	case -1:
+		goto err0;
+	case 1:
+		/* Nothing to do. */
+		return (1);
+	}
+	PC = cookie;
+
+	/* Did the worker thread fail? */
+	if (rc) {
+		warnp("Error in chunk storage layer");
+		chunks_write_pending_free(PC->P);
+		goto err1;
+	}
+
+	/* Ask chunk layer to store the chunk. */
+	if ((zlen = chunks_write_chunk_finish(PC->P)) == -1) {
+		warnp("Error in chunk storage layer");
+		goto err1;
+	}
+
+	/* Compressed length of chunk. */
+	le32enc(PC->ch.zlen, (uint32_t)(zlen));
+
+	if (PC->S != NULL) {
+		/* Add chunk header to elastic array. */
+		if (chunklist_append(PC->S->index, &PC->ch, 1))
+			goto err1;
+	} else {
+		/* Write chunk header to chunk index stream. */
+		if (chunkify_write(d->c.c, (uint8_t *)(&PC->ch),
+		    sizeof(struct chunkheader)))
+			goto err1;
+
+		/* Call the chunk callback, if one exists. */
+		if ((d->callback_chunk != NULL) &&
+		    (d->callback_chunk)(d->callback_cookie, &PC->ch))
+			goto err1;
+	}
+
+	/* Free the pending chunk. */
+	free(PC);
+
+	/* Success! */
+	return (0);
+
+err1:
+	free(PC);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * drain_chunks(d):
+ * Wait for all of the chunks handed to the worker threads of the tape ${d}
+ * (including any chunks of the chunk index stream which are produced in the
+ * process) to be written.
+ */
+static int
+drain_chunks(TAPE_W * d)
+{
+	int rc;
+
+	/* Nothing to do if we're not using worker threads. */
+	if (d->P == NULL)
+		return (0);
+
+	/* Drain chunks until there are none left. */
+	while ((rc = drain_chunk(d)) == 0)
+		continue;
+
+	/* Return failure or success. */
+	return ((rc == -1) ? -1 : 0);
+}
+
+/**
+ * cancel_chunks(d):
+ * Discard any chunks handed to the worker threads of the tape ${d}, and
+ * stop the worker threads.
+ */
+static void
+cancel_chunks(TAPE_W * d)
+{
+	struct pendingchunk * PC;
+	struct prechunker * pcr;
+	struct writetape_prechunk * J;
+	void * cookie;
+	int rc;
+
+	/*
+	 * Stop the threads which chunkify archive entry data; apart from
+	 * segments of file data, the jobs (if any remain) belong to our
+	 * caller.
+	 */
+	workpool_free(d->P_prechunk);
+	d->P_prechunk = NULL;
+
+	/* Free the segments of file data and their chunkifiers. */
+	while ((J = d->seghead) != NULL) {
+		d->seghead = J->next;
+		chunkify_free(J->pcr->c);
+		free(J->pcr);
+		writetape_prechunk_free(J);
+	}
+	d->segtailp = &d->seghead;
+	d->nsegs = 0;
+	writetape_prechunk_free(d->seg);
+	d->seg = NULL;
+
+	/* Free the unused chunkifiers. */
+	while ((pcr = d->prechunkers) != NULL) {
+		d->prechunkers = pcr->next;
+		chunkify_free(pcr->c);
+		free(pcr);
+	}
+
+	/* Nothing more to do if we're not using worker threads. */
+	if (d->P == NULL)
+		return;
+
+	/* Free the pending chunks. */
+	while (workpool_wait(d->P, &cookie, &rc) == 0) {
+		PC = cookie;
+		chunks_write_pending_free(PC->P);
+		free(PC);
+	}
+
+	/* Stop the worker threads. */
+	workpool_free(d->P);
+	d->P = NULL;
+}
+
 /**
  * callback_h(cookie, buf, buflen):
  * Handle a chunk ${buf} of length ${buflen} from the header stream of the
  * tape associated with the multitape write cookie ${cookie}.
  */
 static int
-callback_h(void * cookie, uint8_t * buf, size_t buflen)
+callback_h(void * cookie, const uint8_t * buf, size_t buflen)
 {
 	struct multitape_write_internal * d = cookie;
 
+	/* Hand the chunk to the worker threads, if we have them. */
+	if (d->P != NULL)
+		return (queue_chunk(d, buf, buflen, NULL, &d->h));
+
 	return (handle_chunk(buf, buflen, &d->h, d->C));
 }
 
@@ -270,10 +597,14 @@ callback_h(void * cookie, uint8_t * buf, size_t buflen)
  * tape associated with the multitape write cookie ${cookie}.
  */
 static int
-callback_t(void * cookie, uint8_t * buf, size_t buflen)
+callback_t(void * cookie, const uint8_t * buf, size_t buflen)
 {
 	struct multitape_write_internal * d = cookie;
 
+	/* Hand the chunk to the worker threads, if we have them. */
+	if (d->P != NULL)
+		return (queue_chunk(d, buf, buflen, NULL, &d->t));
+
 	return (handle_chunk(buf, buflen, &d->t, d->C));
 }
 
@@ -283,10 +614,14 @@ callback_t(void * cookie, uint8_t * buf, size_t buflen)
  * the tape associated with the multitape write cookie ${cookie}.
  */
 static int
-callback_c(void * cookie, uint8_t * buf, size_t buflen)
+callback_c(void * cookie, const uint8_t * buf, size_t buflen)
 {
 	struct multitape_write_internal * d = cookie;
 
+	/* Hand the chunk to the worker threads, if we have them. */
+	if (d->P != NULL)
+		return (queue_chunk(d, buf, buflen, NULL, &d->c));
+
 	return (handle_chunk(buf, buflen, &d->c, d->C));
 }
 
@@ -296,9 +631,23 @@ callback_c(void * cookie, uint8_t * buf, size_t buflen)
  * written to the tape associated with the multitape write cookie ${cookie}.
  */
 static int
-callback_file(void * cookie, uint8_t * buf, size_t buflen)
+callback_file(void * cookie, const uint8_t * buf, size_t buflen)
 {
 	struct multitape_write_internal * d = cookie;
+
+	return (file_chunk(d, buf, buflen, NULL));
+}
+
+/**
+ * file_chunk(d, buf, buflen, hash):
+ * Handle a chunk ${buf} of length ${buflen} from a file which is being
+ * written to the tape ${d}.  If ${hash} is not NULL, it is the (already
+ * computed) hash of the chunk.
+ */
+static int
+file_chunk(TAPE_W * d, const uint8_t * buf, size_t buflen,
+    const uint8_t * hash)
+{
 	struct chunkheader ch;
 
 	/* Data is being passed out by c_file. */
@@ -312,6 +661,14 @@ callback_file(void * cookie, uint8_t * buf, size_t buflen)
 			goto err0;
 		}
 
+		/*
+		 * Collect any chunks of this file from the worker threads,
+		 * so that the chunk callback is called before the trailer
+		 * callback.
+		 */
+		if (drain_chunks(d))
+			goto err0;
+
 		/* Write to the trailer stream. */
 		if (chunkify_write(d->t.c, buf, buflen))
 			goto err0;
@@ -323,9 +680,22 @@ callback_file(void * cookie, uint8_t * buf, size_t buflen)
 		if ((d->callback_trailer != NULL) &&
 		    (d->callback_trailer)(d->callback_cookie, buf, buflen))
 			goto err0;
+	} else if (d->P != NULL) {
+		/* Make sure we don't have too many pending chunks. */
+		while (workpool_getsize(d->P) >= d->maxpending) {
+			if (drain_chunk(d))
+				goto err0;
+		}
+
+		/* Hand the chunk to the worker threads. */
+		if (queue_chunk(d, buf, buflen, hash, NULL))
+			goto err0;
+
+		/* Record the chunkified data length. */
+		d->clen += buflen;
 	} else {
 		/* Store the chunk. */
-		if (store_chunk(buf, buflen, &ch, d->C))
+		if (store_chunk(buf, buflen, hash, d->level, &ch, d->C))
 			goto err0;
 
 		/* Write chunk header to chunk index stream. */
@@ -350,6 +720,479 @@ err0:
 	return (-1);
 }
 
+/**
+ * callback_prechunk(cookie, buf, buflen):
+ * Record the length of a chunk ${buf} of length ${buflen} from archive
+ * entry data which is being chunkified by a worker thread using the
+ * chunkifier ${cookie}.
+ */
+static int
+callback_prechunk(void * cookie, const uint8_t * buf, size_t buflen)
+{
+	struct prechunker * pcr = cookie;
+	struct chunkheader ch;
+
+	/* Are we discarding a chunk which doesn't end here? */
+	if (pcr->J == NULL)
+		return (0);
+
+	/* Length of chunk; the compressed length isn't used. */
+	memset(&ch, 0, sizeof(struct chunkheader));
+	le32enc(ch.len, (uint32_t)(buflen));
+
+	/*
+	 * Hash of chunk, unless it is going into the trailer stream or will
+	 * be filled in later by prechunk_hash.
+	 */
+	if (!pcr->hashlater && (buflen >= MINCHUNK) &&
+	    crypto_hash_data(CRYPTO_KEY_HMAC_CHUNK, buf, buflen, ch.hash))
+		goto err0;
+
+	/* Add chunk header to elastic array. */
+	if (chunklist_append(pcr->J->chunks, &ch, 1))
+		goto err0;
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Read and chunkify archive entry data; called in a worker thread. */
+static int
+prechunk_work(void * cookie)
+{
+	struct writetape_prechunk * J = cookie;
+
+	/* Read the data, unless we already have it. */
+	if ((J->readfunc != NULL) &&
+	    (J->readfunc)(J->cookie, J->buf, J->buflen))
+		goto err0;
+
+	/* Split it into chunks, as writetape_write and setmode would. */
+	if (chunkify_write(J->pcr->c, J->buf, J->buflen))
+		goto err0;
+
+	/*
+	 * If the data continues past the end of the buffer, the chunk in
+	 * progress doesn't end here; but we still need to reset the
+	 * chunkifier, so discard the chunk rather than recording it.
+	 */
+	if (J->partial)
+		J->pcr->J = NULL;
+	if (chunkify_end(J->pcr->c))
+		goto err0;
+
+	/* Compute the HMACs of the chunks, if we didn't do so above. */
+	if (J->pcr->hashlater && prechunk_hash(J))
+		goto err0;
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * prechunk_hash(J):
+ * Compute the HMACs of the chunks into which the archive entry data ${J}
+ * was split, several chunks at once.
+ */
+static int
+prechunk_hash(struct writetape_prechunk * J)
+{
+	const uint8_t * bufs[PRECHUNK_HASHBATCH];
+	size_t lens[PRECHUNK_HASHBATCH];
+	uint8_t hashes[PRECHUNK_HASHBATCH][32];
+	struct chunkheader * ch;
+	size_t nchunks, pos;
+	size_t i, j, n;
+
+	/* The chunks are consecutive, starting at the start of the buffer. */
+	nchunks = chunklist_getsize(J->chunks);
+	for (pos = i = 0; i < nchunks; i += n) {
+		n = nchunks - i;
+		if (n > PRECHUNK_HASHBATCH)
+			n = PRECHUNK_HASHBATCH;
+
+		/* Find the chunks. */
+		for (j = 0; j < n; j++) {
+			ch = chunklist_get(J->chunks, i + j);
+			bufs[j] = &J->buf[pos];
+			lens[j] = le32dec(ch->len);
+			pos += lens[j];
+		}
+
+		/* Hash them. */
+		if (crypto_hash_data_multi(CRYPTO_KEY_HMAC_CHUNK, bufs, lens,
+		    n, hashes))
+			goto err0;
+
+		/* Record the hashes. */
+		for (j = 0; j < n; j++) {
+			ch = chunklist_get(J->chunks, i + j);
+			memcpy(ch->hash, hashes[j], 32);
+		}
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * prechunk_alloc(buflen):
+ * Allocate a structure for chunkifying ${buflen} bytes of archive entry
+ * data via the worker threads.
+ */
+static struct writetape_prechunk *
+prechunk_alloc(size_t buflen)
+{
+	struct writetape_prechunk * J;
+
+	/* Allocate memory. */
+	if ((J = malloc(sizeof(struct writetape_prechunk))) == NULL)
+		goto err0;
+	J->readfunc = NULL;
+	J->cookie = NULL;
+	J->buflen = buflen;
+	J->partial = 0;
+	J->pcr = NULL;
+	J->chunknum = J->bufpos = 0;
+	J->next = NULL;
+	if ((J->buf = malloc(buflen)) == NULL)
+		goto err1;
+	if ((J->chunks = chunklist_init(0)) == NULL)
+		goto err2;
+
+	/* Success! */
+	return (J);
+
+err2:
+	free(J->buf);
+err1:
+	free(J);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * prechunk_queue(d, J):
+ * Hand the archive entry data ${J} to the worker threads of the tape ${d},
+ * along with an unused (or new) chunkifier.
+ */
+static int
+prechunk_queue(TAPE_W * d, struct writetape_prechunk * J)
+{
+
+	/* Use an unused chunkifier, or create a new one. */
+	if ((J->pcr = d->prechunkers) != NULL) {
+		d->prechunkers = J->pcr->next;
+	} else {
+		if ((J->pcr = malloc(sizeof(struct prechunker))) == NULL)
+			goto err0;
+		if ((J->pcr->c = chunkify_init(MEANCHUNK, MAXCHUNK,
+		    &callback_prechunk, J->pcr)) == NULL)
+			goto err1;
+
+		/*
+		 * If we can hash several chunks in parallel, do that after
+		 * splitting the data instead of hashing each chunk as it
+		 * passes through the chunkifier.
+		 */
+		J->pcr->hashlater = (crypto_hash_multi_lanes() > 1);
+	}
+	J->pcr->J = J;
+
+	/* Hand the job to the worker threads. */
+	if (workpool_add(d->P_prechunk, prechunk_work, J))
+		goto err2;
+
+	/* Success! */
+	return (0);
+
+err2:
+	J->pcr->next = d->prechunkers;
+	d->prechunkers = J->pcr;
+	J->pcr = NULL;
+	goto err0;
+err1:
+	free(J->pcr);
+	J->pcr = NULL;
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * segment_write(d, buf, buflen):
+ * Append ${buflen} bytes of file data from ${buf} to the segments of the
+ * tape ${d}, handing full segments to the worker threads.
+ */
+static int
+segment_write(TAPE_W * d, const uint8_t * buf, size_t buflen)
+{
+	size_t len;
+
+	while (buflen > 0) {
+		/* Start a new (empty) segment if necessary. */
+		if (d->seg == NULL) {
+			if ((d->seg = prechunk_alloc(SEGMENTLEN)) == NULL)
+				goto err0;
+			d->seg->buflen = 0;
+		}
+
+		/* Copy as much data as will fit. */
+		len = SEGMENTLEN - d->seg->buflen;
+		if (len > buflen)
+			len = buflen;
+		memcpy(&d->seg->buf[d->seg->buflen], buf, len);
+		d->seg->buflen += len;
+		buf += len;
+		buflen -= len;
+
+		/* If the segment is full, hand it to the worker threads. */
+		if ((d->seg->buflen == SEGMENTLEN) && segment_start(d))
+			goto err0;
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * segment_start(d):
+ * Hand the (full) segment being filled on the tape ${d} to the worker
+ * threads, so that they can chunkify it speculatively.
+ */
+static int
+segment_start(TAPE_W * d)
+{
+	struct writetape_prechunk * J = d->seg;
+
+	/* Make sure we don't have too many segments in use. */
+	while (d->nsegs >= d->maxsegs) {
+		if (segment_finish(d))
+			goto err0;
+	}
+
+	/* The file data continues in the next segment. */
+	J->partial = 1;
+
+	/* Hand the segment to the worker threads. */
+	if (prechunk_queue(d, J))
+		goto err0;
+	d->seg = NULL;
+
+	/* Add it to the list of segments in use. */
+	*d->segtailp = J;
+	d->segtailp = &J->next;
+	d->nsegs += 1;
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * segment_finish(d):
+ * Wait for the worker threads to chunkify the oldest segment in use on the
+ * tape ${d}, and pass its data through c_file.  Once c_file reaches the
+ * end of a chunk at the same position as the worker thread did, the two
+ * chunkifiers are in the same state, so the remaining chunks which the
+ * worker thread found are exactly the chunks which c_file would find; so
+ * we use those instead of running the data through c_file.
+ */
+static int
+segment_finish(TAPE_W * d)
+{
+	struct writetape_prechunk * J;
+	struct chunkheader * ch;
+	size_t nchunks;
+	size_t len;
+
+	/* Remove the oldest segment from the list. */
+	J = d->seghead;
+	if ((d->seghead = J->next) == NULL)
+		d->segtailp = &d->seghead;
+	d->nsegs -= 1;
+
+	/* Wait for the worker threads. */
+	switch (writetape_prechunk_wait(d, J)) {
+	case -1:
+		goto err1;
+	case 0:
+		nchunks = chunklist_getsize(J->chunks);
+		break;
+	default:
+		/* Chunkify the segment ourselves. */
+		nchunks = 0;
+		break;
+	}
+
+	/* Pass chunks through c_file until it reaches a common boundary. */
+	for (; J->chunknum < nchunks; J->chunknum++) {
+		if (d->c_file_in == d->c_file_out)
+			break;
+		ch = chunklist_get(J->chunks, J->chunknum);
+		len = le32dec(ch->len);
+		if (chunkify_write(d->c_file, &J->buf[J->bufpos], len))
+			goto err1;
+		d->c_file_in += len;
+		J->bufpos += len;
+	}
+
+	/* Handle the remaining chunks as if they had passed through c_file. */
+	for (; J->chunknum < nchunks; J->chunknum++) {
+		ch = chunklist_get(J->chunks, J->chunknum);
+		len = le32dec(ch->len);
+		d->c_file_in += len;
+		if (file_chunk(d, &J->buf[J->bufpos], len, ch->hash))
+			goto err1;
+		J->bufpos += len;
+	}
+
+	/* Pass the rest of the segment (if any) into c_file. */
+	if (chunkify_write(d->c_file, &J->buf[J->bufpos],
+	    J->buflen - J->bufpos))
+		goto err1;
+	d->c_file_in += J->buflen - J->bufpos;
+
+	/* We're done with this segment. */
+	writetape_prechunk_free(J);
+
+	/* Success! */
+	return (0);
+
+err1:
+	writetape_prechunk_free(J);
+
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * segment_flush(d):
+ * Pass all of the file data held in segments of the tape ${d} through
+ * c_file.
+ */
+static int
+segment_flush(TAPE_W * d)
+{
+
+	/* Finish the segments which are in use. */
+	while (d->seghead != NULL) {
+		if (segment_finish(d))
+			goto err0;
+	}
+
+	/* Pass the partial segment through c_file, and keep the buffer. */
+	if (d->seg != NULL) {
+		if (chunkify_write(d->c_file, d->seg->buf, d->seg->buflen))
+			goto err0;
+		d->c_file_in += d->seg->buflen;
+		d->seg->buflen = 0;
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * file_isempty(d):
+ * Return non-zero if c_file on the tape ${d} is at the start of a chunk,
+ * with no file data in segments waiting to be passed through it.  Data
+ * held in smallbuf is not considered.
+ */
+static int
+file_isempty(TAPE_W * d)
+{
+
+	return ((d->c_file_in == d->c_file_out) && (d->seghead == NULL) &&
+	    ((d->seg == NULL) || (d->seg->buflen == 0)));
+}
+
+/**
+ * file_flush(d):
+ * Pass any file data held in smallbuf on the tape ${d} into c_file, or to
+ * the segments which the worker threads chunkify.
+ */
+static int
+file_flush(TAPE_W * d)
+{
+	size_t len = d->smallbuflen;
+
+	/* Nothing to do if we're not holding any data. */
+	if (len == 0)
+		return (0);
+	d->smallbuflen = 0;
+
+	/* Write the data as writetape_write would have. */
+	if (d->maxsegs > 0)
+		return (segment_write(d, d->smallbuf, len));
+	if (chunkify_write(d->c_file, d->smallbuf, len))
+		return (-1);
+	d->c_file_in += len;
+
+	/* Success! */
+	return (0);
+}
+
+/**
+ * file_end(d):
+ * End the current chunk of file data on the tape ${d}, as chunkify_end
+ * would if all of the data had been passed through c_file.
+ */
+static int
+file_end(TAPE_W * d)
+{
+	size_t len = d->smallbuflen;
+
+	/*
+	 * If the data is in smallbuf, c_file would have produced a single
+	 * chunk containing it; so handle it as if that had happened.  (If
+	 * smallbuf is non-empty, c_file and the segments are empty.)
+	 */
+	if (len > 0) {
+		d->smallbuflen = 0;
+		d->c_file_in += len;
+		if (file_chunk(d, d->smallbuf, len, NULL))
+			goto err0;
+	}
+
+	/* Pass the segments through c_file, and end its chunk. */
+	if (segment_flush(d))
+		goto err0;
+	if (chunkify_end(d->c_file))
+		goto err0;
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
 /**
  * endentry(d):
  * An archive entry or trailer is ending; flush buffers into the stream.
@@ -439,6 +1282,9 @@ writetape_open(uint64_t machinenum, const char * cachedir,
 	/* Tape starts in "end of entry" mode. */
 	d->mode = 2;
 
+	/* File data uses the default compression level until told otherwise. */
+	d->level = tarsnap_opt_compression_level;
+
 	/* Record the machine number. */
 	d->machinenum = machinenum;
 
@@ -533,8 +1379,39 @@ writetape_open(uint64_t machinenum, const char * cachedir,
 	} else
 		d->c_file = NULL;
 
-	/* No data has entered or exited c_file. */
+	/*
+	 * Start worker threads, if we've been asked to use them: One set
+	 * compresses and encrypts chunks, and the other reads and chunkifies
+	 * archive entry data via writetape_prechunk_start.
+	 */
+	if (!no_chunkifiers && (tarsnap_opt_worker_threads > 1)) {
+		if ((d->P = workpool_init(tarsnap_opt_worker_threads)) == NULL)
+			goto err11;
+		if ((d->P_prechunk =
+		    workpool_init(tarsnap_opt_worker_threads)) == NULL)
+			goto err12;
+		d->maxpending = MAXPENDING_PERTHREAD *
+		    (size_t)tarsnap_opt_worker_threads;
+	} else {
+		d->P = NULL;
+		d->P_prechunk = NULL;
+	}
+
+	/* No chunkifiers have been created for the worker threads yet. */
+	d->prechunkers = NULL;
+
+	/* No segments of file data exist yet. */
+	d->seg = d->seghead = NULL;
+	d->segtailp = &d->seghead;
+	d->nsegs = 0;
+	if (d->P_prechunk != NULL)
+		d->maxsegs = (size_t)tarsnap_opt_chunk_segments;
+	else
+		d->maxsegs = 0;
+
+	/* No data has entered or exited c_file, or is being held back. */
 	d->c_file_in = d->c_file_out = 0;
+	d->smallbuflen = 0;
 
 	/* Set up communication with the storage layer. */
 	d->storage_modified = storage_modified;
@@ -542,6 +1419,10 @@ writetape_open(uint64_t machinenum, const char * cachedir,
 	/* Success! */
 	return (d);
 
+err12:
+	workpool_free(d->P);
+err11:
+	chunkify_free(d->c_file);
 err10:
 	bytebuf_free(d->hbuf);
 err9:
@@ -607,7 +1488,31 @@ writetape_write(TAPE_W * d, const void * buffer, size_t nbytes)
 
 	switch (d->mode) {
 	case 1:
-		/* We're in data mode.  Write to the file chunkifier. */
+		/*
+		 * We're in data mode.  If c_file is at the start of a chunk
+		 * and the data (including any which we're already holding)
+		 * fits into smallbuf, hold it there; file_end will handle it
+		 * without passing it through c_file if no more data arrives.
+		 */
+		if ((d->c_file != NULL) && file_isempty(d) &&
+		    (nbytes <= SMALLBUFLEN - d->smallbuflen)) {
+			memcpy(&d->smallbuf[d->smallbuflen], buffer, nbytes);
+			d->smallbuflen += nbytes;
+			break;
+		}
+
+		/*
+		 * Otherwise write to the file chunkifier, or to the segments
+		 * which the worker threads chunkify, after any data which we
+		 * were holding.
+		 */
+		if (file_flush(d))
+			goto err0;
+		if (d->maxsegs > 0) {
+			if (segment_write(d, buffer, nbytes))
+				goto err0;
+			break;
+		}
 		if (chunkify_write(d->c_file, buffer, nbytes))
 			goto err0;
 		d->c_file_in += nbytes;
@@ -640,15 +1545,24 @@ err0:
 /**
  * writetape_ischunkpresent(d, ch):
  * If the specified chunk exists, return its length; otherwise, return 0.
+ * Return -1 on error.
  */
 ssize_t
 writetape_ischunkpresent(TAPE_W * d, struct chunkheader * ch)
 {
 
-	if (chunks_write_ispresent(d->C, ch->hash) == 0)
+	/* Make sure any chunks we've already written are visible. */
+	if (drain_chunks(d))
+		return (-1);
+
+	switch (chunks_write_ispresent(d->C, ch->hash)) {
+	case -1:
+		return (-1);
+	case 0:
 		return ((ssize_t)le32dec(ch->len));
-	else
+	default:
 		return (0);
+	}
 }
 
 /**
@@ -668,6 +1582,12 @@ writetape_writechunk(TAPE_W * d, struct chunkheader * ch)
 	if (d->mode != 1)
 		goto notpresent;
 
+	/* Pass any file data we're holding through the file chunkifier. */
+	if (file_flush(d))
+		goto err0;
+	if (segment_flush(d))
+		goto err0;
+
 	/*
 	 * Has all of the data which was written into the file chunkifier
 	 * passed through?  (This check is necessary in order to avoid having
@@ -677,6 +1597,10 @@ writetape_writechunk(TAPE_W * d, struct chunkheader * ch)
 	if (d->c_file_in != d->c_file_out)
 		goto notpresent;
 
+	/* Collect any chunks which precede this one. */
+	if (drain_chunks(d))
+		goto err0;
+
 	/* Attempt to reference the chunk. */
 	switch (chunks_write_chunkref(d->C, ch->hash)) {
 	case -1:
@@ -705,6 +1629,170 @@ err0:
 	return (-1);
 }
 
+/**
+ * writetape_canprechunk(d):
+ * Return non-zero if archive entry data can be read and chunkified by the
+ * worker threads of the tape ${d} via writetape_prechunk_start.
+ */
+int
+writetape_canprechunk(TAPE_W * d)
+{
+
+	return (d->P_prechunk != NULL);
+}
+
+/**
+ * writetape_prechunk_start(d, len, readfunc, cookie):
+ * Ask a worker thread of the tape ${d} to call ${readfunc}(${cookie}, buf,
+ * ${len}) to read ${len} > 0 bytes of archive entry data into a buffer, and
+ * then to split the data into chunks in the same way as writetape_write
+ * would if the data was the entire contents of an archive entry.  The
+ * function ${readfunc} must be thread-safe, and must return 0 on success or
+ * non-zero on failure.  This may only be called if writetape_canprechunk
+ * returned non-zero.
+ */
+struct writetape_prechunk *
+writetape_prechunk_start(TAPE_W * d, size_t len,
+    int (* readfunc)(void *, uint8_t *, size_t), void * cookie)
+{
+	struct writetape_prechunk * J;
+
+	/* Sanity checks. */
+	assert(d->P_prechunk != NULL);
+	assert(len > 0);
+
+	/* Allocate memory. */
+	if ((J = prechunk_alloc(len)) == NULL)
+		goto err0;
+	J->readfunc = readfunc;
+	J->cookie = cookie;
+
+	/* Hand the job to the worker threads. */
+	if (prechunk_queue(d, J))
+		goto err1;
+
+	/* Success! */
+	return (J);
+
+err1:
+	writetape_prechunk_free(J);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * writetape_prechunk_wait(d, J):
+ * Wait until the worker threads of the tape ${d} have finished reading and
+ * chunkifying the archive entry data ${J}.  Return 0 if the data can be
+ * written via writetape_prechunk_write; 1 if reading or chunkifying the data
+ * failed; or -1 on error.
+ */
+int
+writetape_prechunk_wait(TAPE_W * d, struct writetape_prechunk * J)
+{
+	int rc;
+
+	/* Wait for the job. */
+	if (workpool_waitfor(d->P_prechunk, J, &rc))
+		goto err0;
+
+	/*
+	 * Return the chunkifier to the list of unused chunkifiers, unless
+	 * the job failed; in that case the chunkifier might have been left
+	 * in the middle of a chunk, so we free it instead.
+	 */
+	if (rc == 0) {
+		J->pcr->next = d->prechunkers;
+		d->prechunkers = J->pcr;
+	} else {
+		chunkify_free(J->pcr->c);
+		free(J->pcr);
+	}
+	J->pcr = NULL;
+
+	/* The data is ready to be written, or the job failed. */
+	return (rc ? 1 : 0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * writetape_prechunk_write(d, J):
+ * Write the next chunk of the archive entry data ${J}, for which
+ * writetape_prechunk_wait returned 0, to the tape ${d} in the same way as
+ * writetape_write would have.  The tape must be in DATA mode, with no data
+ * having been passed to writetape_write since the mode was set.  Return the
+ * length of the chunk; 0 if all of the data has been written or the archive
+ * is being truncated; or -1 on error.
+ */
+ssize_t
+writetape_prechunk_write(TAPE_W * d, struct writetape_prechunk * J)
+{
+	struct chunkheader * ch;
+	size_t len;
+
+	/* Don't write anything if we're truncating the archive. */
+	if (d->eof)
+		goto done;
+
+	/* Have we written all of the chunks? */
+	if (J->chunknum == chunklist_getsize(J->chunks))
+		goto done;
+
+	/* Make sure we're not interleaving data with other file data. */
+	if ((d->mode != 1) || !file_isempty(d) || (d->smallbuflen != 0)) {
+		warn0("Programmer error: "
+		    "writetape_prechunk_write called in wrong state");
+		goto err0;
+	}
+
+	/* Look up the chunk. */
+	ch = chunklist_get(J->chunks, J->chunknum);
+	len = le32dec(ch->len);
+
+	/* Handle the chunk as if it had passed through c_file. */
+	d->c_file_in += len;
+	if (file_chunk(d, &J->buf[J->bufpos], len, ch->hash))
+		goto err0;
+
+	/* Move on to the next chunk. */
+	J->chunknum += 1;
+	J->bufpos += len;
+
+	/* Success! */
+	return ((ssize_t)len);
+
+done:
+	/* Nothing to write. */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * writetape_prechunk_free(J):
+ * Free the archive entry data ${J}, which must not be pending in the worker
+ * threads (i.e., writetape_prechunk_wait must have been called).
+ */
+void
+writetape_prechunk_free(struct writetape_prechunk * J)
+{
+
+	/* Behave consistently with free(NULL). */
+	if (J == NULL)
+		return;
+
+	/* Free memory. */
+	chunklist_free(J->chunks);
+	free(J->buf);
+	free(J);
+}
+
 /**
  * writetape_setmode(d, mode):
  * Set the tape mode to 0 (HEADER), 1 (DATA), or 2 (finished archive entry).
@@ -718,7 +1806,9 @@ writetape_setmode(TAPE_W * d, int mode)
 
 	/* If we were in DATA mode, end the current file chunk. */
 	if (d->mode == 1) {
-		if (chunkify_end(d->c_file))
+		if (file_end(d))
+			goto err0;
+		if (drain_chunks(d))
 			goto err0;
 	}
 
@@ -747,6 +1837,22 @@ err0:
 	return (-1);
 }
 
+/**
+ * writetape_setlevel(d, level):
+ * Compress any new chunks of archive entry data written after this point
+ * using zlib compression level ${level}.  This must not be called in DATA
+ * mode, since chunks of the current entry might not have been written yet.
+ */
+void
+writetape_setlevel(TAPE_W * d, int level)
+{
+
+	/* Sanity check. */
+	assert(d->mode != 1);
+
+	d->level = level;
+}
+
 /**
  * writetape_truncate(d):
  * Record that the archive is being truncated at the current position.
@@ -776,8 +1882,14 @@ flushtape(TAPE_W * d, int isapart)
 	 */
 	assert(d->tapename != NULL);
 
-	/* Tell the chunkifiers that there will be no more data. */
-	if (chunkify_end(d->c_file))
+	/*
+	 * Tell the chunkifiers that there will be no more data.  Chunks of
+	 * file data must be collected from the worker threads before the
+	 * chunk index stream is ended, since that's where their headers go.
+	 */
+	if (file_end(d))
+		goto err0;
+	if (drain_chunks(d))
 		goto err0;
 	if (chunkify_end(d->t.c))
 		goto err0;
@@ -785,6 +1897,8 @@ flushtape(TAPE_W * d, int isapart)
 		goto err0;
 	if (chunkify_end(d->h.c))
 		goto err0;
+	if (drain_chunks(d))
+		goto err0;
 
 	/* Construct tape name. */
 	if (isapart) {
@@ -985,6 +2099,9 @@ writetape_close(TAPE_W * d)
 	if (chunks_write_checkpoint(d->C))
 		goto err2;
 
+	/* Stop the worker threads. */
+	cancel_chunks(d);
+
 	/* Close the chunk layer and storage layer cookies. */
 	chunks_write_free(d->C);
 	if (storage_write_end(d->S))
@@ -1024,6 +2141,7 @@ err3:
 	if ((output != stderr) && fclose(output))
 		warnp("fclose");
 err2:
+	cancel_chunks(d);
 	chunks_write_free(d->C);
 	storage_write_free(d->S);
 err1:
@@ -1055,6 +2173,7 @@ writetape_free(TAPE_W * d)
 		return;
 
 	/* Clean up. */
+	cancel_chunks(d);
 	chunks_write_free(d->C);
 	storage_write_free(d->S);
 	if ((d->lockfd != -1) && close(d->lockfd))
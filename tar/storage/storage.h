@@ -91,6 +91,46 @@ STORAGE_W * storage_write_start(uint64_t, const uint8_t[32], uint8_t[32]);
  */
 int storage_write_fexist(STORAGE_W *, char, const uint8_t[32]);
 
+/**
+ * storage_write_file_alloc(S, len):
+ * Allocate a buffer for a file containing ${len} bytes of data, to be
+ * written as part of the write transaction associated with the cookie ${S},
+ * and write the encryption header into it.  Return a pointer to the space
+ * for the data, which must be encrypted in place by storage_write_file_seal
+ * before the buffer is passed to storage_write_file_sealed.  Space is
+ * reserved around the data so that it can be sent without being copied.
+ * If ${S} is NULL, the encryption header is not written.
+ */
+uint8_t * storage_write_file_alloc(STORAGE_W *, size_t);
+
+/**
+ * storage_write_file_seal(buf, len):
+ * Encrypt and authenticate in place the ${len} bytes of data in the buffer
+ * ${buf} returned by storage_write_file_alloc.  This function is
+ * thread-safe.
+ */
+int storage_write_file_seal(uint8_t *, size_t);
+
+/**
+ * storage_write_file_sealed(S, buf, len, class, name):
+ * Write the file containing ${len} bytes of data in the buffer ${buf}, which
+ * was returned by storage_write_file_alloc and sealed by
+ * storage_write_file_seal, to the file ${name} in class ${class} as part of
+ * the write transaction associated with the cookie ${S}.  The caller must
+ * not use or free the buffer after this call, whether it succeeds or fails:
+ * on failure it is freed, unless the request has already been handed to the
+ * network layer, in which case it remains attached to that request.
+ */
+int storage_write_file_sealed(STORAGE_W *, uint8_t *, size_t, char,
+    const uint8_t[32]);
+
+/**
+ * storage_write_file_free(buf):
+ * Free the buffer ${buf} returned by storage_write_file_alloc without
+ * writing it.
+ */
+void storage_write_file_free(uint8_t *);
+
 /**
  * storage_write_file(S, buf, len, class, name):
  * Write ${len} bytes from ${buf} to the file ${name} in class ${class} as
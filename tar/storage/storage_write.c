@@ -27,6 +27,13 @@
  */
 #define AGGRESSIVE_CNUM	8
 
+/*
+ * Offset of the file data within a buffer allocated by
+ * storage_write_file_alloc: Space for the netpacket header, followed by
+ * the encryption header.
+ */
+#define FILEBUF_DATAOFF	(NETPACKET_WRITE_FILE_HEADROOM + CRYPTO_FILE_HLEN)
+
 struct storage_write_internal {
 	/* Transaction parameters. */
 	NETPACKET_CONNECTION * NPC[AGGRESSIVE_CNUM];
@@ -71,7 +78,7 @@ struct write_file_internal {
 	uint8_t name[32];
 	uint8_t nonce[32];
 	size_t flen;
-	uint8_t * filebuf;
+	uint8_t * buf;
 };
 
 static void raisesigs(struct storage_write_internal * S);
@@ -294,45 +301,87 @@ err0:
 }
 
 /**
- * storage_write_file(S, buf, len, class, name):
- * Write ${len} bytes from ${buf} to the file ${name} in class ${class} as
- * part of the write transaction associated with the cookie ${S}.  If ${S} is
- * NULL, return 0 without doing anything.
+ * storage_write_file_alloc(S, len):
+ * Allocate a buffer for a file containing ${len} bytes of data, to be
+ * written as part of the write transaction associated with the cookie ${S},
+ * and write the encryption header into it.  Return a pointer to the space
+ * for the data, which must be encrypted in place by storage_write_file_seal
+ * before the buffer is passed to storage_write_file_sealed.  Space is
+ * reserved around the data so that it can be sent without being copied.
+ * If ${S} is NULL, the encryption header is not written.
+ */
+uint8_t *
+storage_write_file_alloc(STORAGE_W * S, size_t len)
+{
+	uint8_t * filebuf;
+
+	/* Sanity-check file length. */
+	if (len > 262144 - CRYPTO_FILE_TLEN - CRYPTO_FILE_HLEN) {
+		warn0("File is too large");
+		goto err0;
+	}
+
+	/* Allocate space for encrypted file and packet header and trailer. */
+	if ((filebuf = malloc(FILEBUF_DATAOFF + len + CRYPTO_FILE_TLEN +
+	    NETPACKET_WRITE_FILE_TAILROOM)) == NULL)
+		goto err0;
+
+	/* Write the encryption header. */
+	if ((S != NULL) &&
+	    crypto_file_enc_init(filebuf + NETPACKET_WRITE_FILE_HEADROOM))
+		goto err1;
+
+	/* Success! */
+	return (filebuf + FILEBUF_DATAOFF);
+
+err1:
+	free(filebuf);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * storage_write_file_seal(buf, len):
+ * Encrypt and authenticate in place the ${len} bytes of data in the buffer
+ * ${buf} returned by storage_write_file_alloc.  This function is
+ * thread-safe.
  */
 int
-storage_write_file(STORAGE_W * S, uint8_t * buf, size_t len,
+storage_write_file_seal(uint8_t * buf, size_t len)
+{
+
+	/* Encrypt and hash file. */
+	return (crypto_file_enc_data(buf, len, buf - CRYPTO_FILE_HLEN));
+}
+
+/**
+ * storage_write_file_sealed(S, buf, len, class, name):
+ * Write the file containing ${len} bytes of data in the buffer ${buf}, which
+ * was returned by storage_write_file_alloc and sealed by
+ * storage_write_file_seal, to the file ${name} in class ${class} as part of
+ * the write transaction associated with the cookie ${S}.  The caller must
+ * not use or free the buffer after this call, whether it succeeds or fails:
+ * on failure it is freed, unless the request has already been handed to the
+ * network layer, in which case it remains attached to that request.
+ */
+int
+storage_write_file_sealed(STORAGE_W * S, uint8_t * buf, size_t len,
     char class, const uint8_t name[32])
 {
 	struct write_file_internal * C;
 
-	/* No-op on NULL. */
-	if (S == NULL)
-		return (0);
-
 	/* Create write cookie. */
 	if ((C = malloc(sizeof(struct write_file_internal))) == NULL)
-		goto err0;
+		goto err1;
 	C->S = S;
 	C->machinenum = S->machinenum;
 	C->class = (uint8_t)class;
 	memcpy(C->name, name, 32);
 	memcpy(C->nonce, S->nonce, 32);
 	C->done = 0;
-
-	/* Sanity-check file length. */
-	if (len > 262144 - CRYPTO_FILE_TLEN - CRYPTO_FILE_HLEN) {
-		warn0("File is too large");
-		goto err1;
-	}
 	C->flen = CRYPTO_FILE_HLEN + len + CRYPTO_FILE_TLEN;
-
-	/* Allocate space for encrypted file. */
-	if ((C->filebuf = malloc(C->flen)) == NULL)
-		goto err1;
-
-	/* Encrypt and hash file. */
-	if (crypto_file_enc(buf, len, C->filebuf))
-		goto err2;
+	C->buf = buf;
 
 	/* We're issuing a write operation. */
 	S->nbytespending += C->flen;
@@ -346,7 +395,11 @@ storage_write_file(STORAGE_W * S, uint8_t * buf, size_t len,
 			goto err2;
 	}
 
-	/* Ask the netpacket layer to send a request and get a response. */
+	/*
+	 * Ask the netpacket layer to send a request and get a response.  If
+	 * this fails, the request may already be queued with a pointer to C,
+	 * so we can't free C or the buffer.
+	 */
 	S->lastcnum = (S->lastcnum + 1) % S->numconns;
 	if (netpacket_op(S->NPC[S->lastcnum], callback_write_file_send, C))
 		goto err0;
@@ -358,9 +411,64 @@ storage_write_file(STORAGE_W * S, uint8_t * buf, size_t len,
 	return (0);
 
 err2:
-	free(C->filebuf);
-err1:
 	free(C);
+err1:
+	storage_write_file_free(buf);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * storage_write_file_free(buf):
+ * Free the buffer ${buf} returned by storage_write_file_alloc without
+ * writing it.
+ */
+void
+storage_write_file_free(uint8_t * buf)
+{
+
+	/* Behave consistently with free(NULL). */
+	if (buf == NULL)
+		return;
+
+	/* Free the buffer, including the space reserved before the data. */
+	free(buf - FILEBUF_DATAOFF);
+}
+
+/**
+ * storage_write_file(S, buf, len, class, name):
+ * Write ${len} bytes from ${buf} to the file ${name} in class ${class} as
+ * part of the write transaction associated with the cookie ${S}.  If ${S} is
+ * NULL, return 0 without doing anything.
+ */
+int
+storage_write_file(STORAGE_W * S, uint8_t * buf, size_t len,
+    char class, const uint8_t name[32])
+{
+	uint8_t * filebuf;
+
+	/* No-op on NULL. */
+	if (S == NULL)
+		return (0);
+
+	/* Allocate space for encrypted file and write the header. */
+	if ((filebuf = storage_write_file_alloc(S, len)) == NULL)
+		goto err0;
+
+	/* Encrypt and hash file. */
+	if (crypto_file_enc_data(buf, len, filebuf - CRYPTO_FILE_HLEN))
+		goto err1;
+
+	/* Send the file; this takes ownership of filebuf. */
+	if (storage_write_file_sealed(S, filebuf, len, class, name))
+		goto err0;
+
+	/* Success! */
+	return (0);
+
+err1:
+	storage_write_file_free(filebuf);
 err0:
 	/* Failure! */
 	return (-1);
@@ -373,7 +481,8 @@ callback_write_file_send(void * cookie, NETPACKET_CONNECTION * NPC)
 
 	/* Write the file. */
 	return (netpacket_write_file(NPC, C->machinenum, C->class, C->name,
-	    C->filebuf, C->flen, C->nonce, callback_write_file_response));
+	    C->buf - CRYPTO_FILE_HLEN, C->flen, C->nonce,
+	    callback_write_file_response));
 }
 
 static int
@@ -435,7 +544,7 @@ callback_write_file_response(void * cookie,
 	raisesigs(C->S);
 
 	/* Free file buffer. */
-	free(C->filebuf);
+	storage_write_file_free(C->buf);
 
 	/* Free write cookie. */
 	free(C);
@@ -446,7 +555,7 @@ callback_write_file_response(void * cookie,
 err2:
 	netproto_printerr(NETPROTO_STATUS_PROTERR);
 err1:
-	free(C->filebuf);
+	storage_write_file_free(C->buf);
 	free(C);
 
 	/* Failure! */
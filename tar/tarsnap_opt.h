@@ -22,4 +22,16 @@ extern uint64_t tarsnap_opt_checkpointbytes;
 /* Print statistics about netpacket transfer. */
 extern int tarsnap_opt_debug_network_stats;
 
+/* Number of threads to use for chunkifying, compressing, and encrypting. */
+extern int tarsnap_opt_worker_threads;
+
+/* Number of segments of file data which worker threads chunkify at once. */
+extern int tarsnap_opt_chunk_segments;
+
+/* Default zlib compression level for new chunks. */
+extern int tarsnap_opt_compression_level;
+
+/* Memory to use for in-core chunk directory records before spilling. */
+extern uint64_t tarsnap_opt_directory_memlimit;
+
 #endif /* !TARSNAP_OPT_H_ */
@@ -98,12 +98,50 @@ __FBSDID("$FreeBSD: src/usr.bin/tar/write.c,v 1.79 2008/11/27 05:49:52 kientzle
 #include "ccache.h"
 #include "fileutil.h"
 #include "sigquit.h"
+#include "tarsnap_opt.h"
 #include "ts_getfstype.h"
 #include "tsnetwork.h"
 
 /* Size of buffer for holding file data prior to writing. */
 #define FILEDATABUFLEN	65536
 
+/*
+ * When using worker threads, write_hierarchy looks ahead by up to this many
+ * archive entries per thread (but no more than LOOKAHEAD_MAXENTRIES, since
+ * each entry may hold an open file descriptor) and has worker threads read
+ * and chunkify regular files of up to LOOKAHEAD_MAXFILE bytes, with up to
+ * LOOKAHEAD_BYTES_PERTHREAD bytes of file data per thread (but no more than
+ * LOOKAHEAD_MAXBYTES in total) being held.
+ */
+#define LOOKAHEAD_ENTRIES_PERTHREAD	16
+#define LOOKAHEAD_MAXENTRIES	256
+#define LOOKAHEAD_MAXFILE	(4 * 1024 * 1024)
+#define LOOKAHEAD_BYTES_PERTHREAD	(8 * 1024 * 1024)
+#define LOOKAHEAD_MAXBYTES	(128 * 1024 * 1024)
+
+/* An archive entry which write_hierarchy has found but not yet written. */
+struct pending_entry {
+	struct archive_entry *entry;	/* Archive entry. */
+	struct stat	 st;		/* Metadata to use for the entry. */
+	char		*rpath;		/* Canonical path, or NULL. */
+	int		 fd;		/* The file, if opened. */
+	int		 fd_errno;	/* Error from opening the file. */
+	off_t		 size;		/* Length of file being read ahead. */
+	int		 grew;		/* The file is longer than ${size}. */
+	struct writetape_prechunk *pc;	/* File data read ahead, or NULL. */
+	struct pending_entry *next;	/* Next entry in the queue. */
+};
+
+/* Archive entries found by write_hierarchy, in the order found. */
+struct lookahead {
+	struct pending_entry *head;	/* Oldest entry. */
+	struct pending_entry **tailp;	/* Pointer to the last next pointer. */
+	size_t		 nentries;	/* Number of entries. */
+	off_t		 nbytes;	/* Length of files being read ahead. */
+	size_t		 maxentries;	/* Maximum number of entries. */
+	off_t		 maxbytes;	/* Maximum length being read ahead. */
+};
+
 static int		 append_archive(struct bsdtar *, struct archive *,
 			     struct archive *ina, void * cookie);
 static int		 append_archive_filename(struct bsdtar *,
@@ -118,17 +156,36 @@ static int		 copy_file_data(struct bsdtar *bsdtar,
 			     struct archive *a, struct archive *ina);
 static int		 getdevino(struct archive *, const char *, dev_t *,
 			     ino_t *);
+static void		 lookahead_add(struct bsdtar *, struct lookahead *,
+			     struct archive_entry *, const struct stat *,
+			     const char *rpath);
+static void		 lookahead_discard(struct bsdtar *,
+			     struct lookahead *);
+static int		 lookahead_flush(struct bsdtar *, struct archive *,
+			     struct lookahead *, int all);
+static int		 lookahead_read(void *, uint8_t *, size_t);
+static void		 pending_entry_free(struct pending_entry *);
+static void		 set_compression_level(struct bsdtar *,
+			     const char *);
 static int		 new_enough(struct bsdtar *, const char *path,
 			     const struct stat *);
 static int		 truncate_archive(struct bsdtar *);
 static void		 write_archive(struct archive *, struct bsdtar *);
 static void		 write_entry_backend(struct bsdtar *, struct archive *,
 			     struct archive_entry *,
-			     const struct stat *, const char *);
+			     const struct stat *, const char *,
+			     struct pending_entry *);
 static int		 write_file_data(struct bsdtar *, struct archive *,
 			     struct archive_entry *, int fd);
+static int		 write_file_prechunked(struct bsdtar *,
+			     struct archive *, struct archive_entry *,
+			     struct pending_entry *);
 static void		 write_hierarchy(struct bsdtar *, struct archive *,
 			     const char *);
+static void		 write_hierarchy_entry(struct bsdtar *,
+			     struct archive *, struct archive_entry *,
+			     const struct stat *, const char *rpath,
+			     struct pending_entry *);
 
 /*
  * Macros to simplify mode-switching.
@@ -141,6 +198,20 @@ static void		 write_hierarchy(struct bsdtar *, struct archive *,
 	(archive_write_finish_entry(a) ||				\
 	    MODE_SET(bsdtar, a, 2))
 
+/*
+ * Tell the multitape layer which compression level to use for the data of
+ * the archive entry ${pathname}, which is about to be written.
+ */
+static void
+set_compression_level(struct bsdtar *bsdtar, const char *pathname)
+{
+	int level;
+
+	if ((level = compress_level(bsdtar, pathname)) == -1)
+		level = tarsnap_opt_compression_level;
+	writetape_setlevel(bsdtar->write_cookie, level);
+}
+
 /* Get the device and inode numbers of a path. */
 static int
 getdevino(struct archive * a, const char * path, dev_t * d, ino_t * i)
@@ -450,7 +521,7 @@ write_archive(struct archive *a, struct bsdtar *bsdtar)
 	entry = NULL;
 	archive_entry_linkify(bsdtar->resolver, &entry, &sparse_entry);
 	while (entry != NULL) {
-		write_entry_backend(bsdtar, a, entry, NULL, NULL);
+		write_entry_backend(bsdtar, a, entry, NULL, NULL, NULL);
 		archive_entry_free(entry);
 		entry = NULL;
 		archive_entry_linkify(bsdtar->resolver, &entry, &sparse_entry);
@@ -654,6 +725,7 @@ append_archive(struct bsdtar *bsdtar, struct archive *a, struct archive *ina,
 
 		if (MODE_HEADER(bsdtar, a))
 			goto err_fatal;
+		set_compression_level(bsdtar, archive_entry_pathname(in_entry));
 		e = archive_write_header(a, in_entry);
 		if (e != ARCHIVE_OK) {
 			if (!bsdtar->verbose)
@@ -751,13 +823,181 @@ copy_file_data(struct bsdtar *bsdtar, struct archive *a, struct archive *ina)
 	return (0);
 }
 
+/*
+ * Read the file data for a queued entry, followed by zeroes up to ${buflen}
+ * bytes (as archive_write_finish_entry would write if the file has shrunk,
+ * and to pad the archive entry); called in a worker thread.
+ */
+static int
+lookahead_read(void *cookie, uint8_t *buf, size_t buflen)
+{
+	struct pending_entry *pe = cookie;
+	size_t len = (size_t)pe->size;
+	size_t pos;
+	ssize_t lenread;
+	uint8_t c;
+
+	/* Read as much of the file as we can. */
+	for (pos = 0; pos < len; pos += (size_t)lenread) {
+		lenread = pread(pe->fd, &buf[pos], len - pos, (off_t)pos);
+		if (lenread == -1)
+			goto err0;
+		if (lenread == 0)
+			break;
+	}
+
+	/* Zero the rest of the buffer. */
+	memset(&buf[pos], 0, buflen - pos);
+
+	/* Has the file grown since we looked at it? */
+	if (pos == len) {
+		if ((lenread = pread(pe->fd, &c, 1, (off_t)len)) == -1)
+			goto err0;
+		pe->grew = (lenread > 0);
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Queue an archive entry found by write_hierarchy.  Regular files are opened
+ * now, since the directory tree code changes the working directory as it
+ * goes; and if the chunkification cache can't provide a file, and it isn't
+ * too large, a worker thread starts reading and chunkifying it.
+ */
+static void
+lookahead_add(struct bsdtar *bsdtar, struct lookahead *Q,
+    struct archive_entry *entry, const struct stat *st, const char *rpath)
+{
+	struct pending_entry *pe;
+	size_t buflen;
+
+	/* Record the entry. */
+	if ((pe = malloc(sizeof(struct pending_entry))) == NULL)
+		bsdtar_errc(bsdtar, 1, 0, "cannot allocate memory");
+	pe->entry = entry;
+	memcpy(&pe->st, st, sizeof(struct stat));
+	if (rpath == NULL)
+		pe->rpath = NULL;
+	else if ((pe->rpath = strdup(rpath)) == NULL)
+		bsdtar_errc(bsdtar, 1, 0, "cannot allocate memory");
+	pe->fd = -1;
+	pe->fd_errno = 0;
+	pe->size = 0;
+	pe->grew = 0;
+	pe->pc = NULL;
+	pe->next = NULL;
+
+	/* Open the file if it has data. */
+	if (S_ISREG(st->st_mode) && (archive_entry_size(entry) > 0)) {
+		pe->fd = fileutil_open_noatime(archive_entry_sourcepath(entry),
+		    O_RDONLY, bsdtar->option_noatime);
+		if (pe->fd == -1)
+			pe->fd_errno = errno;
+	}
+
+	/* Start reading and chunkifying the file, if appropriate. */
+	if ((pe->fd != -1) &&
+	    (archive_entry_size(entry) <= LOOKAHEAD_MAXFILE) &&
+	    !((rpath != NULL) && (bsdtar->cachecrunch < 2) &&
+	    (bsdtar->chunk_cache != NULL) &&
+	    ccache_entry_isfresh(bsdtar->chunk_cache, rpath, st))) {
+		/* The tar format pads entry data to a multiple of 512 bytes. */
+		pe->size = archive_entry_size(entry);
+		buflen = (size_t)((pe->size + 511) & ~(off_t)511);
+		if ((pe->pc = writetape_prechunk_start(bsdtar->write_cookie,
+		    buflen, lookahead_read, pe)) == NULL)
+			bsdtar_errc(bsdtar, 1, 0, "Error reading file data");
+	}
+
+	/* Add it to the queue. */
+	*Q->tailp = pe;
+	Q->tailp = &pe->next;
+	Q->nentries += 1;
+	Q->nbytes += pe->size;
+}
+
+/*
+ * Write queued entries until the queue is within its limits, or until it is
+ * empty if ${all} is non-zero.  Return non-zero if the archive is being
+ * truncated.
+ */
+static int
+lookahead_flush(struct bsdtar *bsdtar, struct archive *a, struct lookahead *Q,
+    int all)
+{
+	struct pending_entry *pe;
+
+	while (((pe = Q->head) != NULL) && (all ||
+	    (Q->nentries > Q->maxentries) || (Q->nbytes > Q->maxbytes))) {
+		if (truncate_archive(bsdtar))
+			return (1);
+		if (checkpoint_archive(bsdtar, 0))
+			exit(1);
+
+		/* Remove the entry from the queue. */
+		if ((Q->head = pe->next) == NULL)
+			Q->tailp = &Q->head;
+		Q->nentries -= 1;
+		Q->nbytes -= pe->size;
+
+		/* Write the entry; this frees the archive_entry. */
+		write_hierarchy_entry(bsdtar, a, pe->entry, &pe->st,
+		    pe->rpath, pe);
+		pe->entry = NULL;
+		pending_entry_free(pe);
+	}
+
+	return (0);
+}
+
+/* Discard any queued entries; the archive is being truncated. */
+static void
+lookahead_discard(struct bsdtar *bsdtar, struct lookahead *Q)
+{
+	struct pending_entry *pe;
+
+	while ((pe = Q->head) != NULL) {
+		Q->head = pe->next;
+
+		/* Worker threads might still be using the entry. */
+		if ((pe->pc != NULL) && (writetape_prechunk_wait(
+		    bsdtar->write_cookie, pe->pc) == -1))
+			bsdtar_errc(bsdtar, 1, 0, "Error reading file data");
+
+		pending_entry_free(pe);
+	}
+	Q->tailp = &Q->head;
+	Q->nentries = 0;
+	Q->nbytes = 0;
+}
+
+/* Free a queued entry which worker threads are not using. */
+static void
+pending_entry_free(struct pending_entry *pe)
+{
+
+	writetape_prechunk_free(pe->pc);
+	if (pe->fd != -1)
+		close(pe->fd);
+	archive_entry_free(pe->entry);
+	free(pe->rpath);
+	free(pe);
+}
+
 /*
  * Add the file or dir hierarchy named by 'path' to the archive
  */
 static void
 write_hierarchy(struct bsdtar *bsdtar, struct archive *a, const char *path)
 {
-	struct archive_entry *entry = NULL, *spare_entry = NULL;
+	struct archive_entry *entry = NULL;
+	struct lookahead Q, *lookahead = NULL;
 	struct tree *tree;
 	char symlink_mode = bsdtar->symlink_mode;
 	dev_t first_dev = 0;
@@ -774,6 +1014,29 @@ write_hierarchy(struct bsdtar *bsdtar, struct archive *a, const char *path)
 		return;
 	}
 
+	/*
+	 * If the multitape layer can have worker threads read and chunkify
+	 * files, look ahead so that several files can be processed at once.
+	 * We don't do this if we need to ask the user about each file or if
+	 * we've been asked to pause between reads.
+	 */
+	if (writetape_canprechunk(bsdtar->write_cookie) &&
+	    !bsdtar->option_interactive && (bsdtar->disk_pause == 0)) {
+		Q.head = NULL;
+		Q.tailp = &Q.head;
+		Q.nentries = 0;
+		Q.nbytes = 0;
+		Q.maxentries = LOOKAHEAD_ENTRIES_PERTHREAD *
+		    (size_t)tarsnap_opt_worker_threads;
+		if (Q.maxentries > LOOKAHEAD_MAXENTRIES)
+			Q.maxentries = LOOKAHEAD_MAXENTRIES;
+		Q.maxbytes = (off_t)LOOKAHEAD_BYTES_PERTHREAD *
+		    tarsnap_opt_worker_threads;
+		if (Q.maxbytes > LOOKAHEAD_MAXBYTES)
+			Q.maxbytes = LOOKAHEAD_MAXBYTES;
+		lookahead = &Q;
+	}
+
 	while ((tree_ret = tree_next(tree))) {
 		int r;
 		const char *name = tree_current_path(tree);
@@ -997,58 +1260,107 @@ write_hierarchy(struct bsdtar *bsdtar, struct archive *a, const char *path)
 		if (S_ISSOCK(st->st_mode))
 			continue;
 
-		/* Display entry as we process it. */
-		if (bsdtar->verbose > 1) {
-			safe_fprintf(stderr, "a ");
-			list_item_verbose(bsdtar, stderr, entry);
-		} else if (bsdtar->verbose > 0) {
-		/* This format is required by SUSv2. */
-			safe_fprintf(stderr, "a %s",
-			    archive_entry_pathname(entry));
+		/* If we're not looking ahead, write the entry now. */
+		if (lookahead == NULL) {
+			write_hierarchy_entry(bsdtar, a, entry, st,
+			    tree_current_realpath(tree), NULL);
+			entry = NULL;
+			continue;
 		}
 
-		/*
-		 * If the user hasn't specifically asked to have the access
-		 * time stored, zero it.  At the moment this usually only
-		 * matters for files which have flags set, since the "posix
-		 * restricted" format doesn't store access times for most
-		 * other files.
-		 */
-		if (bsdtar->option_store_atime == 0)
-			archive_entry_set_atime(entry, 0, 0);
+		/* Queue the entry, and write entries until we're caught up. */
+		lookahead_add(bsdtar, lookahead, entry, st,
+		    tree_current_realpath(tree));
+		entry = NULL;
+		if (lookahead_flush(bsdtar, a, lookahead, 0))
+			break;
+	}
+	archive_entry_free(entry);
 
-		/* Non-regular files get archived with zero size. */
-		if (!S_ISREG(st->st_mode))
-			archive_entry_set_size(entry, 0);
+	/* Write any queued entries, unless the archive is being truncated. */
+	if (lookahead != NULL) {
+		lookahead_flush(bsdtar, a, lookahead, 1);
+		lookahead_discard(bsdtar, lookahead);
+	}
 
-		/* Record what we're doing, for SIGINFO / SIGUSR1. */
-		siginfo_setinfo(bsdtar, "adding",
-		    archive_entry_pathname(entry), archive_entry_size(entry),
-		    archive_file_count(a),
-		    archive_position_uncompressed(a));
-		archive_entry_linkify(bsdtar->resolver, &entry, &spare_entry);
+	if (tree_close(tree))
+		bsdtar_errc(bsdtar, 1, 0, "Error traversing directory tree");
 
-		/* Handle SIGINFO / SIGUSR1 request if one was made. */
-		siginfo_printinfo(bsdtar, 0, 0);
+	/* We're not processing any more files. */
+	siginfo_setinfo(bsdtar, NULL, NULL, 0, archive_file_count(a),
+	    archive_position_uncompressed(a));
+}
+
+/*
+ * Write an archive entry found by write_hierarchy.  If ${pe} is not NULL,
+ * it is the queued entry holding ${entry}, ${st}, and ${rpath}.
+ */
+static void
+write_hierarchy_entry(struct bsdtar *bsdtar, struct archive *a,
+    struct archive_entry *entry, const struct stat *st, const char *rpath,
+    struct pending_entry *pe)
+{
+	struct archive_entry *spare_entry = NULL;
+	int rc;
 
-		while (entry != NULL) {
-			write_entry_backend(bsdtar, a, entry, st,
-			    tree_current_realpath(tree));
-			archive_entry_free(entry);
-			entry = spare_entry;
-			spare_entry = NULL;
+	/*
+	 * If a worker thread has been reading and chunkifying the file, wait
+	 * for it; if it failed, we'll read the file ourselves later.
+	 */
+	if ((pe != NULL) && (pe->pc != NULL)) {
+		rc = writetape_prechunk_wait(bsdtar->write_cookie, pe->pc);
+		if (rc == -1)
+			bsdtar_errc(bsdtar, 1, 0, "Error reading file data");
+		if (rc == 1) {
+			writetape_prechunk_free(pe->pc);
+			pe->pc = NULL;
 		}
+	}
 
-		if (bsdtar->verbose)
-			fprintf(stderr, "\n");
+	/* Display entry as we process it. */
+	if (bsdtar->verbose > 1) {
+		safe_fprintf(stderr, "a ");
+		list_item_verbose(bsdtar, stderr, entry);
+	} else if (bsdtar->verbose > 0) {
+	/* This format is required by SUSv2. */
+		safe_fprintf(stderr, "a %s",
+		    archive_entry_pathname(entry));
 	}
-	archive_entry_free(entry);
-	if (tree_close(tree))
-		bsdtar_errc(bsdtar, 1, 0, "Error traversing directory tree");
 
-	/* We're not processing any more files. */
-	siginfo_setinfo(bsdtar, NULL, NULL, 0, archive_file_count(a),
+	/*
+	 * If the user hasn't specifically asked to have the access
+	 * time stored, zero it.  At the moment this usually only
+	 * matters for files which have flags set, since the "posix
+	 * restricted" format doesn't store access times for most
+	 * other files.
+	 */
+	if (bsdtar->option_store_atime == 0)
+		archive_entry_set_atime(entry, 0, 0);
+
+	/* Non-regular files get archived with zero size. */
+	if (!S_ISREG(st->st_mode))
+		archive_entry_set_size(entry, 0);
+
+	/* Record what we're doing, for SIGINFO / SIGUSR1. */
+	siginfo_setinfo(bsdtar, "adding",
+	    archive_entry_pathname(entry), archive_entry_size(entry),
+	    archive_file_count(a),
 	    archive_position_uncompressed(a));
+	archive_entry_linkify(bsdtar->resolver, &entry, &spare_entry);
+
+	/* Handle SIGINFO / SIGUSR1 request if one was made. */
+	siginfo_printinfo(bsdtar, 0, 0);
+
+	while (entry != NULL) {
+		write_entry_backend(bsdtar, a, entry, st, rpath, pe);
+		archive_entry_free(entry);
+		entry = spare_entry;
+		spare_entry = NULL;
+		pe = NULL;
+	}
+
+	if (bsdtar->verbose)
+		fprintf(stderr, "\n");
 }
 
 /*
@@ -1056,9 +1368,10 @@ write_hierarchy(struct bsdtar *bsdtar, struct archive *a, const char *path)
  */
 static void
 write_entry_backend(struct bsdtar *bsdtar, struct archive *a,
-    struct archive_entry *entry, const struct stat *st, const char *rpath)
+    struct archive_entry *entry, const struct stat *st, const char *rpath,
+    struct pending_entry *pe)
 {
-	off_t			 skiplen;
+	off_t			 skiplen = 0;
 	CCACHE_ENTRY		*cce = NULL;
 	int			 filecached = 0;
 	int fd = -1;
@@ -1083,8 +1396,15 @@ write_entry_backend(struct bsdtar *bsdtar, struct archive *a,
 	 */
 	if ((archive_entry_size(entry) > 0) && (filecached == 0)) {
 		const char *pathname = archive_entry_sourcepath(entry);
-		fd = fileutil_open_noatime(pathname, O_RDONLY,
-		    bsdtar->option_noatime);
+		if (pe != NULL) {
+			/* The file was opened when the entry was queued. */
+			fd = pe->fd;
+			pe->fd = -1;
+			errno = pe->fd_errno;
+		} else {
+			fd = fileutil_open_noatime(pathname, O_RDONLY,
+			    bsdtar->option_noatime);
+		}
 		if (fd == -1) {
 			if (!bsdtar->verbose)
 				bsdtar_warnc(bsdtar, errno,
@@ -1100,6 +1420,7 @@ write_entry_backend(struct bsdtar *bsdtar, struct archive *a,
 		bsdtar_warnc(bsdtar, 0, "%s", archive_error_string(a));
 		exit(1);
 	}
+	set_compression_level(bsdtar, archive_entry_pathname(entry));
 	e = archive_write_header(a, entry);
 	if (e != ARCHIVE_OK) {
 		if (bsdtar->verbose > 1) {
@@ -1184,8 +1505,19 @@ write_entry_backend(struct bsdtar *bsdtar, struct archive *a,
 			}
 		}
 
-		if (write_file_data(bsdtar, a, entry, fd))
-			exit(1);
+		/*
+		 * If a worker thread read and chunkified the file, and the
+		 * cache didn't provide any of it, use that data; otherwise
+		 * read the file ourselves.
+		 */
+		if ((pe != NULL) && (pe->pc != NULL) && (skiplen == 0) &&
+		    (pe->size == archive_entry_size(entry))) {
+			if (write_file_prechunked(bsdtar, a, entry, pe))
+				exit(1);
+		} else {
+			if (write_file_data(bsdtar, a, entry, fd))
+				exit(1);
+		}
 	}
 
 	/* This entry is done. */
@@ -1259,6 +1591,49 @@ write_file_data(struct bsdtar *bsdtar, struct archive *a,
 	return 0;
 }
 
+/* Helper function to write file data which was chunkified in advance. */
+static int
+write_file_prechunked(struct bsdtar *bsdtar, struct archive *a,
+    struct archive_entry *entry, struct pending_entry *pe)
+{
+	ssize_t	bytes_written;
+	off_t	progress = 0;
+
+	while ((bytes_written = writetape_prechunk_write(bsdtar->write_cookie,
+	    pe->pc)) > 0) {
+		if (network_select(0))
+			return (-1);
+
+		siginfo_printinfo(bsdtar, progress, 0);
+
+		/* Tell the archive layer that the data has been written. */
+		if (archive_write_skip(a, bytes_written)) {
+			bsdtar_warnc(bsdtar, 0, "%s", archive_error_string(a));
+			return (-1);
+		}
+
+		if (truncate_archive(bsdtar))
+			return (0);
+		if (checkpoint_archive(bsdtar, 1))
+			exit(1);
+
+		progress += bytes_written;
+	}
+	if (bytes_written < 0) {
+		bsdtar_warnc(bsdtar, 0, "Error writing archive");
+		return (-1);
+	}
+
+	/* Warn if there was more data than we read. */
+	if (pe->grew && !bsdtar->option_quiet)
+		bsdtar_warnc(bsdtar, 0,
+		    "%s: Truncated write; file may have "
+		    "grown while being archived.",
+		    archive_entry_pathname(entry));
+
+	return (0);
+}
+
 /*
  * Test if the specified file is new enough to include in the archive.
  */
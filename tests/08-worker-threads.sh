@@ -0,0 +1,77 @@
+#!/bin/sh
+
+### Constants
+c_valgrind_min=1
+sampledir=${scriptdir}/sample-backup
+keyfile=${scriptdir}/fake.keys
+cachedir=${s_basename}-cachedir
+datadir=${s_basename}-data
+init_cache_stderr=${s_basename}-cachedir.stderr
+conf_none=${s_basename}-none.conf
+conf_segs=${s_basename}-segs.conf
+
+check_threads() {
+	name=$1
+	args=$2
+
+	# Archive the data using worker threads as specified by ${args}.  We
+	# need a real (albeit fake) keyfile, since otherwise the dry run uses
+	# random keys and the statistics would differ between runs.  Don't
+	# quote the ${args}.
+	setup_check "check -c --dry-run ${args}"
+	${c_valgrind_cmd} ./tarsnap --no-default-config		\
+		--keyfile "${keyfile}" --cachedir "${cachedir}"	\
+		-c --dry-run --print-stats			\
+		${args}						\
+		-C "${datadir}" .				\
+		2> "${s_basename}-stats-${name}.stderr"
+	echo $? > "${c_exitfile}"
+}
+
+scenario_cmd() {
+	# Create a directory with some small files and a file which is large
+	# enough to be split into several segments.
+	mkdir "${datadir}"
+	cp -R "${sampledir}" "${datadir}/sample-backup"
+	awk 'BEGIN { for (i = 0; i < 1000000; i++)			\
+	    printf "%d %d\n", i, (i * 7919) % 100003 }'		\
+	    > "${datadir}/large"
+
+	# Create a cache directory.
+	setup_check "check --initialize-cachedir"
+	${c_valgrind_cmd} ./tarsnap --no-default-config		\
+		--keyfile "${keyfile}" --cachedir "${cachedir}"	\
+		--initialize-cachedir				\
+		2> "${init_cache_stderr}"
+	echo $? > "${c_exitfile}"
+
+	# The command line is stored in the archive, so options which would
+	# change its length are given via config files with names of the
+	# same length.
+	touch "${conf_none}"
+	echo "chunk-segments 3" > "${conf_segs}"
+
+	# Archive the data with different numbers of threads, and with the
+	# large file being split into segments by the worker threads.
+	check_threads "1" "--worker-threads 1 --configfile ${conf_none}"
+	check_threads "8" "--worker-threads 8 --configfile ${conf_none}"
+	check_threads "8-segments"					\
+	    "--worker-threads 8 --configfile ${conf_segs}"
+
+	# The archive should not depend upon how the work was done.
+	setup_check "check --worker-threads output"
+	cmp "${s_basename}-stats-1.stderr" "${s_basename}-stats-8.stderr"
+	echo $? > "${c_exitfile}"
+
+	setup_check "check --chunk-segments output"
+	cmp "${s_basename}-stats-1.stderr"				\
+	    "${s_basename}-stats-8-segments.stderr"
+	echo $? > "${c_exitfile}"
+
+	# Make sure that we archived something.
+	setup_check "check --worker-threads output > 0"
+	total=$( grep "This archive" "${s_basename}-stats-1.stderr" |	\
+	    awk '{ print $3 }' )
+	test "${total}" -gt 10000000
+	echo $? > "${c_exitfile}"
+}
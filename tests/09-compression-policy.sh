@@ -0,0 +1,110 @@
+#!/bin/sh
+
+### Constants
+c_valgrind_min=1
+keyfile=${scriptdir}/fake.keys
+cachedir=${s_basename}-cachedir
+datadir=${s_basename}-data
+init_cache_stderr=${s_basename}-cachedir.stderr
+
+check_policy() {
+	name=$1
+	policies=$2
+
+	# The command line is stored in the archive, so the policies are
+	# given via config files with names of the same length.
+	conf_name=${s_basename}-${name}.conf
+	printf "%s" "${policies}" > "${conf_name}"
+
+	# Archive the data.  We need a real (albeit fake) keyfile, since
+	# otherwise the dry run uses random keys and the statistics would
+	# differ between runs.
+	setup_check "check ${name}"
+	${c_valgrind_cmd} ./tarsnap --no-default-config		\
+		--keyfile "${keyfile}" --cachedir "${cachedir}"	\
+		-c --dry-run --print-stats			\
+		--configfile "${conf_name}"			\
+		-C "${datadir}" .				\
+		2> "${s_basename}-stats-${name}.stderr"
+	echo $? > "${c_exitfile}"
+}
+
+check_invalid() {
+	name=$1
+	policy=$2
+
+	# Set up variables.
+	out_name=${s_basename}-${name}.txt
+	good_name=${scriptdir}/09-compression-policy-${name}.good
+
+	# Run command.
+	setup_check "check ${name}"
+	${c_valgrind_cmd} ./tarsnap --no-default-config		\
+		-c --dry-run					\
+		--compression-policy "${policy}"		\
+		-C "${datadir}" .				\
+		2> "${out_name}"
+	expected_exitcode 1 $? > "${c_exitfile}"
+
+	# Check against expected output.
+	setup_check "check ${name} output"
+	cmp "${good_name}" "${out_name}"
+	echo $? > "${c_exitfile}"
+}
+
+# Print the compressed size of the archive from the statistics ${1}.
+compressed_size() {
+	grep "This archive" "$1" | awk '{ print $4 }'
+}
+
+scenario_cmd() {
+	# Create a directory with two compressible files which are large
+	# enough to be stored in chunks of their own.
+	mkdir "${datadir}"
+	awk 'BEGIN { for (i = 0; i < 20000; i++)			\
+	    printf "line %d of the log\n", i }' > "${datadir}/a.log"
+	awk 'BEGIN { for (i = 0; i < 20000; i++)			\
+	    printf "record %d of the data\n", i }' > "${datadir}/b.dat"
+
+	# Create a cache directory.
+	setup_check "check --initialize-cachedir"
+	${c_valgrind_cmd} ./tarsnap --no-default-config		\
+		--keyfile "${keyfile}" --cachedir "${cachedir}"	\
+		--initialize-cachedir				\
+		2> "${init_cache_stderr}"
+	echo $? > "${c_exitfile}"
+
+	# No policy; the log stored without compression; and the same
+	# patterns with different levels, in both orders.
+	check_policy "policy-1" ""
+	check_policy "policy-2" "compression-policy 0:*.log
+"
+	check_policy "policy-3" "compression-policy 0:*.log
+compression-policy 9:*.log
+"
+	check_policy "policy-4" "compression-policy 9:*.log
+compression-policy 0:*.log
+"
+
+	# Storing the log without compression should make the archive larger.
+	setup_check "check policy changes compressed size"
+	test "$(compressed_size "${s_basename}-stats-policy-2.stderr")"	\
+	    -gt "$(compressed_size "${s_basename}-stats-policy-1.stderr")"
+	echo $? > "${c_exitfile}"
+
+	# The first matching pattern wins.
+	setup_check "check first matching policy is used"
+	cmp "${s_basename}-stats-policy-2.stderr"			\
+	    "${s_basename}-stats-policy-3.stderr"
+	echo $? > "${c_exitfile}"
+
+	setup_check "check later matching policy is ignored"
+	cmp "${s_basename}-stats-policy-1.stderr"			\
+	    "${s_basename}-stats-policy-4.stderr"
+	echo $? > "${c_exitfile}"
+
+	# Invalid LEVEL:PATTERN arguments are rejected.
+	check_invalid "bad-level" "10:*.log"
+	check_invalid "no-pattern" "1:"
+	check_invalid "no-colon" "1"
+}
@@ -0,0 +1,13 @@
+#!/bin/sh
+
+### Constants
+c_valgrind_min=1
+test_output=${s_basename}-stdout.txt
+
+scenario_cmd() {
+	# Check every AES-CTR implementation which this CPU supports.
+	setup_check "check crypto_aesctr implementations"
+	${c_valgrind_cmd} ./tests/crypto_aesctr/test_crypto_aesctr	\
+		> "${test_output}"
+	echo $? > "${c_exitfile}"
+}
@@ -0,0 +1,21 @@
+#!/bin/sh
+
+### Constants
+c_valgrind_min=1
+test_cmd=./tests/chunks_directory/test_chunks_directory
+cachedir=${s_basename}-cachedir
+spilldir=${s_basename}-spilldir
+test_output=${s_basename}-stdout.txt
+test_stderr=${s_basename}-stderr.txt
+
+scenario_cmd() {
+	mkdir "${cachedir}" "${spilldir}"
+
+	# Write complete directories and deltas, read them back, and check
+	# that damaged directories are rejected; and do the same again with
+	# records being spilled to disk.
+	setup_check "check chunk directory save and load"
+	${c_valgrind_cmd} ${test_cmd} "${cachedir}" "${spilldir}"	\
+		> "${test_output}" 2> "${test_stderr}"
+	echo $? > "${c_exitfile}"
+}
@@ -0,0 +1,19 @@
+#!/bin/sh
+
+### Constants
+c_valgrind_min=1
+cachedir=${s_basename}-cachedir
+test_output=${s_basename}-stdout.txt
+test_stderr=${s_basename}-stderr.txt
+
+scenario_cmd() {
+	mkdir "${cachedir}"
+
+	# Write and read back the chunkification cache over several runs;
+	# check that damaged log segments are ignored and that the log is
+	# compacted; and check that a damaged cache file is rejected.
+	setup_check "check chunkification cache save and load"
+	${c_valgrind_cmd} ./tests/ccache/test_ccache "${cachedir}"	\
+		> "${test_output}" 2> "${test_stderr}"
+	echo $? > "${c_exitfile}"
+}
@@ -0,0 +1,867 @@
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "asprintf.h"
+#include "ccache.h"
+#include "ccache_internal.h"
+#include "multitape_internal.h"
+#include "sha256.h"
+#include "sysendian.h"
+#include "warnp.h"
+
+/* Number of files, and the chunks and trailer which each one has. */
+#define NFILES		2000
+#define NCHUNKS		3
+#define CHUNKLEN	1000
+#define TRAILERLEN	100
+#define FILELEN		(NCHUNKS * CHUNKLEN + TRAILERLEN)
+
+/* A file being archived. */
+static struct file {
+	char * path;
+	struct stat sb;		/* Inode number, size, and mtime. */
+	uint32_t ver;		/* Version of the file's contents. */
+	int modified;		/* Modified since it was last archived. */
+} files[NFILES];
+
+/* The contents of a file in the cache directory; NULL if it is absent. */
+struct cachefile {
+	uint8_t * buf;
+	size_t len;
+};
+
+/* The cache file and log. */
+struct snapshot {
+	struct cachefile cache;
+	struct cachefile log;
+};
+
+/* What the chunkification cache told us about a file. */
+struct result {
+	int fresh;		/* ccache_entry_isfresh. */
+	int full;		/* ccache_entry_lookup fullentry. */
+	off_t skip;		/* Length provided from the cache. */
+};
+
+/* Callbacks which the chunkification cache set on the "multitape". */
+static int (* callback_chunk)(void *, struct chunkheader *);
+static int (* callback_trailer)(void *, const uint8_t *, size_t);
+static void * callback_cookie;
+
+/*
+ * Stand-ins for the multitape layer: every chunk is present, and data is
+ * thrown away.
+ */
+void
+writetape_setcallback(TAPE_W * d,
+    int (* chunk)(void *, struct chunkheader *),
+    int (* trailer)(void *, const uint8_t *, size_t), void * cookie)
+{
+
+	(void)d; /* UNUSED */
+
+	callback_chunk = chunk;
+	callback_trailer = trailer;
+	callback_cookie = cookie;
+}
+
+ssize_t
+writetape_write(TAPE_W * d, const void * buf, size_t nbytes)
+{
+
+	(void)d; /* UNUSED */
+	(void)buf; /* UNUSED */
+
+	return ((ssize_t)nbytes);
+}
+
+ssize_t
+writetape_ischunkpresent(TAPE_W * d, struct chunkheader * ch)
+{
+
+	(void)d; /* UNUSED */
+
+	return ((ssize_t)le32dec(ch->len));
+}
+
+ssize_t
+writetape_writechunk(TAPE_W * d, struct chunkheader * ch)
+{
+
+	(void)d; /* UNUSED */
+
+	return ((ssize_t)le32dec(ch->len));
+}
+
+/* Create the files. */
+static int
+files_init(void)
+{
+	size_t i;
+
+	for (i = 0; i < NFILES; i++) {
+		if (asprintf(&files[i].path, "/data/dir%zu/file%zu",
+		    i % 50, i) == -1) {
+			warnp("asprintf");
+			goto err1;
+		}
+		memset(&files[i].sb, 0, sizeof(struct stat));
+		files[i].sb.st_ino = (ino_t)(i + 1);
+		files[i].sb.st_size = FILELEN;
+		files[i].sb.st_mtime = 500;
+		files[i].ver = 0;
+		files[i].modified = 1;
+	}
+
+	/* Success! */
+	return (0);
+
+err1:
+	while (i > 0)
+		free(files[--i].path);
+
+	/* Failure! */
+	return (-1);
+}
+
+/* Free the files. */
+static void
+files_free(void)
+{
+	size_t i;
+
+	for (i = 0; i < NFILES; i++)
+		free(files[i].path);
+}
+
+/* Modify every ${n}th file, starting with file ${first}, before ${snaptime}. */
+static void
+files_modify(size_t first, size_t n, time_t snaptime)
+{
+	size_t i;
+
+	for (i = first; i < NFILES; i += n) {
+		files[i].sb.st_mtime = snaptime - 50;
+		files[i].ver++;
+		files[i].modified = 1;
+	}
+}
+
+/* Mark all the files as not modified since they were last archived. */
+static void
+files_archived(void)
+{
+	size_t i;
+
+	for (i = 0; i < NFILES; i++)
+		files[i].modified = 0;
+}
+
+/* Write the chunks and trailer of file ${i} which the cache didn't have. */
+static int
+write_data(size_t i, off_t skip)
+{
+	struct chunkheader ch;
+	uint8_t trailer[TRAILERLEN];
+	uint8_t buf[12];
+	size_t k;
+
+	/* We only drop whole chunks from the cache. */
+	if (skip % CHUNKLEN) {
+		warn0("cache provided %jd bytes", (intmax_t)skip);
+		goto err0;
+	}
+
+	/* Pass the remaining chunks to the cache. */
+	for (k = (size_t)(skip / CHUNKLEN); k < NCHUNKS; k++) {
+		le32enc(&buf[0], (uint32_t)i);
+		le32enc(&buf[4], files[i].ver);
+		le32enc(&buf[8], (uint32_t)k);
+		SHA256_Buf(buf, 12, ch.hash);
+		le32enc(ch.len, CHUNKLEN);
+		le32enc(ch.zlen, CHUNKLEN / 2);
+		if ((callback_chunk != NULL) &&
+		    callback_chunk(callback_cookie, &ch))
+			goto err0;
+	}
+
+	/* And the trailer. */
+	memset(trailer, (int)(files[i].ver & 0xff), TRAILERLEN);
+	if ((callback_trailer != NULL) &&
+	    callback_trailer(callback_cookie, trailer, TRAILERLEN))
+		goto err0;
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Archive all the files at ${snaptime} using the cache in ${cachepath} and
+ * record what the cache provided in ${R}, as tarsnap -c would do.  The file
+ * descriptor ${fd} has no data, so a file is read again in full unless the
+ * cache can provide all of it.
+ */
+static int
+run(const char * cachepath, time_t snaptime, int fd, struct result * R)
+{
+	CCACHE * C;
+	CCACHE_ENTRY * cce;
+	off_t skip;
+	size_t i;
+
+	/* Read the cache. */
+	if ((C = ccache_read(cachepath)) == NULL) {
+		warnp("ccache_read");
+		goto err0;
+	}
+
+	/* Archive each file. */
+	for (i = 0; i < NFILES; i++) {
+		R[i].fresh = ccache_entry_isfresh(C, files[i].path,
+		    &files[i].sb);
+		if ((cce = ccache_entry_lookup(C, files[i].path,
+		    &files[i].sb, NULL, &R[i].full)) == NULL)
+			goto err1;
+		if (R[i].full) {
+			if ((skip = ccache_entry_write(cce, NULL)) < 0)
+				goto err2;
+		} else {
+			if ((skip = ccache_entry_writefile(cce, NULL, 0,
+			    fd)) < 0)
+				goto err2;
+			if (write_data(i, skip))
+				goto err2;
+		}
+		R[i].skip = skip;
+		if (ccache_entry_end(C, cce, NULL, files[i].path, snaptime))
+			goto err1;
+	}
+
+	/* Write the cache back out. */
+	if (ccache_write(C, cachepath)) {
+		warnp("ccache_write");
+		goto err1;
+	}
+	ccache_free(C);
+
+	/* Success! */
+	return (0);
+
+err2:
+	ccache_entry_free(cce, NULL);
+err1:
+	ccache_free(C);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Check that the results ${R} provided every file from the cache unless it
+ * was modified, and mark all the files as not modified.
+ */
+static int
+check_results(const struct result * R)
+{
+	size_t i;
+	int rc = 0;
+
+	for (i = 0; i < NFILES; i++) {
+		if (files[i].modified) {
+			if (R[i].fresh || R[i].full || R[i].skip) {
+				warn0("%s: wrongly cached", files[i].path);
+				rc = -1;
+			}
+		} else {
+			if (!R[i].fresh || !R[i].full ||
+			    (R[i].skip != FILELEN)) {
+				warn0("%s: not cached", files[i].path);
+				rc = -1;
+			}
+		}
+	}
+	files_archived();
+
+	/* Return status. */
+	return (rc);
+}
+
+/* Return 1 if ${cachepath}/${name} exists, 0 if not, or -1 on error. */
+static int
+cachefile_exists(const char * cachepath, const char * name)
+{
+	struct stat sb;
+	char * s;
+	int rc;
+
+	if (asprintf(&s, "%s/%s", cachepath, name) == -1) {
+		warnp("asprintf");
+		return (-1);
+	}
+	rc = (stat(s, &sb) == 0);
+	free(s);
+	return (rc);
+}
+
+/* Return non-zero unless the cache file in ${cachepath} is mapped. */
+static int
+checkmagic(const char * cachepath)
+{
+	char buf[8];
+	char * s;
+	FILE * f;
+	int rc = 1;
+
+	/* Read the start of the cache file. */
+	if (asprintf(&s, "%s/cache", cachepath) == -1) {
+		warnp("asprintf");
+		goto err0;
+	}
+	if ((f = fopen(s, "r")) == NULL) {
+		warnp("fopen(%s)", s);
+		goto err1;
+	}
+	if (fread(buf, 8, 1, f) != 1) {
+		warnp("fread(%s)", s);
+		goto err2;
+	}
+
+	/* Is it in the current format? */
+	if (memcmp(buf, CCACHE_MAGIC, 8) == 0)
+		rc = 0;
+	else
+		warn0("%s: wrong magic", s);
+
+err2:
+	fclose(f);
+err1:
+	free(s);
+err0:
+	/* Return status. */
+	return (rc);
+}
+
+/* Return non-zero if the results ${R} and ${S} differ. */
+static int
+results_cmp(const struct result * R, const struct result * S)
+{
+	size_t i;
+
+	for (i = 0; i < NFILES; i++) {
+		if ((R[i].fresh != S[i].fresh) || (R[i].full != S[i].full) ||
+		    (R[i].skip != S[i].skip)) {
+			warn0("%s: results differ", files[i].path);
+			return (-1);
+		}
+	}
+
+	/* The results are the same. */
+	return (0);
+}
+
+/* Read ${cachepath}/${name} into ${F}. */
+static int
+cachefile_read(const char * cachepath, const char * name,
+    struct cachefile * F)
+{
+	struct stat sb;
+	char * s;
+	FILE * f;
+
+	/* Nothing yet. */
+	F->buf = NULL;
+	F->len = 0;
+
+	/* Open the file, if it exists. */
+	if (asprintf(&s, "%s/%s", cachepath, name) == -1) {
+		warnp("asprintf");
+		goto err0;
+	}
+	if ((f = fopen(s, "r")) == NULL) {
+		if (errno == ENOENT)
+			goto done;
+		warnp("fopen(%s)", s);
+		goto err1;
+	}
+
+	/* Read it. */
+	if (fstat(fileno(f), &sb)) {
+		warnp("fstat(%s)", s);
+		goto err2;
+	}
+	F->len = (size_t)sb.st_size;
+	if ((F->buf = malloc(F->len + 1)) == NULL) {
+		warnp("malloc");
+		goto err2;
+	}
+	if ((F->len > 0) && (fread(F->buf, F->len, 1, f) != 1)) {
+		warnp("fread(%s)", s);
+		goto err3;
+	}
+	fclose(f);
+
+done:
+	free(s);
+
+	/* Success! */
+	return (0);
+
+err3:
+	free(F->buf);
+	F->buf = NULL;
+err2:
+	fclose(f);
+err1:
+	free(s);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Write ${F} to ${cachepath}/${name}, or remove it if ${F} is absent. */
+static int
+cachefile_write(const char * cachepath, const char * name,
+    const struct cachefile * F)
+{
+	char * s;
+	FILE * f;
+
+	/* Construct the file name. */
+	if (asprintf(&s, "%s/%s", cachepath, name) == -1) {
+		warnp("asprintf");
+		goto err0;
+	}
+
+	/* Remove the file if it shouldn't exist. */
+	if (F->buf == NULL) {
+		if (unlink(s) && (errno != ENOENT)) {
+			warnp("unlink(%s)", s);
+			goto err1;
+		}
+		goto done;
+	}
+
+	/* Write the file. */
+	if ((f = fopen(s, "w")) == NULL) {
+		warnp("fopen(%s)", s);
+		goto err1;
+	}
+	if ((F->len > 0) && (fwrite(F->buf, F->len, 1, f) != 1)) {
+		warnp("fwrite(%s)", s);
+		fclose(f);
+		goto err1;
+	}
+	if (fclose(f)) {
+		warnp("fclose(%s)", s);
+		goto err1;
+	}
+
+done:
+	free(s);
+
+	/* Success! */
+	return (0);
+
+err1:
+	free(s);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Record the cache file and log in ${cachepath} in ${S}. */
+static int
+snapshot_take(const char * cachepath, struct snapshot * S)
+{
+
+	if (cachefile_read(cachepath, "cache", &S->cache))
+		goto err0;
+	if (cachefile_read(cachepath, "cache.log", &S->log))
+		goto err1;
+
+	/* Success! */
+	return (0);
+
+err1:
+	free(S->cache.buf);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Put the cache file and log from ${S} back into ${cachepath}. */
+static int
+snapshot_restore(const char * cachepath, const struct snapshot * S)
+{
+
+	if (cachefile_write(cachepath, "cache", &S->cache) ||
+	    cachefile_write(cachepath, "cache.log", &S->log))
+		return (-1);
+	return (0);
+}
+
+/* Free the snapshot ${S}. */
+static void
+snapshot_free(struct snapshot * S)
+{
+
+	free(S->cache.buf);
+	free(S->log.buf);
+}
+
+/*
+ * Restore ${S} in ${cachepath}, remove the log if ${nolog} is non-zero,
+ * and run with the results going into ${R}.
+ */
+static int
+run_from(const char * cachepath, const struct snapshot * S, int nolog,
+    time_t snaptime, int fd, struct result * R)
+{
+	struct cachefile nofile = {NULL, 0};
+
+	if (snapshot_restore(cachepath, S))
+		return (-1);
+	if (nolog && cachefile_write(cachepath, "cache.log", &nofile))
+		return (-1);
+	return (run(cachepath, snaptime, fd, R));
+}
+
+/*
+ * Restore ${S} in ${cachepath}, damage the log with ${damage}, and check
+ * that a run gives the results ${Rref} of a run without the damaged
+ * segment.  Then check that the next run can take every file from the
+ * cache, i.e., that the log was repaired.
+ */
+static int
+check_damaged(const char * cachepath, const struct snapshot * S,
+    int (* damage)(const char *, size_t), const char * name,
+    time_t snaptime, int fd, struct result * R, const struct result * Rref)
+{
+
+	printf("%s: ", name);
+	if (snapshot_restore(cachepath, S) ||
+	    damage(cachepath, S->log.len) ||
+	    run(cachepath, snaptime, fd, R) || results_cmp(R, Rref))
+		goto failed;
+	files_archived();
+	if (run(cachepath, snaptime + 10, fd, R) || check_results(R))
+		goto failed;
+	printf("PASSED!\n");
+
+	/* Success! */
+	return (0);
+
+failed:
+	printf("FAILED!\n");
+
+	/* Failure! */
+	return (-1);
+}
+
+/* Corrupt the CRC at the end of the ${len}-byte log in ${cachepath}. */
+static int
+damage_crc(const char * cachepath, size_t len)
+{
+	struct cachefile F;
+	int rc;
+
+	if (cachefile_read(cachepath, "cache.log", &F))
+		return (-1);
+	if (F.len != len) {
+		warn0("cache log has the wrong length");
+		free(F.buf);
+		return (-1);
+	}
+	F.buf[len - 1] ^= 0x01;
+	rc = cachefile_write(cachepath, "cache.log", &F);
+	free(F.buf);
+	return (rc);
+}
+
+/* Cut the last byte from the ${len}-byte log in ${cachepath}. */
+static int
+damage_truncate(const char * cachepath, size_t len)
+{
+	char * s;
+	int rc;
+
+	if (asprintf(&s, "%s/cache.log", cachepath) == -1) {
+		warnp("asprintf");
+		return (-1);
+	}
+	if ((rc = truncate(s, (off_t)(len - 1))) != 0)
+		warnp("truncate(%s)", s);
+	free(s);
+	return (rc);
+}
+
+/*
+ * Archive modified files until the log grows to more than 1/CCACHE_LOGFRAC
+ * of the size of the cache file, and check that the cache file is then
+ * rewritten and the log removed, and that the new cache file can be read.
+ */
+static int
+check_compaction(const char * cachepath, time_t * snaptime, int fd,
+    struct result * R)
+{
+	struct snapshot S, T;
+	int compacted = 0;
+	int k;
+
+	for (k = 0; k < 20; k++) {
+		/* Record the cache before this run. */
+		if (snapshot_take(cachepath, &S))
+			goto err0;
+
+		/* Modify some files and archive them. */
+		*snaptime += 100;
+		files_modify((size_t)k % 10, 10, *snaptime);
+		if (run(cachepath, *snaptime, fd, R) || check_results(R))
+			goto err1;
+		if (snapshot_take(cachepath, &T))
+			goto err1;
+
+		/*
+		 * Once the log is too large, the cache file should have been
+		 * rewritten and the log removed; until then, we should only
+		 * have appended to the log.  After compaction, make sure we
+		 * go on to append to a log for the new cache file.
+		 */
+		if ((S.log.buf != NULL) &&
+		    (S.log.len > S.cache.len / CCACHE_LOGFRAC)) {
+			if ((T.log.buf != NULL) ||
+			    ((T.cache.len == S.cache.len) &&
+			    !memcmp(T.cache.buf, S.cache.buf, S.cache.len))) {
+				warn0("cache was not compacted");
+				goto err2;
+			}
+			compacted = 1;
+		} else {
+			if ((T.log.buf == NULL) ||
+			    (T.log.len <= S.log.len) ||
+			    (T.cache.len != S.cache.len) ||
+			    memcmp(T.cache.buf, S.cache.buf, S.cache.len)) {
+				warn0("cache log was not appended to");
+				goto err2;
+			}
+			if (compacted)
+				break;
+		}
+		snapshot_free(&T);
+		snapshot_free(&S);
+	}
+	if (k == 20) {
+		warn0("cache was never compacted");
+		goto err0;
+	}
+
+	/* Clean up. */
+	snapshot_free(&T);
+	snapshot_free(&S);
+
+	/* Success! */
+	return (0);
+
+err2:
+	snapshot_free(&T);
+err1:
+	snapshot_free(&S);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Check that a truncated cache file in ${cachepath} is rejected. */
+static int
+check_truncated(const char * cachepath)
+{
+	CCACHE * C;
+	struct stat sb;
+	char * s;
+
+	/* Cut the cache file in half. */
+	if (asprintf(&s, "%s/cache", cachepath) == -1) {
+		warnp("asprintf");
+		goto err0;
+	}
+	if (stat(s, &sb)) {
+		warnp("stat(%s)", s);
+		goto err1;
+	}
+	if (truncate(s, sb.st_size / 2)) {
+		warnp("truncate(%s)", s);
+		goto err1;
+	}
+
+	/* We should refuse to read it; tarsnap continues without a cache. */
+	if ((C = ccache_read(cachepath)) != NULL) {
+		warn0("truncated cache file was read");
+		ccache_free(C);
+		goto err1;
+	}
+
+	/* Clean up. */
+	free(s);
+
+	/* Success! */
+	return (0);
+
+err1:
+	free(s);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+int
+main(int argc, char * argv[])
+{
+	struct snapshot S[3];
+	struct result * R;
+	struct result * Rref;
+	const char * cachepath;
+	time_t snaptime = 1000000;
+	int fd;
+	int k;
+
+	WARNP_INIT;
+
+	/* Parse command line. */
+	if (argc != 2) {
+		fprintf(stderr, "usage: test_ccache cachedir\n");
+		goto err0;
+	}
+	cachepath = argv[1];
+
+	/* Set up the files and somewhere to store results. */
+	if (files_init())
+		goto err0;
+	if ((R = malloc(NFILES * sizeof(struct result))) == NULL) {
+		warnp("malloc");
+		goto err1;
+	}
+	if ((Rref = malloc(NFILES * sizeof(struct result))) == NULL) {
+		warnp("malloc");
+		goto err2;
+	}
+	if ((fd = open("/dev/null", O_RDONLY)) == -1) {
+		warnp("open(/dev/null)");
+		goto err3;
+	}
+	memset(S, 0, sizeof(S));
+
+	/* With no cache, everything is read. */
+	printf("empty cache: ");
+	if (run(cachepath, snaptime, fd, R) || check_results(R) ||
+	    checkmagic(cachepath) ||
+	    (cachefile_exists(cachepath, "cache.log") != 0))
+		goto failed;
+	printf("PASSED!\n");
+
+	/* Everything should now come from the cache we wrote. */
+	printf("cache round trip: ");
+	snaptime += 100;
+	if (run(cachepath, snaptime, fd, R) || check_results(R) ||
+	    snapshot_take(cachepath, &S[0]) || (S[0].log.buf == NULL))
+		goto failed;
+	printf("PASSED!\n");
+
+	/* Modified files should be read again. */
+	printf("modified files: ");
+	snaptime += 100;
+	files_modify(0, 10, snaptime);
+	if (run(cachepath, snaptime, fd, R) || check_results(R) ||
+	    snapshot_take(cachepath, &S[1]))
+		goto failed;
+	printf("PASSED!\n");
+
+	/* ... and then they should be cached too. */
+	printf("modified files cached: ");
+	snaptime += 100;
+	files_modify(5, 10, snaptime);
+	if (run(cachepath, snaptime, fd, R) || check_results(R) ||
+	    snapshot_take(cachepath, &S[2]))
+		goto failed;
+	printf("PASSED!\n");
+
+	/*
+	 * Modify some more files, and find out what the next run gets from
+	 * the cache if the last segment of the log is missing; and if the
+	 * log contains only one segment and we remove it entirely.
+	 */
+	printf("reference runs: ");
+	snaptime += 100;
+	files_modify(3, 10, snaptime);
+	if (run_from(cachepath, &S[1], 0, snaptime, fd, Rref))
+		goto failed;
+	printf("PASSED!\n");
+
+	/* A damaged last segment should be ignored and then replaced. */
+	if (check_damaged(cachepath, &S[2], damage_crc, "log with bad CRC",
+	    snaptime, fd, R, Rref))
+		goto failed0;
+	if (check_damaged(cachepath, &S[2], damage_truncate,
+	    "truncated log", snaptime, fd, R, Rref))
+		goto failed0;
+
+	/* Likewise if the log has only one segment. */
+	printf("reference run without log: ");
+	if (run_from(cachepath, &S[0], 1, snaptime, fd, Rref))
+		goto failed;
+	printf("PASSED!\n");
+	if (check_damaged(cachepath, &S[0], damage_crc,
+	    "single log segment with bad CRC", snaptime, fd, R, Rref))
+		goto failed0;
+
+	/* Keep going until the log is folded into a new cache file. */
+	printf("log compaction: ");
+	snaptime += 100;
+	if (check_compaction(cachepath, &snaptime, fd, R))
+		goto failed;
+	printf("PASSED!\n");
+
+	/* A damaged cache file should be rejected. */
+	printf("truncated cache: ");
+	if (check_truncated(cachepath))
+		goto failed;
+	printf("PASSED!\n");
+
+	/* Clean up. */
+	for (k = 0; k < 3; k++)
+		snapshot_free(&S[k]);
+	close(fd);
+	free(Rref);
+	free(R);
+	files_free();
+
+	/* Success! */
+	exit(0);
+
+failed:
+	printf("FAILED!\n");
+failed0:
+	for (k = 0; k < 3; k++)
+		snapshot_free(&S[k]);
+	close(fd);
+err3:
+	free(Rref);
+err2:
+	free(R);
+err1:
+	files_free();
+err0:
+	/* Failure! */
+	exit(1);
+}
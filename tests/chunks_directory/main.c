@@ -0,0 +1,460 @@
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "asprintf.h"
+#include "sha256.h"
+#include "sysendian.h"
+#include "tarsnap_opt.h"
+#include "warnp.h"
+
+#include "chunks_internal.h"
+
+/* Options used by the chunk directory and statistics code. */
+int tarsnap_opt_humanize_numbers = 0;
+int tarsnap_opt_worker_threads = 1;
+uint64_t tarsnap_opt_directory_memlimit = (uint64_t)(-1);
+
+/* Number of distinct chunks used by the transactions. */
+#define NCHUNKS	30000
+
+/* A range [lo, hi) of chunks. */
+struct range {
+	size_t lo;
+	size_t hi;
+};
+
+/* A transaction, and the kind of chunk directory it should write. */
+static const struct step {
+	const char * name;
+	struct range add;	/* Chunks to add. */
+	struct range ref;	/* Chunks to add a reference to. */
+	struct range del;	/* Chunks to remove a reference from. */
+	const char * magic;	/* Magic of the resulting directory. */
+} steps[] = {
+	{ "initial directory", {0, 20000}, {0, 0}, {0, 0}, "tschdir2" },
+	{ "first delta", {20000, 20100}, {0, 100}, {100, 150}, "tschdlt2" },
+	{ "second delta", {20100, 20200}, {150, 250}, {0, 50}, "tschdlt2" },
+	{ "compacted directory", {20200, 25000}, {1000, 2000}, {2000, 2500},
+	    "tschdir2" },
+	{ "delta after compaction", {25000, 25100}, {5000, 5100},
+	    {6000, 6050}, "tschdlt2" }
+};
+static const size_t nsteps = sizeof(steps) / sizeof(steps[0]);
+
+/* What we expect to find in the directory; nrefs == 0 means absent. */
+static struct chunkdata model[NCHUNKS];
+static struct chunkstats model_extra;
+
+/* Compute the (fake) HMAC of chunk number ${i}. */
+static void
+chunkhash(size_t i, uint8_t hash[32])
+{
+	uint8_t buf[8];
+
+	le64enc(buf, (uint64_t)i);
+	SHA256_Buf(buf, 8, hash);
+}
+
+/* Return non-zero unless the directory in ${cachepath} has magic ${magic}. */
+static int
+checkmagic(const char * cachepath, const char * magic)
+{
+	char buf[8];
+	char * s;
+	FILE * f;
+	int rc = 1;
+
+	/* Read the start of the directory. */
+	if (asprintf(&s, "%s/directory", cachepath) == -1) {
+		warnp("asprintf");
+		goto err0;
+	}
+	if ((f = fopen(s, "r")) == NULL) {
+		warnp("fopen(%s)", s);
+		goto err1;
+	}
+	if (fread(buf, 8, 1, f) != 1) {
+		warnp("fread(%s)", s);
+		goto err2;
+	}
+
+	/* Is it what we expected? */
+	if (memcmp(buf, magic, 8) == 0)
+		rc = 0;
+	else
+		warn0("%s: wrong magic", s);
+
+err2:
+	fclose(f);
+err1:
+	free(s);
+err0:
+	/* Return status. */
+	return (rc);
+}
+
+/* Perform the transaction ${step} on the chunk directory in ${cachepath}. */
+static int
+transaction(const char * cachepath, const struct step * step)
+{
+	CHUNKS_DIR * D;
+	struct chunkstats stats_unique, stats_all, stats_extra;
+	struct chunkdata chn;
+	struct chunkdata * ch;
+	uint8_t hash[32];
+	size_t i;
+
+	/* Open the directory. */
+	if ((D = chunks_directory_open(cachepath, &stats_unique, &stats_all,
+	    &stats_extra, 0, 0)) == NULL)
+		goto err0;
+
+	/* Add new chunks. */
+	for (i = step->add.lo; i < step->add.hi; i++) {
+		chunkhash(i, hash);
+		if (chunks_directory_find(D, hash, &ch))
+			goto err1;
+		if (ch != NULL) {
+			warn0("chunk %zu is already present", i);
+			goto err1;
+		}
+		chn.len = (uint32_t)(1000 + i);
+		chn.zlen_flags = (uint32_t)(500 + i % 400) | CHDATA_CTAPE;
+		chn.nrefs = 1;
+		chn.ncopies = 1;
+		if (chunks_directory_insert(D, hash, &chn))
+			goto err1;
+		model[i] = chn;
+		model[i].zlen_flags &= CHDATA_ZLEN;
+	}
+
+	/* Add references to existing chunks, as chunks_write does. */
+	for (i = step->ref.lo; i < step->ref.hi; i++) {
+		chunkhash(i, hash);
+		if (chunks_directory_find(D, hash, &ch))
+			goto err1;
+		if (ch == NULL) {
+			warn0("chunk %zu is missing", i);
+			goto err1;
+		}
+		ch->ncopies += 1;
+		if ((ch->zlen_flags & CHDATA_CTAPE) == 0) {
+			ch->nrefs += 1;
+			ch->zlen_flags |= CHDATA_CTAPE;
+		}
+		model[i].nrefs += 1;
+		model[i].ncopies += 1;
+	}
+
+	/* Remove references to chunks, as chunks_delete does. */
+	for (i = step->del.lo; i < step->del.hi; i++) {
+		chunkhash(i, hash);
+		if (chunks_directory_find(D, hash, &ch))
+			goto err1;
+		if (ch == NULL) {
+			warn0("chunk %zu is missing", i);
+			goto err1;
+		}
+		ch->ncopies -= 1;
+		if ((ch->zlen_flags & CHDATA_CTAPE) == 0) {
+			ch->nrefs -= 1;
+			ch->zlen_flags |= CHDATA_CTAPE;
+		}
+		model[i].nrefs -= 1;
+		model[i].ncopies -= 1;
+	}
+
+	/* Pretend that we stored some metadata too. */
+	chunks_stats_add(&stats_extra, 100, 50, 1);
+	chunks_stats_add(&model_extra, 100, 50, 1);
+
+	/* Write out the directory and commit it. */
+	if (chunks_directory_save(D, cachepath, &stats_extra, ".tmp"))
+		goto err1;
+	chunks_directory_close(D);
+	if (chunks_directory_commit(cachepath, ".tmp", ""))
+		goto err0;
+	if (chunks_directory_prune(cachepath))
+		goto err0;
+
+	/* Success! */
+	return (0);
+
+err1:
+	chunks_directory_close(D);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Return non-zero if the statistics ${a} and ${b} differ. */
+static int
+statscmp(const struct chunkstats * a, const struct chunkstats * b)
+{
+
+	return ((a->nchunks != b->nchunks) || (a->s_len != b->s_len) ||
+	    (a->s_zlen != b->s_zlen));
+}
+
+/* Check that the directory in ${cachepath} matches our model. */
+static int
+verify(const char * cachepath)
+{
+	CHUNKS_DIR * D;
+	struct chunkstats stats_unique, stats_all, stats_extra;
+	struct chunkstats model_unique, model_all;
+	struct chunkdata * ch;
+	uint8_t hash[32];
+	size_t i;
+
+	/* Work out what the statistics should be. */
+	chunks_stats_zero(&model_unique);
+	chunks_stats_zero(&model_all);
+	for (i = 0; i < NCHUNKS; i++) {
+		if (model[i].nrefs == 0)
+			continue;
+		chunks_stats_add(&model_unique, model[i].len,
+		    model[i].zlen_flags, 1);
+		chunks_stats_add(&model_all, model[i].len,
+		    model[i].zlen_flags, (ssize_t)model[i].ncopies);
+	}
+
+	/* Open the directory. */
+	if ((D = chunks_directory_open(cachepath, &stats_unique, &stats_all,
+	    &stats_extra, 1, 0)) == NULL)
+		goto err0;
+
+	/* Check the statistics. */
+	if (chunks_directory_getsize(D) != model_unique.nchunks) {
+		warn0("wrong number of chunks: %zu",
+		    chunks_directory_getsize(D));
+		goto err1;
+	}
+	if (statscmp(&stats_unique, &model_unique) ||
+	    statscmp(&stats_all, &model_all) ||
+	    statscmp(&stats_extra, &model_extra)) {
+		warn0("wrong statistics");
+		goto err1;
+	}
+
+	/* Look up every chunk. */
+	for (i = 0; i < NCHUNKS; i++) {
+		chunkhash(i, hash);
+		if (chunks_directory_find(D, hash, &ch))
+			goto err1;
+		if (model[i].nrefs == 0) {
+			if (ch != NULL) {
+				warn0("chunk %zu should not be present", i);
+				goto err1;
+			}
+			continue;
+		}
+		if ((ch == NULL) || (ch->len != model[i].len) ||
+		    (ch->zlen_flags != model[i].zlen_flags) ||
+		    (ch->nrefs != model[i].nrefs) ||
+		    (ch->ncopies != model[i].ncopies)) {
+			warn0("chunk %zu is missing or wrong", i);
+			goto err1;
+		}
+	}
+
+	/* Clean up. */
+	chunks_directory_close(D);
+
+	/* Success! */
+	return (0);
+
+err1:
+	chunks_directory_close(D);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Check that the damaged directory in ${cachepath} can't be opened. */
+static int
+check_damaged(const char * cachepath, const char * name)
+{
+	CHUNKS_DIR * D;
+	struct chunkstats stats_unique, stats_all, stats_extra;
+
+	printf("%s: ", name);
+	if ((D = chunks_directory_open(cachepath, &stats_unique, &stats_all,
+	    &stats_extra, 1, 0)) != NULL) {
+		chunks_directory_close(D);
+		printf("FAILED!\n");
+		return (-1);
+	}
+	printf("PASSED!\n");
+	return (0);
+}
+
+/* Damage the delta in ${cachepath} in various ways. */
+static int
+damage(const char * cachepath)
+{
+	struct stat sb;
+	char * s;
+	char * t;
+	char * u;
+
+	/* Construct file names. */
+	if (asprintf(&s, "%s/directory", cachepath) == -1) {
+		warnp("asprintf");
+		goto err0;
+	}
+	if (asprintf(&t, "%s/directory.base", cachepath) == -1) {
+		warnp("asprintf");
+		goto err1;
+	}
+	if (asprintf(&u, "%s/directory.base.saved", cachepath) == -1) {
+		warnp("asprintf");
+		goto err2;
+	}
+
+	/* A delta without its base. */
+	if (rename(t, u)) {
+		warnp("rename(%s, %s)", t, u);
+		goto err3;
+	}
+	if (check_damaged(cachepath, "delta without base"))
+		goto err3;
+	if (rename(u, t)) {
+		warnp("rename(%s, %s)", u, t);
+		goto err3;
+	}
+
+	/* Having put the base back, the directory should be fine again. */
+	printf("delta with base restored: ");
+	if (verify(cachepath)) {
+		printf("FAILED!\n");
+		goto err3;
+	}
+	printf("PASSED!\n");
+
+	/* A delta which ends part way through a record. */
+	if (stat(s, &sb)) {
+		warnp("stat(%s)", s);
+		goto err3;
+	}
+	if (truncate(s, sb.st_size - 20)) {
+		warnp("truncate(%s)", s);
+		goto err3;
+	}
+	if (check_damaged(cachepath, "truncated delta"))
+		goto err3;
+
+	/* A delta which ends part way through its header. */
+	if (truncate(s, 40)) {
+		warnp("truncate(%s)", s);
+		goto err3;
+	}
+	if (check_damaged(cachepath, "truncated header"))
+		goto err3;
+
+	/* Clean up. */
+	free(u);
+	free(t);
+	free(s);
+
+	/* Success! */
+	return (0);
+
+err3:
+	free(u);
+err2:
+	free(t);
+err1:
+	free(s);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Run each transaction on the directory in ${cachepath}, starting from an
+ * empty directory, and read the directory back after each one.
+ */
+static int
+run_steps(const char * cachepath, const char * prefix)
+{
+	size_t i;
+
+	/* Nothing yet. */
+	memset(model, 0, sizeof(model));
+	chunks_stats_zero(&model_extra);
+
+	for (i = 0; i < nsteps; i++) {
+		printf("%s%s: ", prefix, steps[i].name);
+		if (transaction(cachepath, &steps[i]) ||
+		    checkmagic(cachepath, steps[i].magic) ||
+		    verify(cachepath)) {
+			printf("FAILED!\n");
+			return (-1);
+		}
+		printf("PASSED!\n");
+	}
+
+	/* Success! */
+	return (0);
+}
+
+int
+main(int argc, char * argv[])
+{
+	struct stat sb;
+	char * s;
+
+	WARNP_INIT;
+
+	/* Parse command line. */
+	if (argc != 3) {
+		fprintf(stderr,
+		    "usage: test_chunks_directory cachedir spilldir\n");
+		goto err0;
+	}
+
+	/* Run the transactions with all the records in core. */
+	if (run_steps(argv[1], ""))
+		goto err0;
+
+	/*
+	 * Run them again with the smallest possible memory limit, so that
+	 * records are spilled to disk, both while the transactions are
+	 * running and while we read the directory back.  We should get the
+	 * same records and statistics.
+	 */
+	tarsnap_opt_directory_memlimit = 0;
+	if (run_steps(argv[2], "spilled "))
+		goto err0;
+	tarsnap_opt_directory_memlimit = (uint64_t)(-1);
+
+	/* Spill runs should not be left behind. */
+	if (asprintf(&s, "%s/directory.spill", argv[2]) == -1) {
+		warnp("asprintf");
+		goto err0;
+	}
+	if ((stat(s, &sb) == 0) || (errno != ENOENT)) {
+		warn0("spill run was left behind: %s", s);
+		free(s);
+		goto err0;
+	}
+	free(s);
+
+	/* Damaged directories must be rejected. */
+	if (damage(argv[1]))
+		goto err0;
+
+	/* Success! */
+	exit(0);
+
+err0:
+	/* Failure! */
+	exit(1);
+}
@@ -0,0 +1,276 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpusupport.h"
+#include "crypto_aes.h"
+#include "crypto_aesctr.h"
+#include "crypto_aesctr_aesni.h"
+#include "crypto_aesctr_vaes.h"
+#include "warnp.h"
+
+/* Known-answer tests: AES-CTR with an initial counter block of nonce || 0. */
+#define KAT_LEN 150
+static const struct kat {
+	size_t keylen;
+	uint8_t key[32];
+	uint64_t nonce;
+	uint8_t ct[KAT_LEN];	/* Encryption of 0x00, 0x01, 0x02, ... */
+} kats[] = {
+	{ 16, {
+		0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+		0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f
+	}, 0x0123456789abcdef, {
+		0xe2, 0xc9, 0x10, 0x11, 0x0a, 0x7f, 0x42, 0x07,
+		0xef, 0x05, 0xc8, 0x1d, 0x9f, 0x58, 0x73, 0x51,
+		0xe0, 0xf2, 0xfa, 0x20, 0x33, 0x4d, 0x3c, 0xd2,
+		0xa9, 0x35, 0x37, 0xd4, 0xe7, 0xea, 0xa0, 0x21,
+		0x4c, 0x15, 0x30, 0xfa, 0xdd, 0x8b, 0xdf, 0xfd,
+		0xc5, 0xe4, 0x22, 0x04, 0x7c, 0x6e, 0xf9, 0x79,
+		0xd9, 0xb9, 0x84, 0xbd, 0x8a, 0x5f, 0xd0, 0x1f,
+		0xb3, 0x0a, 0x2b, 0xa7, 0x39, 0x79, 0xb9, 0x49,
+		0xf7, 0x6d, 0xf8, 0xab, 0xa2, 0xad, 0x08, 0xf2,
+		0xaf, 0x93, 0xfc, 0x9d, 0x43, 0x26, 0x25, 0xcd,
+		0x2b, 0x28, 0xf3, 0xc6, 0x80, 0xe4, 0x1f, 0x55,
+		0x26, 0x34, 0x2f, 0xe1, 0x82, 0x39, 0x40, 0xaa,
+		0x77, 0xce, 0x53, 0x42, 0x76, 0x6f, 0xe4, 0xc2,
+		0x96, 0xb6, 0x13, 0xca, 0x86, 0xfc, 0xa5, 0xf8,
+		0x90, 0x8b, 0x4c, 0x7f, 0x94, 0x9f, 0x79, 0xaf,
+		0x6f, 0xb7, 0xe1, 0xad, 0x29, 0xef, 0x6e, 0x7c,
+		0x49, 0x16, 0xcd, 0xb3, 0x38, 0x04, 0x4b, 0x66,
+		0x27, 0x74, 0x8d, 0x80, 0xbd, 0x01, 0x52, 0x6e,
+		0x60, 0x18, 0xf8, 0xcc, 0x21, 0x7a
+	}},
+	{ 32, {
+		0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+		0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+		0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
+		0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f
+	}, 0x0123456789abcdef, {
+		0x23, 0x7b, 0x47, 0x80, 0x07, 0x5f, 0xf9, 0x90,
+		0x2c, 0xe0, 0xe6, 0x36, 0x7c, 0xa4, 0x06, 0xfe,
+		0x4e, 0x91, 0x43, 0x08, 0x36, 0x08, 0x11, 0x9e,
+		0x60, 0x25, 0xf2, 0x68, 0x6c, 0x52, 0x5b, 0x57,
+		0xf2, 0xf2, 0xc3, 0x37, 0xfd, 0xb9, 0xe9, 0xfa,
+		0x3f, 0xde, 0x8c, 0x74, 0x6b, 0x33, 0x3e, 0x54,
+		0x91, 0xd2, 0xb3, 0xe0, 0x02, 0x3d, 0xe0, 0x90,
+		0x9e, 0xca, 0x48, 0xc8, 0xc7, 0xae, 0x87, 0x29,
+		0x19, 0x31, 0x1e, 0x49, 0xda, 0x91, 0x31, 0xe8,
+		0x89, 0x0d, 0x18, 0x2c, 0x05, 0x51, 0xaf, 0xfd,
+		0xae, 0xb2, 0x31, 0xfc, 0x3b, 0x3d, 0x02, 0xd7,
+		0x6d, 0x1e, 0x36, 0x1c, 0xc5, 0x00, 0x7a, 0xa6,
+		0x85, 0x93, 0x7e, 0x82, 0x1c, 0xff, 0xf4, 0xff,
+		0x4a, 0x15, 0x01, 0xc4, 0x55, 0xd6, 0x60, 0x87,
+		0x08, 0x07, 0xaf, 0x4b, 0xce, 0xd7, 0xae, 0x62,
+		0xc8, 0xd1, 0xae, 0x93, 0x13, 0xd1, 0x4f, 0xda,
+		0x8f, 0x0c, 0xfb, 0x34, 0xba, 0x0f, 0xa5, 0xf4,
+		0xd7, 0xe1, 0x96, 0xc9, 0x75, 0xc5, 0x0b, 0x07,
+		0xda, 0x16, 0x3a, 0x26, 0xaf, 0x20
+	}}
+};
+static const size_t num_kats = sizeof(kats) / sizeof(kats[0]);
+
+/*
+ * Offsets at which to start encrypting, and lengths to encrypt, when
+ * comparing an implementation against the generic code.  These are chosen
+ * to include partial blocks and runs of blocks which are not multiples of 8.
+ */
+static const size_t offsets[] = {0, 1, 15, 16, 17, 48, 112, 127, 128, 129,
+    200};
+static const size_t num_offsets = sizeof(offsets) / sizeof(offsets[0]);
+static const size_t lengths[] = {1, 15, 16, 17, 100, 127, 128, 129, 143,
+    255, 256, 1000, 4500};
+static const size_t num_lengths = sizeof(lengths) / sizeof(lengths[0]);
+
+/*
+ * Length of data used to compare implementations.  This must be long enough
+ * that the least significant byte of the counter wraps.
+ */
+#define CMP_LEN 5000
+
+/* An implementation of crypto_aesctr_stream. */
+struct impl {
+	const char * name;
+	void (* func)(struct crypto_aesctr *, const uint8_t *, uint8_t *,
+	    size_t);
+};
+
+/* Encrypt using the generic code, which is used for fewer than 16 bytes. */
+static void
+stream_generic(struct crypto_aesctr * stream, const uint8_t * inbuf,
+    uint8_t * outbuf, size_t buflen)
+{
+	size_t len;
+
+	for (; buflen > 0; inbuf += len, outbuf += len, buflen -= len) {
+		len = (buflen > 15) ? 15 : buflen;
+		crypto_aesctr_stream(stream, inbuf, outbuf, len);
+	}
+}
+
+/*
+ * Check the implementation ${impl} against the known answers, using the
+ * stream ${stream} and input ${inbuf}.
+ */
+static int
+check_kats(const struct impl * impl, struct crypto_aesctr * stream,
+    const uint8_t * inbuf)
+{
+	struct crypto_aes_key * key;
+	uint8_t outbuf[KAT_LEN];
+	size_t i;
+
+	for (i = 0; i < num_kats; i++) {
+		/* Expand the key. */
+		if ((key = crypto_aes_key_expand(kats[i].key,
+		    kats[i].keylen)) == NULL) {
+			warn0("crypto_aes_key_expand");
+			goto err0;
+		}
+
+		/* Encrypt the data in one go. */
+		crypto_aesctr_init2(stream, key, kats[i].nonce);
+		impl->func(stream, inbuf, outbuf, KAT_LEN);
+
+		/* Clean up. */
+		crypto_aes_key_free(key);
+
+		/* Check the result. */
+		if (memcmp(outbuf, kats[i].ct, KAT_LEN)) {
+			warn0("%s: known-answer test %zu failed", impl->name,
+			    i);
+			goto err0;
+		}
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Check the implementation ${impl} against the generic code, starting at a
+ * variety of offsets and encrypting a variety of lengths, using the stream
+ * ${stream}, key ${key}, input ${inbuf}, and generic output ${refbuf}.
+ */
+static int
+check_offsets(const struct impl * impl, struct crypto_aesctr * stream,
+    const struct crypto_aes_key * key, const uint8_t * inbuf,
+    const uint8_t * refbuf)
+{
+	uint8_t outbuf[CMP_LEN];
+	size_t off, len;
+	size_t i, j;
+
+	for (i = 0; i < num_offsets; i++) {
+		for (j = 0; j < num_lengths; j++) {
+			off = offsets[i];
+			len = lengths[j];
+
+			/* Skip to the offset, then encrypt in one go. */
+			crypto_aesctr_init2(stream, key, 0x0123456789abcdef);
+			impl->func(stream, inbuf, outbuf, off);
+			impl->func(stream, &inbuf[off], &outbuf[off], len);
+
+			/* Check the result. */
+			if (memcmp(outbuf, refbuf, off + len)) {
+				warn0("%s: offset %zu length %zu differs"
+				    " from generic code", impl->name, off,
+				    len);
+				goto err0;
+			}
+		}
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+int
+main(int argc, char * argv[])
+{
+	static const uint8_t key_unexpanded[32] = {
+		0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+		0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+		0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
+		0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f
+	};
+	struct impl impls[4];
+	struct crypto_aes_key * key;
+	struct crypto_aesctr * stream;
+	uint8_t inbuf[CMP_LEN];
+	uint8_t refbuf[CMP_LEN];
+	size_t nimpls = 0;
+	size_t i;
+
+	WARNP_INIT;
+	(void)argc; /* UNUSED */
+
+	/* Which implementations can we test? */
+	impls[nimpls].name = "generic";
+	impls[nimpls++].func = stream_generic;
+	impls[nimpls].name = "default";
+	impls[nimpls++].func = crypto_aesctr_stream;
+#if defined(CPUSUPPORT_X86_AESNI)
+	if (crypto_aes_can_use_intrinsics() == 1) {
+		impls[nimpls].name = "aesni";
+		impls[nimpls++].func = crypto_aesctr_aesni_stream;
+	}
+#if defined(CPUSUPPORT_X86_VAES)
+	if ((crypto_aes_can_use_intrinsics() == 1) && cpusupport_x86_vaes()) {
+		impls[nimpls].name = "vaes";
+		impls[nimpls++].func = crypto_aesctr_vaes_stream;
+	}
+#endif
+#endif
+
+	/* Prepare the input. */
+	for (i = 0; i < CMP_LEN; i++)
+		inbuf[i] = (uint8_t)i;
+
+	/* Encrypt it using the generic code. */
+	if ((key = crypto_aes_key_expand(key_unexpanded, 32)) == NULL) {
+		warn0("crypto_aes_key_expand");
+		goto err0;
+	}
+	if ((stream = crypto_aesctr_alloc()) == NULL) {
+		warnp("crypto_aesctr_alloc");
+		goto err1;
+	}
+	crypto_aesctr_init2(stream, key, 0x0123456789abcdef);
+	stream_generic(stream, inbuf, refbuf, CMP_LEN);
+
+	/* Check each implementation. */
+	for (i = 0; i < nimpls; i++) {
+		printf("%s: ", impls[i].name);
+		if (check_kats(&impls[i], stream, inbuf) ||
+		    check_offsets(&impls[i], stream, key, inbuf, refbuf)) {
+			printf("FAILED!\n");
+			goto err2;
+		}
+		printf("PASSED!\n");
+	}
+
+	/* Clean up. */
+	crypto_aesctr_free(stream);
+	crypto_aes_key_free(key);
+
+	/* Success! */
+	exit(0);
+
+err2:
+	crypto_aesctr_free(stream);
+err1:
+	crypto_aes_key_free(key);
+err0:
+	/* Failure! */
+	exit(1);
+}